@@ -0,0 +1,27 @@
+#pragma once
+
+#include <QColor>
+#include <QSharedPointer>
+#include <QVector>
+
+// Indexed colours of one theme: the 16 ANSI slots followed by the xterm 6x6x6
+// cube and grey ramp, flattened into a 256-entry lookup table. Tables are
+// immutable once built, so every terminal using a theme shares one instance
+// and resolves an indexed cell colour with a single array load.
+class ColorTable {
+public:
+  static constexpr int kAnsiColors = 16;
+
+  // libvterm's built-in ANSI colours, used when no theme palette is set.
+  static QVector<QColor> defaultAnsi();
+  static QSharedPointer<const ColorTable> create(const QVector<QColor> &ansi);
+  static QSharedPointer<const ColorTable> defaultTable();
+
+  QRgb color(int index) const { return lut_[index & 0xff]; }
+  QColor ansi(int index) const { return QColor::fromRgb(lut_[index & 0x0f]); }
+
+private:
+  ColorTable() = default;
+
+  QRgb lut_[256];
+};
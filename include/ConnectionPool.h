@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ProfileStore.h"
+
+#include <QHash>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include <memory>
+
+struct SshConnection;
+
+// Keeps authenticated, idle connections to profiles marked "keep warm", so a
+// new tab only has to open a channel. A pooled connection is an ordinary
+// shared connection (see SshReactor::shareConnection) on which the pool
+// holds a reference. Limits come from QSettings: pool/maxConnections,
+// pool/keepaliveSec and pool/idleTimeoutMin.
+class ConnectionPool : public QObject {
+  Q_OBJECT
+public:
+  struct Stats {
+    int warm = 0;
+    int hits = 0;
+    int misses = 0;
+    qint64 savedMs = 0;
+  };
+
+  static ConnectionPool *instance();
+
+  // Connects `p` in the background unless it is pooled already or the pool
+  // is full. Keys that need a passphrase are skipped without one; the
+  // passphrase is kept to reconnect after a dropped link.
+  void warm(const Profile &p, const QString &keyPassphrase = QString());
+  // Takes a reference on the connection a tab opened for `p`, keeping it
+  // after the tab closes. Without a passphrase of its own, a key that needs
+  // one is not reconnected once the link drops.
+  void adopt(const Profile &p);
+  // Called as a tab starts connecting to `p`; counts a hit or a miss.
+  void recordConnect(const Profile &p);
+  Stats stats() const { return stats_; }
+
+private:
+  struct Entry;
+
+  explicit ConnectionPool(QObject *parent);
+  ~ConnectionPool() override;
+
+  bool hasRoom() const;
+  void hold(Entry *entry, const std::shared_ptr<SshConnection> &connection);
+  void drop(const QString &id);
+  void maintain();
+
+  QHash<QString, Entry *> entries_;
+  QTimer maintainTimer_;
+  int maxConnections_ = 4;
+  int keepaliveMs_ = 60000;
+  qint64 idleTimeoutMs_ = 30 * 60000;
+  Stats stats_;
+};
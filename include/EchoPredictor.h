@@ -0,0 +1,72 @@
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+
+class ScreenModel;
+
+// Speculative local echo in the style of mosh. Printable keys typed at a
+// shell prompt are predicted to appear at the cursor; the predictions are
+// checked against the screen as the server's echo is parsed and dropped
+// when they match, or all rolled back when they do not.
+//
+// Every keystroke is tracked, shown or not, so the echo round trip is always
+// measured; predictions are only drawn once the smoothed RTT exceeds
+// kShowAboveMs. Nothing is predicted on the alternate screen or after a
+// password prompt, and a timeout or mismatch hides predictions until the
+// next confirmed echo. SSH_TERMINAL_PREDICT=always or never overrides the
+// RTT test.
+class EchoPredictor {
+public:
+  struct Prediction {
+    int row;
+    int col;
+    uint codepoint;
+    qint64 sentMs;
+  };
+
+  EchoPredictor();
+
+  // Records input before it is sent. A single printable character is
+  // predicted; anything else holds predictions back until output arrives.
+  void inputSent(const QByteArray &bytes, const ScreenModel &model);
+  // Compares pending predictions with the screen after output was parsed.
+  void reconcile(const ScreenModel &model);
+  // Rolls back predictions the server never echoed, e.g. with echo off.
+  void expire();
+  void reset();
+
+  bool isEmpty() const { return pending_.isEmpty(); }
+  // Whether predictions should be drawn right now.
+  bool visible() const;
+  const QVector<Prediction> &predictions() const { return pending_; }
+  // Row of the predictions, or -1 when there are none.
+  int row() const { return pending_.isEmpty() ? -1 : pending_.first().row; }
+  qint64 smoothedRttMs() const { return srttMs_; }
+
+  // Counters over all terminals for SSH_TERMINAL_STATS.
+  static QString report();
+  // Whether the text left of the cursor looks like a password prompt.
+  static bool atPasswordPrompt(const ScreenModel &model);
+  // Whether `text`, a line up to the cursor, ends in a password prompt.
+  static bool isPasswordPrompt(const QString &text);
+
+private:
+  enum class Mode { Adaptive, Always, Never };
+
+  void confirm(const Prediction &p);
+  void rollback();
+
+  Mode mode_ = Mode::Adaptive;
+  QElapsedTimer clock_;
+  QVector<Prediction> pending_;
+  qint64 srttMs_ = -1;
+  bool showing_ = false;
+  // Set by a mismatch or timeout; cleared by the next confirmed echo.
+  bool glitched_ = false;
+  // A key we could not predict is in flight; the cursor position on screen
+  // is stale until output arrives.
+  bool awaitingOutput_ = false;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+class QWidget;
+class TerminalWidget;
+
+// Paces terminal output for one top-level window. Incoming data is parsed in
+// slices bounded by a time budget, and damaged terminals are presented at
+// most once per display refresh; parse passes that land between two
+// presents never get painted on their own. Terminals that are not on screen
+// are parsed on a coarse timer under a small budget and never presented.
+class FrameScheduler : public QObject {
+  Q_OBJECT
+public:
+  struct Stats {
+    quint64 framesRendered = 0;
+    quint64 framesSkipped = 0;
+    quint64 bytesParsed = 0;
+    quint64 backgroundPasses = 0;
+    qint64 parseNsecs = 0;
+  };
+
+  explicit FrameScheduler(QWidget *window);
+  ~FrameScheduler() override;
+
+  static FrameScheduler *forWindow(QWidget *widget);
+  static Stats totalStats();
+
+  void inputPending(TerminalWidget *terminal);
+  void remove(TerminalWidget *terminal);
+
+private:
+  void parsePass();
+  void backgroundPass();
+  void presentFrame();
+  void schedulePresent();
+  int frameIntervalMs() const;
+
+  QWidget *window_;
+  QVector<TerminalWidget *> parseQueue_;
+  QVector<TerminalWidget *> presentQueue_;
+  QVector<TerminalWidget *> backgroundQueue_;
+  QTimer parseTimer_;
+  QTimer backgroundTimer_;
+  QTimer frameTimer_;
+  QElapsedTimer sinceFrame_;
+  int passesSinceFrame_ = 0;
+};
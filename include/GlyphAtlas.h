@@ -0,0 +1,100 @@
+#pragma once
+
+#include <QFont>
+#include <QHash>
+#include <QPixmap>
+#include <QRect>
+#include <QSharedPointer>
+#include <QVector>
+
+// Pre-rasterized glyph cache for the terminal renderer. Glyphs are drawn once
+// into a few large pixmap pages and blitted from there on every paint. One
+// atlas exists per font/cell geometry/device pixel ratio and is shared by all
+// TerminalWidget instances using it. Double-width glyphs get a two-cell slot,
+// and grapheme clusters (combining sequences, emoji) are shaped once as a
+// whole and cached like single characters.
+class GlyphAtlas {
+public:
+  enum Variant : quint8 {
+    Regular = 0,
+    Bold = 1,
+    Italic = 2,
+    BoldItalic = Bold | Italic,
+  };
+
+  struct Stats {
+    quint64 hits = 0;
+    quint64 misses = 0;
+    quint64 evictions = 0;
+    int pages = 0;
+    int glyphs = 0;
+  };
+
+  static QSharedPointer<GlyphAtlas> shared(const QFont &font, int cellWidth, int cellHeight,
+                                           int ascent, qreal dpr);
+
+  ~GlyphAtlas();
+
+  // Returns the index of the page holding the glyph and its source rect in
+  // page pixels, rasterizing on a miss. Returns -1 if the glyph cannot be
+  // cached. A miss may recycle a page; callers batching blits compare
+  // evictions() before and after their lookups.
+  int glyph(uint codepoint, bool wide, Variant variant, QRgb color, QRect *source);
+  int cluster(const QString &text, bool wide, Variant variant, QRgb color, QRect *source);
+  const QPixmap &page(int index) const { return pages_.at(index); }
+
+  qreal devicePixelRatio() const { return dpr_; }
+  quint64 evictions() const { return evictions_; }
+  Stats stats() const;
+  static Stats totalStats();
+
+private:
+  GlyphAtlas(const QFont &font, int cellWidth, int cellHeight, int ascent, qreal dpr);
+
+  struct Entry {
+    int page = -1;
+    QRect source;
+  };
+
+  // Bits 0-20 hold a codepoint or, with bit 21 set, an interned cluster id.
+  static constexpr quint32 kClusterKey = 1u << 21;
+  static constexpr quint32 kWideKey = 1u << 22;
+
+  static quint64 makeKey(quint32 id, bool wide, Variant variant, QRgb color) {
+    return (quint64(color & 0xffffff) << 32) | (quint64(variant) << 24) | (wide ? kWideKey : 0) |
+           (id & (kClusterKey | 0x1fffff));
+  }
+
+  void reclaimClusterIds();
+  int insert(quint64 key, const QString &text, bool wide, Variant variant, QRgb color, QRect *source);
+  bool allocate(int width, int *page, QPoint *origin);
+  void evictPage(int page);
+  QFont fontFor(const QString &text, Variant variant);
+  void rasterize(const QString &text, const QFont &font, QRgb color, int page, const QRect &slot);
+
+  QString registryKey_;
+  QFont fonts_[4];
+  int cellWidth_ = 0;
+  int cellHeight_ = 0;
+  int ascent_ = 0;
+  qreal dpr_ = 1.0;
+  int slotWidth_ = 0;
+  int slotHeight_ = 0;
+  int wideSlotWidth_ = 0;
+
+  QVector<QPixmap> pages_;
+  int currentPage_ = -1;
+  QPoint cursor_;
+  int nextEviction_ = 0;
+  QHash<quint64, Entry> entries_;
+  QHash<QString, quint32> clusterIds_;
+  QVector<quint32> freeClusterIds_;
+  // Base codepoint -> index into fallbackFonts_, or -1 for the primary font.
+  QHash<uint, int> fallbackFor_;
+  QVector<QFont> fallbackFonts_;
+  bool fallbacksLoaded_ = false;
+
+  quint64 hits_ = 0;
+  quint64 misses_ = 0;
+  quint64 evictions_ = 0;
+};
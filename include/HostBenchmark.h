@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+
+#include "ProfileStore.h"
+
+class QThread;
+
+// Measures download throughput from a host for each candidate cipher and
+// compression level. Every combination opens its own connection, runs a
+// command that prints a few tens of megabytes of text and times the read.
+// Runs on a worker thread with blocking libssh calls; results are read after
+// finished().
+class HostBenchmark : public QObject {
+  Q_OBJECT
+public:
+  struct Result {
+    QString cipher;
+    int compressionLevel = 0;
+    double mbPerSecond = 0.0;
+    QString error;
+  };
+
+  HostBenchmark(const Profile &profile, const QString &keyPassphrase, QObject *parent = nullptr);
+  ~HostBenchmark() override;
+
+  void start();
+  void cancel();
+  // Blocks until the worker exits; after cancel() that is within a second
+  // unless a connect is in progress.
+  void wait();
+  bool isRunning() const;
+
+  QVector<Result> results() const { return results_; }
+  // The fastest successful combination; an empty cipher if none worked.
+  Result best() const;
+
+signals:
+  void progress(int done, int total, const QString &label);
+  void finished();
+
+private:
+  void run();
+  Result measure(const QString &cipher, int compressionLevel) const;
+
+  Profile profile_;
+  QString keyPassphrase_;
+  QThread *thread_ = nullptr;
+  std::atomic<bool> cancelled_{false};
+  // Written by the worker, read after finished().
+  QVector<Result> results_;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <QString>
+#include <QVector>
+
+// One hop of a ProxyJump chain, written like ssh(1)'s -J option:
+// "[user@]host[:port]", hops separated by commas, outermost first. As with
+// ssh(1), each hop is looked up in ~/.ssh/config: a hop without a user or
+// port takes the User and Port of its Host entry, and the local user and
+// port 22 without one.
+struct JumpHost {
+  // Empty when the spec names none.
+  QString user;
+  QString host;
+  int port = 22;
+
+  // Parses `spec` into `hops`; "none" and an empty spec give no hops.
+  static bool parseChain(const QString &spec, QVector<JumpHost> *hops, QString *error = nullptr);
+  // The first `count` hops (all if negative), each with its port spelled out.
+  static QString chainString(const QVector<JumpHost> &hops, int count = -1);
+  QString toString() const;
+};
@@ -3,8 +3,11 @@
 #include <QMainWindow>
 #include <QColor>
 #include <QFont>
+#include <QSharedPointer>
+#include <QVector>
 #include "ProfileStore.h"
 
+class ColorTable;
 class QTabWidget;
 class QCloseEvent;
 
@@ -12,6 +15,7 @@ class MainWindow : public QMainWindow {
   Q_OBJECT
 public:
   explicit MainWindow(QWidget *parent = nullptr);
+  void addBlankTabs(int count);
 
 protected:
   void closeEvent(QCloseEvent *event) override;
@@ -25,6 +29,7 @@ private slots:
 
 private:
   bool restoreSessions();
+  void warmProfiles();
   void openTabWithProfile(const Profile &p, bool autoConnect);
   QStringList loadLastSessions() const;
   void saveLastSessions(const QStringList &names) const;
@@ -35,6 +40,8 @@ private:
   QTabWidget *tabs_;
   QColor themeFg_;
   QColor themeBg_;
+  QVector<QColor> themeAnsi_;
+  QSharedPointer<const ColorTable> colorTable_;
   QFont themeFont_;
   bool closing_ = false;
 };
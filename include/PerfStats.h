@@ -0,0 +1,15 @@
+#pragma once
+
+#include <QString>
+
+#include <functional>
+
+// Opt-in runtime counters. Set SSH_TERMINAL_STATS=1 to have every registered
+// reporter printed through qInfo() every few seconds.
+namespace PerfStats {
+
+bool enabled();
+void setReporter(const QString &name, std::function<QString()> report);
+void removeReporter(const QString &name);
+
+} // namespace PerfStats
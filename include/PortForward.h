@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QString>
+
+// A port forward kept with a profile, written like the ssh(1) options:
+//   "L [bind_address:]port:host:hostport"  forwards to host:hostport (-L)
+//   "D [bind_address:]port"                acts as a SOCKS5 proxy (-D)
+// The bind address defaults to 127.0.0.1.
+struct PortForward {
+  enum Type { Local, Dynamic };
+
+  Type type = Local;
+  QString bindAddress = "127.0.0.1";
+  quint16 bindPort = 0;
+  QString targetHost;
+  quint16 targetPort = 0;
+
+  static bool parse(const QString &spec, PortForward *forward, QString *error = nullptr);
+  QString toString() const;
+};
+
+// The SOCKS5 handshake a dynamic forward answers (RFC 1928): a greeting that
+// must offer "no authentication", then a CONNECT request. Each call looks at
+// the bytes read so far; once it is done, `*used` says how many it took.
+struct Socks5 {
+  enum Status { Incomplete, Accepted, Unsupported, Invalid };
+
+  // Unsupported if the client is not version 5 or needs authentication.
+  static Status parseGreeting(const uchar *data, int size, int *used);
+  // Unsupported for anything but a version 5 CONNECT; Invalid for an
+  // unknown address type.
+  static Status parseRequest(const uchar *data, int size, int *used, QString *host, quint16 *port);
+};
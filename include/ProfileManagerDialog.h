@@ -11,6 +11,8 @@ class QSpinBox;
 class QPushButton;
 class QToolButton;
 class QCheckBox;
+class QGroupBox;
+class QPlainTextEdit;
 
 class ProfileManagerDialog : public QDialog {
   Q_OBJECT
@@ -26,6 +28,7 @@ private slots:
   void onDeleteProfile();
   void onConnect();
   void onImportSshConfig();
+  void onBenchmarkHost();
 
 private:
   bool loadProfiles();
@@ -34,6 +37,7 @@ private:
   void refreshList();
   void setFieldsFromProfile(const Profile &p);
   Profile profileFromFields() const;
+  bool checkFields();
   int currentIndex() const;
   QString storePath() const;
 
@@ -49,6 +53,8 @@ private:
   QSpinBox *port_;
   QLineEdit *keyPath_;
   QToolButton *browseKeyButton_;
+  QLineEdit *proxyJump_;
+  QPlainTextEdit *forwards_;
   QPushButton *addButton_;
   QPushButton *saveButton_;
   QPushButton *deleteButton_;
@@ -56,4 +62,17 @@ private:
   QPushButton *connectButton_;
   QCheckBox *protectCheck_;
   QCheckBox *openInNewTabCheck_;
+  QCheckBox *keepWarmCheck_;
+  QCheckBox *logSessionCheck_;
+  QGroupBox *transportGroup_;
+  QLineEdit *ciphers_;
+  QLineEdit *macs_;
+  QLineEdit *kex_;
+  QSpinBox *compression_;
+  QSpinBox *rekeyData_;
+  QSpinBox *rekeyTime_;
+  QCheckBox *noDelayCheck_;
+  QSpinBox *sendBuffer_;
+  QSpinBox *receiveBuffer_;
+  QPushButton *benchmarkButton_;
 };
@@ -3,6 +3,9 @@
 #include <QString>
 #include <QVector>
 
+#include "PortForward.h"
+#include "SshTransport.h"
+
 struct Profile {
   QString name;
   QString host;
@@ -10,6 +13,13 @@ struct Profile {
   int port = 22;
   QString keyPath;
   bool openInNewTab = false;
+  bool keepWarm = false;
+  // Record every session of this profile with SessionLog.
+  bool logSession = false;
+  SshTransport transport;
+  QVector<PortForward> forwards;
+  // Jump hosts to connect through, as in ssh -J; empty for a direct connection.
+  QString proxyJump;
 };
 
 class ProfileStore {
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+
+#ifdef HAVE_LIBVTERM
+#include <vterm.h>
+#if !defined(VTERM_VERSION_MAJOR) || (VTERM_VERSION_MAJOR == 0 && VTERM_VERSION_MINOR < 2)
+#error "libvterm 0.2 or later is required"
+#endif
+#endif
+
+// One terminal cell packed into 12 bytes. `glyph` holds the codepoint in its
+// low 21 bits and the rendition flags above it; colours use the packing of
+// the CellColor helpers below.
+struct Cell {
+  enum : quint32 {
+    CodepointMask = 0x001fffff,
+    Bold = 1u << 21,
+    Italic = 1u << 22,
+    UnderlineShift = 23,
+    UnderlineMask = 3u << 23,
+    Blink = 1u << 25,
+    Reverse = 1u << 26,
+    Conceal = 1u << 27,
+    Strike = 1u << 28,
+    AttrMask = 0x1fe00000,
+    Wide = 1u << 29,     // first column of a double-width glyph
+    WideTail = 1u << 30, // second column; draws nothing itself
+    Cluster = 1u << 31,  // codepoint bits index ScreenModel::cluster()
+  };
+
+  quint32 glyph = 0;
+  quint32 fg = 0;
+  quint32 bg = 0;
+
+  uint codepoint() const { return glyph & CodepointMask; }
+  quint32 attrs() const { return glyph & AttrMask; }
+};
+
+static_assert(sizeof(Cell) == 12, "Cell must stay packed");
+
+namespace CellColor {
+
+constexpr quint32 Default = 0;
+constexpr quint32 IndexedTag = 0x01000000;
+constexpr quint32 RgbTag = 0x02000000;
+constexpr quint32 TagMask = 0xff000000;
+
+constexpr quint32 indexed(int index) { return IndexedTag | quint32(index & 0xff); }
+constexpr quint32 rgb(int r, int g, int b) {
+  return RgbTag | (quint32(r & 0xff) << 16) | (quint32(g & 0xff) << 8) | quint32(b & 0xff);
+}
+constexpr bool isDefault(quint32 c) { return c == Default; }
+constexpr bool isIndexed(quint32 c) { return (c & TagMask) == IndexedTag; }
+
+} // namespace CellColor
+
+class Scrollback;
+
+// Screen contents behind TerminalWidget, fed directly by the VTermState
+// callbacks. Each buffer is one contiguous cell array addressed through a row
+// map, so scrolling rotates row indices instead of copying cells. Lines
+// scrolled off the top of the main screen go to the scrollback.
+//
+// Rows that libvterm wrapped onto the next are flagged, and the flag goes to
+// the scrollback with the row, so a resize can lay soft-wrapped text out again
+// at the new width.
+class ScreenModel {
+public:
+  // A block of cells that moved on screen, in cell coordinates. Renderers
+  // holding a rasterized copy of the screen can shift their pixels instead of
+  // redrawing the destination.
+  struct Move {
+    int destRow;
+    int srcRow;
+    int rows;
+    int destCol;
+    int srcCol;
+    int cols;
+  };
+
+  ScreenModel(int rows, int cols);
+  ~ScreenModel();
+
+  Scrollback &scrollback() { return *scrollback_; }
+  const Scrollback &scrollback() const { return *scrollback_; }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  const Cell *row(int r) const {
+    const Buffer &buf = alt_ ? altBuf_ : mainBuf_;
+    return buf.cells.constData() + buf.rowMap.at(r) * cols_;
+  }
+  QString cluster(quint32 id) const { return clusters_.value(int(id)); }
+  // Cluster text by id, for cells with Cell::Cluster set.
+  const QVector<QString> &clusters() const { return clusters_; }
+  // Where each row starts when `length` cells of text are laid out `cols`
+  // wide; a double-width glyph is never cut in half. Always starts with 0.
+  static QVector<int> wrapPoints(const Cell *cells, int length, int cols);
+  QString text(const Cell &cell) const;
+
+  int cursorRow() const { return cursorRow_; }
+  int cursorCol() const { return cursorCol_; }
+  bool cursorVisible() const { return cursorVisible_; }
+  bool altScreen() const { return alt_; }
+  bool reverseVideo() const { return reverse_; }
+
+  // Calls fn(move) for every move since the last call, oldest first. Must be
+  // drained before takeDamage(): damage is recorded in post-move coordinates.
+  template <typename Fn>
+  void takeMoves(Fn &&fn) {
+    for (const Move &m : moves_) {
+      fn(m);
+    }
+    moves_.clear();
+  }
+
+  // Calls fn(row, startCol, endCol) for every row changed since the last
+  // call and clears the recorded damage.
+  template <typename Fn>
+  void takeDamage(Fn &&fn) {
+    if (!damaged_) {
+      return;
+    }
+    for (int r = 0; r < rows_; ++r) {
+      Span &d = damage_[r];
+      if (d.start < d.end) {
+        fn(r, d.start, d.end);
+        d = Span{cols_, 0};
+      }
+    }
+    damaged_ = false;
+  }
+
+#ifdef HAVE_LIBVTERM
+  void attach(VTermState *state);
+#endif
+
+private:
+  struct Buffer {
+    QVector<Cell> cells;
+    QVector<int> rowMap;
+    // By storage row, like `cells`: the row continues on the one below.
+    QVector<bool> wrapped;
+  };
+  struct Span {
+    int start;
+    int end;
+  };
+
+  Buffer &buffer() { return alt_ ? altBuf_ : mainBuf_; }
+  Cell *mutableRow(int r) {
+    Buffer &buf = buffer();
+    return buf.cells.data() + buf.rowMap.at(r) * cols_;
+  }
+  Cell blankCell() const;
+  void fillRow(int r, int startCol, int endCol, const Cell &blank);
+  void splitWide(Cell *line, int row, int col);
+  void damage(int row, int startCol, int endCol);
+  void damageRows(int first, int last);
+  void recordMove(const Move &move);
+  static void resizeBuffer(Buffer *buf, int oldRows, int oldCols, int rows, int cols, int skip);
+
+#ifdef HAVE_LIBVTERM
+  quint32 internCluster(const uint32_t *chars);
+  void reclaimClusters();
+  // Pushes a row to the scrollback, noting the line for each cluster in it.
+  void saveLine(const Cell *cells, int cols, bool wrapped);
+  static quint32 packColor(const VTermColor &col);
+
+  int putGlyph(const VTermGlyphInfo *info, VTermPos pos);
+  int scrollRect(VTermRect rect, int downward, int rightward);
+  int moveRect(VTermRect dest, VTermRect src);
+  int erase(VTermRect rect);
+  int setPenAttr(VTermAttr attr, const VTermValue *val);
+  int setTermProp(VTermProp prop, const VTermValue *val);
+  int resize(int rows, int cols, VTermStateFields *fields);
+  void reflow(int rows, int cols, VTermPos *cursor);
+
+  VTermStateCallbacks callbacks_ = {};
+#endif
+
+  int rows_ = 0;
+  int cols_ = 0;
+  Buffer mainBuf_;
+  Buffer altBuf_;
+  bool alt_ = false;
+  bool reverse_ = false;
+  Cell pen_;
+  int cursorRow_ = 0;
+  int cursorCol_ = 0;
+  bool cursorVisible_ = true;
+  // Storage row of the last glyph if it reached the end of its row, until
+  // the cursor moves elsewhere; -1 otherwise.
+  int wrapPending_ = -1;
+  QVector<Span> damage_;
+  bool damaged_ = false;
+  QVector<Move> moves_;
+  QVector<QString> clusters_;
+  QHash<QString, quint32> clusterIds_;
+  // By cluster id: the newest scrollback line that used it, -1 for none.
+  // Ids on neither screen whose line has been dropped are reused.
+  QVector<qint64> clusterLines_;
+  QVector<quint32> freeClusters_;
+  // Scrollback start at the last sweep that freed nothing, -1 otherwise.
+  qint64 sweptBegin_ = -1;
+  int missesSinceSweep_ = 0;
+  std::unique_ptr<Scrollback> scrollback_;
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QTemporaryFile>
+#include <QVector>
+
+#include <memory>
+
+#include "ScreenModel.h"
+
+// Lines scrolled off the top of the main screen, oldest first. Each line is
+// encoded into a shared arena block: trailing blanks are dropped, text is one
+// byte per cell when the line is plain ASCII and a varint per cell otherwise,
+// and attributes are stored as runs. A line of default-coloured text costs
+// little more than its characters.
+//
+// Only the newest few blocks stay in memory. Older ones are compressed into
+// fixed-size slots of a temporary file and read back on demand, keeping a
+// handful of decompressed blocks cached, so memory use does not grow with the
+// history. Without a usable temp file every block stays in memory.
+//
+// A line pushed as soft-wrapped continues on the next one; together they make
+// up one line of text, which can be laid out again at another width. Every
+// block holds lines pushed at a single screen width.
+//
+// Lines are numbered from the first one ever pushed, so an index stays valid
+// until the line is dropped. Limits are enforced by dropping the oldest block,
+// so a few hundred lines more than the limit may be held at a time.
+class Scrollback {
+public:
+  static constexpr int kBlockSize = 64 * 1024;
+  static constexpr int kSlotSize = 16 * 1024;
+  // Sealed blocks kept uncompressed behind the one being filled.
+  static constexpr int kHotBlocks = 4;
+  // Decompressed cold blocks kept for scrolling around in old history.
+  static constexpr int kCachedBlocks = 8;
+
+  // A block as a reader on another thread sees it. Hot blocks share their
+  // bytes; cold ones only name their slots until readSegment() fills them in.
+  struct Segment {
+    qint64 first = 0;
+    int lines = 0;
+    QByteArray data;
+    QVector<quint16> starts;
+    QVector<quint32> slots;
+    int packedSize = 0;
+  };
+
+  Scrollback(int maxLines = 100000, qint64 maxBytes = 64 * 1024 * 1024);
+
+  // A limit of 0 lines turns the scrollback off. `maxBytes` counts blocks
+  // where they are stored, compressed on disk or in memory.
+  void setLimits(int maxLines, qint64 maxBytes);
+  int maxLines() const { return maxLines_; }
+  qint64 maxBytes() const { return maxBytes_; }
+  // Whether sealed blocks may move to the temp file; on by default.
+  void setSpillEnabled(bool enabled);
+
+  // Index of the oldest line held, and one past the newest.
+  qint64 begin() const { return begin_; }
+  qint64 end() const { return end_; }
+  int size() const { return int(end_ - begin_); }
+  bool isEmpty() const { return end_ == begin_; }
+  // Space the history takes, on disk and in memory.
+  qint64 bytes() const { return bytes_; }
+  // Memory held by uncompressed blocks.
+  qint64 residentBytes() const;
+
+  // `wrapped` if the line continues on the next one pushed.
+  void push(const Cell *cells, int cols, bool wrapped = false);
+  // Removes the newest line into `cells`; false if there is none.
+  bool pop(QVector<Cell> *cells, bool *wrapped = nullptr);
+  // Decodes line `index` into `cells`, sized to the cells the line kept.
+  // False if the line is gone or its block could not be read back.
+  bool line(qint64 index, QVector<Cell> *cells, bool *wrapped = nullptr) const;
+  // The screen width line `index` was pushed at, 0 if it is gone, and the
+  // lines [first, last) around it held in the same block.
+  int width(qint64 index, qint64 *first = nullptr, qint64 *last = nullptr) const;
+  void clear();
+
+  // The blocks holding lines from `from` on, oldest first.
+  QVector<Segment> segments(qint64 from) const;
+  // The temp file behind cold segments; empty before the first spill.
+  QString fileName() const;
+  // Reads a cold segment from `file`, opened separately on fileName(). False
+  // if the read fails or the slots were meanwhile reused for another block.
+  static bool readSegment(QIODevice *file, Segment *segment);
+  // The text of an encoded line if every cell in it is ASCII: one byte per
+  // cell, 0 for an empty cell.
+  static bool asciiText(const char *data, int size, const char **text, int *length);
+  static void decode(const char *data, int size, QVector<Cell> *cells, bool *wrapped = nullptr);
+
+private:
+  struct Block {
+    qint64 first = 0;
+    int lines = 0;
+    int cols = 0;
+    // Empty while the block is on disk and not cached.
+    QByteArray data;
+    // Start of each line in `data`. Lines never start past kBlockSize, only
+    // a line larger than a whole block makes one longer.
+    QVector<quint16> starts;
+    // File slots holding the compressed block, in order; empty while hot.
+    QVector<quint32> slots;
+    int packedSize = 0;
+
+    bool cold() const { return !slots.isEmpty(); }
+  };
+
+  int find(qint64 index, int *slot) const;
+  void trim();
+  void spill(Block *block);
+  bool load(const std::shared_ptr<Block> &block) const;
+  void release(Block *block);
+  void uncache(Block *block) const;
+  static void encode(const Cell *cells, int cols, bool wrapped, QByteArray *out);
+  static bool unpack(QIODevice *file, const QVector<quint32> &slots, int packedSize, qint64 first, int lines,
+                     QByteArray *data, QVector<quint16> *starts);
+
+  QList<std::shared_ptr<Block>> blocks_;
+  QByteArray scratch_;
+  qint64 begin_ = 0;
+  qint64 end_ = 0;
+  qint64 bytes_ = 0;
+  int maxLines_ = 0;
+  qint64 maxBytes_ = 0;
+
+  // Opened on the first spill; removed when the scrollback goes away.
+  mutable QTemporaryFile file_;
+  bool spill_ = true;
+  bool fileFailed_ = false;
+  quint32 slotCount_ = 0;
+  QVector<quint32> freeSlots_;
+  // Cold blocks holding decompressed data, least recently used first.
+  mutable QList<std::shared_ptr<Block>> cache_;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <QVector>
+
+#include <deque>
+
+#include "Scrollback.h"
+
+// The scrollback as rows of the screen width. Lines pushed at that width are
+// a row each, as they were on screen; a run of soft-wrapped lines pushed at
+// another width is joined into one line and cut again. Rows are counted back
+// from the newest, 0 being the row just above the screen, and are only laid
+// out as far back as they have been asked for, so after a resize the cost of
+// reflowing the history follows how far the view is scrolled.
+class ScrollbackLayout {
+public:
+  // Cells [offset, offset + length) of lines [line, last) joined.
+  struct Row {
+    qint64 line = 0;
+    qint64 last = 0;
+    int offset = 0;
+    int length = 0;
+  };
+  // Part of a row: `length` cells from column `col` of scrollback line `line`,
+  // shown from column `at` of the row.
+  struct Piece {
+    qint64 line = 0;
+    int col = 0;
+    int at = 0;
+    int length = 0;
+  };
+
+  // Forgets the layout; rows are `cols` wide from then on.
+  void reset(int cols);
+  int cols() const { return cols_; }
+
+  // How many of the first `want` rows exist, laying out further back as
+  // needed.
+  int available(const Scrollback &history, int want);
+  // Row `n`; false past the oldest line.
+  bool row(const Scrollback &history, int n, Row *out);
+  // The row showing column `col` of line `line`, -1 if the line is gone.
+  int rowOf(const Scrollback &history, qint64 line, int col);
+  // The cells of a row, padded to the width.
+  void cells(const Scrollback &history, const Row &row, QVector<Cell> *out);
+  // The scrollback lines a row shows, left to right.
+  void pieces(const Scrollback &history, const Row &row, QVector<Piece> *out);
+
+private:
+  // Lines [first, last) on rows [top, top + rows) in a coordinate that grows
+  // towards newer rows. A `direct` entry has a row per line; any other is a
+  // single reflowed line.
+  struct Entry {
+    qint64 first;
+    qint64 last;
+    qint64 top;
+    int rows;
+    bool direct;
+  };
+
+  void sync(const Scrollback &history);
+  bool growBack(const Scrollback &history);
+  void append(const Scrollback &history, qint64 first, qint64 last, bool direct);
+  qint64 lineStart(const Scrollback &history, qint64 last, int width);
+  qint64 lineEnd(const Scrollback &history, qint64 first, qint64 stop, int width);
+  const QVector<int> &join(const Scrollback &history, qint64 first, qint64 last);
+  int entryAt(qint64 coord) const;
+
+  int cols_ = 0;
+  // Oldest first, covering [entries_.front().first, end_).
+  std::deque<Entry> entries_;
+  qint64 end_ = -1;
+  qint64 bottom_ = 0;
+  QVector<Cell> scratch_;
+  // The last line joined: its cells, where each scrollback line starts in
+  // them and where its rows start.
+  qint64 joinedFirst_ = -1;
+  qint64 joinedLast_ = -1;
+  QVector<Cell> joined_;
+  QVector<int> joinedStarts_;
+  QVector<int> joinedRows_;
+};
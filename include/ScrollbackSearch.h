@@ -0,0 +1,126 @@
+#pragma once
+
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QRegularExpression>
+#include <QString>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <atomic>
+
+#include "Scrollback.h"
+
+class QThread;
+
+// Finds text in the scrollback on a worker thread. A search scans every block
+// once, newest first so the hits nearest the screen come back first, and
+// extend() then scans only the lines pushed since. Results are delivered in
+// batches through found() on the owner's thread; a batch never spans blocks
+// and is sorted by position.
+class ScrollbackSearch : public QObject {
+  Q_OBJECT
+public:
+  struct Query {
+    QString pattern;
+    bool regex = false;
+    bool caseSensitive = false;
+  };
+
+  // `line` is a scrollback index; screen rows continue after Scrollback::end().
+  // `col` and `length` are in cells.
+  struct Match {
+    qint64 line = 0;
+    int col = 0;
+    int length = 0;
+  };
+
+  // A compiled query. Plain ASCII literals are found by scanning the encoded
+  // blocks directly; anything else is matched against decoded line text.
+  class Matcher {
+  public:
+    explicit Matcher(const Query &query = Query());
+
+    bool isEmpty() const { return needle_.isEmpty(); }
+    bool isValid() const { return error_.isEmpty(); }
+    QString errorString() const { return error_; }
+
+    // Appends the matches in a row of cells, as line `line`. Cluster cells
+    // are searched as their text in `clusters`, ScreenModel::clusters().
+    void matchCells(const Cell *cells, int count, qint64 line, const QVector<QString> &clusters,
+                    QVector<Match> *out) const;
+    // Appends the matches in a block, for lines from `fromLine` on.
+    void matchSegment(const Scrollback::Segment &segment, qint64 fromLine, const QVector<QString> &clusters,
+                      QVector<Match> *out) const;
+
+  private:
+    void matchText(const QString &text, const QVector<int> &cols, const Cell *cells, qint64 line,
+                   QVector<Match> *out) const;
+    void scanAscii(const Scrollback::Segment &segment, int firstLine, const QVector<QString> &clusters,
+                   QVector<Match> *out) const;
+    bool verify(const char *text, int length, int at) const;
+
+    QString needle_;
+    QRegularExpression regex_;
+    bool isRegex_ = false;
+    Qt::CaseSensitivity cs_ = Qt::CaseInsensitive;
+    QString error_;
+    // Set for ASCII literals: the needle as bytes, folded to lower case when
+    // matching without case, and its longest run without blanks, which is
+    // what the scanner looks for (an empty cell reads as a blank).
+    QByteArray bytes_;
+    int anchorAt_ = 0;
+    int anchorLength_ = 0;
+  };
+
+  explicit ScrollbackSearch(QObject *parent = nullptr);
+  ~ScrollbackSearch() override;
+
+  // Starts searching `history` for `query`, dropping any search in progress.
+  // `clusters` is copied for the worker to read the text of cluster cells.
+  void start(const Query &query, const Scrollback &history, const QVector<QString> &clusters);
+  // Queues the lines pushed to `history` since the last start() or extend().
+  void extend(const Scrollback &history, const QVector<QString> &clusters);
+  void stop();
+  bool isActive() const { return active_; }
+  // True while queued blocks remain to be scanned.
+  bool isBusy() const { return pending_ > 0; }
+  // Searches stop delivering hits past this many.
+  static constexpr int kMaxMatches = 100000;
+
+signals:
+  void found(const QVector<ScrollbackSearch::Match> &matches);
+  // The queue ran dry; `truncated` if kMaxMatches was reached.
+  void finished(bool truncated);
+
+protected:
+  void customEvent(QEvent *event) override;
+
+private:
+  struct Job {
+    quint64 generation = 0;
+    Query query;
+    QVector<QString> clusters;
+    QVector<Scrollback::Segment> segments;
+    qint64 from = 0;
+    QString fileName;
+    bool newestFirst = false;
+  };
+
+  void enqueue(Job job);
+  void run();
+
+  QThread *thread_ = nullptr;
+  QMutex mutex_;
+  QWaitCondition wake_;
+  QList<Job> jobs_;
+  bool quit_ = false;
+  std::atomic<quint64> generation_{0};
+
+  // Owner thread only.
+  Query query_;
+  bool active_ = false;
+  qint64 scanned_ = 0;
+  int pending_ = 0;
+};
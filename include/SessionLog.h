@@ -0,0 +1,96 @@
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QWaitCondition>
+
+class QThread;
+
+// Records a session as an asciicast v2 file: a JSON header line, then a
+// [time, code, data] line for every chunk of output ("o"), input ("i") and
+// every resize ("r"). Recording a chunk only queues it, sharing the caller's
+// bytes; a writer thread turns each batch into JSON and appends it to the
+// file, so a slow disk never holds up the caller. A file that grows past the
+// size limit is closed and the recording goes on in a new part with its own
+// header.
+class SessionLog : public QObject {
+  Q_OBJECT
+public:
+  // Past this many bytes waiting to be written, chunks are dropped and a
+  // marker ("m") in the file says how much.
+  static constexpr qint64 kMaxQueued = 64 * 1024 * 1024;
+
+  explicit SessionLog(QObject *parent = nullptr);
+  ~SessionLog() override;
+
+  // Starts recording to `path`; later parts insert ".2", ".3", ... before
+  // the extension. A `maxBytes` of 0 keeps everything in one file.
+  bool open(const QString &path, int rows, int cols, const QString &title, qint64 maxBytes,
+            QString *error = nullptr);
+  // Writes out what is queued and stops.
+  void close();
+  bool isOpen() const { return thread_ != nullptr; }
+  QString fileName() const { return path_; }
+
+  void output(const QByteArray &data) { record('o', data); }
+  void input(const QByteArray &data) { record('i', data); }
+  void resize(int rows, int cols);
+
+  // Where logs go unless the `logging/dir` setting says otherwise.
+  static QString defaultDirectory();
+  // Logs `megabytes` of coloured output in 16 KB chunks and reports the
+  // time the caller spent and the rate the writer kept up. Used by
+  // --bench-log.
+  static QString benchmark(int megabytes);
+
+signals:
+  // Logging stopped because the file could not be written.
+  void failed(const QString &message);
+
+protected:
+  void customEvent(QEvent *event) override;
+
+private:
+  struct Event {
+    qint64 nsecs;
+    char code;
+    QByteArray data;
+  };
+
+  void record(char code, const QByteArray &data);
+  void run();
+  bool append(const Event &event, QByteArray *batch, QString *error, bool hold = true);
+  bool write(QByteArray *batch, QString *error);
+  bool startPart(qint64 nsecs, QString *error);
+
+  QThread *thread_ = nullptr;
+  QMutex mutex_;
+  QWaitCondition wake_;
+  QList<Event> queue_;
+  qint64 queued_ = 0;
+  qint64 dropped_ = 0;
+  bool quit_ = false;
+  bool broken_ = false;
+  QElapsedTimer clock_;
+  QString path_;
+
+  // Writer thread only while it runs.
+  QFile file_;
+  QString title_;
+  qint64 epochMs_ = 0;
+  qint64 maxBytes_ = 0;
+  int rows_ = 0;
+  int cols_ = 0;
+  int part_ = 0;
+  qint64 partStart_ = 0;
+  qint64 partBytes_ = 0;
+  qint64 headerBytes_ = 0;
+  // The start of a UTF-8 sequence cut off at the end of the last output and
+  // input chunk, held back until the rest arrives.
+  QByteArray tail_[2];
+};
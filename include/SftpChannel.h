@@ -0,0 +1,182 @@
+#pragma once
+
+#include "SpscRing.h"
+#include "SshReactor.h"
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+
+class SftpPanel;
+
+struct SftpEntry {
+  QString name;
+  qint64 size = -1;
+  quint32 permissions = 0;
+  QDateTime modified;
+
+  bool isDir() const { return (permissions & 0170000) == 0040000; }
+  bool isLink() const { return (permissions & 0170000) == 0120000; }
+};
+
+// One file copied over SFTP. Queued by the GUI, run by the reactor, which
+// reports progress through the atomics.
+struct SftpTransfer {
+  enum Direction { Download, Upload };
+  enum State { Queued, Running, Done, Failed, Cancelled };
+
+  Direction direction = Download;
+  QString remotePath;
+  QString localPath;
+  // Continue a partial copy: what is already at the destination is kept
+  // and only the rest is sent.
+  bool resume = false;
+  std::atomic<bool> cancelRequested{false};
+  std::atomic<int> state{Queued};
+  std::atomic<qint64> size{-1};
+  std::atomic<qint64> resumedFrom{0};
+  std::atomic<qint64> done{0}; // bytes of the file at the destination
+  QString error;                // set before the transfer is reported done
+
+  // Reactor thread only.
+  QFile file;
+  QByteArray handle;
+  qint64 nextOffset = 0; // next file offset to request
+  qint64 eofAt = -1;     // downloads: offset the server reported EOF at
+  int inFlight = 0;
+  // Downloads: data that arrived ahead of a gap, written once it fills.
+  QMap<qint64, QByteArray> early;
+};
+
+// A request from the GUI thread.
+struct SftpCommand {
+  enum Kind { List, Transfer };
+  Kind kind = List;
+  QString path;
+  std::shared_ptr<SftpTransfer> transfer;
+};
+
+// A result for the GUI thread.
+struct SftpReply {
+  enum Kind { Ready, Listing, TransferDone, Failed, Closed };
+  Kind kind = Ready;
+  QString path; // Ready: the home directory; Listing, Failed: the path
+  QVector<SftpEntry> entries;
+  std::shared_ptr<SftpTransfer> transfer;
+  QString error;
+};
+
+// An SFTP (version 3) client on one channel of a shared SSH connection,
+// spoken directly on the reactor so it never blocks and needs no thread of
+// its own. Transfers are pipelined: each keeps up to kMaxInFlight reads or
+// writes of kChunkSize outstanding, so throughput is bounded by the link
+// and the SSH window rather than the round trip. Up to maxTransfers files
+// copy at once, and rateLimit caps their combined speed.
+class SftpChannel {
+public:
+  static constexpr quint32 kChunkSize = 32 * 1024; // accepted by every server
+  static constexpr int kMaxInFlight = 64;
+
+  explicit SftpChannel(const std::shared_ptr<SshConnection> &connection) : connection(connection) {}
+
+  const std::shared_ptr<SshConnection> connection;
+  SpscRing<SftpCommand> commands{256}; // GUI -> reactor
+  SpscRing<SftpReply> replies{256};    // reactor -> GUI
+  std::atomic<bool> repliesPosted{false};
+  std::atomic<bool> closeRequested{false};
+  std::atomic<int> maxTransfers{3};
+  std::atomic<qint64> rateLimit{0}; // bytes per second, 0 = unlimited
+
+  // Reactor thread only. service() runs the protocol as far as it can
+  // without blocking; it returns false with `error` set if the connection
+  // itself failed. close() ends every transfer and reports Closed.
+  bool service(QString *error);
+  void close(const QString &error);
+  bool isClosed() const { return closed_; }
+  // Whether another service() call would make progress right away.
+  bool readPending() const;
+  bool writePending() const;
+  // When a throttled or connecting channel next needs a look.
+  QDeadlineTimer wakeDeadline() const;
+  // Set when the connection's socket was readable.
+  void markReadable() { channelReadable_ = true; }
+  // Marks the channel readable if libssh already holds data or an EOF for
+  // it, taken in while another channel on the connection was read.
+  void markIfBuffered();
+  // Whether replies were pushed since the last call.
+  bool takeRepliesPushed();
+  quint64 takeBytesRead();
+  quint64 takeBytesWritten();
+
+  // GUI thread only; cleared when the panel lets go of the channel.
+  SftpPanel *owner = nullptr;
+
+private:
+  enum class Phase { Creating, OpeningChannel, StartingSubsystem, Initializing, Ready };
+
+  struct Request {
+    enum Kind { Home, OpenDir, ReadDir, CloseHandle, Stat, Open, Read, Write };
+    Kind kind = Home;
+    QString path;
+    QByteArray handle;
+    QVector<SftpEntry> entries;
+    std::shared_ptr<SftpTransfer> transfer;
+    qint64 offset = 0;
+    quint32 length = 0;
+  };
+
+  bool stepChannel();
+  void takeCommands();
+  bool readPackets(QString *error);
+  void handlePacket(quint8 type, const char *body, int size);
+  void handleReply(Request &request, quint8 type, const char *body, int size);
+  void startTransfers();
+  void startTransfer(const std::shared_ptr<SftpTransfer> &transfer);
+  void openRemote(const std::shared_ptr<SftpTransfer> &transfer);
+  bool pumpTransfer(const std::shared_ptr<SftpTransfer> &transfer);
+  bool downloaded(const std::shared_ptr<SftpTransfer> &transfer, qint64 offset, const char *data, int length);
+  void checkFinished(const std::shared_ptr<SftpTransfer> &transfer);
+  void finish(const std::shared_ptr<SftpTransfer> &transfer, SftpTransfer::State state, const QString &error);
+  bool takeTokens(quint32 bytes);
+  // Requests are built in place at the end of out_: beginPacket() writes
+  // the header and registers `request` under a new id, the caller appends
+  // the fields, endPacket() fills in the length.
+  quint32 beginPacket(quint8 type, Request request, int *start);
+  void endPacket(int start);
+  void sendRead(const Request &request);
+  void sendClose(const QByteArray &handle);
+  bool flush(QString *error);
+  void reply(SftpReply reply);
+
+#ifdef HAVE_LIBSSH
+  ssh_channel channel_ = nullptr;
+#endif
+  Phase phase_ = Phase::Creating;
+  QDeadlineTimer deadline_;
+  TunnelBuffer in_{512 * 1024};
+  QByteArray out_;
+  int outOffset_ = 0;
+  bool channelReadable_ = true;
+  bool closed_ = false;
+  bool repliesPushed_ = false;
+  quint32 nextId_ = 1;
+  QHash<quint32, Request> requests_;
+  QList<std::shared_ptr<SftpTransfer>> queued_;
+  QList<std::shared_ptr<SftpTransfer>> running_;
+  QList<SftpReply> unsent_; // waiting for room in the reply ring
+  double tokens_ = 0.0;
+  QElapsedTimer tokenClock_;
+  QDeadlineTimer throttled_;
+  quint64 bytesRead_ = 0;
+  quint64 bytesWritten_ = 0;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QWidget>
+
+#include <memory>
+
+#include "SftpChannel.h"
+
+class QLabel;
+class QLineEdit;
+class QSpinBox;
+class QTimer;
+class QTreeWidget;
+class QTreeWidgetItem;
+class SshSession;
+
+// Remote file browser and transfer queue for one tab. Runs over an SFTP
+// channel on the tab's own SSH connection, so it needs no second login.
+class SftpPanel : public QWidget {
+  Q_OBJECT
+public:
+  explicit SftpPanel(SshSession *session, QWidget *parent = nullptr);
+  ~SftpPanel() override;
+
+  // Opens the SFTP channel unless it is open; the session must be connected.
+  void open();
+  // Lets go of the channel; unfinished transfers are cancelled.
+  void close();
+
+private slots:
+  void onPathEntered();
+  void onUp();
+  void onItemActivated(QTreeWidgetItem *item, int column);
+  void onUpload();
+  void onDownload();
+  void onCancelTransfers();
+  void onClearTransfers();
+  void onLimitsChanged();
+  void updateTransfers();
+
+private:
+  friend class SshReactor;
+
+  struct Row {
+    std::shared_ptr<SftpTransfer> transfer;
+    QTreeWidgetItem *item = nullptr;
+    qint64 lastDone = 0;
+  };
+
+  void drainReplies();
+  void list(const QString &path);
+  void queue(SftpCommand command);
+  void flushCommands();
+  void addTransfer(SftpTransfer::Direction direction, const QString &remotePath, const QString &localPath,
+                   bool resume);
+  void showListing(const QString &path, QVector<SftpEntry> entries);
+  // Asks whether files already at the destination should be resumed or
+  // replaced; false if the user cancelled.
+  bool askResume(const QStringList &existing, bool *resume);
+  QString remotePath(const QString &name) const;
+
+  SshSession *session_;
+  std::shared_ptr<SftpChannel> sftp_;
+  QString cwd_;
+  QVector<SftpEntry> entries_;
+  QList<SftpCommand> pending_; // waiting for room in the command ring
+  QList<Row> rows_;
+  QLineEdit *pathEdit_;
+  QTreeWidget *files_;
+  QTreeWidget *transfers_;
+  QSpinBox *parallel_;
+  QSpinBox *rateLimit_;
+  QLabel *status_;
+  QTimer *timer_;
+};
@@ -0,0 +1,346 @@
+#pragma once
+
+#include "PortForward.h"
+#include "SpscRing.h"
+#include "SshTarget.h"
+#include "SshTransport.h"
+
+#include <QByteArray>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+#ifdef HAVE_LIBSSH
+#include <libssh/libssh.h>
+#endif
+
+class QThread;
+class SftpChannel;
+class SshReactor;
+class SshSession;
+struct SshEndpoint;
+struct SshListener;
+struct SshTunnel;
+
+// Connection setup phases, in order. The reactor drives each one with
+// non-blocking libssh calls under its own timeout.
+enum class SshPhase { TcpConnect, Handshake, Authenticating, OpeningChannel, RequestingPty, StartingShell, Ready };
+
+QString sshPhaseName(SshPhase phase);
+
+// A request from the GUI thread for one channel, applied in order.
+struct SshCommand {
+  enum Kind { Write, Resize };
+  Kind kind = Write;
+  QByteArray data;
+  int rows = 0;
+  int cols = 0;
+};
+
+// A socket the reactor's poller watches. Reactor thread only.
+struct SshPollable {
+  int fd = -1;
+  bool watched = false;
+  int interest = 0; // as last given to the poller
+  bool readable = false;
+  bool writable = false;
+};
+
+// One authenticated SSH connection, shared by every channel opened to the
+// same host, user, port and key (like OpenSSH's ControlMaster). The
+// connection is pinned to one reactor since a libssh session must only be
+// used from one thread. A connection made through a jump host runs on the
+// jump host's reactor, over a direct-tcpip channel of its session.
+struct SshConnection : SshPollable {
+#ifdef HAVE_LIBSSH
+  ssh_session session = nullptr;
+  // Connection setup, consumed by the reactor as the phases advance. With a
+  // jump host, `host` is the channel's target and `addresses` are unused.
+  QList<QHostAddress> addresses;
+  QString host;
+  quint16 port = 22;
+  QByteArray password;
+  ssh_key key = nullptr;
+#endif
+  SshTransport transport; // socket options are applied by the reactor
+  SshReactor *reactor = nullptr;
+  // The ProxyJump hop this connection tunnels through, or null. Set before
+  // the connection is attached; the connection holds one user of it.
+  std::shared_ptr<SshConnection> jump;
+  // Set by the GUI once no session uses the connection; the reactor then
+  // disconnects it as soon as its last channel has closed.
+  std::atomic<bool> retired{false};
+  std::atomic<bool> failed{false};
+  // Interval for keepalive@openssh.com requests once authenticated; 0 = off.
+  std::atomic<int> keepaliveMs{0};
+  // Time from the start of the TCP connect to successful auth; -1 until then.
+  std::atomic<qint64> connectMs{-1};
+
+  // Reactor thread only. Phases run up to Authenticating; Ready means the
+  // connection is authenticated and channels can be opened.
+  SshPhase phase = SshPhase::TcpConnect;
+  QDeadlineTimer deadline;
+  QElapsedTimer connectTimer;
+  QDeadlineTimer nextKeepalive;
+  int addressIndex = 0;
+  bool fdOwned = false; // until libssh takes the socket over
+  bool adopted = false;
+  bool closed = false;
+  // A channel read or wrote this pass, so libssh may hold data for others.
+  bool pumped = false;
+  QString error;
+  QVector<std::shared_ptr<SshEndpoint>> endpoints;
+  QVector<std::shared_ptr<SshListener>> listeners;
+  QVector<std::shared_ptr<SshTunnel>> tunnels;
+  QVector<std::shared_ptr<SftpChannel>> sftp;
+
+  // GUI thread only.
+  QString id;
+  int users = 0;
+  // Forwards started on this connection, whichever tab asked for them.
+  QVector<std::shared_ptr<SshListener>> forwards;
+};
+
+// A listening socket for one port forward. Accepted connections become
+// tunnels on the listener's SSH connection and close with it.
+struct SshListener : SshPollable {
+  PortForward forward;
+  std::shared_ptr<SshConnection> connection;
+  // Read by the GUI for the forward's status line.
+  std::atomic<int> activeTunnels{0};
+  std::atomic<quint64> totalTunnels{0};
+  std::atomic<quint64> bytesUp{0};   // local socket -> channel
+  std::atomic<quint64> bytesDown{0}; // channel -> local socket
+  std::atomic<bool> closed{false};
+};
+
+// A byte buffer filled at the tail and drained from the head. Space is only
+// reclaimed by moving the remainder down when the tail runs out.
+struct TunnelBuffer {
+  explicit TunnelBuffer(int size) : data(size, Qt::Uninitialized) {}
+
+  char *space() {
+    if (tail == data.size() && head > 0) {
+      std::memmove(data.data(), data.constData() + head, size_t(tail - head));
+      tail -= head;
+      head = 0;
+    }
+    return data.data() + tail;
+  }
+  int spaceSize() const { return data.size() - tail + (tail == data.size() ? head : 0); }
+  const char *pending() const { return data.constData() + head; }
+  int pendingSize() const { return tail - head; }
+  void produced(int n) { tail += n; }
+  void consumed(int n) {
+    head += n;
+    if (head == tail) {
+      head = tail = 0;
+    }
+  }
+
+  QByteArray data;
+  int head = 0;
+  int tail = 0;
+};
+
+// One forwarded TCP connection: a local socket pumped to and from a
+// direct-tcpip channel. Reactor thread only. Tunnels without a listener carry
+// a connection made through a jump host; their socket is one end of a
+// socketpair whose other end is that connection's.
+struct SshTunnel : SshPollable {
+  enum State { SocksGreeting, SocksRequest, Opening, Open };
+  static constexpr int kBufferSize = 256 * 1024;
+
+  std::shared_ptr<SshConnection> connection;
+  std::shared_ptr<SshListener> listener;
+  std::weak_ptr<SshConnection> carried;
+#ifdef HAVE_LIBSSH
+  ssh_channel channel = nullptr;
+#endif
+  State state = Opening;
+  QString targetHost;
+  quint16 targetPort = 0;
+  QString originHost;
+  quint16 originPort = 0;
+  QDeadlineTimer deadline;
+  TunnelBuffer up{kBufferSize};   // read from the socket, for the channel
+  TunnelBuffer down{kBufferSize}; // read from the channel, for the socket
+  bool channelReadable = true;
+  bool socketEof = false;
+  bool channelEofSent = false;
+  bool socketShutdown = false;
+  bool closed = false;
+};
+
+// One interactive channel owned by a reactor. Once attached, its connection
+// is only touched on the reactor thread; the GUI thread talks to the channel
+// through the two rings and the atomic flags.
+struct SshEndpoint {
+  // queuedBytes at or below which a waiting writer is told to send more.
+  static constexpr qint64 kWriteLowWater = 64 * 1024;
+
+  std::shared_ptr<SshConnection> connection;
+#ifdef HAVE_LIBSSH
+  ssh_channel channel = nullptr;
+#endif
+  int ptyRows = 24;
+  int ptyCols = 80;
+  SpscRing<QByteArray> output{256};  // reactor -> GUI
+  SpscRing<SshCommand> input{1024};  // GUI -> reactor
+  std::atomic<bool> outputPosted{false};
+  std::atomic<bool> outputStalled{false};
+  std::atomic<bool> closeRequested{false};
+  // Bytes accepted by SshSession::send() and not yet taken by the channel.
+  std::atomic<qint64> queuedBytes{0};
+  // Set by the GUI when it holds back data until queuedBytes drains.
+  std::atomic<bool> drainWanted{false};
+
+  // Reactor thread only. Mirrors the connection's phase until it is
+  // authenticated, then runs the channel phases.
+  SshPhase phase = SshPhase::TcpConnect;
+  QDeadlineTimer deadline;
+  QByteArray writeBacklog;
+  int writeOffset = 0;
+  bool needsRead = true;
+  bool closed = false;
+  QString error; // set before the close is posted
+
+  // GUI thread only; cleared when the session lets go of the endpoint.
+  SshSession *owner = nullptr;
+};
+
+// I/O thread running one epoll (poll(), or WSAPoll() on Windows, outside
+// Linux) loop over every attached SSH connection. Output is handed to the GUI
+// thread through each endpoint's output ring plus one posted event per batch,
+// so slow or flooding sessions never block the UI or each other. Channels are serviced in
+// rotating order so those sharing a connection get equal turns.
+class SshReactor : public QObject {
+  Q_OBJECT
+public:
+  struct Stats {
+    int endpoints = 0;
+    int connections = 0;
+    quint64 loops = 0;
+    quint64 bytesRead = 0;
+    quint64 bytesWritten = 0;
+  };
+
+  // Picks the least loaded reactor, starting threads on demand. The pool size
+  // comes from SSH_TERMINAL_IO_THREADS (default 1).
+  static SshReactor *acquire();
+  static Stats totalStats();
+
+  // Shared connections by id, GUI thread only. add() also picks the
+  // connection's reactor if it has none yet. share() adds a user to a live
+  // connection, or returns null if there is none. add() registers a new
+  // connection with one user; release() drops a user and retires the
+  // connection with the last one.
+  static bool hasConnection(const QString &id);
+  static std::shared_ptr<SshConnection> shareConnection(const QString &id);
+  static void addConnection(const std::shared_ptr<SshConnection> &connection);
+  static void releaseConnection(const std::shared_ptr<SshConnection> &connection);
+  // `jumpChain` is JumpHost::chainString() of the hops in front of the host.
+  static QString connectionId(const QString &host, const QString &user, int port, const QString &keyPath,
+                              const SshTransport &transport, const QString &jumpChain = QString());
+#ifdef HAVE_LIBSSH
+  // Creates a session for user@host:port with ~/.ssh/config and the libssh
+  // side of `transport` applied, and loads `keyPath`, if set, into `key`.
+  // `target` gets the host and port to connect to. Returns null with `error`
+  // set on failure. Touches no network, so any thread may call it.
+  static ssh_session newSession(const QString &host, const QString &user, int port, const QString &keyPath,
+                                const QString &keyPassphrase, const SshTransport &transport, ssh_key *key,
+                                SshTarget *target, QString *error);
+#endif
+
+  ~SshReactor() override;
+
+  void attach(const std::shared_ptr<SshEndpoint> &endpoint);
+  // Starts connecting without opening a channel, for connections kept warm.
+  void attachConnection(const std::shared_ptr<SshConnection> &connection);
+  // Binds the forward's local port on the calling thread, so errors such as
+  // a port in use are reported right away. attachListener() then starts
+  // accepting on the listener's connection.
+  static std::shared_ptr<SshListener> openListener(const PortForward &forward, QString *error);
+  void attachListener(const std::shared_ptr<SshListener> &listener);
+  void attachSftp(const std::shared_ptr<SftpChannel> &sftp);
+  // Wakes the I/O thread after queuing input or draining a full output ring.
+  void wake();
+
+protected:
+  void customEvent(QEvent *event) override;
+
+private:
+  explicit SshReactor(int index, QObject *parent);
+
+  void run();
+  void adopt(const std::shared_ptr<SshEndpoint> &endpoint);
+  void adoptConnection(const std::shared_ptr<SshConnection> &connection);
+  void adoptListener(const std::shared_ptr<SshListener> &listener);
+  void serviceConnection(const std::shared_ptr<SshConnection> &connection);
+  void service(const std::shared_ptr<SshEndpoint> &endpoint);
+  void advanceConnect(const std::shared_ptr<SshConnection> &connection);
+  bool stepConnect(const std::shared_ptr<SshConnection> &connection);
+  bool startTcpConnect(SshConnection *connection);
+  bool startJump(const std::shared_ptr<SshConnection> &connection);
+  void enterConnectionPhase(const std::shared_ptr<SshConnection> &connection, SshPhase phase);
+  bool stepChannel(const std::shared_ptr<SshEndpoint> &endpoint);
+  void enterPhase(const std::shared_ptr<SshEndpoint> &endpoint, SshPhase phase);
+  void flushWrites(const std::shared_ptr<SshEndpoint> &endpoint);
+  void readOutput(const std::shared_ptr<SshEndpoint> &endpoint);
+  void markBuffered(SshConnection *connection);
+  void closeEndpoint(const std::shared_ptr<SshEndpoint> &endpoint, const QString &error);
+  void closeConnection(const std::shared_ptr<SshConnection> &connection, const QString &error);
+  void post(const std::shared_ptr<SshEndpoint> &endpoint, int kind);
+  void acceptTunnels(const std::shared_ptr<SshListener> &listener);
+  void serviceTunnel(const std::shared_ptr<SshTunnel> &tunnel);
+  bool readSocks(const std::shared_ptr<SshTunnel> &tunnel);
+  void pumpTunnel(const std::shared_ptr<SshTunnel> &tunnel);
+  void closeTunnel(const std::shared_ptr<SshTunnel> &tunnel);
+  void closeListener(const std::shared_ptr<SshListener> &listener);
+  void adoptSftp(const std::shared_ptr<SftpChannel> &sftp);
+  void serviceSftp(const std::shared_ptr<SftpChannel> &sftp);
+  void postSftp(const std::shared_ptr<SftpChannel> &sftp);
+
+  // Platform poller: epoll on Linux, poll() or WSAPoll() elsewhere. Connections wait for
+  // writability while their TCP connect is in flight, then for input unless
+  // every channel on them is stalled. Listeners wait for input; tunnels for
+  // whichever direction has room. SFTP channels read whenever they are open.
+  bool openPoller();
+  void closePoller();
+  void updateInterest(SshPollable *pollable, int interest);
+  void unwatch(SshPollable *pollable);
+  void waitForEvents(int timeoutMs);
+
+  QThread *thread_ = nullptr;
+  std::atomic<bool> stopping_{false};
+  std::atomic<bool> wakePending_{false};
+  std::atomic<int> load_{0};
+  std::atomic<int> connectionCount_{0};
+  std::atomic<quint64> loops_{0};
+  std::atomic<quint64> bytesRead_{0};
+  std::atomic<quint64> bytesWritten_{0};
+
+  QMutex attachMutex_;
+  QVector<std::shared_ptr<SshEndpoint>> attaching_;
+  QVector<std::shared_ptr<SshConnection>> attachingConnections_;
+  QVector<std::shared_ptr<SshListener>> attachingListeners_;
+  QVector<std::shared_ptr<SftpChannel>> attachingSftp_;
+
+  // Reactor thread only.
+  QVector<std::shared_ptr<SshEndpoint>> endpoints_;
+  QVector<std::shared_ptr<SshConnection>> connections_;
+  int rotation_ = 0;
+  QByteArray readBuffer_;
+  int pollFd_ = -1;
+  int wakeRead_ = -1;
+  int wakeWrite_ = -1;
+};
@@ -2,11 +2,35 @@
 
 #include <QObject>
 #include <QByteArray>
+#include <QHostAddress>
+#include <QHostInfo>
+#include <QList>
 #include <QString>
+#include <QVector>
+
+#include <memory>
+
+#include "PortForward.h"
+
+#include "SshTransport.h"
+
+class SftpChannel;
+class SftpPanel;
+struct SshCommand;
+struct SshConnection;
+enum class SshPhase;
 
 class SshSession : public QObject {
   Q_OBJECT
 public:
+  struct ForwardStatus {
+    PortForward forward;
+    int activeTunnels = 0;
+    quint64 totalTunnels = 0;
+    quint64 bytesUp = 0;
+    quint64 bytesDown = 0;
+  };
+
   explicit SshSession(QObject *parent = nullptr);
   ~SshSession();
 
@@ -15,18 +39,62 @@ public:
                      const QString &password,
                      const QString &keyPath,
                      const QString &keyPassphrase,
-                     int port = 22);
+                     int port = 22,
+                     const SshTransport &transport = SshTransport(),
+                     const QString &proxyJump = QString());
+  // True when a tab already holds a live connection that connectToHost()
+  // with these arguments would share, so no key needs to be loaded.
+  static bool hasSharedConnection(const QString &host, const QString &user, int port, const QString &keyPath,
+                                  const SshTransport &transport = SshTransport(),
+                                  const QString &proxyJump = QString());
+
   void send(const QByteArray &data);
+  void sendPaste(const QByteArray &data, bool bracketed);
+  void cancelPaste();
+  // Aborts a connection attempt that has not reached the shell yet.
+  void cancel();
   void disconnectFromHost();
   void setPtySize(int rows, int cols);
+  // While paused, output stays in the reactor's ring; once that fills, the
+  // reactor stops reading the channel and the SSH and TCP windows hold the
+  // remote back. Used by a terminal that cannot keep up with its output.
+  void setOutputPaused(bool paused);
+  // Starts listening for `forward` on this session's connection once it is
+  // connected. A forward another tab already started on the shared
+  // connection is reused; errors are reported through error().
+  void addForward(const PortForward &forward);
+  // Forwards running on this session's connection.
+  QVector<ForwardStatus> forwardStatus() const;
+  // Opens an SFTP channel for `owner` on this session's connection, or
+  // returns null when not connected.
+  std::shared_ptr<SftpChannel> openSftp(SftpPanel *owner);
 
 signals:
   void output(const QByteArray &data);
   void error(const QString &message);
   void connected();
   void disconnected();
+  // Human-readable connection phase while connecting.
+  void progress(const QString &phase);
+  // Emitted while a chunked paste streams out; sent == total when it ends.
+  void pasteProgress(qint64 sent, qint64 total);
+
+private slots:
+  void onHostResolved(const QHostInfo &info);
 
 private:
+  friend class SshReactor;
+
+  void startConnection(const QList<QHostAddress> &addresses);
+  std::shared_ptr<SshConnection> jumpConnection(int index, const QList<QHostAddress> &addresses);
+  void attachEndpoint(const std::shared_ptr<SshConnection> &connection);
+  void queueCommand(SshCommand command, bool hasCommand);
+  void pumpPaste();
+  void drainReactorOutput(bool all = false);
+  void handleReactorWritten();
+  void handleReactorProgress(SshPhase phase);
+  void handleReactorClosed();
+
   struct Impl;
   Impl *impl_;
   bool connected_ = false;
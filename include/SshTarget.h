@@ -0,0 +1,27 @@
+#pragma once
+
+#include <QString>
+
+#ifdef HAVE_LIBSSH
+#include <libssh/libssh.h>
+#endif
+
+// Where a session goes once ~/.ssh/config has been applied to the name it
+// was given, so an alias connects to its HostName and Port like it does with
+// ssh(1).
+struct SshTarget {
+  QString host;
+  // Empty when neither the caller nor the config names one; libssh then
+  // logs in as the local user.
+  QString user;
+  int port = 22;
+
+#ifdef HAVE_LIBSSH
+  // Sets `host` on `session` and applies `configFile`, or ~/.ssh/config and
+  // the system file if empty. A non-empty `user` and a `port` other than 22
+  // override the entry's User and Port, as ssh -l and -p do. False with
+  // `error` set if the config cannot be parsed.
+  static bool resolve(ssh_session session, const QString &host, const QString &user, int port, SshTarget *target,
+                      QString *error = nullptr, const QString &configFile = QString());
+#endif
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <QString>
+
+// Per-profile transport settings. Empty strings and zeros leave the libssh
+// (or ~/.ssh/config) defaults in place.
+struct SshTransport {
+  QString ciphers; // comma-separated, used in both directions
+  QString macs;
+  QString kex;
+  int compressionLevel = 0; // 0 = off, 1-9 = zlib level
+  int rekeyDataMB = 0;
+  int rekeyTimeSec = 0;
+  bool tcpNoDelay = true;
+  int sendBufferKB = 0;
+  int receiveBufferKB = 0;
+
+  // Distinguishes connections that must not be shared between profiles.
+  QString id() const {
+    return QString("%1/%2/%3/%4/%5/%6/%7/%8/%9")
+        .arg(ciphers, macs, kex)
+        .arg(compressionLevel)
+        .arg(rekeyDataMB)
+        .arg(rekeyTimeSec)
+        .arg(tcpNoDelay ? 1 : 0)
+        .arg(sendBufferKB)
+        .arg(receiveBufferKB);
+  }
+};
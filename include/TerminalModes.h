@@ -0,0 +1,25 @@
+#pragma once
+
+// Follows the DEC private modes (CSI ? Pm h / l) set by the output handed to
+// libvterm, for modes libvterm acts on internally but has no getter for.
+// Sequences may be split across chunks; RIS and DECSTR reset the modes as
+// they do in libvterm. Expects UTF-8 output, so 8-bit C1 codes are text.
+class TerminalModes {
+public:
+  void feed(const char *data, int size);
+  void reset();
+
+  // DECSET 2004: the remote wants pastes wrapped in ESC [200~ ... ESC [201~.
+  bool bracketedPaste() const { return bracketedPaste_; }
+
+private:
+  enum class State { Ground, Escape, EscapeIntermediate, Csi, Private, Bang, Ignore, String, StringEscape };
+
+  void endParam();
+
+  State state_ = State::Ground;
+  int param_ = 0;
+  // Whether the private sequence being read names mode 2004.
+  bool namesBracketedPaste_ = false;
+  bool bracketedPaste_ = false;
+};
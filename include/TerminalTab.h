@@ -3,20 +3,34 @@
 #include <QWidget>
 #include <QColor>
 #include <QFont>
+#include <QSharedPointer>
+#include <QVector>
 #include "ProfileStore.h"
+#include "SshSession.h"
 
+class ColorTable;
+class QCheckBox;
+class QLabel;
+class QLineEdit;
+class QProgressBar;
+class QPushButton;
+class QSplitter;
+class QTimer;
+class SessionLog;
+class SftpPanel;
 class TerminalWidget;
-class SshSession;
 
 class TerminalTab : public QWidget {
   Q_OBJECT
 public:
   explicit TerminalTab(QWidget *parent = nullptr);
   void connectProfile(const Profile &p, bool promptKeyPass = true);
+  void connectProfile(const Profile &p, const QString &keyPassphrase);
   bool hasProfile() const;
   bool isConnected() const;
   Profile currentProfile() const;
-  void applyTheme(const QColor &fg, const QColor &bg, const QFont &font);
+  void applyTheme(const QColor &fg, const QColor &bg, const QSharedPointer<const ColorTable> &colors,
+                  const QFont &font);
 
 signals:
   void profileConnected(const Profile &p);
@@ -31,10 +45,46 @@ private slots:
   void onTerminalResize(int rows, int cols);
   void onSessionConnected();
   void onSessionDisconnected();
+  void onSessionProgress(const QString &phase);
+  void onPasteProgress(qint64 sent, qint64 total);
+  void updateForwardStatus();
+  void onFilesToggled(bool show);
+  void onLogToggled(bool on);
+  void onLogFailed(const QString &message);
+  void onFindRequested();
+  void onFindChanged();
+  void onSearchStatus(int current, int total, bool searching, bool truncated);
+
+protected:
+  bool eventFilter(QObject *watched, QEvent *event) override;
 
 private:
+  void setConnectStatus(const QString &status);
+  void closeFindBar();
+  void logInput(const QByteArray &data);
+
   TerminalWidget *terminal_;
   SshSession *session_;
+  QLabel *statusLabel_;
+  QPushButton *cancelButton_;
+  QProgressBar *pasteBar_;
+  QPushButton *cancelPasteButton_;
+  QLabel *forwardsLabel_;
+  QTimer *forwardTimer_;
+  QVector<SshSession::ForwardStatus> lastForwards_;
+  QPushButton *logButton_;
+  QPushButton *filesButton_;
+  QSplitter *splitter_;
+  SftpPanel *sftpPanel_ = nullptr; // created when first shown
+  QWidget *findBar_;
+  QLineEdit *findEdit_;
+  QCheckBox *findCase_;
+  QCheckBox *findRegex_;
+  QLabel *findStatus_;
+  SessionLog *log_;
+  bool logInput_ = false;
+  int rows_ = 24;
+  int cols_ = 80;
   Profile currentProfile_;
   bool hasProfile_ = false;
   bool connected_ = false;
@@ -4,6 +4,21 @@
 #include <QColor>
 #include <QFont>
 #include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QMap>
+#include <QPointer>
+#include <QRegion>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "ColorTable.h"
+#include "EchoPredictor.h"
+#include "GlyphAtlas.h"
+#include "ScreenModel.h"
+#include "ScrollbackLayout.h"
+#include "ScrollbackSearch.h"
+#include "TerminalModes.h"
 
 #ifdef HAVE_LIBVTERM
 #include <vterm.h>
@@ -11,6 +26,7 @@
 
 class QTextEdit;
 class QPlainTextEdit;
+class FrameScheduler;
 
 class TerminalWidget : public QWidget {
   Q_OBJECT
@@ -20,11 +36,35 @@ public:
 
   void writeData(const QByteArray &data);
   void clearScreen();
-  void setTheme(const QColor &fg, const QColor &bg, const QFont &font);
+  void setTheme(const QColor &fg, const QColor &bg, const QSharedPointer<const ColorTable> &colors,
+                const QFont &font);
+
+  // Times full repaints of a 200x60 screen of `ls --color` output with the
+  // per-cell and the run-batched renderer. Used by --bench-render.
+  static QString renderBenchmark(int frames);
+
+  // Highlights every match of `query` on the screen and in the scrollback,
+  // which is searched in the background; an empty pattern ends the search.
+  // False with `error` set if the query is not a valid regular expression.
+  bool setSearch(const ScrollbackSearch::Query &query, QString *error = nullptr);
+  // Selects and shows the next match towards older output, or newer output.
+  void findNext(bool older);
+  // Whether the cursor sits after a password or passphrase prompt.
+  bool atPasswordPrompt() const;
 
 signals:
   void sendData(const QByteArray &data);
+  // Clipboard text; `bracketed` when the remote asked for bracketed paste.
+  void pasteData(const QByteArray &data, bool bracketed);
   void terminalResized(int rows, int cols);
+  // True once more output is waiting to be parsed than the terminal keeps
+  // queued, false when it has caught up; the source should hold back
+  // meanwhile.
+  void outputBacklogged(bool backlogged);
+  // Ctrl+Shift+F.
+  void findRequested();
+  // `current` counts from the oldest match and is 0 when none is selected.
+  void searchStatus(int current, int total, bool searching, bool truncated);
 
 protected:
   void keyPressEvent(QKeyEvent *event) override;
@@ -32,46 +72,121 @@ protected:
   void resizeEvent(QResizeEvent *event) override;
   void focusInEvent(QFocusEvent *event) override;
   void focusOutEvent(QFocusEvent *event) override;
+  void showEvent(QShowEvent *event) override;
+  void hideEvent(QHideEvent *event) override;
   void mousePressEvent(QMouseEvent *event) override;
   void mouseMoveEvent(QMouseEvent *event) override;
   void mouseReleaseEvent(QMouseEvent *event) override;
+  void wheelEvent(QWheelEvent *event) override;
 
 private:
+  friend class FrameScheduler;
+
   bool handleKeyEvent(QKeyEvent *event);
   void pasteFromClipboard();
   void initFallbackUi();
 #ifdef HAVE_LIBVTERM
   void initVTerm();
-  void renderVTerm(QPainter &p);
+  void applyStateColors();
+  void renderVTerm(QPainter &p, const QRegion &region);
+  void renderRow(QPainter &p, int row, int cols);
+  void paintCursor(QPainter &p, int rows, int cols);
+  void paintPredictions(QPainter &p, int cols);
+  void refreshPredictions(int oldRow, bool wasVisible);
+  void drawGlyph(QPainter &p, quint32 glyph, GlyphAtlas::Variant variant, const QColor &color, int x, int y);
+  int atlasGlyph(quint32 glyph, GlyphAtlas::Variant variant, QRgb color, QRect *source);
+  QString glyphText(quint32 glyph) const;
+  bool ensureAtlas();
+  void flushDamage();
+  void applyMove(const ScreenModel::Move &move);
+  qint64 parsePending(qint64 maxBytes);
+  bool hasPendingInput() const { return !pendingInput_.isEmpty(); }
+  bool exposed() const { return exposed_; }
+  void invalidateRows(int first, int last);
+  void invalidateAll();
+  void scrollView(int lines);
+  const Cell *viewRow(int row, QVector<Cell> *scratch) const;
+  void viewPieces(int row, QVector<ScrollbackLayout::Piece> *out) const;
+  qint64 viewLine(int row) const;
+  int viewRowOf(qint64 line, int col) const;
+  void setSelection(const VTermPos &start, const VTermPos &end, bool selecting);
+  bool selectionRange(VTermPos *a, VTermPos *b) const;
+  QRect cellRect(int row, int col) const;
+  QRect cursorRect() const;
+  QRgb resolveColor(quint32 color, QRgb fallback) const;
   void updateSizeFromPixel();
   VTermPos pointToCell(const QPoint &p) const;
   QString selectedText() const;
+  void onSearchFound(const QVector<ScrollbackSearch::Match> &matches);
+  bool updateScreenMatches();
+  void trimSearchMatches();
+  const ScrollbackSearch::Match *matchesOn(qint64 line, int *count) const;
+  bool adjacentMatch(qint64 line, int col, bool older, ScrollbackSearch::Match *out) const;
+  void selectMatch(const ScrollbackSearch::Match &match);
+  void emitSearchStatus();
 #endif
 
 private:
 #ifdef HAVE_LIBVTERM
   VTerm *vterm_ = nullptr;
-  VTermScreen *screen_ = nullptr;
   VTermState *state_ = nullptr;
+  ScreenModel *model_ = nullptr;
   int cellWidth_ = 0;
   int cellHeight_ = 0;
   int cellAscent_ = 0;
   QFont font_;
   QColor fg_;
   QColor bg_;
+  QSharedPointer<const ColorTable> colors_;
+  QSharedPointer<GlyphAtlas> atlas_;
+  QImage backing_;
+  QVector<bool> rowDirty_;
+  QRegion damage_;
+  bool perCellRendering_ = false;
+  QList<QByteArray> pendingInput_;
+  int pendingOffset_ = 0;
+  qint64 pendingBytes_ = 0;
+  bool backlogged_ = false;
+  // Modes libvterm keeps to itself, fed the same bytes in the same order.
+  TerminalModes modes_;
+  QPointer<FrameScheduler> scheduler_;
   QTimer *cursorTimer_ = nullptr;
   QTimer *resizeTimer_ = nullptr;
+  // Holds back the PTY size until the widget stops changing size.
+  QTimer *ptyResizeTimer_ = nullptr;
+  EchoPredictor predictor_;
+  QTimer *predictTimer_ = nullptr;
   bool cursorVisible_ = true;
   bool vtermReady_ = false;
+  // False while the tab is in the background or the window is minimized.
+  bool exposed_ = false;
   int lastRows_ = 0;
   int lastCols_ = 0;
-  VTermScreenCallbacks callbacks_ = {};
   bool selecting_ = false;
   VTermPos selStart_{0, 0};
   VTermPos selEnd_{0, 0};
   int cursorRow_ = 0;
   int cursorCol_ = 0;
   bool cursorShown_ = true;
+  // Rows of scrollback shown above the screen; 0 follows the output.
+  int scrollOffset_ = 0;
+  qint64 scrollbackEnd_ = 0;
+  // The scrollback laid out at the screen width, as far back as viewed.
+  mutable ScrollbackLayout layout_;
+  QVector<ScrollbackLayout::Piece> pieceScratch_;
+  int wheelRemainder_ = 0;
+  QVector<Cell> rowScratch_;
+  ScrollbackSearch *search_ = nullptr;
+  ScrollbackSearch::Query searchQuery_;
+  ScrollbackSearch::Matcher searchMatcher_;
+  // Scrollback hits in batches keyed by their first line, and screen hits
+  // by screen row. Screen rows count as lines from Scrollback::end() on, so
+  // a hit keeps its line when its row scrolls into the scrollback.
+  QMap<qint64, QVector<ScrollbackSearch::Match>> historyMatches_;
+  int historyMatchCount_ = 0;
+  QVector<QVector<ScrollbackSearch::Match>> screenMatches_;
+  ScrollbackSearch::Match currentMatch_{-1, 0, 0};
+  bool searchTruncated_ = false;
   QPlainTextEdit *output_ = nullptr;
 #else
   QPlainTextEdit *output_ = nullptr;
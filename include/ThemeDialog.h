@@ -3,6 +3,7 @@
 #include <QDialog>
 #include <QColor>
 #include <QFont>
+#include <QVector>
 
 class QPushButton;
 class QLabel;
@@ -10,10 +11,12 @@ class QLabel;
 class ThemeDialog : public QDialog {
   Q_OBJECT
 public:
-  explicit ThemeDialog(const QColor &fg, const QColor &bg, const QFont &font, QWidget *parent = nullptr);
+  ThemeDialog(const QColor &fg, const QColor &bg, const QVector<QColor> &ansi, const QFont &font,
+              QWidget *parent = nullptr);
 
   QColor foreground() const;
   QColor background() const;
+  QVector<QColor> ansiColors() const;
   QFont font() const;
 
 private slots:
@@ -25,10 +28,11 @@ private slots:
 
 private:
   void updatePreview();
-  bool parseBase16(const QString &path, QColor *fg, QColor *bg, QString *error);
+  bool parseBase16(const QString &path, QColor *fg, QColor *bg, QVector<QColor> *ansi, QString *error);
 
   QColor fg_;
   QColor bg_;
+  QVector<QColor> ansi_;
   QFont font_;
 
   QPushButton *fgButton_;
@@ -36,4 +40,5 @@ private:
   QPushButton *fontButton_;
   QPushButton *defaultsButton_;
   QLabel *preview_;
+  QLabel *swatches_;
 };
@@ -0,0 +1,38 @@
+#include "ColorTable.h"
+
+namespace {
+
+constexpr int kCubeLevels[6] = {0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff};
+
+} // namespace
+
+QVector<QColor> ColorTable::defaultAnsi() {
+  return {
+      QColor(0, 0, 0),       QColor(224, 0, 0),     QColor(0, 224, 0),     QColor(224, 224, 0),
+      QColor(0, 0, 224),     QColor(224, 0, 224),   QColor(0, 224, 224),   QColor(224, 224, 224),
+      QColor(128, 128, 128), QColor(255, 64, 64),   QColor(64, 255, 64),   QColor(255, 255, 64),
+      QColor(64, 64, 255),   QColor(255, 64, 255),  QColor(64, 255, 255),  QColor(255, 255, 255),
+  };
+}
+
+QSharedPointer<const ColorTable> ColorTable::create(const QVector<QColor> &ansi) {
+  QSharedPointer<ColorTable> table(new ColorTable());
+  const QVector<QColor> fallback = defaultAnsi();
+  for (int i = 0; i < kAnsiColors; ++i) {
+    const QColor c = i < ansi.size() && ansi.at(i).isValid() ? ansi.at(i) : fallback.at(i);
+    table->lut_[i] = c.rgb();
+  }
+  for (int i = 0; i < 216; ++i) {
+    table->lut_[16 + i] = qRgb(kCubeLevels[i / 36], kCubeLevels[(i / 6) % 6], kCubeLevels[i % 6]);
+  }
+  for (int i = 0; i < 24; ++i) {
+    const int level = 8 + i * 10;
+    table->lut_[232 + i] = qRgb(level, level, level);
+  }
+  return table;
+}
+
+QSharedPointer<const ColorTable> ColorTable::defaultTable() {
+  static const QSharedPointer<const ColorTable> table = create(defaultAnsi());
+  return table;
+}
@@ -0,0 +1,254 @@
+#include "ConnectionPool.h"
+#include "JumpHost.h"
+#include "PerfStats.h"
+#include "SshReactor.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostInfo>
+#include <QSettings>
+#include <QStringList>
+
+namespace {
+
+constexpr int kMaintainIntervalMs = 30000;
+
+// The id SshSession::connectToHost() gives the profile's connection.
+QString profileConnectionId(const Profile &p) {
+  QVector<JumpHost> hops;
+  JumpHost::parseChain(p.proxyJump, &hops);
+  return SshReactor::connectionId(p.host, p.user, p.port, p.keyPath.trimmed(), p.transport,
+                                  JumpHost::chainString(hops));
+}
+
+} // namespace
+
+struct ConnectionPool::Entry {
+  Profile profile;
+  // Kept to re-warm after a dropped link; zeroed when the entry goes.
+  QString keyPassphrase;
+  QString id;
+  std::shared_ptr<SshConnection> connection;
+  // Restarted whenever a tab uses the connection.
+  QElapsedTimer idle;
+#ifdef HAVE_LIBSSH
+  // Owned here only while the host name resolves.
+  int lookupId = -1;
+  ssh_session session = nullptr;
+  ssh_key key = nullptr;
+#endif
+};
+
+ConnectionPool *ConnectionPool::instance() {
+  static ConnectionPool *pool = nullptr;
+  if (!pool) {
+    pool = new ConnectionPool(QCoreApplication::instance());
+  }
+  return pool;
+}
+
+ConnectionPool::ConnectionPool(QObject *parent) : QObject(parent) {
+  QSettings settings("sshterminal", "sshterminal");
+  maxConnections_ = qMax(0, settings.value("pool/maxConnections", 4).toInt());
+  keepaliveMs_ = qMax(0, settings.value("pool/keepaliveSec", 60).toInt()) * 1000;
+  idleTimeoutMs_ = qMax(1, settings.value("pool/idleTimeoutMin", 30).toInt()) * qint64(60000);
+
+  maintainTimer_.setInterval(kMaintainIntervalMs);
+  maintainTimer_.setTimerType(Qt::CoarseTimer);
+  connect(&maintainTimer_, &QTimer::timeout, this, &ConnectionPool::maintain);
+
+  PerfStats::setReporter("pool", [this]() {
+    return QString("warm=%1 hits=%2 misses=%3 saved=%4s")
+        .arg(entries_.size())
+        .arg(stats_.hits)
+        .arg(stats_.misses)
+        .arg(stats_.savedMs / 1000.0, 0, 'f', 1);
+  });
+}
+
+ConnectionPool::~ConnectionPool() {
+  PerfStats::removeReporter("pool");
+  const QStringList ids = entries_.keys();
+  for (const QString &id : ids) {
+    drop(id);
+  }
+}
+
+void ConnectionPool::warm(const Profile &p, const QString &keyPassphrase) {
+#ifdef HAVE_LIBSSH
+  const QString keyPath = p.keyPath.trimmed();
+  const QString id = profileConnectionId(p);
+  if (!p.keepWarm || entries_.contains(id) || !hasRoom()) {
+    return;
+  }
+
+  auto *entry = new Entry();
+  entry->profile = p;
+  entry->keyPassphrase = keyPassphrase;
+  entry->id = id;
+  if (const std::shared_ptr<SshConnection> shared = SshReactor::shareConnection(id)) {
+    entries_.insert(id, entry);
+    hold(entry, shared);
+    return;
+  }
+  QVector<JumpHost> hops;
+  if (!JumpHost::parseChain(p.proxyJump, &hops) || !hops.isEmpty()) {
+    // Connections through jump hosts are only kept once a tab has made one;
+    // adopt() picks them up.
+    entry->keyPassphrase.fill(QChar());
+    delete entry;
+    return;
+  }
+
+  QString error;
+  SshTarget target;
+  entry->session = SshReactor::newSession(p.host, p.user, p.port, keyPath, keyPassphrase, p.transport, &entry->key,
+                                          &target, &error);
+  if (!entry->session) {
+    // Typically a key that needs a passphrase; adopt() picks the connection
+    // up once a tab has connected with it.
+    entry->keyPassphrase.fill(QChar());
+    delete entry;
+    return;
+  }
+  entries_.insert(id, entry);
+  const quint16 port = quint16(target.port);
+  entry->lookupId = QHostInfo::lookupHost(target.host, this, [this, id, port](const QHostInfo &info) {
+    Entry *pending = entries_.value(id);
+    if (!pending || pending->lookupId != info.lookupId()) {
+      return;
+    }
+    pending->lookupId = -1;
+    if (info.error() != QHostInfo::NoError || info.addresses().isEmpty()) {
+      drop(id);
+      return;
+    }
+
+    std::shared_ptr<SshConnection> connection = SshReactor::shareConnection(id);
+    if (connection) {
+      if (pending->key) {
+        ssh_key_free(pending->key);
+        pending->key = nullptr;
+      }
+      ssh_free(pending->session);
+    } else {
+      connection = std::make_shared<SshConnection>();
+      connection->id = id;
+      connection->session = pending->session;
+      connection->addresses = info.addresses();
+      connection->port = port;
+      connection->transport = pending->profile.transport;
+      connection->key = pending->key;
+      pending->key = nullptr;
+      SshReactor::addConnection(connection);
+      connection->reactor->attachConnection(connection);
+    }
+    pending->session = nullptr;
+    hold(pending, connection);
+  });
+#else
+  Q_UNUSED(p)
+  Q_UNUSED(keyPassphrase)
+#endif
+}
+
+void ConnectionPool::adopt(const Profile &p) {
+  const QString id = profileConnectionId(p);
+  if (!p.keepWarm || entries_.contains(id) || !hasRoom()) {
+    return;
+  }
+  const std::shared_ptr<SshConnection> connection = SshReactor::shareConnection(id);
+  if (!connection) {
+    return;
+  }
+  auto *entry = new Entry();
+  entry->profile = p;
+  entry->id = id;
+  entries_.insert(id, entry);
+  hold(entry, connection);
+}
+
+void ConnectionPool::recordConnect(const Profile &p) {
+  if (!p.keepWarm) {
+    return;
+  }
+  Entry *entry = entries_.value(profileConnectionId(p));
+  if (!entry || !entry->connection || entry->connection->failed) {
+    ++stats_.misses;
+    return;
+  }
+  ++stats_.hits;
+  // A connection still being warmed saves less; count only finished ones.
+  stats_.savedMs += qMax<qint64>(0, entry->connection->connectMs.load());
+  entry->idle.restart();
+}
+
+bool ConnectionPool::hasRoom() const {
+  return entries_.size() < maxConnections_;
+}
+
+void ConnectionPool::hold(Entry *entry, const std::shared_ptr<SshConnection> &connection) {
+  entry->connection = connection;
+  entry->idle.start();
+  connection->keepaliveMs = keepaliveMs_;
+  stats_.warm = entries_.size();
+  if (!maintainTimer_.isActive()) {
+    maintainTimer_.start();
+  }
+}
+
+void ConnectionPool::drop(const QString &id) {
+  Entry *entry = entries_.take(id);
+  if (!entry) {
+    return;
+  }
+#ifdef HAVE_LIBSSH
+  if (entry->lookupId >= 0) {
+    QHostInfo::abortHostLookup(entry->lookupId);
+  }
+  if (entry->key) {
+    ssh_key_free(entry->key);
+  }
+  if (entry->session) {
+    ssh_free(entry->session);
+  }
+#endif
+  if (entry->connection) {
+    SshReactor::releaseConnection(entry->connection);
+  }
+  entry->keyPassphrase.fill(QChar());
+  delete entry;
+  stats_.warm = entries_.size();
+  if (entries_.isEmpty()) {
+    maintainTimer_.stop();
+  }
+}
+
+// Replaces failed connections and closes those no tab used for the idle
+// timeout. Tabs still open keep a connection busy.
+void ConnectionPool::maintain() {
+  const QStringList ids = entries_.keys();
+  for (const QString &id : ids) {
+    Entry *entry = entries_.value(id);
+    if (!entry->connection) {
+      continue; // still resolving
+    }
+    if (entry->connection->failed) {
+      // Reconnect after a dropped link, but never retry a failed login.
+      const bool wasUp = entry->connection->connectMs.load() >= 0;
+      const Profile profile = entry->profile;
+      QString keyPassphrase = entry->keyPassphrase;
+      drop(id);
+      if (wasUp) {
+        warm(profile, keyPassphrase);
+      }
+      keyPassphrase.fill(QChar());
+      continue;
+    }
+    if (entry->connection->users > 1) {
+      entry->idle.restart();
+    } else if (entry->idle.hasExpired(idleTimeoutMs_)) {
+      drop(id);
+    }
+  }
+}
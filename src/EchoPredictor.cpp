@@ -0,0 +1,196 @@
+#include "EchoPredictor.h"
+#include "ScreenModel.h"
+
+#include <QRegularExpression>
+#include <QString>
+
+namespace {
+
+// Hysteresis on the smoothed echo RTT, as in mosh.
+constexpr qint64 kShowAboveMs = 30;
+constexpr qint64 kHideBelowMs = 20;
+constexpr qint64 kMinTimeoutMs = 1000;
+
+struct PredictCounters {
+  quint64 predicted = 0;
+  quint64 confirmed = 0;
+  quint64 rolledBack = 0;
+  qint64 srttMs = -1;
+};
+
+PredictCounters &predictCounters() {
+  static PredictCounters counters;
+  return counters;
+}
+
+} // namespace
+
+EchoPredictor::EchoPredictor() {
+  const QByteArray mode = qgetenv("SSH_TERMINAL_PREDICT").toLower();
+  if (mode == "always" || mode == "1") {
+    mode_ = Mode::Always;
+  } else if (mode == "never" || mode == "0") {
+    mode_ = Mode::Never;
+  }
+  clock_.start();
+}
+
+QString EchoPredictor::report() {
+  const PredictCounters &c = predictCounters();
+  return QString("predicted=%1 confirmed=%2 rolledBack=%3 srtt=%4ms")
+      .arg(c.predicted)
+      .arg(c.confirmed)
+      .arg(c.rolledBack)
+      .arg(c.srttMs);
+}
+
+void EchoPredictor::inputSent(const QByteArray &bytes, const ScreenModel &model) {
+  if (mode_ == Mode::Never) {
+    return;
+  }
+  if (model.altScreen() || atPasswordPrompt(model)) {
+    reset();
+    awaitingOutput_ = true;
+    return;
+  }
+
+  const QString text = QString::fromUtf8(bytes);
+  // Single-width characters only; wide glyphs and combining marks would
+  // need the server's idea of their width.
+  const bool printable = text.size() == 1 && text.at(0).unicode() >= 0x20 && text.at(0).unicode() < 0x1100 &&
+                         text.at(0).isPrint() && text.at(0).category() != QChar::Mark_NonSpacing;
+  if (printable) {
+    if (awaitingOutput_) {
+      return;
+    }
+    int row = model.cursorRow();
+    int col = model.cursorCol();
+    if (!pending_.isEmpty()) {
+      row = pending_.last().row;
+      col = pending_.last().col + 1;
+    }
+    // Leave line wrapping to the server.
+    if (col >= model.cols() - 1) {
+      awaitingOutput_ = true;
+      return;
+    }
+    pending_.append(Prediction{row, col, text.at(0).unicode(), clock_.elapsed()});
+    ++predictCounters().predicted;
+    return;
+  }
+
+  if (bytes == "\x7f" && !pending_.isEmpty()) {
+    // The server echoes the character and then erases it; neither needs to
+    // be shown ahead of time.
+    pending_.removeLast();
+    return;
+  }
+  // Enter, cursor keys, control characters: the cursor ends up somewhere we
+  // cannot know, so wait for the server before predicting again.
+  awaitingOutput_ = true;
+}
+
+void EchoPredictor::reconcile(const ScreenModel &model) {
+  awaitingOutput_ = false;
+  if (model.altScreen()) {
+    reset();
+    return;
+  }
+  const int cursorRow = model.cursorRow();
+  const int cursorCol = model.cursorCol();
+  while (!pending_.isEmpty()) {
+    const Prediction p = pending_.first();
+    // The server has not written this cell yet.
+    if (cursorRow == p.row && cursorCol <= p.col) {
+      break;
+    }
+    bool matches = false;
+    if (p.row < model.rows() && p.col < model.cols()) {
+      const Cell &cell = model.row(p.row)[p.col];
+      matches = !(cell.glyph & Cell::Cluster) && cell.codepoint() == p.codepoint;
+    }
+    if (matches) {
+      confirm(p);
+      pending_.removeFirst();
+      continue;
+    }
+    // The cursor passed the cell and left something else there. A changed
+    // row (Enter, scrolling) is not a misprediction, just unverifiable.
+    if (cursorRow == p.row) {
+      glitched_ = true;
+    }
+    rollback();
+    break;
+  }
+}
+
+void EchoPredictor::expire() {
+  if (pending_.isEmpty()) {
+    return;
+  }
+  const qint64 timeout = qMax(kMinTimeoutMs, 3 * srttMs_);
+  if (clock_.elapsed() - pending_.first().sentMs > timeout) {
+    glitched_ = true;
+    rollback();
+  }
+}
+
+void EchoPredictor::reset() {
+  pending_.clear();
+}
+
+bool EchoPredictor::visible() const {
+  if (pending_.isEmpty() || glitched_) {
+    return false;
+  }
+  switch (mode_) {
+  case Mode::Always:
+    return true;
+  case Mode::Never:
+    return false;
+  case Mode::Adaptive:
+    break;
+  }
+  return showing_;
+}
+
+bool EchoPredictor::isPasswordPrompt(const QString &text) {
+  // Whole words only: "Mapping:" or "Spinning up:" are not PIN prompts.
+  static const QRegularExpression prompt("\\b(password|passphrase|passcode|pin|verification code)\\b[^:]*:\\s*$",
+                                         QRegularExpression::CaseInsensitiveOption);
+  return prompt.match(text).hasMatch();
+}
+
+bool EchoPredictor::atPasswordPrompt(const ScreenModel &model) {
+  const int row = model.cursorRow();
+  if (row < 0 || row >= model.rows()) {
+    return false;
+  }
+  const Cell *line = model.row(row);
+  QString text;
+  for (int c = 0; c < model.cursorCol() && c < model.cols(); ++c) {
+    if (!(line[c].glyph & Cell::WideTail)) {
+      text += model.text(line[c]);
+    }
+  }
+  return isPasswordPrompt(text);
+}
+
+void EchoPredictor::confirm(const Prediction &p) {
+  const qint64 sample = clock_.elapsed() - p.sentMs;
+  srttMs_ = srttMs_ < 0 ? sample : (7 * srttMs_ + sample) / 8;
+  if (srttMs_ > kShowAboveMs) {
+    showing_ = true;
+  } else if (srttMs_ < kHideBelowMs) {
+    showing_ = false;
+  }
+  glitched_ = false;
+  PredictCounters &counters = predictCounters();
+  ++counters.confirmed;
+  counters.srttMs = srttMs_;
+}
+
+void EchoPredictor::rollback() {
+  predictCounters().rolledBack += quint64(pending_.size());
+  pending_.clear();
+}
@@ -0,0 +1,181 @@
+#include "FrameScheduler.h"
+#include "PerfStats.h"
+#include "TerminalWidget.h"
+
+#include <QScreen>
+#include <QWidget>
+
+namespace {
+
+// Bytes handed to libvterm per slice; small enough to check the budget often.
+constexpr qint64 kParseSlice = 64 * 1024;
+
+// Hidden terminals are parsed this often, for at most this long a pass.
+// Output beyond that stays queued until the terminal pauses its session.
+constexpr int kBackgroundIntervalMs = 250;
+constexpr qint64 kBackgroundBudgetNs = 8 * 1000000LL;
+
+FrameScheduler::Stats &totals() {
+  static FrameScheduler::Stats stats;
+  return stats;
+}
+
+} // namespace
+
+FrameScheduler::FrameScheduler(QWidget *window) : QObject(window), window_(window) {
+  setObjectName("FrameScheduler");
+  parseTimer_.setSingleShot(true);
+  parseTimer_.setInterval(0);
+  connect(&parseTimer_, &QTimer::timeout, this, &FrameScheduler::parsePass);
+  backgroundTimer_.setSingleShot(true);
+  backgroundTimer_.setInterval(kBackgroundIntervalMs);
+  backgroundTimer_.setTimerType(Qt::CoarseTimer);
+  connect(&backgroundTimer_, &QTimer::timeout, this, &FrameScheduler::backgroundPass);
+  frameTimer_.setSingleShot(true);
+  frameTimer_.setTimerType(Qt::PreciseTimer);
+  connect(&frameTimer_, &QTimer::timeout, this, &FrameScheduler::presentFrame);
+  sinceFrame_.start();
+
+  PerfStats::setReporter("frames", []() {
+    const Stats &s = totals();
+    const double mbPerSec = s.parseNsecs > 0 ? (s.bytesParsed / 1048576.0) / (s.parseNsecs / 1e9) : 0.0;
+    return QString("rendered=%1 skipped=%2 parsed=%3MB parse=%4MB/s background=%5")
+        .arg(s.framesRendered)
+        .arg(s.framesSkipped)
+        .arg(s.bytesParsed / 1048576.0, 0, 'f', 1)
+        .arg(mbPerSec, 0, 'f', 1)
+        .arg(s.backgroundPasses);
+  });
+}
+
+FrameScheduler::~FrameScheduler() = default;
+
+FrameScheduler *FrameScheduler::forWindow(QWidget *widget) {
+  QWidget *window = widget ? widget->window() : nullptr;
+  if (!window) {
+    return nullptr;
+  }
+  auto *scheduler = window->findChild<FrameScheduler *>("FrameScheduler", Qt::FindDirectChildrenOnly);
+  if (!scheduler) {
+    scheduler = new FrameScheduler(window);
+  }
+  return scheduler;
+}
+
+FrameScheduler::Stats FrameScheduler::totalStats() {
+  return totals();
+}
+
+void FrameScheduler::inputPending(TerminalWidget *terminal) {
+  if (!terminal->exposed()) {
+    if (!backgroundQueue_.contains(terminal)) {
+      backgroundQueue_.append(terminal);
+    }
+    if (!backgroundTimer_.isActive()) {
+      backgroundTimer_.start();
+    }
+    return;
+  }
+  backgroundQueue_.removeAll(terminal);
+  if (!parseQueue_.contains(terminal)) {
+    parseQueue_.append(terminal);
+  }
+  if (!parseTimer_.isActive()) {
+    parseTimer_.start();
+  }
+}
+
+void FrameScheduler::remove(TerminalWidget *terminal) {
+  parseQueue_.removeAll(terminal);
+  presentQueue_.removeAll(terminal);
+  backgroundQueue_.removeAll(terminal);
+}
+
+int FrameScheduler::frameIntervalMs() const {
+  QScreen *screen = window_->screen();
+  const qreal hz = screen ? screen->refreshRate() : 60.0;
+  return qMax(1, qRound(1000.0 / (hz > 1.0 ? hz : 60.0)));
+}
+
+void FrameScheduler::parsePass() {
+  // Leave half of each frame for painting and input handling.
+  const qint64 budgetNs = frameIntervalMs() * 1000000LL / 2;
+  QElapsedTimer timer;
+  timer.start();
+  Stats &stats = totals();
+  bool parsedAny = false;
+
+  while (!parseQueue_.isEmpty() && timer.nsecsElapsed() < budgetNs) {
+    TerminalWidget *terminal = parseQueue_.takeFirst();
+    if (!terminal->exposed()) {
+      inputPending(terminal);
+      continue;
+    }
+    const qint64 parsed = terminal->parsePending(kParseSlice);
+    stats.bytesParsed += quint64(parsed);
+    if (parsed > 0) {
+      parsedAny = true;
+      if (!presentQueue_.contains(terminal)) {
+        presentQueue_.append(terminal);
+      }
+    }
+    // Round-robin so one flooding tab cannot starve the others.
+    if (terminal->hasPendingInput()) {
+      parseQueue_.append(terminal);
+    }
+  }
+  stats.parseNsecs += timer.nsecsElapsed();
+
+  if (parsedAny) {
+    ++passesSinceFrame_;
+    schedulePresent();
+  }
+  if (!parseQueue_.isEmpty()) {
+    parseTimer_.start();
+  }
+}
+
+// Parses hidden terminals a slice at a time, round-robin, until the budget
+// is spent; whoever is still waiting goes first next pass.
+void FrameScheduler::backgroundPass() {
+  QElapsedTimer timer;
+  timer.start();
+  Stats &stats = totals();
+  while (!backgroundQueue_.isEmpty() && timer.nsecsElapsed() < kBackgroundBudgetNs) {
+    TerminalWidget *terminal = backgroundQueue_.takeFirst();
+    if (terminal->exposed()) {
+      inputPending(terminal);
+      continue;
+    }
+    stats.bytesParsed += quint64(terminal->parsePending(kParseSlice));
+    if (terminal->hasPendingInput() && !backgroundQueue_.contains(terminal)) {
+      backgroundQueue_.append(terminal);
+    }
+  }
+  stats.parseNsecs += timer.nsecsElapsed();
+  ++stats.backgroundPasses;
+  if (!backgroundQueue_.isEmpty() && !backgroundTimer_.isActive()) {
+    backgroundTimer_.start();
+  }
+}
+
+void FrameScheduler::schedulePresent() {
+  if (frameTimer_.isActive()) {
+    return;
+  }
+  const qint64 wait = qMax<qint64>(0, frameIntervalMs() - sinceFrame_.elapsed());
+  frameTimer_.start(int(wait));
+}
+
+void FrameScheduler::presentFrame() {
+  Stats &stats = totals();
+  const QVector<TerminalWidget *> terminals = presentQueue_;
+  presentQueue_.clear();
+  for (TerminalWidget *terminal : terminals) {
+    terminal->flushDamage();
+  }
+  ++stats.framesRendered;
+  stats.framesSkipped += quint64(qMax(0, passesSinceFrame_ - 1));
+  passesSinceFrame_ = 0;
+  sinceFrame_.restart();
+}
@@ -0,0 +1,289 @@
+#include "GlyphAtlas.h"
+#include "PerfStats.h"
+
+#include <QFontDatabase>
+#include <QFontMetrics>
+#include <QPainter>
+#include <QtMath>
+
+namespace {
+
+constexpr int kPageSize = 1024;
+constexpr int kMaxPages = 4;
+// Cluster ids handed out at once; past this, ids with no cached glyph are reused.
+constexpr int kMaxClusters = 1 << 16;
+
+// Families tried, in order, for characters the terminal font lacks.
+const char *const kFallbackFamilies[] = {
+    "Noto Color Emoji", "Apple Color Emoji", "Segoe UI Emoji", "Noto Sans Mono CJK SC", "Noto Sans CJK SC",
+    "PingFang SC",      "Microsoft YaHei",   "Noto Sans Symbols 2", "DejaVu Sans Mono", "DejaVu Sans",
+};
+
+QHash<QString, QWeakPointer<GlyphAtlas>> &registry() {
+  static QHash<QString, QWeakPointer<GlyphAtlas>> atlases;
+  return atlases;
+}
+
+GlyphAtlas::Stats &retiredStats() {
+  static GlyphAtlas::Stats stats;
+  return stats;
+}
+
+} // namespace
+
+QSharedPointer<GlyphAtlas> GlyphAtlas::shared(const QFont &font, int cellWidth, int cellHeight,
+                                              int ascent, qreal dpr) {
+  const QString key = QString("%1|%2x%3+%4@%5")
+                          .arg(font.key())
+                          .arg(cellWidth)
+                          .arg(cellHeight)
+                          .arg(ascent)
+                          .arg(dpr);
+  auto &atlases = registry();
+  QSharedPointer<GlyphAtlas> atlas = atlases.value(key).toStrongRef();
+  if (!atlas) {
+    atlas = QSharedPointer<GlyphAtlas>(new GlyphAtlas(font, cellWidth, cellHeight, ascent, dpr));
+    atlas->registryKey_ = key;
+    atlases.insert(key, atlas);
+    PerfStats::setReporter("glyph-atlas", []() {
+      const Stats s = GlyphAtlas::totalStats();
+      return QString("hits=%1 misses=%2 evictions=%3 pages=%4 glyphs=%5")
+          .arg(s.hits)
+          .arg(s.misses)
+          .arg(s.evictions)
+          .arg(s.pages)
+          .arg(s.glyphs);
+    });
+  }
+  return atlas;
+}
+
+GlyphAtlas::GlyphAtlas(const QFont &font, int cellWidth, int cellHeight, int ascent, qreal dpr)
+    : cellWidth_(cellWidth), cellHeight_(cellHeight), ascent_(ascent), dpr_(dpr > 0 ? dpr : 1.0) {
+  for (int v = 0; v < 4; ++v) {
+    QFont f = font;
+    f.setBold(v & Bold);
+    f.setItalic(v & Italic);
+    f.setStyleStrategy(QFont::PreferAntialias);
+    fonts_[v] = f;
+  }
+  slotWidth_ = qMax(1, qCeil(cellWidth_ * dpr_));
+  slotHeight_ = qMax(1, qCeil(cellHeight_ * dpr_));
+  wideSlotWidth_ = qMax(1, qCeil(2 * cellWidth_ * dpr_));
+  pages_.reserve(kMaxPages);
+}
+
+GlyphAtlas::~GlyphAtlas() {
+  Stats &retired = retiredStats();
+  retired.hits += hits_;
+  retired.misses += misses_;
+  retired.evictions += evictions_;
+  auto &atlases = registry();
+  auto it = atlases.find(registryKey_);
+  if (it != atlases.end() && it.value().isNull()) {
+    atlases.erase(it);
+  }
+}
+
+int GlyphAtlas::glyph(uint codepoint, bool wide, Variant variant, QRgb color, QRect *source) {
+  const quint64 key = makeKey(codepoint, wide, variant, color);
+  auto it = entries_.constFind(key);
+  if (it != entries_.constEnd()) {
+    ++hits_;
+    *source = it->source;
+    return it->page;
+  }
+  return insert(key, QString::fromUcs4(&codepoint, 1), wide, variant, color, source);
+}
+
+int GlyphAtlas::cluster(const QString &text, bool wide, Variant variant, QRgb color, QRect *source) {
+  auto id = clusterIds_.constFind(text);
+  if (id == clusterIds_.constEnd()) {
+    if (freeClusterIds_.isEmpty() && clusterIds_.size() >= kMaxClusters) {
+      reclaimClusterIds();
+    }
+    const quint32 next = freeClusterIds_.isEmpty() ? quint32(clusterIds_.size()) : freeClusterIds_.takeLast();
+    id = clusterIds_.insert(text, next);
+  }
+  const quint64 key = makeKey(*id | kClusterKey, wide, variant, color);
+  auto it = entries_.constFind(key);
+  if (it != entries_.constEnd()) {
+    ++hits_;
+    *source = it->source;
+    return it->page;
+  }
+  return insert(key, text, wide, variant, color, source);
+}
+
+int GlyphAtlas::insert(quint64 key, const QString &text, bool wide, Variant variant, QRgb color, QRect *source) {
+  ++misses_;
+  const int width = wide ? wideSlotWidth_ : slotWidth_;
+  int page = -1;
+  QPoint origin;
+  if (!allocate(width, &page, &origin)) {
+    return -1;
+  }
+  Entry entry;
+  entry.page = page;
+  entry.source = QRect(origin, QSize(width, slotHeight_));
+  rasterize(text, fontFor(text, variant), color, page, entry.source);
+  entries_.insert(key, entry);
+  *source = entry.source;
+  return page;
+}
+
+// Frees the ids of clusters whose glyphs have all been evicted. If every id
+// still has a glyph, the cluster glyphs are dropped and all ids start over.
+void GlyphAtlas::reclaimClusterIds() {
+  QVector<bool> live(clusterIds_.size(), false);
+  for (auto it = entries_.constBegin(); it != entries_.constEnd(); ++it) {
+    if (it.key() & kClusterKey) {
+      live[int(it.key() & 0x1fffff)] = true;
+    }
+  }
+  for (auto it = clusterIds_.begin(); it != clusterIds_.end();) {
+    if (!live.at(int(*it))) {
+      freeClusterIds_.append(*it);
+      it = clusterIds_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (!freeClusterIds_.isEmpty()) {
+    return;
+  }
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it.key() & kClusterKey) {
+      it = entries_.erase(it);
+      ++evictions_;
+    } else {
+      ++it;
+    }
+  }
+  clusterIds_.clear();
+}
+
+GlyphAtlas::Stats GlyphAtlas::stats() const {
+  Stats s;
+  s.hits = hits_;
+  s.misses = misses_;
+  s.evictions = evictions_;
+  s.pages = pages_.size();
+  s.glyphs = entries_.size();
+  return s;
+}
+
+GlyphAtlas::Stats GlyphAtlas::totalStats() {
+  Stats total = retiredStats();
+  total.pages = 0;
+  total.glyphs = 0;
+  for (const auto &weak : registry()) {
+    const QSharedPointer<GlyphAtlas> atlas = weak.toStrongRef();
+    if (!atlas) {
+      continue;
+    }
+    const Stats s = atlas->stats();
+    total.hits += s.hits;
+    total.misses += s.misses;
+    total.evictions += s.evictions;
+    total.pages += s.pages;
+    total.glyphs += s.glyphs;
+  }
+  return total;
+}
+
+bool GlyphAtlas::allocate(int width, int *page, QPoint *origin) {
+  if (width > kPageSize || slotHeight_ > kPageSize) {
+    return false;
+  }
+  if (currentPage_ >= 0) {
+    if (cursor_.x() + width > kPageSize) {
+      cursor_ = QPoint(0, cursor_.y() + slotHeight_);
+    }
+    if (cursor_.y() + slotHeight_ <= kPageSize) {
+      *page = currentPage_;
+      *origin = cursor_;
+      cursor_.rx() += width;
+      return true;
+    }
+  }
+
+  // Current page is full: open a new one, or recycle the oldest page.
+  if (pages_.size() < kMaxPages) {
+    QPixmap pm(kPageSize, kPageSize);
+    pm.fill(Qt::transparent);
+    pm.setDevicePixelRatio(dpr_);
+    pages_.append(pm);
+    currentPage_ = pages_.size() - 1;
+  } else {
+    currentPage_ = nextEviction_;
+    nextEviction_ = (nextEviction_ + 1) % kMaxPages;
+    evictPage(currentPage_);
+  }
+  cursor_ = QPoint(width, 0);
+  *page = currentPage_;
+  *origin = QPoint(0, 0);
+  return true;
+}
+
+void GlyphAtlas::evictPage(int page) {
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->page == page) {
+      it = entries_.erase(it);
+      ++evictions_;
+    } else {
+      ++it;
+    }
+  }
+  pages_[page].fill(Qt::transparent);
+}
+
+QFont GlyphAtlas::fontFor(const QString &text, Variant variant) {
+  const uint base = text.isEmpty() ? 0 : text.toUcs4().value(0);
+  auto it = fallbackFor_.constFind(base);
+  if (it == fallbackFor_.constEnd()) {
+    int index = -1;
+    if (!QFontMetrics(fonts_[Regular]).inFontUcs4(base)) {
+      if (!fallbacksLoaded_) {
+        const QStringList installed = QFontDatabase().families();
+        for (const char *family : kFallbackFamilies) {
+          if (installed.contains(QString::fromLatin1(family))) {
+            QFont f(QString::fromLatin1(family));
+            f.setPixelSize(QFontMetrics(fonts_[Regular]).ascent());
+            f.setStyleStrategy(QFont::PreferAntialias);
+            fallbackFonts_.append(f);
+          }
+        }
+        fallbacksLoaded_ = true;
+      }
+      for (int i = 0; i < fallbackFonts_.size(); ++i) {
+        if (QFontMetrics(fallbackFonts_.at(i)).inFontUcs4(base)) {
+          index = i;
+          break;
+        }
+      }
+    }
+    it = fallbackFor_.insert(base, index);
+  }
+  if (*it < 0) {
+    return fonts_[variant];
+  }
+  QFont f = fallbackFonts_.at(*it);
+  f.setBold(variant & Bold);
+  f.setItalic(variant & Italic);
+  return f;
+}
+
+void GlyphAtlas::rasterize(const QString &text, const QFont &font, QRgb color, int page, const QRect &slot) {
+  QPixmap &pm = pages_[page];
+  const QRectF logical(slot.x() / dpr_, slot.y() / dpr_, slot.width() / dpr_, slot.height() / dpr_);
+
+  QPainter painter(&pm);
+  painter.setCompositionMode(QPainter::CompositionMode_Source);
+  painter.fillRect(logical, Qt::transparent);
+  painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+  painter.setClipRect(logical);
+  painter.setFont(font);
+  painter.setPen(QColor::fromRgb(color));
+  painter.drawText(QPointF(logical.x(), logical.y() + ascent_), text);
+}
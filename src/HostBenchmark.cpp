@@ -0,0 +1,168 @@
+#include "HostBenchmark.h"
+#include "JumpHost.h"
+#include "SshReactor.h"
+
+#include <QElapsedTimer>
+#include <QThread>
+
+#ifdef HAVE_LIBSSH
+#include <libssh/libssh.h>
+#endif
+
+namespace {
+
+const char *const kCiphers[] = {
+    "aes128-gcm@openssh.com", "aes256-gcm@openssh.com", "chacha20-poly1305@openssh.com",
+    "aes128-ctr",             "aes256-ctr",
+};
+const int kCompressionLevels[] = {0, 6};
+
+// About 30 MB of digits and newlines, which compresses like terminal output.
+constexpr const char *kCommand = "seq 1 4000000";
+constexpr qint64 kMaxReadMs = 5000;
+constexpr int kReadBufferSize = 64 * 1024;
+
+} // namespace
+
+HostBenchmark::HostBenchmark(const Profile &profile, const QString &keyPassphrase, QObject *parent)
+    : QObject(parent), profile_(profile), keyPassphrase_(keyPassphrase) {}
+
+HostBenchmark::~HostBenchmark() {
+  cancel();
+  if (thread_) {
+    thread_->wait();
+    delete thread_;
+  }
+}
+
+void HostBenchmark::start() {
+  if (thread_) {
+    return;
+  }
+  cancelled_ = false;
+  results_.clear();
+  thread_ = QThread::create([this]() { run(); });
+  thread_->setObjectName("host-benchmark");
+  connect(thread_, &QThread::finished, this, &HostBenchmark::finished);
+  thread_->start();
+}
+
+void HostBenchmark::cancel() {
+  cancelled_ = true;
+}
+
+void HostBenchmark::wait() {
+  if (thread_) {
+    thread_->wait();
+  }
+}
+
+bool HostBenchmark::isRunning() const {
+  return thread_ && thread_->isRunning();
+}
+
+HostBenchmark::Result HostBenchmark::best() const {
+  Result best;
+  for (const Result &r : results_) {
+    if (r.error.isEmpty() && r.mbPerSecond > best.mbPerSecond) {
+      best = r;
+    }
+  }
+  return best;
+}
+
+void HostBenchmark::run() {
+  const int total = int(sizeof(kCiphers) / sizeof(kCiphers[0]) * sizeof(kCompressionLevels) / sizeof(int));
+  int done = 0;
+  for (const char *cipher : kCiphers) {
+    for (int level : kCompressionLevels) {
+      if (cancelled_) {
+        return;
+      }
+      const QString label = level > 0 ? QString("%1, zlib %2").arg(cipher).arg(level) : QString(cipher);
+      emit progress(done, total, label);
+      results_.push_back(measure(cipher, level));
+      ++done;
+    }
+  }
+  emit progress(done, total, QString());
+}
+
+HostBenchmark::Result HostBenchmark::measure(const QString &cipher, int compressionLevel) const {
+  Result result;
+  result.cipher = cipher;
+  result.compressionLevel = compressionLevel;
+#ifdef HAVE_LIBSSH
+  // Connections here are direct; through jump hosts they would time
+  // another path than sessions take, if they connect at all.
+  QVector<JumpHost> hops;
+  if (!JumpHost::parseChain(profile_.proxyJump, &hops) || !hops.isEmpty()) {
+    result.error = "Hosts behind a proxy jump cannot be benchmarked";
+    return result;
+  }
+  SshTransport transport = profile_.transport;
+  transport.ciphers = cipher;
+  transport.compressionLevel = compressionLevel;
+
+  ssh_key key = nullptr;
+  SshTarget target;
+  ssh_session session = SshReactor::newSession(profile_.host, profile_.user, profile_.port,
+                                               profile_.keyPath.trimmed(), keyPassphrase_, transport, &key,
+                                               &target, &result.error);
+  if (!session) {
+    return result;
+  }
+  const long timeoutSec = 15;
+  ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeoutSec);
+
+  ssh_channel channel = nullptr;
+  auto fail = [&](const QString &what) {
+    result.error = QString("%1: %2").arg(what, ssh_get_error(session));
+  };
+  if (ssh_connect(session) != SSH_OK) {
+    fail("Connect failed");
+  } else {
+    const int rc = key ? ssh_userauth_publickey(session, nullptr, key)
+                       : ssh_userauth_publickey_auto(session, nullptr, nullptr);
+    if (rc != SSH_AUTH_SUCCESS) {
+      fail("Authentication failed");
+    } else if (!(channel = ssh_channel_new(session)) || ssh_channel_open_session(channel) != SSH_OK ||
+               ssh_channel_request_exec(channel, kCommand) != SSH_OK) {
+      fail("Starting benchmark command failed");
+    } else {
+      QByteArray buffer(kReadBufferSize, Qt::Uninitialized);
+      qint64 bytes = 0;
+      QElapsedTimer timer;
+      timer.start();
+      while (!cancelled_ && !timer.hasExpired(kMaxReadMs)) {
+        const int n = ssh_channel_read_timeout(channel, buffer.data(), buffer.size(), 0, 1000);
+        if (n == SSH_ERROR) {
+          fail("Read failed");
+          break;
+        }
+        if (n == 0 && ssh_channel_is_eof(channel)) {
+          break;
+        }
+        bytes += n;
+      }
+      const qint64 elapsed = qMax<qint64>(1, timer.elapsed());
+      if (result.error.isEmpty()) {
+        result.mbPerSecond = bytes / (1024.0 * 1024.0) * 1000.0 / elapsed;
+      }
+    }
+  }
+
+  if (channel) {
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+  }
+  if (key) {
+    ssh_key_free(key);
+  }
+  ssh_disconnect(session);
+  ssh_free(session);
+#else
+  result.error = "libssh not available at build time";
+#endif
+  return result;
+}
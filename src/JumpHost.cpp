@@ -0,0 +1,69 @@
+#include "JumpHost.h"
+
+#include <QStringList>
+
+bool JumpHost::parseChain(const QString &spec, QVector<JumpHost> *hops, QString *error) {
+  hops->clear();
+  const QString trimmed = spec.trimmed();
+  if (trimmed.isEmpty() || trimmed.compare("none", Qt::CaseInsensitive) == 0) {
+    return true;
+  }
+  for (QString part : trimmed.split(',', Qt::SkipEmptyParts)) {
+    part = part.trimmed();
+    if (part.startsWith("ssh://")) {
+      part = part.mid(6);
+    }
+    JumpHost hop;
+    const int at = part.lastIndexOf('@');
+    bool ok = true;
+    if (at >= 0) {
+      hop.user = part.left(at);
+      part = part.mid(at + 1);
+      ok = !hop.user.isEmpty();
+    }
+    QString portText;
+    if (part.startsWith('[')) {
+      // [IPv6]:port
+      const int close = part.indexOf(']');
+      if (close < 0) {
+        part.clear();
+      } else {
+        portText = part.mid(close + 1);
+        part = part.mid(1, close - 1);
+        if (!portText.isEmpty() && !portText.startsWith(':')) {
+          part.clear();
+        }
+        portText = portText.mid(1);
+      }
+    } else if (part.count(':') == 1) {
+      portText = part.section(':', 1);
+      part = part.section(':', 0, 0);
+    }
+    hop.host = part;
+    if (ok && !portText.isEmpty()) {
+      hop.port = portText.toInt(&ok);
+      ok = ok && hop.port > 0 && hop.port <= 65535;
+    }
+    if (!ok || hop.host.isEmpty() || hop.host.contains(' ')) {
+      if (error) *error = QString("invalid jump host \"%1\"").arg(spec.trimmed());
+      hops->clear();
+      return false;
+    }
+    hops->append(hop);
+  }
+  return true;
+}
+
+QString JumpHost::chainString(const QVector<JumpHost> &hops, int count) {
+  QStringList parts;
+  for (int i = 0; i < hops.size() && (count < 0 || i < count); ++i) {
+    parts << hops.at(i).toString();
+  }
+  return parts.join(',');
+}
+
+QString JumpHost::toString() const {
+  const QString name = host.contains(':') ? QString("[%1]").arg(host) : host;
+  const QString hostPort = QString("%1:%2").arg(name).arg(port);
+  return user.isEmpty() ? hostPort : QString("%1@%2").arg(user, hostPort);
+}
@@ -1,4 +1,6 @@
 #include "MainWindow.h"
+#include "ColorTable.h"
+#include "ConnectionPool.h"
 #include "TerminalTab.h"
 #include "ThemeDialog.h"
 
@@ -8,6 +10,7 @@
 #include <QMenuBar>
 #include <QMessageBox>
 #include <QFile>
+#include <QFileInfo>
 #include <QSettings>
 #include <QTabWidget>
 #include <QTabBar>
@@ -36,10 +39,11 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), tabs_(new QTabWid
   auto *viewMenu = menuBar()->addMenu("View");
   auto *themeAction = viewMenu->addAction("Theme...");
   connect(themeAction, &QAction::triggered, [this]() {
-    ThemeDialog dlg(themeFg_, themeBg_, themeFont_, this);
+    ThemeDialog dlg(themeFg_, themeBg_, themeAnsi_, themeFont_, this);
     if (dlg.exec() == QDialog::Accepted) {
       themeFg_ = dlg.foreground();
       themeBg_ = dlg.background();
+      themeAnsi_ = dlg.ansiColors();
       themeFont_ = dlg.font();
       saveTheme();
       applyThemeToAll();
@@ -51,6 +55,7 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), tabs_(new QTabWid
   if (!restoreSessions()) {
     newTab();
   }
+  warmProfiles();
 }
 
 void MainWindow::newTab() {
@@ -72,7 +77,15 @@ void MainWindow::newTab() {
       closeTab(idx);
     }
   });
-  tab->applyTheme(themeFg_, themeBg_, themeFont_);
+  tab->applyTheme(themeFg_, themeBg_, colorTable_, themeFont_);
+}
+
+void MainWindow::addBlankTabs(int count) {
+  const int current = tabs_->currentIndex();
+  for (int i = 0; i < count; ++i) {
+    newTab();
+  }
+  tabs_->setCurrentIndex(current);
 }
 
 void MainWindow::closeTab(int index) {
@@ -116,6 +129,7 @@ void MainWindow::closeEvent(QCloseEvent *event) {
 }
 
 void MainWindow::onProfileConnected(const Profile &p) {
+  ConnectionPool::instance()->adopt(p);
   QStringList names = loadLastSessions();
   names.removeAll(p.name);
   names.prepend(p.name);
@@ -141,6 +155,23 @@ void MainWindow::onConnectInNewTab(const Profile &p) {
   openTabWithProfile(p, true);
 }
 
+// Starts the pool for "keep warm" profiles. An encrypted store is left alone
+// rather than asking for its passphrase at startup; those profiles join the
+// pool when a tab first connects to them.
+void MainWindow::warmProfiles() {
+  QFile f(ProfileStore::defaultPath());
+  if (!f.open(QIODevice::ReadOnly) || ProfileStore::looksEncrypted(f.readAll())) {
+    return;
+  }
+  QVector<Profile> profiles;
+  if (!ProfileStore(ProfileStore::defaultPath()).loadPlain(&profiles)) {
+    return;
+  }
+  for (const auto &p : profiles) {
+    ConnectionPool::instance()->warm(p);
+  }
+}
+
 bool MainWindow::restoreSessions() {
   const QStringList names = loadLastSessions();
   if (names.isEmpty()) {
@@ -191,15 +222,35 @@ bool MainWindow::restoreSessions() {
     byName.insert(p.name, p);
   }
 
-  bool restoredAny = false;
+  // Connects run concurrently on the reactor, so ask for every key
+  // passphrase up front (once per key) and then start all tabs at once.
+  QVector<Profile> restore;
+  QHash<QString, QString> keyPassphrases;
   for (const auto &name : names) {
     if (!byName.contains(name)) {
       continue;
     }
-    openTabWithProfile(byName.value(name), true);
-    restoredAny = true;
+    const Profile p = byName.value(name);
+    const QString keyPath = p.keyPath.trimmed();
+    if (!keyPath.isEmpty() && QFileInfo::exists(keyPath) && !keyPassphrases.contains(keyPath)) {
+      bool ok = false;
+      const QString keyPass = QInputDialog::getText(this, "Key Passphrase",
+                                                    QString("Passphrase for %1 (leave empty if none)").arg(keyPath),
+                                                    QLineEdit::Password, "", &ok);
+      if (!ok) {
+        continue;
+      }
+      keyPassphrases.insert(keyPath, keyPass);
+    }
+    restore.append(p);
   }
-  return restoredAny;
+
+  for (const auto &p : restore) {
+    openTabWithProfile(p, false);
+    auto *tab = qobject_cast<TerminalTab *>(tabs_->widget(tabs_->count() - 1));
+    tab->connectProfile(p, keyPassphrases.value(p.keyPath.trimmed()));
+  }
+  return !restore.isEmpty();
 }
 
 void MainWindow::openTabWithProfile(const Profile &p, bool autoConnect) {
@@ -221,7 +272,7 @@ void MainWindow::openTabWithProfile(const Profile &p, bool autoConnect) {
       closeTab(idx);
     }
   });
-  tab->applyTheme(themeFg_, themeBg_, themeFont_);
+  tab->applyTheme(themeFg_, themeBg_, colorTable_, themeFont_);
   if (autoConnect) {
     tab->connectProfile(p, true);
   }
@@ -245,21 +296,37 @@ void MainWindow::loadTheme() {
   if (themeFont_.pointSize() <= 0) {
     themeFont_.setPointSize(12);
   }
+  themeAnsi_.clear();
+  const QStringList ansi = settings.value("theme/ansi").toStringList();
+  for (const QString &name : ansi) {
+    themeAnsi_.append(QColor(name));
+  }
+  if (themeAnsi_.size() != ColorTable::kAnsiColors) {
+    themeAnsi_ = ColorTable::defaultAnsi();
+  }
+  colorTable_ = ColorTable::create(themeAnsi_);
 }
 
 void MainWindow::saveTheme() const {
   QSettings settings("sshterminal", "sshterminal");
   settings.setValue("theme/fg", themeFg_);
   settings.setValue("theme/bg", themeBg_);
+  QStringList ansi;
+  for (const QColor &c : themeAnsi_) {
+    ansi.append(c.name(QColor::HexRgb));
+  }
+  settings.setValue("theme/ansi", ansi);
   settings.setValue("theme/font", themeFont_);
 }
 
 void MainWindow::applyThemeToAll() {
+  // One table for every tab; terminals only swap their shared pointer.
+  colorTable_ = ColorTable::create(themeAnsi_);
   for (int i = 0; i < tabs_->count(); ++i) {
     auto *tab = qobject_cast<TerminalTab *>(tabs_->widget(i));
     if (!tab) {
       continue;
     }
-    tab->applyTheme(themeFg_, themeBg_, themeFont_);
+    tab->applyTheme(themeFg_, themeBg_, colorTable_, themeFont_);
   }
 }
@@ -0,0 +1,67 @@
+#include "PerfStats.h"
+
+#include <QAbstractEventDispatcher>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QTimer>
+
+namespace {
+
+QMap<QString, std::function<QString()>> &reporters() {
+  static QMap<QString, std::function<QString()>> map;
+  return map;
+}
+
+void ensureTimer() {
+  static QTimer *timer = nullptr;
+  if (timer || !QCoreApplication::instance()) {
+    return;
+  }
+  timer = new QTimer(QCoreApplication::instance());
+  timer->setInterval(5000);
+
+  // Every return from the event loop's wait counts as one wakeup; an idle
+  // application should stay close to the stats timer's own 0.2/s.
+  static quint64 wakeups = 0;
+  if (QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance()) {
+    QObject::connect(dispatcher, &QAbstractEventDispatcher::awake, []() { ++wakeups; });
+  }
+  static QElapsedTimer sinceReport;
+  sinceReport.start();
+
+  QObject::connect(timer, &QTimer::timeout, []() {
+    const qint64 ms = qMax<qint64>(1, sinceReport.restart());
+    qInfo().noquote() << "[stats]" << "wakeups" << QString("%1/s").arg(wakeups * 1000.0 / ms, 0, 'f', 1);
+    wakeups = 0;
+    const auto &map = reporters();
+    for (auto it = map.constBegin(); it != map.constEnd(); ++it) {
+      qInfo().noquote() << "[stats]" << it.key() << it.value()();
+    }
+  });
+  timer->start();
+}
+
+} // namespace
+
+namespace PerfStats {
+
+bool enabled() {
+  static const bool on = !qgetenv("SSH_TERMINAL_STATS").isEmpty();
+  return on;
+}
+
+void setReporter(const QString &name, std::function<QString()> report) {
+  if (!enabled()) {
+    return;
+  }
+  reporters().insert(name, std::move(report));
+  ensureTimer();
+}
+
+void removeReporter(const QString &name) {
+  reporters().remove(name);
+}
+
+} // namespace PerfStats
@@ -0,0 +1,138 @@
+#include "PortForward.h"
+
+#include <QHostAddress>
+#include <QStringList>
+#include <QtEndian>
+
+#include <cstring>
+
+namespace {
+
+bool parsePort(const QString &text, quint16 *port) {
+  bool ok = false;
+  const int value = text.toInt(&ok);
+  if (!ok || value <= 0 || value > 65535) {
+    return false;
+  }
+  *port = quint16(value);
+  return true;
+}
+
+// Splits on ':' outside of [brackets], so IPv6 addresses can be given as
+// [::1]:8080.
+QStringList splitFields(const QString &text) {
+  QStringList fields;
+  QString current;
+  bool bracketed = false;
+  for (const QChar c : text) {
+    if (c == '[') {
+      bracketed = true;
+    } else if (c == ']') {
+      bracketed = false;
+    } else if (c == ':' && !bracketed) {
+      fields << current;
+      current.clear();
+    } else {
+      current += c;
+    }
+  }
+  fields << current;
+  return fields;
+}
+
+QString bracketed(const QString &host) {
+  return host.contains(':') ? QString("[%1]").arg(host) : host;
+}
+
+} // namespace
+
+bool PortForward::parse(const QString &spec, PortForward *forward, QString *error) {
+  const QString trimmed = spec.trimmed();
+  const QString kind = trimmed.section(' ', 0, 0, QString::SectionSkipEmpty).toUpper();
+  const QStringList fields = splitFields(trimmed.section(' ', 1, -1, QString::SectionSkipEmpty).trimmed());
+
+  PortForward f;
+  bool ok = false;
+  if (kind == "L" || kind == "-L") {
+    f.type = Local;
+    if (fields.size() == 4) {
+      f.bindAddress = fields.at(0);
+    }
+    ok = (fields.size() == 3 || fields.size() == 4) && parsePort(fields.at(fields.size() - 3), &f.bindPort) &&
+         parsePort(fields.last(), &f.targetPort);
+    f.targetHost = fields.value(fields.size() - 2);
+    ok = ok && !f.targetHost.isEmpty();
+  } else if (kind == "D" || kind == "-D") {
+    f.type = Dynamic;
+    if (fields.size() == 2) {
+      f.bindAddress = fields.at(0);
+    }
+    ok = (fields.size() == 1 || fields.size() == 2) && parsePort(fields.last(), &f.bindPort);
+  }
+  if (f.bindAddress.isEmpty() || f.bindAddress == "localhost") {
+    f.bindAddress = "127.0.0.1";
+  } else if (f.bindAddress == "*") {
+    f.bindAddress = "0.0.0.0";
+  }
+  if (!ok) {
+    if (error) *error = QString("invalid forward \"%1\"").arg(trimmed);
+    return false;
+  }
+  *forward = f;
+  return true;
+}
+
+QString PortForward::toString() const {
+  if (type == Dynamic) {
+    return QString("D %1:%2").arg(bracketed(bindAddress)).arg(bindPort);
+  }
+  return QString("L %1:%2:%3:%4").arg(bracketed(bindAddress)).arg(bindPort).arg(bracketed(targetHost)).arg(targetPort);
+}
+
+Socks5::Status Socks5::parseGreeting(const uchar *data, int size, int *used) {
+  // VER NMETHODS METHODS
+  if (size < 2 || size < 2 + data[1]) {
+    return Incomplete;
+  }
+  *used = 2 + data[1];
+  const bool noAuth = std::memchr(data + 2, 0, data[1]) != nullptr;
+  return data[0] == 5 && noAuth ? Accepted : Unsupported;
+}
+
+Socks5::Status Socks5::parseRequest(const uchar *data, int size, int *used, QString *host, quint16 *port) {
+  // VER CMD RSV ATYP ADDR PORT
+  if (size < 5) {
+    return Incomplete;
+  }
+  int addressLength = 0;
+  switch (data[3]) {
+  case 1:
+    addressLength = 4;
+    break;
+  case 3:
+    addressLength = 1 + data[4];
+    break;
+  case 4:
+    addressLength = 16;
+    break;
+  default:
+    return Invalid;
+  }
+  const int length = 4 + addressLength + 2;
+  if (size < length) {
+    return Incomplete;
+  }
+  *used = length;
+  if (data[0] != 5 || data[1] != 1) {
+    return Unsupported;
+  }
+  if (data[3] == 3) {
+    *host = QString::fromLatin1(reinterpret_cast<const char *>(data + 5), data[4]);
+  } else if (data[3] == 1) {
+    *host = QHostAddress(qFromBigEndian<quint32>(data + 4)).toString();
+  } else {
+    *host = QHostAddress(data + 4).toString();
+  }
+  *port = quint16(data[length - 2] << 8 | data[length - 1]);
+  return Accepted;
+}
@@ -1,12 +1,18 @@
 #include "ProfileManagerDialog.h"
+#include "HostBenchmark.h"
+#include "JumpHost.h"
 
 #include <QDir>
 #include <QFileInfo>
 #include <QFormLayout>
 #include <QFileDialog>
+#include <QFontMetrics>
+#include <QGroupBox>
 #include <QInputDialog>
 #include <QListWidget>
 #include <QMessageBox>
+#include <QPlainTextEdit>
+#include <QProgressDialog>
 #include <QPushButton>
 #include <QRegExp>
 #include <QSet>
@@ -17,6 +23,13 @@
 #include <QToolButton>
 #include <QVBoxLayout>
 
+namespace {
+
+const char *const kNoJumpBenchmark =
+    "Not available with a Proxy Jump: the benchmark connects directly and would not measure the path sessions take";
+
+} // namespace
+
 ProfileManagerDialog::ProfileManagerDialog(QWidget *parent) : QDialog(parent) {
   setWindowTitle("Profiles");
   resize(520, 360);
@@ -54,6 +67,18 @@ ProfileManagerDialog::ProfileManagerDialog(QWidget *parent) : QDialog(parent) {
   keyRowWrap->setLayout(keyRow);
   form->addRow("Key Path", keyRowWrap);
 
+  proxyJump_ = new QLineEdit(this);
+  proxyJump_->setPlaceholderText("user@bastion:22");
+  proxyJump_->setToolTip("Jump hosts to connect through, outermost first, separated by commas (as in ssh -J); "
+                         "~/.ssh/config aliases work");
+  form->addRow("Proxy Jump", proxyJump_);
+
+  forwards_ = new QPlainTextEdit(this);
+  forwards_->setPlaceholderText("L 5432:db.internal:5432\nD 1080");
+  forwards_->setToolTip("One per line: \"L [bind:]port:host:hostport\" or \"D [bind:]port\" (SOCKS5)");
+  forwards_->setFixedHeight(QFontMetrics(forwards_->font()).lineSpacing() * 3 + 12);
+  form->addRow("Forwards", forwards_);
+
   addButton_ = new QPushButton("Add", this);
   saveButton_ = new QPushButton("Save", this);
   deleteButton_ = new QPushButton("Delete", this);
@@ -79,12 +104,71 @@ ProfileManagerDialog::ProfileManagerDialog(QWidget *parent) : QDialog(parent) {
   protectCheck_->setChecked(settings.value("profiles/encrypted", false).toBool());
 
   openInNewTabCheck_ = new QCheckBox("Open this profile in new tab by default", this);
+  keepWarmCheck_ = new QCheckBox("Keep a connection to this host warm", this);
+  logSessionCheck_ = new QCheckBox("Log sessions to asciicast files", this);
+
+  // Empty fields and zeros keep the libssh defaults.
+  transportGroup_ = new QGroupBox("Transport", this);
+  transportGroup_->setCheckable(true);
+  transportGroup_->setChecked(false);
+  ciphers_ = new QLineEdit(this);
+  ciphers_->setPlaceholderText("default");
+  macs_ = new QLineEdit(this);
+  macs_->setPlaceholderText("default");
+  kex_ = new QLineEdit(this);
+  kex_->setPlaceholderText("default");
+  compression_ = new QSpinBox(this);
+  compression_->setRange(0, 9);
+  compression_->setSpecialValueText("off");
+  rekeyData_ = new QSpinBox(this);
+  rekeyData_->setRange(0, 1 << 20);
+  rekeyData_->setSuffix(" MB");
+  rekeyData_->setSpecialValueText("default");
+  rekeyTime_ = new QSpinBox(this);
+  rekeyTime_->setRange(0, 7 * 24 * 3600);
+  rekeyTime_->setSuffix(" s");
+  rekeyTime_->setSpecialValueText("default");
+  noDelayCheck_ = new QCheckBox("Disable Nagle (TCP_NODELAY)", this);
+  noDelayCheck_->setChecked(true);
+  sendBuffer_ = new QSpinBox(this);
+  sendBuffer_->setRange(0, 64 * 1024);
+  sendBuffer_->setSuffix(" KB");
+  sendBuffer_->setSpecialValueText("system");
+  receiveBuffer_ = new QSpinBox(this);
+  receiveBuffer_->setRange(0, 64 * 1024);
+  receiveBuffer_->setSuffix(" KB");
+  receiveBuffer_->setSpecialValueText("system");
+  benchmarkButton_ = new QPushButton("Benchmark Host", this);
+  connect(benchmarkButton_, &QPushButton::clicked, this, &ProfileManagerDialog::onBenchmarkHost);
+  // The benchmark connects straight to the host, so through jump hosts it
+  // would fail or time a different path than the sessions take.
+  connect(proxyJump_, &QLineEdit::textChanged, this, [this](const QString &text) {
+    QVector<JumpHost> hops;
+    const bool direct = JumpHost::parseChain(text, &hops) && hops.isEmpty();
+    benchmarkButton_->setEnabled(direct);
+    benchmarkButton_->setToolTip(direct ? QString() : QString(kNoJumpBenchmark));
+  });
+
+  auto *transportForm = new QFormLayout(transportGroup_);
+  transportForm->addRow("Ciphers", ciphers_);
+  transportForm->addRow("MACs", macs_);
+  transportForm->addRow("Key exchange", kex_);
+  transportForm->addRow("Compression", compression_);
+  transportForm->addRow("Rekey after", rekeyData_);
+  transportForm->addRow("Rekey every", rekeyTime_);
+  transportForm->addRow(QString(), noDelayCheck_);
+  transportForm->addRow("Send buffer", sendBuffer_);
+  transportForm->addRow("Receive buffer", receiveBuffer_);
+  transportForm->addRow(QString(), benchmarkButton_);
 
   auto *layout = new QVBoxLayout();
   layout->addWidget(list_);
   layout->addLayout(form);
   layout->addWidget(protectCheck_);
   layout->addWidget(openInNewTabCheck_);
+  layout->addWidget(keepWarmCheck_);
+  layout->addWidget(logSessionCheck_);
+  layout->addWidget(transportGroup_);
   layout->addLayout(buttonsRow);
   setLayout(layout);
 
@@ -118,6 +202,9 @@ void ProfileManagerDialog::onAddProfile() {
     QMessageBox::warning(this, "Profile", "Name is required");
     return;
   }
+  if (!checkFields()) {
+    return;
+  }
   profiles_.push_back(p);
   refreshList();
   list_->setCurrentRow(profiles_.size() - 1);
@@ -135,6 +222,9 @@ void ProfileManagerDialog::onSaveProfile() {
     QMessageBox::warning(this, "Profile", "Name is required");
     return;
   }
+  if (!checkFields()) {
+    return;
+  }
   profiles_[idx] = p;
   refreshList();
   list_->setCurrentRow(idx);
@@ -160,6 +250,9 @@ void ProfileManagerDialog::onConnect() {
     QMessageBox::warning(this, "Profile", "Select a profile to connect");
     return;
   }
+  if (!checkFields()) {
+    return;
+  }
   selected_ = profileFromFields();
   profiles_[idx] = selected_;
   saveProfiles();
@@ -257,6 +350,15 @@ void ProfileManagerDialog::onImportSshConfig() {
       if (currentProfile.port <= 0) {
         currentProfile.port = 22;
       }
+    } else if ((key == "localforward" && parts.size() >= 3) || (key == "dynamicforward" && parts.size() >= 2)) {
+      const QString spec = key == "localforward" ? QString("L %1:%2").arg(parts.at(1), parts.at(2))
+                                                 : QString("D %1").arg(parts.at(1));
+      PortForward forward;
+      if (PortForward::parse(spec, &forward)) {
+        currentProfile.forwards.push_back(forward);
+      }
+    } else if (key == "proxyjump" && parts.size() >= 2) {
+      currentProfile.proxyJump = parts.mid(1).join(QString());
     }
   }
 
@@ -276,6 +378,76 @@ void ProfileManagerDialog::onImportSshConfig() {
   QMessageBox::information(this, "Import SSH Config", QString("Imported %1 profile(s).").arg(imported.size()));
 }
 
+// Tries each cipher and compression level against the selected host and
+// stores the fastest in the profile.
+void ProfileManagerDialog::onBenchmarkHost() {
+  const int idx = currentIndex();
+  if (idx < 0 || idx >= profiles_.size()) {
+    QMessageBox::warning(this, "Benchmark", "Select a profile to benchmark");
+    return;
+  }
+  const Profile p = profileFromFields();
+  if (p.host.trimmed().isEmpty()) {
+    QMessageBox::warning(this, "Benchmark", "Host is required");
+    return;
+  }
+  QVector<JumpHost> hops;
+  if (!JumpHost::parseChain(p.proxyJump, &hops) || !hops.isEmpty()) {
+    QMessageBox::warning(this, "Benchmark", kNoJumpBenchmark);
+    return;
+  }
+  QString keyPass;
+  const QString keyPath = p.keyPath.trimmed();
+  if (!keyPath.isEmpty() && QFileInfo::exists(keyPath)) {
+    bool ok = false;
+    keyPass = QInputDialog::getText(this, "Key Passphrase", "Passphrase (leave empty if none)",
+                                    QLineEdit::Password, "", &ok);
+    if (!ok) {
+      return;
+    }
+  }
+
+  HostBenchmark benchmark(p, keyPass);
+  QProgressDialog progress("Connecting...", "Cancel", 0, 1, this);
+  progress.setWindowTitle("Benchmark Host");
+  progress.setWindowModality(Qt::WindowModal);
+  progress.setMinimumDuration(0);
+  connect(&benchmark, &HostBenchmark::progress, &progress, [&progress](int done, int total, const QString &label) {
+    progress.setMaximum(total);
+    progress.setValue(done);
+    if (!label.isEmpty()) {
+      progress.setLabelText(QString("Measuring %1...").arg(label));
+    }
+  });
+  connect(&progress, &QProgressDialog::canceled, &benchmark, &HostBenchmark::cancel);
+  connect(&benchmark, &HostBenchmark::finished, &progress, &QProgressDialog::reset);
+  benchmark.start();
+  progress.exec();
+  benchmark.cancel();
+  benchmark.wait();
+
+  QStringList lines;
+  for (const HostBenchmark::Result &r : benchmark.results()) {
+    const QString name = r.compressionLevel > 0 ? QString("%1, zlib %2").arg(r.cipher).arg(r.compressionLevel)
+                                                : r.cipher;
+    lines << (r.error.isEmpty() ? QString("%1: %2 MB/s").arg(name).arg(r.mbPerSecond, 0, 'f', 1)
+                                : QString("%1: %2").arg(name, r.error));
+  }
+  const HostBenchmark::Result best = benchmark.best();
+  if (best.cipher.isEmpty()) {
+    QMessageBox::warning(this, "Benchmark Host",
+                         lines.isEmpty() ? QString("Benchmark cancelled.") : lines.join('\n'));
+    return;
+  }
+  transportGroup_->setChecked(true);
+  ciphers_->setText(best.cipher);
+  compression_->setValue(best.compressionLevel);
+  profiles_[idx] = profileFromFields();
+  saveProfiles();
+  QMessageBox::information(this, "Benchmark Host",
+                           lines.join('\n') + QString("\n\nSaved %1 to the profile.").arg(best.cipher));
+}
+
 bool ProfileManagerDialog::loadProfiles() {
   const QString path = storePath();
   const QFileInfo fi(path);
@@ -398,6 +570,26 @@ void ProfileManagerDialog::setFieldsFromProfile(const Profile &p) {
   port_->setValue(p.port);
   keyPath_->setText(p.keyPath);
   openInNewTabCheck_->setChecked(p.openInNewTab);
+  keepWarmCheck_->setChecked(p.keepWarm);
+  logSessionCheck_->setChecked(p.logSession);
+  proxyJump_->setText(p.proxyJump);
+  QStringList forwards;
+  for (const auto &f : p.forwards) {
+    forwards << f.toString();
+  }
+  forwards_->setPlainText(forwards.join('\n'));
+
+  const SshTransport &t = p.transport;
+  transportGroup_->setChecked(t.id() != SshTransport().id());
+  ciphers_->setText(t.ciphers);
+  macs_->setText(t.macs);
+  kex_->setText(t.kex);
+  compression_->setValue(t.compressionLevel);
+  rekeyData_->setValue(t.rekeyDataMB);
+  rekeyTime_->setValue(t.rekeyTimeSec);
+  noDelayCheck_->setChecked(t.tcpNoDelay);
+  sendBuffer_->setValue(t.sendBufferKB);
+  receiveBuffer_->setValue(t.receiveBufferKB);
 }
 
 Profile ProfileManagerDialog::profileFromFields() const {
@@ -408,9 +600,47 @@ Profile ProfileManagerDialog::profileFromFields() const {
   p.port = port_->value();
   p.keyPath = keyPath_->text();
   p.openInNewTab = openInNewTabCheck_->isChecked();
+  p.keepWarm = keepWarmCheck_->isChecked();
+  p.logSession = logSessionCheck_->isChecked();
+  p.proxyJump = proxyJump_->text().trimmed();
+  for (const QString &line : forwards_->toPlainText().split('\n', Qt::SkipEmptyParts)) {
+    PortForward forward;
+    if (PortForward::parse(line, &forward)) {
+      p.forwards.push_back(forward);
+    }
+  }
+  // An unchecked group keeps the values on screen but saves the defaults.
+  if (transportGroup_->isChecked()) {
+    p.transport.ciphers = ciphers_->text().trimmed();
+    p.transport.macs = macs_->text().trimmed();
+    p.transport.kex = kex_->text().trimmed();
+    p.transport.compressionLevel = compression_->value();
+    p.transport.rekeyDataMB = rekeyData_->value();
+    p.transport.rekeyTimeSec = rekeyTime_->value();
+    p.transport.tcpNoDelay = noDelayCheck_->isChecked();
+    p.transport.sendBufferKB = sendBuffer_->value();
+    p.transport.receiveBufferKB = receiveBuffer_->value();
+  }
   return p;
 }
 
+bool ProfileManagerDialog::checkFields() {
+  QString error;
+  QVector<JumpHost> hops;
+  if (!JumpHost::parseChain(proxyJump_->text(), &hops, &error)) {
+    QMessageBox::warning(this, "Profile", "Proxy Jump: " + error);
+    return false;
+  }
+  for (const QString &line : forwards_->toPlainText().split('\n', Qt::SkipEmptyParts)) {
+    PortForward forward;
+    if (!line.trimmed().isEmpty() && !PortForward::parse(line, &forward, &error)) {
+      QMessageBox::warning(this, "Profile", "Forwards: " + error);
+      return false;
+    }
+  }
+  return true;
+}
+
 int ProfileManagerDialog::currentIndex() const {
   return list_->currentRow();
 }
@@ -11,6 +11,34 @@
 #include <sodium.h>
 #endif
 
+static QJsonObject transportToJson(const SshTransport &t) {
+  QJsonObject o;
+  o["ciphers"] = t.ciphers;
+  o["macs"] = t.macs;
+  o["kex"] = t.kex;
+  o["compressionLevel"] = t.compressionLevel;
+  o["rekeyDataMB"] = t.rekeyDataMB;
+  o["rekeyTimeSec"] = t.rekeyTimeSec;
+  o["tcpNoDelay"] = t.tcpNoDelay;
+  o["sendBufferKB"] = t.sendBufferKB;
+  o["receiveBufferKB"] = t.receiveBufferKB;
+  return o;
+}
+
+static SshTransport transportFromJson(const QJsonObject &o) {
+  SshTransport t;
+  t.ciphers = o.value("ciphers").toString();
+  t.macs = o.value("macs").toString();
+  t.kex = o.value("kex").toString();
+  t.compressionLevel = o.value("compressionLevel").toInt(0);
+  t.rekeyDataMB = o.value("rekeyDataMB").toInt(0);
+  t.rekeyTimeSec = o.value("rekeyTimeSec").toInt(0);
+  t.tcpNoDelay = o.value("tcpNoDelay").toBool(true);
+  t.sendBufferKB = o.value("sendBufferKB").toInt(0);
+  t.receiveBufferKB = o.value("receiveBufferKB").toInt(0);
+  return t;
+}
+
 static QJsonArray profilesToJson(const QVector<Profile> &profiles) {
   QJsonArray arr;
   for (const auto &p : profiles) {
@@ -21,6 +49,15 @@ static QJsonArray profilesToJson(const QVector<Profile> &profiles) {
     o["port"] = p.port;
     o["keyPath"] = p.keyPath;
     o["openInNewTab"] = p.openInNewTab;
+    o["keepWarm"] = p.keepWarm;
+    o["logSession"] = p.logSession;
+    o["transport"] = transportToJson(p.transport);
+    QJsonArray forwards;
+    for (const auto &f : p.forwards) {
+      forwards.push_back(f.toString());
+    }
+    o["forwards"] = forwards;
+    o["proxyJump"] = p.proxyJump;
     arr.push_back(o);
   }
   return arr;
@@ -38,6 +75,16 @@ static QVector<Profile> profilesFromJson(const QJsonArray &arr) {
     p.port = o.value("port").toInt(22);
     p.keyPath = o.value("keyPath").toString();
     p.openInNewTab = o.value("openInNewTab").toBool(false);
+    p.keepWarm = o.value("keepWarm").toBool(false);
+    p.logSession = o.value("logSession").toBool(false);
+    p.transport = transportFromJson(o.value("transport").toObject());
+    for (const auto &f : o.value("forwards").toArray()) {
+      PortForward forward;
+      if (PortForward::parse(f.toString(), &forward)) {
+        p.forwards.push_back(forward);
+      }
+    }
+    p.proxyJump = o.value("proxyJump").toString();
     profiles.push_back(p);
   }
   return profiles;
@@ -0,0 +1,605 @@
+#include "ScreenModel.h"
+#include "Scrollback.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr quint32 kNoCluster = 0xffffffff;
+// Distinct clusters held at once; past this, ids no cell uses are reclaimed.
+constexpr int kMaxClusters = 1 << 16;
+
+// Past this many unpresented moves, repainting everything is cheaper.
+constexpr int kMaxPendingMoves = 64;
+
+// Cells up to the last one that is not a default-coloured blank.
+int textLength(const Cell *cells, int cols) {
+  while (cols > 0 && (cells[cols - 1].glyph == 0 || cells[cols - 1].glyph == ' ') &&
+         CellColor::isDefault(cells[cols - 1].fg) && CellColor::isDefault(cells[cols - 1].bg)) {
+    --cols;
+  }
+  return cols;
+}
+
+} // namespace
+
+ScreenModel::ScreenModel(int rows, int cols)
+    : rows_(qMax(1, rows)), cols_(qMax(1, cols)), scrollback_(new Scrollback()) {
+  resizeBuffer(&mainBuf_, 0, 0, rows_, cols_, 0);
+  damage_ = QVector<Span>(rows_, Span{cols_, 0});
+  damageRows(0, rows_);
+}
+
+ScreenModel::~ScreenModel() = default;
+
+QString ScreenModel::text(const Cell &cell) const {
+  if (cell.glyph & Cell::Cluster) {
+    return cluster(cell.codepoint());
+  }
+  uint cp = cell.codepoint();
+  if (cp == 0) {
+    cp = ' ';
+  }
+  return QString::fromUcs4(&cp, 1);
+}
+
+Cell ScreenModel::blankCell() const {
+  Cell blank;
+  blank.glyph = pen_.attrs();
+  blank.fg = pen_.fg;
+  blank.bg = pen_.bg;
+  return blank;
+}
+
+QVector<int> ScreenModel::wrapPoints(const Cell *cells, int length, int cols) {
+  QVector<int> starts{0};
+  for (int at = cols; at < length; at = starts.last() + cols) {
+    // A double-width glyph that would be cut in half starts the next row.
+    if ((cells[at].glyph & Cell::WideTail) && at - 1 > starts.last()) {
+      --at;
+    }
+    starts.append(at);
+  }
+  return starts;
+}
+
+void ScreenModel::fillRow(int r, int startCol, int endCol, const Cell &blank) {
+  Cell *line = mutableRow(r);
+  std::fill(line + startCol, line + endCol, blank);
+}
+
+void ScreenModel::damage(int row, int startCol, int endCol) {
+  Span &d = damage_[row];
+  d.start = qMin(d.start, startCol);
+  d.end = qMax(d.end, endCol);
+  damaged_ = true;
+}
+
+void ScreenModel::damageRows(int first, int last) {
+  for (int r = first; r < last; ++r) {
+    damage_[r] = Span{0, cols_};
+  }
+  damaged_ = damaged_ || first < last;
+}
+
+void ScreenModel::recordMove(const Move &move) {
+  if (moves_.size() >= kMaxPendingMoves) {
+    moves_.clear();
+    damageRows(0, rows_);
+    return;
+  }
+  // Consecutive upward scrolls of the same region (the common case while
+  // output streams) collapse into one larger move.
+  if (!moves_.isEmpty() && move.cols == cols_ && move.srcRow > move.destRow) {
+    Move &last = moves_.last();
+    if (last.cols == cols_ && last.destRow == move.destRow && last.srcRow > last.destRow &&
+        last.srcRow + last.rows == move.srcRow + move.rows) {
+      const int shift = (last.srcRow - last.destRow) + (move.srcRow - move.destRow);
+      const int height = last.srcRow + last.rows - last.destRow;
+      if (shift >= height) {
+        moves_.removeLast();
+      } else {
+        last.srcRow = last.destRow + shift;
+        last.rows = height - shift;
+      }
+      return;
+    }
+  }
+  moves_.append(move);
+}
+
+void ScreenModel::resizeBuffer(Buffer *buf, int oldRows, int oldCols, int rows, int cols, int skip) {
+  QVector<Cell> cells(rows * cols);
+  const int keepRows = qMin(rows, oldRows - skip);
+  const int keepCols = qMin(cols, oldCols);
+  for (int r = 0; r < keepRows; ++r) {
+    const Cell *src = buf->cells.constData() + buf->rowMap.at(r + skip) * oldCols;
+    std::copy(src, src + keepCols, cells.data() + r * cols);
+  }
+  buf->cells = cells;
+  buf->rowMap.resize(rows);
+  for (int r = 0; r < rows; ++r) {
+    buf->rowMap[r] = r;
+  }
+  buf->wrapped = QVector<bool>(rows, false);
+}
+
+#ifdef HAVE_LIBVTERM
+void ScreenModel::attach(VTermState *state) {
+  callbacks_ = {};
+  callbacks_.putglyph = [](VTermGlyphInfo *info, VTermPos pos, void *user) -> int {
+    return static_cast<ScreenModel *>(user)->putGlyph(info, pos);
+  };
+  callbacks_.movecursor = [](VTermPos pos, VTermPos oldpos, int visible, void *user) -> int {
+    Q_UNUSED(oldpos)
+    auto *self = static_cast<ScreenModel *>(user);
+    // Only the implicit move of an autowrap keeps a wrap pending; the cursor
+    // reports its position unchanged at the end of the line before that.
+    if (self->wrapPending_ >= 0 &&
+        (pos.col != self->cols_ - 1 || pos.row < 0 || pos.row >= self->rows_ ||
+         self->buffer().rowMap.at(pos.row) != self->wrapPending_)) {
+      self->wrapPending_ = -1;
+    }
+    self->cursorRow_ = pos.row;
+    self->cursorCol_ = pos.col;
+    self->cursorVisible_ = (visible != 0);
+    return 1;
+  };
+  callbacks_.scrollrect = [](VTermRect rect, int downward, int rightward, void *user) -> int {
+    return static_cast<ScreenModel *>(user)->scrollRect(rect, downward, rightward);
+  };
+  callbacks_.moverect = [](VTermRect dest, VTermRect src, void *user) -> int {
+    return static_cast<ScreenModel *>(user)->moveRect(dest, src);
+  };
+  callbacks_.erase = [](VTermRect rect, int selective, void *user) -> int {
+    Q_UNUSED(selective)
+    return static_cast<ScreenModel *>(user)->erase(rect);
+  };
+  callbacks_.initpen = [](void *user) -> int {
+    static_cast<ScreenModel *>(user)->pen_ = Cell();
+    return 1;
+  };
+  callbacks_.setpenattr = [](VTermAttr attr, VTermValue *val, void *user) -> int {
+    return static_cast<ScreenModel *>(user)->setPenAttr(attr, val);
+  };
+  callbacks_.settermprop = [](VTermProp prop, VTermValue *val, void *user) -> int {
+    return static_cast<ScreenModel *>(user)->setTermProp(prop, val);
+  };
+  callbacks_.bell = [](void *user) -> int {
+    Q_UNUSED(user)
+    return 1;
+  };
+  callbacks_.resize = [](int rows, int cols, VTermStateFields *fields, void *user) -> int {
+    return static_cast<ScreenModel *>(user)->resize(rows, cols, fields);
+  };
+  vterm_state_set_callbacks(state, &callbacks_, this);
+}
+
+quint32 ScreenModel::internCluster(const uint32_t *chars) {
+  int n = 0;
+  while (n < VTERM_MAX_CHARS_PER_CELL && chars[n]) {
+    ++n;
+  }
+  const QString text = QString::fromUcs4(reinterpret_cast<const uint *>(chars), n);
+  auto it = clusterIds_.constFind(text);
+  if (it != clusterIds_.constEnd()) {
+    return it.value();
+  }
+  if (freeClusters_.isEmpty() && clusters_.size() >= kMaxClusters) {
+    reclaimClusters();
+  }
+  quint32 id = kNoCluster;
+  if (!freeClusters_.isEmpty()) {
+    id = freeClusters_.takeLast();
+    clusters_[int(id)] = text;
+    clusterLines_[int(id)] = -1;
+  } else if (clusters_.size() < kMaxClusters) {
+    id = quint32(clusters_.size());
+    clusters_.append(text);
+    clusterLines_.append(-1);
+  } else {
+    // Every id is still in use; the cell shows its base character.
+    return kNoCluster;
+  }
+  clusterIds_.insert(text, id);
+  return id;
+}
+
+void ScreenModel::reclaimClusters() {
+  // After a sweep that found every cluster live, rescan only once the
+  // scrollback has dropped lines or enough new clusters were turned away.
+  const qint64 begin = scrollback_->begin();
+  if (begin == sweptBegin_ && ++missesSinceSweep_ < kMaxClusters / 16) {
+    return;
+  }
+  missesSinceSweep_ = 0;
+
+  QVector<bool> live(clusters_.size(), false);
+  for (const Buffer *buf : {&mainBuf_, &altBuf_}) {
+    for (const Cell &cell : buf->cells) {
+      if ((cell.glyph & Cell::Cluster) && int(cell.codepoint()) < live.size()) {
+        live[int(cell.codepoint())] = true;
+      }
+    }
+  }
+  for (int id = 0; id < clusters_.size(); ++id) {
+    if (!live.at(id) && clusterLines_.at(id) < begin) {
+      clusterIds_.remove(clusters_.at(id));
+      clusters_[id].clear();
+      freeClusters_.append(quint32(id));
+    }
+  }
+  sweptBegin_ = freeClusters_.isEmpty() ? begin : -1;
+}
+
+void ScreenModel::saveLine(const Cell *cells, int cols, bool wrapped) {
+  const qint64 line = scrollback_->end();
+  scrollback_->push(cells, cols, wrapped);
+  if (scrollback_->end() == line) {
+    return;
+  }
+  for (int c = 0; c < cols; ++c) {
+    if ((cells[c].glyph & Cell::Cluster) && int(cells[c].codepoint()) < clusterLines_.size()) {
+      clusterLines_[int(cells[c].codepoint())] = line;
+    }
+  }
+}
+
+quint32 ScreenModel::packColor(const VTermColor &col) {
+  if (VTERM_COLOR_IS_DEFAULT_FG(&col) || VTERM_COLOR_IS_DEFAULT_BG(&col)) {
+    return CellColor::Default;
+  }
+  if (VTERM_COLOR_IS_INDEXED(&col)) {
+    return CellColor::indexed(col.indexed.idx);
+  }
+  return CellColor::rgb(col.rgb.red, col.rgb.green, col.rgb.blue);
+}
+
+int ScreenModel::putGlyph(const VTermGlyphInfo *info, VTermPos pos) {
+  if (pos.row < 0 || pos.row >= rows_ || pos.col < 0 || pos.col >= cols_) {
+    return 0;
+  }
+  // A glyph at the start of the row below one that was written up to its
+  // end, with the cursor not moved in between, is where libvterm wrapped.
+  Buffer &buf = buffer();
+  if (wrapPending_ >= 0) {
+    if (pos.col == 0 && pos.row > 0 && buf.rowMap.at(pos.row - 1) == wrapPending_) {
+      buf.wrapped[wrapPending_] = true;
+    }
+    wrapPending_ = -1;
+  }
+  Cell *line = mutableRow(pos.row);
+  splitWide(line, pos.row, pos.col);
+  if (info->width == 2 && pos.col + 1 < cols_) {
+    splitWide(line, pos.row, pos.col + 1);
+  }
+  Cell &cell = line[pos.col];
+  const quint32 id = (info->chars[0] && info->chars[1]) ? internCluster(info->chars) : kNoCluster;
+  if (id != kNoCluster) {
+    cell.glyph = id | Cell::Cluster;
+  } else {
+    cell.glyph = info->chars[0] & Cell::CodepointMask;
+  }
+  cell.glyph |= pen_.attrs();
+  cell.fg = pen_.fg;
+  cell.bg = pen_.bg;
+  int end = pos.col + 1;
+  if (info->width == 2 && end < cols_) {
+    cell.glyph |= Cell::Wide;
+    Cell &tail = line[end];
+    tail.glyph = Cell::WideTail | pen_.attrs();
+    tail.fg = pen_.fg;
+    tail.bg = pen_.bg;
+    ++end;
+  }
+  // A double-width glyph also wraps when a single column is left.
+  if (end >= cols_ - 1) {
+    wrapPending_ = buf.rowMap.at(pos.row);
+  }
+  damage(pos.row, pos.col, end);
+  return 1;
+}
+
+// Overwriting either half of a double-width glyph leaves the other half
+// blank, as a real terminal would.
+void ScreenModel::splitWide(Cell *line, int row, int col) {
+  const quint32 glyph = line[col].glyph;
+  if ((glyph & Cell::WideTail) && col > 0) {
+    line[col - 1].glyph &= Cell::AttrMask;
+    damage(row, col - 1, col);
+  }
+  if ((glyph & Cell::Wide) && col + 1 < cols_) {
+    line[col + 1].glyph &= Cell::AttrMask;
+    damage(row, col + 1, col + 2);
+  }
+}
+
+int ScreenModel::scrollRect(VTermRect rect, int downward, int rightward) {
+  // Only whole-line scrolls are row rotations; anything else falls back to
+  // libvterm's moverect + erase.
+  if (rightward != 0 || rect.start_col != 0 || rect.end_col != cols_) {
+    return 0;
+  }
+  const int height = rect.end_row - rect.start_row;
+  const int n = qMin(qAbs(downward), height);
+  if (n == 0) {
+    return 1;
+  }
+  Buffer &buf = buffer();
+  QVector<int> &map = buf.rowMap;
+  const Cell blank = blankCell();
+  // Pending damage travels with the rows it belongs to; only the exposed
+  // rows are new.
+  if (downward > 0) {
+    // Like xterm, only scrolls of a region at the top of the main screen
+    // save lines; a status line below the region does not stop that.
+    if (!alt_ && rect.start_row == 0) {
+      for (int r = 0; r < n; ++r) {
+        saveLine(row(r), cols_, buf.wrapped.at(map.at(r)));
+      }
+    }
+    std::rotate(map.begin() + rect.start_row, map.begin() + rect.start_row + n, map.begin() + rect.end_row);
+    std::rotate(damage_.begin() + rect.start_row, damage_.begin() + rect.start_row + n,
+                damage_.begin() + rect.end_row);
+    for (int r = rect.end_row - n; r < rect.end_row; ++r) {
+      fillRow(r, 0, cols_, blank);
+      buf.wrapped[map.at(r)] = false;
+    }
+    damageRows(rect.end_row - n, rect.end_row);
+    if (n < height) {
+      recordMove(Move{rect.start_row, rect.start_row + n, height - n, 0, 0, cols_});
+    }
+  } else {
+    std::rotate(map.begin() + rect.start_row, map.begin() + rect.end_row - n, map.begin() + rect.end_row);
+    std::rotate(damage_.begin() + rect.start_row, damage_.begin() + rect.end_row - n,
+                damage_.begin() + rect.end_row);
+    for (int r = rect.start_row; r < rect.start_row + n; ++r) {
+      fillRow(r, 0, cols_, blank);
+      buf.wrapped[map.at(r)] = false;
+    }
+    damageRows(rect.start_row, rect.start_row + n);
+    if (n < height) {
+      recordMove(Move{rect.start_row + n, rect.start_row, height - n, 0, 0, cols_});
+    }
+  }
+  return 1;
+}
+
+int ScreenModel::moveRect(VTermRect dest, VTermRect src) {
+  const int height = src.end_row - src.start_row;
+  const int width = src.end_col - src.start_col;
+  if (height <= 0 || width <= 0) {
+    return 1;
+  }
+  // Copy in the direction that never overwrites rows still to be read. A
+  // destination row only needs repainting if its source row was damaged.
+  const bool upward = dest.start_row < src.start_row;
+  Buffer &buf = buffer();
+  for (int i = 0; i < height; ++i) {
+    const int offset = upward ? i : height - 1 - i;
+    Cell *to = mutableRow(dest.start_row + offset) + dest.start_col;
+    const Cell *from = mutableRow(src.start_row + offset) + src.start_col;
+    std::memmove(static_cast<void *>(to), from, size_t(width) * sizeof(Cell));
+    if (width == cols_) {
+      buf.wrapped[buf.rowMap.at(dest.start_row + offset)] = buf.wrapped.at(buf.rowMap.at(src.start_row + offset));
+    }
+    const Span &srcDamage = damage_[src.start_row + offset];
+    if (srcDamage.start < srcDamage.end) {
+      damage(dest.start_row + offset, dest.start_col, dest.end_col);
+    }
+  }
+  recordMove(Move{dest.start_row, src.start_row, height, dest.start_col, src.start_col, width});
+  return 1;
+}
+
+int ScreenModel::erase(VTermRect rect) {
+  const Cell blank = blankCell();
+  const int startCol = qBound(0, rect.start_col, cols_);
+  const int endCol = qBound(0, rect.end_col, cols_);
+  Buffer &buf = buffer();
+  for (int r = qMax(0, rect.start_row); r < qMin(rows_, rect.end_row); ++r) {
+    fillRow(r, startCol, endCol, blank);
+    damage(r, startCol, endCol);
+    // A row erased to its end no longer runs on into the next one.
+    if (endCol == cols_) {
+      buf.wrapped[buf.rowMap.at(r)] = false;
+    }
+  }
+  return 1;
+}
+
+int ScreenModel::setPenAttr(VTermAttr attr, const VTermValue *val) {
+  auto setFlag = [this](quint32 flag, bool on) {
+    pen_.glyph = on ? (pen_.glyph | flag) : (pen_.glyph & ~flag);
+  };
+  switch (attr) {
+    case VTERM_ATTR_BOLD:
+      setFlag(Cell::Bold, val->boolean);
+      break;
+    case VTERM_ATTR_UNDERLINE:
+      pen_.glyph = (pen_.glyph & ~quint32(Cell::UnderlineMask)) |
+                   ((quint32(val->number) << Cell::UnderlineShift) & Cell::UnderlineMask);
+      break;
+    case VTERM_ATTR_ITALIC:
+      setFlag(Cell::Italic, val->boolean);
+      break;
+    case VTERM_ATTR_BLINK:
+      setFlag(Cell::Blink, val->boolean);
+      break;
+    case VTERM_ATTR_REVERSE:
+      setFlag(Cell::Reverse, val->boolean);
+      break;
+    case VTERM_ATTR_CONCEAL:
+      setFlag(Cell::Conceal, val->boolean);
+      break;
+    case VTERM_ATTR_STRIKE:
+      setFlag(Cell::Strike, val->boolean);
+      break;
+    case VTERM_ATTR_FOREGROUND:
+      pen_.fg = packColor(val->color);
+      break;
+    case VTERM_ATTR_BACKGROUND:
+      pen_.bg = packColor(val->color);
+      break;
+    default:
+      break;
+  }
+  return 1;
+}
+
+int ScreenModel::setTermProp(VTermProp prop, const VTermValue *val) {
+  switch (prop) {
+    case VTERM_PROP_CURSORVISIBLE:
+      cursorVisible_ = val->boolean;
+      break;
+    case VTERM_PROP_ALTSCREEN:
+      if (bool(val->boolean) == alt_) {
+        break;
+      }
+      if (val->boolean) {
+        resizeBuffer(&altBuf_, 0, 0, rows_, cols_, 0);
+      } else {
+        // The alternate screen is erased on every entry; don't keep it around.
+        altBuf_ = Buffer();
+      }
+      alt_ = val->boolean;
+      damageRows(0, rows_);
+      break;
+    case VTERM_PROP_REVERSE:
+      reverse_ = val->boolean;
+      damageRows(0, rows_);
+      break;
+    default:
+      break;
+  }
+  return 1;
+}
+
+int ScreenModel::resize(int rows, int cols, VTermStateFields *fields) {
+  if (alt_) {
+    // Full-screen programs redraw on a resize; only keep the cursor row
+    // visible.
+    const int skip = qBound(0, fields->pos.row + 1 - rows, rows_);
+    resizeBuffer(&mainBuf_, rows_, cols_, rows, cols, 0);
+    resizeBuffer(&altBuf_, rows_, cols_, rows, cols, skip);
+    fields->pos.row -= skip;
+  } else {
+    reflow(rows, cols, &fields->pos);
+  }
+  wrapPending_ = -1;
+  rows_ = rows;
+  cols_ = cols;
+  moves_.clear();
+  damage_ = QVector<Span>(rows_, Span{cols_, 0});
+  damageRows(0, rows_);
+  return 1;
+}
+
+// Lays the main screen out again at a new size. Soft-wrapped rows join into
+// lines that are cut again at the new width, down to the cursor or the last
+// row with text. Rows that no longer fit above the cursor go to the
+// scrollback; when the screen has room, lines come back from it instead,
+// keeping as many blank rows under the text as there were.
+void ScreenModel::reflow(int rows, int cols, VTermPos *cursor) {
+  const Buffer &old = mainBuf_;
+  const int cursorRow = qBound(0, cursor->row, rows_ - 1);
+  int last = cursorRow;
+  for (int r = rows_ - 1; r > last; --r) {
+    if (textLength(row(r), cols_) > 0) {
+      last = r;
+      break;
+    }
+  }
+
+  QList<QVector<Cell>> lines;
+  QVector<Cell> line;
+  int cursorLine = 0;
+  int cursorAt = 0;
+  for (int r = 0; r <= last; ++r) {
+    const Cell *cells = row(r);
+    const bool wrapped = r < last && old.wrapped.at(old.rowMap.at(r));
+    if (r == cursorRow) {
+      cursorLine = lines.size();
+      cursorAt = line.size() + qBound(0, cursor->col, cols_ - 1);
+    }
+    const int n = wrapped ? cols_ : textLength(cells, cols_);
+    const int at = line.size();
+    line.resize(at + n);
+    std::copy(cells, cells + n, line.begin() + at);
+    if (!wrapped) {
+      lines.append(line);
+      line.clear();
+    }
+  }
+  if (lines[cursorLine].size() <= cursorAt) {
+    lines[cursorLine].resize(cursorAt + 1);
+  }
+
+  auto rowsOf = [cols](const QVector<Cell> &l) { return wrapPoints(l.constData(), l.size(), cols).size(); };
+  int total = 0;
+  for (const QVector<Cell> &l : lines) {
+    total += rowsOf(l);
+  }
+  const int target = rows - (rows_ - 1 - last);
+  QVector<Cell> popped;
+  bool poppedWrapped = false;
+  while (total < target && scrollback_->pop(&popped, &poppedWrapped)) {
+    if (poppedWrapped) {
+      // The newest saved line ran on into the top row.
+      total -= rowsOf(lines.first());
+      lines.first() = popped + lines.first();
+      total += rowsOf(lines.first());
+      if (cursorLine == 0) {
+        cursorAt += popped.size();
+      }
+    } else {
+      lines.prepend(popped);
+      total += rowsOf(popped);
+      ++cursorLine;
+    }
+  }
+
+  struct Piece {
+    int line;
+    int start;
+    int end;
+    bool wrapped;
+  };
+  QVector<Piece> pieces;
+  int newRow = 0;
+  int newCol = 0;
+  for (int i = 0; i < lines.size(); ++i) {
+    const QVector<Cell> &l = lines.at(i);
+    const QVector<int> starts = wrapPoints(l.constData(), l.size(), cols);
+    for (int k = 0; k < starts.size(); ++k) {
+      const bool wrapped = k + 1 < starts.size();
+      const int end = wrapped ? starts.at(k + 1) : l.size();
+      if (i == cursorLine && cursorAt >= starts.at(k) && (!wrapped || cursorAt < end)) {
+        newRow = pieces.size();
+        newCol = qMin(cursorAt - starts.at(k), cols - 1);
+      }
+      pieces.append(Piece{i, starts.at(k), end, wrapped});
+    }
+  }
+
+  const int skip = qMin(qMax(0, pieces.size() - rows), newRow);
+  Buffer buf;
+  resizeBuffer(&buf, 0, 0, rows, cols, 0);
+  QVector<Cell> pushed(cols);
+  for (int r = 0; r < qMin(pieces.size(), skip + rows); ++r) {
+    const Piece &piece = pieces.at(r);
+    const Cell *from = lines.at(piece.line).constData() + piece.start;
+    Cell *to = r < skip ? pushed.data() : buf.cells.data() + (r - skip) * cols;
+    std::fill(std::copy(from, from + (piece.end - piece.start), to), to + cols, Cell());
+    if (r < skip) {
+      saveLine(to, cols, piece.wrapped);
+    } else {
+      buf.wrapped[r - skip] = piece.wrapped;
+    }
+  }
+  mainBuf_ = buf;
+  cursor->row = newRow - skip;
+  cursor->col = newCol;
+}
+#endif
@@ -0,0 +1,444 @@
+#include "Scrollback.h"
+
+#include <QDir>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Flags in the first byte of an encoded line.
+constexpr char kAsciiLine = 1;
+constexpr char kWrappedLine = 2;
+
+// Everything in Cell::glyph except the rendition flags, which go in runs.
+constexpr quint32 kGlyphBits = ~quint32(Cell::AttrMask);
+constexpr int kAttrShift = 21;
+
+// First line and line count at the start of a spilled block's image.
+constexpr int kImageHeader = int(sizeof(qint64) + sizeof(qint32));
+
+void putVarint(QByteArray *out, quint32 value) {
+  while (value >= 0x80) {
+    out->append(char(value | 0x80));
+    value >>= 7;
+  }
+  out->append(char(value));
+}
+
+quint32 getVarint(const uchar *&p, const uchar *end) {
+  quint32 value = 0;
+  for (int shift = 0; p < end && shift < 32; shift += 7) {
+    const uchar byte = *p++;
+    value |= quint32(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return value;
+}
+
+bool isTrailingBlank(const Cell &cell) {
+  return (cell.glyph == 0 || cell.glyph == ' ') && CellColor::isDefault(cell.fg) && CellColor::isDefault(cell.bg);
+}
+
+bool sameStyle(const Cell &a, const Cell &b) {
+  return a.attrs() == b.attrs() && a.fg == b.fg && a.bg == b.bg;
+}
+
+} // namespace
+
+Scrollback::Scrollback(int maxLines, qint64 maxBytes) {
+  setLimits(maxLines, maxBytes);
+}
+
+void Scrollback::setLimits(int maxLines, qint64 maxBytes) {
+  maxLines_ = qMax(0, maxLines);
+  maxBytes_ = qMax<qint64>(kBlockSize, maxBytes);
+  if (maxLines_ == 0) {
+    clear();
+  } else {
+    trim();
+  }
+}
+
+void Scrollback::setSpillEnabled(bool enabled) {
+  spill_ = enabled;
+}
+
+qint64 Scrollback::residentBytes() const {
+  qint64 bytes = 0;
+  for (int i = blocks_.size() - 1; i >= 0 && !blocks_.at(i)->cold(); --i) {
+    bytes += blocks_.at(i)->data.capacity();
+  }
+  for (const auto &block : cache_) {
+    bytes += block->data.capacity();
+  }
+  return bytes;
+}
+
+void Scrollback::push(const Cell *cells, int cols, bool wrapped) {
+  if (maxLines_ == 0) {
+    return;
+  }
+  encode(cells, cols, wrapped, &scratch_);
+  const int size = scratch_.size();
+  if (blocks_.isEmpty() || blocks_.last()->cold() ||
+      (blocks_.last()->lines > 0 &&
+       (blocks_.last()->data.size() + size > kBlockSize || blocks_.last()->cols != cols))) {
+    auto block = std::make_shared<Block>();
+    block->first = end_;
+    block->cols = cols;
+    blocks_.append(block);
+    // Cold blocks always come before hot ones, so walking back from the
+    // newest sealed block past the hot window finds every block to spill.
+    for (int i = blocks_.size() - 2 - kHotBlocks; i >= 0 && spill_ && !fileFailed_; --i) {
+      Block *sealed = blocks_.at(i).get();
+      if (sealed->cold()) {
+        break;
+      }
+      spill(sealed);
+    }
+  }
+  Block &block = *blocks_.last();
+  const int capacity = block.data.capacity();
+  if (block.lines == 0) {
+    block.data.reserve(qMax(kBlockSize, size));
+  }
+  block.starts.append(quint16(block.data.size()));
+  block.data.append(scratch_);
+  ++block.lines;
+  bytes_ += block.data.capacity() - capacity;
+  ++end_;
+  trim();
+}
+
+bool Scrollback::pop(QVector<Cell> *cells, bool *wrapped) {
+  if (isEmpty()) {
+    return false;
+  }
+  const std::shared_ptr<Block> &last = blocks_.last();
+  if (last->cold()) {
+    // Popping back into spilled history: bring the block back in memory for
+    // good so it can shrink again.
+    if (!load(last)) {
+      return false;
+    }
+    uncache(last.get());
+    release(last.get());
+    bytes_ += last->data.capacity();
+  }
+  Block &block = *last;
+  const int start = block.starts.takeLast();
+  decode(block.data.constData() + start, block.data.size() - start, cells, wrapped);
+  --block.lines;
+  --end_;
+  if (block.lines == 0) {
+    bytes_ -= block.data.capacity();
+    blocks_.removeLast();
+  } else {
+    const int capacity = block.data.capacity();
+    block.data.truncate(start);
+    bytes_ += block.data.capacity() - capacity;
+  }
+  return true;
+}
+
+bool Scrollback::line(qint64 index, QVector<Cell> *cells, bool *wrapped) const {
+  int slot = 0;
+  const int at = find(index, &slot);
+  if (at < 0) {
+    return false;
+  }
+  const std::shared_ptr<Block> &block = blocks_.at(at);
+  if (block->cold() && !load(block)) {
+    return false;
+  }
+  const int start = block->starts.at(slot);
+  const int stop = slot + 1 < block->lines ? block->starts.at(slot + 1) : block->data.size();
+  decode(block->data.constData() + start, stop - start, cells, wrapped);
+  return true;
+}
+
+int Scrollback::width(qint64 index, qint64 *first, qint64 *last) const {
+  int slot = 0;
+  const int at = find(index, &slot);
+  if (at < 0) {
+    return 0;
+  }
+  const Block &block = *blocks_.at(at);
+  if (first) {
+    *first = qMax(block.first, begin_);
+  }
+  if (last) {
+    *last = block.first + block.lines;
+  }
+  return block.cols;
+}
+
+void Scrollback::clear() {
+  blocks_.clear();
+  cache_.clear();
+  freeSlots_.clear();
+  slotCount_ = 0;
+  if (file_.isOpen()) {
+    file_.resize(0);
+  }
+  begin_ = end_;
+  bytes_ = 0;
+}
+
+int Scrollback::find(qint64 index, int *slot) const {
+  if (index < begin_ || index >= end_) {
+    return -1;
+  }
+  const auto it = std::upper_bound(blocks_.cbegin(), blocks_.cend(), index,
+                                   [](qint64 i, const std::shared_ptr<Block> &block) { return i < block->first; });
+  const int at = int(it - blocks_.cbegin()) - 1;
+  *slot = int(index - blocks_.at(at)->first);
+  return at;
+}
+
+// Drops whole blocks from the old end; the block being filled always stays.
+void Scrollback::trim() {
+  while (blocks_.size() > 1 && (size() > maxLines_ || bytes_ > maxBytes_)) {
+    Block *block = blocks_.first().get();
+    if (block->cold()) {
+      uncache(block);
+      release(block);
+    } else {
+      bytes_ -= block->data.capacity();
+    }
+    blocks_.removeFirst();
+    begin_ = blocks_.first()->first;
+  }
+}
+
+// Compresses a sealed block into file slots and drops its memory. The image
+// starts with the block's first line and line count, which tells a reader on
+// another thread whether the slots still hold this block, followed by the line
+// offsets and the data. On a write error the block stays hot and spilling
+// stops.
+void Scrollback::spill(Block *block) {
+  if (!file_.isOpen()) {
+    file_.setFileTemplate(QDir::tempPath() + "/sshterminal-scrollback-XXXXXX");
+    if (!file_.open()) {
+      fileFailed_ = true;
+      return;
+    }
+  }
+  const qint32 lines = block->lines;
+  QByteArray raw;
+  raw.reserve(kImageHeader + lines * int(sizeof(quint16)) + block->data.size());
+  raw.append(reinterpret_cast<const char *>(&block->first), sizeof(block->first));
+  raw.append(reinterpret_cast<const char *>(&lines), sizeof(lines));
+  raw.append(reinterpret_cast<const char *>(block->starts.constData()), lines * int(sizeof(quint16)));
+  raw.append(block->data);
+  const QByteArray packed = qCompress(raw, 1);
+
+  QVector<quint32> slots;
+  for (int at = 0; at < packed.size(); at += kSlotSize) {
+    const quint32 slot = freeSlots_.isEmpty() ? slotCount_++ : freeSlots_.takeLast();
+    slots.append(slot);
+    const int length = qMin(kSlotSize, packed.size() - at);
+    if (!file_.seek(qint64(slot) * kSlotSize) || file_.write(packed.constData() + at, length) != length) {
+      freeSlots_ += slots;
+      fileFailed_ = true;
+      return;
+    }
+  }
+  // Readers on other threads open the file separately.
+  file_.flush();
+  bytes_ += qint64(slots.size()) * kSlotSize - block->data.capacity();
+  block->slots = slots;
+  block->packedSize = packed.size();
+  block->data = QByteArray();
+  block->starts = QVector<quint16>();
+}
+
+// Reads a cold block back into memory and makes it the most recently used
+// entry of the cache, evicting the oldest one past kCachedBlocks.
+bool Scrollback::load(const std::shared_ptr<Block> &block) const {
+  if (!block->data.isEmpty()) {
+    cache_.removeOne(block);
+    cache_.append(block);
+    return true;
+  }
+  if (!unpack(&file_, block->slots, block->packedSize, block->first, block->lines, &block->data, &block->starts)) {
+    return false;
+  }
+  cache_.append(block);
+  while (cache_.size() > kCachedBlocks) {
+    const std::shared_ptr<Block> evicted = cache_.takeFirst();
+    evicted->data = QByteArray();
+    evicted->starts = QVector<quint16>();
+  }
+  return true;
+}
+
+bool Scrollback::unpack(QIODevice *file, const QVector<quint32> &slots, int packedSize, qint64 first, int lines,
+                        QByteArray *data, QVector<quint16> *starts) {
+  QByteArray packed(packedSize, Qt::Uninitialized);
+  for (int i = 0; i < slots.size(); ++i) {
+    const int at = i * kSlotSize;
+    const int length = qMin(kSlotSize, packed.size() - at);
+    if (!file->seek(qint64(slots.at(i)) * kSlotSize) || file->read(packed.data() + at, length) != length) {
+      return false;
+    }
+  }
+  QByteArray raw = qUncompress(packed);
+  const int index = kImageHeader + lines * int(sizeof(quint16));
+  qint64 imageFirst = 0;
+  qint32 imageLines = 0;
+  if (raw.size() <= index) {
+    return false;
+  }
+  std::memcpy(&imageFirst, raw.constData(), sizeof(imageFirst));
+  std::memcpy(&imageLines, raw.constData() + sizeof(imageFirst), sizeof(imageLines));
+  if (imageFirst != first || imageLines != lines) {
+    return false;
+  }
+  starts->resize(lines);
+  std::memcpy(starts->data(), raw.constData() + kImageHeader, size_t(lines) * sizeof(quint16));
+  *data = raw.remove(0, index);
+  return true;
+}
+
+QVector<Scrollback::Segment> Scrollback::segments(qint64 from) const {
+  QVector<Segment> out;
+  int slot = 0;
+  int at = find(qMax(from, begin_), &slot);
+  for (; at >= 0 && at < blocks_.size(); ++at) {
+    const Block &block = *blocks_.at(at);
+    Segment segment;
+    segment.first = block.first;
+    segment.lines = block.lines;
+    if (block.cold()) {
+      segment.slots = block.slots;
+      segment.packedSize = block.packedSize;
+    } else {
+      segment.data = block.data;
+      segment.starts = block.starts;
+    }
+    out.append(segment);
+  }
+  return out;
+}
+
+QString Scrollback::fileName() const {
+  return file_.isOpen() ? file_.fileName() : QString();
+}
+
+bool Scrollback::readSegment(QIODevice *file, Segment *segment) {
+  if (segment->slots.isEmpty()) {
+    return true;
+  }
+  return unpack(file, segment->slots, segment->packedSize, segment->first, segment->lines, &segment->data,
+                &segment->starts);
+}
+
+bool Scrollback::asciiText(const char *data, int size, const char **text, int *length) {
+  const auto *p = reinterpret_cast<const uchar *>(data);
+  const uchar *end = p + size;
+  if (p >= end || !(*p++ & kAsciiLine)) {
+    return false;
+  }
+  const int n = int(qMin<quint32>(getVarint(p, end), quint32(end - p)));
+  *text = reinterpret_cast<const char *>(p);
+  *length = n;
+  return true;
+}
+
+// Returns a cold block's slots to the free list.
+void Scrollback::release(Block *block) {
+  bytes_ -= qint64(block->slots.size()) * kSlotSize;
+  freeSlots_ += block->slots;
+  block->slots.clear();
+  block->packedSize = 0;
+}
+
+void Scrollback::uncache(Block *block) const {
+  for (int i = 0; i < cache_.size(); ++i) {
+    if (cache_.at(i).get() == block) {
+      cache_.removeAt(i);
+      return;
+    }
+  }
+}
+
+// Layout: flags, cell count, text (a byte per cell for ASCII lines, else a
+// varint of the glyph bits per cell), then attribute runs as (length,
+// rendition, fg, bg) varints. A line in default colours has no runs. A
+// wrapped line keeps its trailing blanks, which belong to the text it joins.
+void Scrollback::encode(const Cell *cells, int cols, bool wrapped, QByteArray *out) {
+  out->clear();
+  int n = cols;
+  while (!wrapped && n > 0 && isTrailingBlank(cells[n - 1])) {
+    --n;
+  }
+  bool ascii = true;
+  int runs = n > 0 ? 1 : 0;
+  for (int i = 0; i < n; ++i) {
+    ascii = ascii && (cells[i].glyph & kGlyphBits) < 0x80;
+    if (i > 0 && !sameStyle(cells[i], cells[i - 1])) {
+      ++runs;
+    }
+  }
+  if (runs == 1 && sameStyle(cells[0], Cell())) {
+    runs = 0;
+  }
+
+  out->append(char((ascii ? kAsciiLine : 0) | (wrapped ? kWrappedLine : 0)));
+  putVarint(out, quint32(n));
+  for (int i = 0; i < n; ++i) {
+    if (ascii) {
+      out->append(char(cells[i].glyph & 0x7f));
+    } else {
+      putVarint(out, cells[i].glyph & kGlyphBits);
+    }
+  }
+  putVarint(out, quint32(runs));
+  for (int start = 0; runs > 0 && start < n;) {
+    int stop = start + 1;
+    while (stop < n && sameStyle(cells[stop], cells[start])) {
+      ++stop;
+    }
+    putVarint(out, quint32(stop - start));
+    putVarint(out, cells[start].attrs() >> kAttrShift);
+    putVarint(out, cells[start].fg);
+    putVarint(out, cells[start].bg);
+    start = stop;
+  }
+}
+
+void Scrollback::decode(const char *data, int size, QVector<Cell> *cells, bool *wrapped) {
+  const auto *p = reinterpret_cast<const uchar *>(data);
+  const uchar *end = p + size;
+  const uchar flags = p < end ? *p++ : 0;
+  const bool ascii = flags & kAsciiLine;
+  if (wrapped) {
+    *wrapped = flags & kWrappedLine;
+  }
+  // Every cell takes at least one byte, which bounds a corrupt count.
+  const int n = int(qMin<quint32>(getVarint(p, end), quint32(end - p)));
+  cells->resize(n);
+  Cell *out = cells->data();
+  for (int i = 0; i < n; ++i) {
+    out[i] = Cell();
+    out[i].glyph = ascii ? (p < end ? *p++ : 0) : getVarint(p, end);
+  }
+  const quint32 runs = getVarint(p, end);
+  int at = 0;
+  for (quint32 r = 0; r < runs && at < n; ++r) {
+    const int length = int(qMin<quint32>(getVarint(p, end), quint32(n - at)));
+    const quint32 attrs = (getVarint(p, end) << kAttrShift) & Cell::AttrMask;
+    const quint32 fg = getVarint(p, end);
+    const quint32 bg = getVarint(p, end);
+    for (int i = at; i < at + length; ++i) {
+      out[i].glyph |= attrs;
+      out[i].fg = fg;
+      out[i].bg = bg;
+    }
+    at += length;
+  }
+}
@@ -0,0 +1,240 @@
+#include "ScrollbackLayout.h"
+
+#include <algorithm>
+
+void ScrollbackLayout::reset(int cols) {
+  cols_ = qMax(1, cols);
+  entries_.clear();
+  end_ = -1;
+  bottom_ = 0;
+  joinedFirst_ = -1;
+  joinedLast_ = -1;
+}
+
+int ScrollbackLayout::available(const Scrollback &history, int want) {
+  sync(history);
+  auto laidOut = [this]() { return entries_.empty() ? 0 : bottom_ - entries_.front().top; };
+  while (laidOut() < want && growBack(history)) {
+  }
+  return int(qMin<qint64>(want, laidOut()));
+}
+
+bool ScrollbackLayout::row(const Scrollback &history, int n, Row *out) {
+  sync(history);
+  if (n < 0) {
+    return false;
+  }
+  const qint64 coord = bottom_ - 1 - n;
+  while (entries_.empty() || coord < entries_.front().top) {
+    if (!growBack(history)) {
+      return false;
+    }
+  }
+  const Entry &entry = entries_.at(size_t(entryAt(coord)));
+  const int i = int(coord - entry.top);
+  if (entry.direct) {
+    *out = Row{entry.first + i, entry.first + i + 1, 0, cols_};
+    return true;
+  }
+  const QVector<int> &rows = join(history, entry.first, entry.last);
+  const int stop = i + 1 < rows.size() ? rows.at(i + 1) : joined_.size();
+  *out = Row{entry.first, entry.last, rows.at(i), stop - rows.at(i)};
+  return true;
+}
+
+int ScrollbackLayout::rowOf(const Scrollback &history, qint64 line, int col) {
+  sync(history);
+  if (line < history.begin() || line >= history.end()) {
+    return -1;
+  }
+  while (entries_.empty() || line < entries_.front().first) {
+    if (!growBack(history)) {
+      return -1;
+    }
+  }
+  const auto it = std::upper_bound(entries_.cbegin(), entries_.cend(), line,
+                                   [](qint64 l, const Entry &entry) { return l < entry.first; }) - 1;
+  qint64 coord = it->top;
+  if (it->direct) {
+    coord += line - it->first;
+  } else {
+    const QVector<int> &rows = join(history, it->first, it->last);
+    const int at = joinedStarts_.at(int(line - it->first)) + col;
+    coord += int(std::upper_bound(rows.cbegin(), rows.cend(), at) - rows.cbegin()) - 1;
+  }
+  return int(bottom_ - 1 - coord);
+}
+
+void ScrollbackLayout::cells(const Scrollback &history, const Row &row, QVector<Cell> *out) {
+  if (row.last == row.line + 1) {
+    if (!history.line(row.line, out)) {
+      out->clear();
+    }
+    out->remove(0, qMin(row.offset, out->size()));
+  } else {
+    join(history, row.line, row.last);
+    *out = joined_.mid(row.offset, row.length);
+  }
+  out->resize(qMin(out->size(), row.length));
+  out->resize(cols_);
+}
+
+void ScrollbackLayout::pieces(const Scrollback &history, const Row &row, QVector<Piece> *out) {
+  out->clear();
+  if (row.last == row.line + 1) {
+    out->append(Piece{row.line, row.offset, 0, row.length});
+    return;
+  }
+  join(history, row.line, row.last);
+  for (int i = 0; i < joinedStarts_.size(); ++i) {
+    const int start = joinedStarts_.at(i);
+    const int stop = i + 1 < joinedStarts_.size() ? joinedStarts_.at(i + 1) : joined_.size();
+    const int from = qMax(start, row.offset);
+    const int to = qMin(stop, row.offset + row.length);
+    if (from < to) {
+      out->append(Piece{row.line + i, from - start, from - row.offset, to - from});
+    }
+  }
+}
+
+// Forgets rows whose lines were dropped and lays out the lines pushed since
+// the last call. Lines taken back out of the scrollback, which only a resize
+// does, start the layout over.
+void ScrollbackLayout::sync(const Scrollback &history) {
+  if (end_ < 0 || history.end() < end_) {
+    entries_.clear();
+    end_ = history.end();
+    joinedFirst_ = -1;
+    joinedLast_ = -1;
+    return;
+  }
+  while (!entries_.empty() && entries_.front().first < history.begin()) {
+    Entry &front = entries_.front();
+    if (front.direct && front.last > history.begin()) {
+      const int cut = int(history.begin() - front.first);
+      front.first += cut;
+      front.top += cut;
+      front.rows -= cut;
+      break;
+    }
+    entries_.pop_front();
+  }
+  if (history.end() == end_) {
+    return;
+  }
+  qint64 at = qMax(end_, history.begin());
+  // A reflowed line that was still running on takes in what follows it.
+  if (!entries_.empty() && !entries_.back().direct && entries_.back().last == at) {
+    const Entry &back = entries_.back();
+    bool wrapped = false;
+    if (history.width(at) == history.width(back.first) && history.line(at - 1, &scratch_, &wrapped) && wrapped) {
+      at = back.first;
+      bottom_ -= back.rows;
+      entries_.pop_back();
+    }
+  }
+  while (at < history.end()) {
+    qint64 blockLast = 0;
+    const int width = history.width(at, nullptr, &blockLast);
+    const qint64 last = width == cols_ ? blockLast : lineEnd(history, at, history.end(), width);
+    append(history, at, last, width == cols_);
+    at = last;
+  }
+  end_ = history.end();
+}
+
+// Lays out the lines just older than the oldest laid out: the rest of their
+// block if it was pushed at the current width, else the line ending there.
+bool ScrollbackLayout::growBack(const Scrollback &history) {
+  const qint64 last = entries_.empty() ? end_ : entries_.front().first;
+  const qint64 top = entries_.empty() ? bottom_ : entries_.front().top;
+  if (last <= history.begin()) {
+    return false;
+  }
+  qint64 blockFirst = 0;
+  const int width = history.width(last - 1, &blockFirst);
+  if (width == 0) {
+    return false;
+  }
+  if (width == cols_) {
+    const int n = int(last - blockFirst);
+    if (!entries_.empty() && entries_.front().direct) {
+      Entry &front = entries_.front();
+      front.first = blockFirst;
+      front.top -= n;
+      front.rows += n;
+    } else {
+      entries_.push_front(Entry{blockFirst, last, top - n, n, true});
+    }
+    return true;
+  }
+  const qint64 first = lineStart(history, last, width);
+  const int rows = join(history, first, last).size();
+  entries_.push_front(Entry{first, last, top - rows, rows, false});
+  return true;
+}
+
+void ScrollbackLayout::append(const Scrollback &history, qint64 first, qint64 last, bool direct) {
+  if (direct) {
+    const int n = int(last - first);
+    if (!entries_.empty() && entries_.back().direct && entries_.back().last == first) {
+      entries_.back().last = last;
+      entries_.back().rows += n;
+    } else {
+      entries_.push_back(Entry{first, last, bottom_, n, true});
+    }
+    bottom_ += n;
+    return;
+  }
+  const int rows = join(history, first, last).size();
+  entries_.push_back(Entry{first, last, bottom_, rows, false});
+  bottom_ += rows;
+}
+
+// The first line of the wrapped run, pushed at `width`, that ends at `last`.
+qint64 ScrollbackLayout::lineStart(const Scrollback &history, qint64 last, int width) {
+  qint64 first = last - 1;
+  bool wrapped = false;
+  while (first > history.begin() && history.width(first - 1) == width && history.line(first - 1, &scratch_, &wrapped) &&
+         wrapped) {
+    --first;
+  }
+  return first;
+}
+
+// One past the last line of the wrapped run, pushed at `width`, that starts
+// at `first`.
+qint64 ScrollbackLayout::lineEnd(const Scrollback &history, qint64 first, qint64 stop, int width) {
+  qint64 last = first;
+  bool wrapped = false;
+  while (last + 1 < stop && history.line(last, &scratch_, &wrapped) && wrapped && history.width(last + 1) == width) {
+    ++last;
+  }
+  return last + 1;
+}
+
+// Joins lines [first, last) and finds where their rows start, keeping the
+// result for the next rows of the same line.
+const QVector<int> &ScrollbackLayout::join(const Scrollback &history, qint64 first, qint64 last) {
+  if (first == joinedFirst_ && last == joinedLast_) {
+    return joinedRows_;
+  }
+  joined_.clear();
+  joinedStarts_.clear();
+  for (qint64 i = first; i < last; ++i) {
+    joinedStarts_.append(joined_.size());
+    if (history.line(i, &scratch_)) {
+      joined_ += scratch_;
+    }
+  }
+  joinedRows_ = ScreenModel::wrapPoints(joined_.constData(), joined_.size(), cols_);
+  joinedFirst_ = first;
+  joinedLast_ = last;
+  return joinedRows_;
+}
+
+int ScrollbackLayout::entryAt(qint64 coord) const {
+  const auto it = std::upper_bound(entries_.cbegin(), entries_.cend(), coord,
+                                   [](qint64 c, const Entry &entry) { return c < entry.top; });
+  return int(it - entries_.cbegin()) - 1;
+}
@@ -0,0 +1,448 @@
+#include "ScrollbackSearch.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QFile>
+#include <QMutexLocker>
+#include <QThread>
+#include <QtAlgorithms>
+
+#include <algorithm>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SCROLLBACK_SEARCH_SSE2
+#endif
+
+namespace {
+
+const QEvent::Type kResultEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+
+class ResultEvent : public QEvent {
+public:
+  ResultEvent(quint64 generation, const QVector<ScrollbackSearch::Match> &matches, bool done, bool truncated)
+      : QEvent(kResultEvent), generation(generation), matches(matches), done(done), truncated(truncated) {}
+
+  quint64 generation;
+  QVector<ScrollbackSearch::Match> matches;
+  bool done;
+  bool truncated;
+};
+
+bool isLowerAscii(char c) {
+  return c >= 'a' && c <= 'z';
+}
+
+uchar foldByte(uchar c, bool fold) {
+  if (c == 0) {
+    return ' ';
+  }
+  return fold && c >= 'A' && c <= 'Z' ? uchar(c | 0x20) : c;
+}
+
+// Calls hit(i) for every i where data[i] and data[i + k - 1] equal the first
+// and last byte of `anchor`, a cheap filter for where it may start; 16
+// positions at a time with SSE2. With `fold`, letters in the data are
+// compared in lower case.
+template <typename Fn>
+void scanCandidates(const char *data, int size, const char *anchor, int k, bool fold, Fn &&hit) {
+  const uchar first = uchar(anchor[0]);
+  const uchar last = uchar(anchor[k - 1]);
+  const uchar firstFold = fold && isLowerAscii(anchor[0]) ? 0x20 : 0;
+  const uchar lastFold = fold && isLowerAscii(anchor[k - 1]) ? 0x20 : 0;
+  int i = 0;
+#ifdef SCROLLBACK_SEARCH_SSE2
+  const __m128i firstBytes = _mm_set1_epi8(char(first));
+  const __m128i lastBytes = _mm_set1_epi8(char(last));
+  const __m128i firstMask = _mm_set1_epi8(char(firstFold));
+  const __m128i lastMask = _mm_set1_epi8(char(lastFold));
+  for (; i + k - 1 + 16 <= size; i += 16) {
+    const __m128i a = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), firstMask);
+    const __m128i b = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + k - 1)), lastMask);
+    uint mask = uint(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, firstBytes), _mm_cmpeq_epi8(b, lastBytes))));
+    while (mask) {
+      hit(i + qCountTrailingZeroBits(mask));
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i + k <= size; ++i) {
+    if (uchar(data[i] | firstFold) == first && uchar(data[i + k - 1] | lastFold) == last) {
+      hit(i);
+    }
+  }
+}
+
+// Text of a row as searched: blanks as spaces, the tail of a wide glyph
+// skipped and a cluster as its text from `clusters`, or U+FFFD if it is not
+// there. `cols` gets the cell of each QChar.
+void cellText(const Cell *cells, int count, const QVector<QString> &clusters, QString *text, QVector<int> *cols) {
+  text->clear();
+  cols->clear();
+  for (int c = 0; c < count; ++c) {
+    const quint32 glyph = cells[c].glyph;
+    if (glyph & Cell::WideTail) {
+      continue;
+    }
+    if (glyph & Cell::Cluster) {
+      const QString cluster = clusters.value(int(glyph & Cell::CodepointMask));
+      if (!cluster.isEmpty()) {
+        text->append(cluster);
+        cols->insert(cols->size(), cluster.size(), c);
+        continue;
+      }
+    }
+    const uint cp = (glyph & Cell::Cluster) ? 0xfffd : (glyph & Cell::CodepointMask);
+    if (QChar::requiresSurrogates(cp)) {
+      text->append(QChar(QChar::highSurrogate(cp)));
+      text->append(QChar(QChar::lowSurrogate(cp)));
+      cols->append(c);
+      cols->append(c);
+    } else {
+      text->append(cp == 0 ? QChar(' ') : QChar(cp));
+      cols->append(c);
+    }
+  }
+}
+
+bool before(const ScrollbackSearch::Match &a, const ScrollbackSearch::Match &b) {
+  return a.line < b.line || (a.line == b.line && a.col < b.col);
+}
+
+} // namespace
+
+ScrollbackSearch::Matcher::Matcher(const Query &query)
+    : needle_(query.pattern), isRegex_(query.regex),
+      cs_(query.caseSensitive ? Qt::CaseSensitive : Qt::CaseInsensitive) {
+  if (needle_.isEmpty()) {
+    return;
+  }
+  if (isRegex_) {
+    regex_ = QRegularExpression(needle_, query.caseSensitive ? QRegularExpression::NoPatternOption
+                                                             : QRegularExpression::CaseInsensitiveOption);
+    if (!regex_.isValid()) {
+      error_ = regex_.errorString();
+    }
+    return;
+  }
+  for (const QChar ch : needle_) {
+    if (ch.unicode() == 0 || ch.unicode() >= 0x80) {
+      return;
+    }
+  }
+  bytes_ = needle_.toLatin1();
+  if (cs_ == Qt::CaseInsensitive) {
+    bytes_ = bytes_.toLower();
+  }
+  for (int i = 0; i < bytes_.size();) {
+    int j = i;
+    while (j < bytes_.size() && bytes_.at(j) != ' ') {
+      ++j;
+    }
+    if (j - i > anchorLength_) {
+      anchorAt_ = i;
+      anchorLength_ = j - i;
+    }
+    i = j + 1;
+  }
+}
+
+void ScrollbackSearch::Matcher::matchCells(const Cell *cells, int count, qint64 line,
+                                           const QVector<QString> &clusters, QVector<Match> *out) const {
+  if (isEmpty() || !isValid()) {
+    return;
+  }
+  QString text;
+  QVector<int> cols;
+  cellText(cells, count, clusters, &text, &cols);
+  matchText(text, cols, cells, line, out);
+}
+
+// `cols` maps text positions to cells; empty when they are the same, as for
+// an ASCII line.
+void ScrollbackSearch::Matcher::matchText(const QString &text, const QVector<int> &cols, const Cell *cells,
+                                          qint64 line, QVector<Match> *out) const {
+  auto add = [&](int start, int length) {
+    if (length <= 0) {
+      return;
+    }
+    if (cols.isEmpty()) {
+      out->append(Match{line, start, length});
+      return;
+    }
+    const int col = cols.at(start);
+    int last = cols.at(start + length - 1);
+    if (cells[last].glyph & Cell::Wide) {
+      ++last;
+    }
+    out->append(Match{line, col, last - col + 1});
+  };
+  if (isRegex_) {
+    QRegularExpressionMatchIterator it = regex_.globalMatch(text);
+    while (it.hasNext()) {
+      const QRegularExpressionMatch m = it.next();
+      add(m.capturedStart(), m.capturedLength());
+    }
+    return;
+  }
+  for (int at = text.indexOf(needle_, 0, cs_); at >= 0; at = text.indexOf(needle_, at + needle_.size(), cs_)) {
+    add(at, needle_.size());
+  }
+}
+
+void ScrollbackSearch::Matcher::matchSegment(const Scrollback::Segment &segment, qint64 fromLine,
+                                             const QVector<QString> &clusters, QVector<Match> *out) const {
+  if (isEmpty() || !isValid()) {
+    return;
+  }
+  const int firstLine = int(qBound<qint64>(0, fromLine - segment.first, segment.lines));
+  if (anchorLength_ > 0) {
+    scanAscii(segment, firstLine, clusters, out);
+    return;
+  }
+  // A literal that is not plain ASCII cannot occur in an ASCII line.
+  const bool asciiLines = isRegex_ || !bytes_.isEmpty();
+  QVector<Cell> cells;
+  QString text;
+  QVector<int> cols;
+  const char *base = segment.data.constData();
+  for (int i = firstLine; i < segment.lines; ++i) {
+    const int start = segment.starts.at(i);
+    const int stop = i + 1 < segment.lines ? segment.starts.at(i + 1) : segment.data.size();
+    const char *ascii = nullptr;
+    int length = 0;
+    if (Scrollback::asciiText(base + start, stop - start, &ascii, &length)) {
+      if (asciiLines) {
+        text = QString::fromLatin1(ascii, length);
+        text.replace(QChar(0), QChar(' '));
+        matchText(text, QVector<int>(), nullptr, segment.first + i, out);
+      }
+      continue;
+    }
+    Scrollback::decode(base + start, stop - start, &cells);
+    cellText(cells.constData(), cells.size(), clusters, &text, &cols);
+    matchText(text, cols, cells.constData(), segment.first + i, out);
+  }
+}
+
+// The literal fast path: the anchor is looked for across the encoded block in
+// one pass, and a candidate counts if it lies in the text of an ASCII line and
+// the whole needle matches around it. Other lines are decoded.
+void ScrollbackSearch::Matcher::scanAscii(const Scrollback::Segment &segment, int firstLine,
+                                          const QVector<QString> &clusters, QVector<Match> *out) const {
+  if (firstLine >= segment.lines) {
+    return;
+  }
+  const int mark = out->size();
+  const char *base = segment.data.constData();
+  const int begin = segment.starts.at(firstLine);
+  auto lineEnd = [&](int i) { return i + 1 < segment.lines ? int(segment.starts.at(i + 1)) : segment.data.size(); };
+
+  QVector<Cell> cells;
+  QString text;
+  QVector<int> cols;
+  for (int i = firstLine; i < segment.lines; ++i) {
+    const int start = segment.starts.at(i);
+    const char *ascii = nullptr;
+    int length = 0;
+    if (!Scrollback::asciiText(base + start, lineEnd(i) - start, &ascii, &length)) {
+      Scrollback::decode(base + start, lineEnd(i) - start, &cells);
+      cellText(cells.constData(), cells.size(), clusters, &text, &cols);
+      matchText(text, cols, cells.constData(), segment.first + i, out);
+    }
+  }
+
+  const bool fold = cs_ == Qt::CaseInsensitive;
+  const int needleLength = bytes_.size();
+  int line = firstLine - 1;
+  const char *lineText = nullptr;
+  int lineLength = 0;
+  int nextFree = 0;
+  scanCandidates(base + begin, segment.data.size() - begin, bytes_.constData() + anchorAt_, anchorLength_, fold,
+                 [&](int pos) {
+                   pos += begin;
+                   if (line < 0 || pos >= lineEnd(line)) {
+                     do {
+                       ++line;
+                     } while (line + 1 < segment.lines && segment.starts.at(line + 1) <= pos);
+                     const int start = segment.starts.at(line);
+                     if (!Scrollback::asciiText(base + start, lineEnd(line) - start, &lineText, &lineLength)) {
+                       lineText = nullptr;
+                     }
+                     nextFree = 0;
+                   }
+                   if (!lineText) {
+                     return;
+                   }
+                   const int at = int(pos - (lineText - base)) - anchorAt_;
+                   if (at < nextFree || at + needleLength > lineLength || !verify(lineText, lineLength, at)) {
+                     return;
+                   }
+                   out->append(Match{segment.first + line, at, needleLength});
+                   nextFree = at + needleLength;
+                 });
+  std::sort(out->begin() + mark, out->end(), before);
+}
+
+bool ScrollbackSearch::Matcher::verify(const char *text, int length, int at) const {
+  const bool fold = cs_ == Qt::CaseInsensitive;
+  if (at < 0 || at + bytes_.size() > length) {
+    return false;
+  }
+  for (int j = 0; j < bytes_.size(); ++j) {
+    if (foldByte(uchar(text[at + j]), fold) != uchar(bytes_.at(j))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ScrollbackSearch::ScrollbackSearch(QObject *parent) : QObject(parent) {}
+
+ScrollbackSearch::~ScrollbackSearch() {
+  if (thread_) {
+    {
+      QMutexLocker lock(&mutex_);
+      quit_ = true;
+      jobs_.clear();
+    }
+    ++generation_;
+    wake_.wakeOne();
+    thread_->wait();
+    delete thread_;
+  }
+}
+
+void ScrollbackSearch::start(const Query &query, const Scrollback &history, const QVector<QString> &clusters) {
+  stop();
+  query_ = query;
+  active_ = true;
+  scanned_ = history.end();
+  Job job;
+  job.query = query;
+  job.clusters = clusters;
+  job.segments = history.segments(history.begin());
+  job.from = history.begin();
+  job.fileName = history.fileName();
+  job.newestFirst = true;
+  enqueue(job);
+}
+
+void ScrollbackSearch::extend(const Scrollback &history, const QVector<QString> &clusters) {
+  if (!active_) {
+    return;
+  }
+  const qint64 from = qMax(scanned_, history.begin());
+  scanned_ = history.end();
+  if (from >= history.end()) {
+    return;
+  }
+  Job job;
+  job.query = query_;
+  job.clusters = clusters;
+  job.segments = history.segments(from);
+  job.from = from;
+  job.fileName = history.fileName();
+  enqueue(job);
+}
+
+void ScrollbackSearch::stop() {
+  ++generation_;
+  active_ = false;
+  pending_ = 0;
+  QMutexLocker lock(&mutex_);
+  jobs_.clear();
+}
+
+void ScrollbackSearch::enqueue(Job job) {
+  job.generation = generation_;
+  ++pending_;
+  {
+    QMutexLocker lock(&mutex_);
+    jobs_.append(job);
+  }
+  wake_.wakeOne();
+  if (!thread_) {
+    thread_ = QThread::create([this]() { run(); });
+    thread_->setObjectName("scrollback-search");
+    thread_->start(QThread::LowPriority);
+  }
+}
+
+void ScrollbackSearch::customEvent(QEvent *event) {
+  if (event->type() != kResultEvent) {
+    QObject::customEvent(event);
+    return;
+  }
+  auto *e = static_cast<ResultEvent *>(event);
+  if (e->generation != generation_ || !active_) {
+    return;
+  }
+  if (!e->matches.isEmpty()) {
+    emit found(e->matches);
+  }
+  if (e->done && --pending_ == 0) {
+    emit finished(e->truncated);
+  }
+}
+
+// The worker. A search's first job scans all history newest first and stops
+// at kMaxMatches; jobs for new lines always deliver, and the owner drops the
+// oldest hits to stay near the limit.
+void ScrollbackSearch::run() {
+  quint64 generation = 0;
+  std::unique_ptr<Matcher> matcher;
+  QFile file;
+  int matches = 0;
+  bool truncated = false;
+  for (;;) {
+    Job job;
+    {
+      QMutexLocker lock(&mutex_);
+      while (!quit_ && jobs_.isEmpty()) {
+        wake_.wait(&mutex_);
+      }
+      if (quit_) {
+        return;
+      }
+      job = jobs_.takeFirst();
+    }
+    if (!matcher || job.generation != generation) {
+      generation = job.generation;
+      matcher = std::make_unique<Matcher>(job.query);
+      matches = 0;
+      truncated = false;
+    }
+    if (file.fileName() != job.fileName) {
+      file.close();
+      file.setFileName(job.fileName);
+    }
+    if (!job.fileName.isEmpty() && !file.isOpen()) {
+      file.open(QIODevice::ReadOnly);
+    }
+    const int count = job.segments.size();
+    for (int n = 0; n < count && !(job.newestFirst && truncated) && generation_ == job.generation; ++n) {
+      Scrollback::Segment &segment = job.segments[job.newestFirst ? count - 1 - n : n];
+      // A cold block that cannot be read back has been dropped meanwhile.
+      if (!segment.slots.isEmpty() && (!file.isOpen() || !Scrollback::readSegment(&file, &segment))) {
+        continue;
+      }
+      QVector<Match> found;
+      matcher->matchSegment(segment, job.from, job.clusters, &found);
+      segment = Scrollback::Segment();
+      if (found.isEmpty()) {
+        continue;
+      }
+      if (job.newestFirst) {
+        if (matches + found.size() >= kMaxMatches) {
+          found = found.mid(found.size() - (kMaxMatches - matches));
+          truncated = true;
+        }
+        matches += found.size();
+      }
+      QCoreApplication::postEvent(this, new ResultEvent(job.generation, found, false, false));
+    }
+    QCoreApplication::postEvent(this, new ResultEvent(job.generation, QVector<Match>(), true, truncated));
+  }
+}
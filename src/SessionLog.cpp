@@ -0,0 +1,419 @@
+#include "SessionLog.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QEvent>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QtAlgorithms>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SESSION_LOG_SSE2
+#endif
+
+namespace {
+
+const QEvent::Type kFailedEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+
+class FailedEvent : public QEvent {
+public:
+  explicit FailedEvent(const QString &message) : QEvent(kFailedEvent), message(message) {}
+
+  QString message;
+};
+
+// The writer wakes for a batch this large, or after this long.
+constexpr qint64 kBatchBytes = 256 * 1024;
+constexpr unsigned long kFlushIntervalMs = 250;
+
+// Length of the valid UTF-8 sequence at `p`, 0 if it is not one.
+int utf8Length(const uchar *p, int n) {
+  const uchar c = p[0];
+  int length = 0;
+  uchar low = 0x80;
+  uchar high = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf) {
+    length = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    length = 3;
+    low = c == 0xe0 ? 0xa0 : 0x80;
+    high = c == 0xed ? 0x9f : 0xbf;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    length = 4;
+    low = c == 0xf0 ? 0x90 : 0x80;
+    high = c == 0xf4 ? 0x8f : 0xbf;
+  }
+  if (length == 0 || n < length || p[1] < low || p[1] > high) {
+    return 0;
+  }
+  for (int i = 2; i < length; ++i) {
+    if ((p[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+// Bytes at the end of `data` that start a UTF-8 sequence the next chunk
+// may complete.
+int incompleteTail(const QByteArray &data) {
+  const auto *p = reinterpret_cast<const uchar *>(data.constData());
+  const int n = data.size();
+  for (int i = n - 1; i >= 0 && i >= n - 3; --i) {
+    if ((p[i] & 0xc0) == 0x80) {
+      continue;
+    }
+    const int length = p[i] >= 0xf0 ? 4 : p[i] >= 0xe0 ? 3 : p[i] >= 0xc0 ? 2 : 1;
+    return n - i < length ? n - i : 0;
+  }
+  return 0;
+}
+
+// Appends `n` bytes as a JSON string. Terminal output is mostly printable
+// ASCII, which is copied in runs found 16 bytes at a time; invalid UTF-8
+// becomes U+FFFD.
+void appendJsonString(QByteArray *out, const char *data, int n) {
+  static const char hex[] = "0123456789abcdef";
+  const auto *p = reinterpret_cast<const uchar *>(data);
+  out->append('"');
+  int i = 0;
+  while (i < n) {
+    int j = i;
+#ifdef SESSION_LOG_SSE2
+    // Bytes from 0x80 up are negative as signed, so one compare finds them
+    // along with the control characters.
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; j + 16 <= n; j += 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + j));
+      const __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                           _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+      const int mask = _mm_movemask_epi8(special);
+      if (mask != 0) {
+        j += int(qCountTrailingZeroBits(uint(mask)));
+        break;
+      }
+    }
+#endif
+    while (j < n && p[j] >= 0x20 && p[j] < 0x80 && p[j] != '"' && p[j] != '\\') {
+      ++j;
+    }
+    out->append(data + i, j - i);
+    i = j;
+    if (i >= n) {
+      break;
+    }
+    const uchar c = p[i];
+    if (c >= 0x80) {
+      const int length = utf8Length(p + i, n - i);
+      if (length > 0) {
+        out->append(data + i, length);
+        i += length;
+      } else {
+        out->append("\\ufffd");
+        ++i;
+      }
+      continue;
+    }
+    switch (c) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      default: {
+        const char escape[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        out->append(escape, int(sizeof(escape)));
+        break;
+      }
+    }
+    ++i;
+  }
+  out->append('"');
+}
+
+QString partName(const QString &path, int part) {
+  if (part <= 1) {
+    return path;
+  }
+  const QFileInfo info(path);
+  const QString suffix = info.suffix().isEmpty() ? QString() : "." + info.suffix();
+  return info.path() + "/" + info.completeBaseName() + "." + QString::number(part) + suffix;
+}
+
+} // namespace
+
+SessionLog::SessionLog(QObject *parent) : QObject(parent) {}
+
+SessionLog::~SessionLog() {
+  close();
+}
+
+bool SessionLog::open(const QString &path, int rows, int cols, const QString &title, qint64 maxBytes,
+                      QString *error) {
+  close();
+  QDir().mkpath(QFileInfo(path).absolutePath());
+  path_ = path;
+  title_ = title;
+  rows_ = rows;
+  cols_ = cols;
+  maxBytes_ = qMax<qint64>(0, maxBytes);
+  part_ = 0;
+  queued_ = 0;
+  dropped_ = 0;
+  quit_ = false;
+  broken_ = false;
+  tail_[0].clear();
+  tail_[1].clear();
+  clock_.start();
+  epochMs_ = QDateTime::currentMSecsSinceEpoch();
+  if (!startPart(0, error)) {
+    return false;
+  }
+  thread_ = QThread::create([this]() { run(); });
+  thread_->setObjectName("session-log");
+  thread_->start(QThread::LowPriority);
+  return true;
+}
+
+void SessionLog::close() {
+  if (!thread_) {
+    return;
+  }
+  {
+    QMutexLocker lock(&mutex_);
+    quit_ = true;
+  }
+  wake_.wakeOne();
+  thread_->wait();
+  delete thread_;
+  thread_ = nullptr;
+}
+
+void SessionLog::resize(int rows, int cols) {
+  record('r', QByteArray::number(cols) + 'x' + QByteArray::number(rows));
+}
+
+QString SessionLog::defaultDirectory() {
+  return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/logs";
+}
+
+void SessionLog::record(char code, const QByteArray &data) {
+  if (!thread_ || data.isEmpty()) {
+    return;
+  }
+  const qint64 nsecs = clock_.nsecsElapsed();
+  QMutexLocker lock(&mutex_);
+  if (broken_) {
+    return;
+  }
+  if (queued_ + data.size() > kMaxQueued) {
+    dropped_ += data.size();
+    return;
+  }
+  queue_.append(Event{nsecs, code, data});
+  queued_ += data.size();
+  if (queued_ >= kBatchBytes && queued_ - data.size() < kBatchBytes) {
+    wake_.wakeOne();
+  }
+}
+
+void SessionLog::customEvent(QEvent *event) {
+  if (event->type() != kFailedEvent) {
+    QObject::customEvent(event);
+    return;
+  }
+  emit failed(static_cast<FailedEvent *>(event)->message);
+}
+
+// Takes everything queued at once, at the latest every kFlushIntervalMs, and
+// writes it out with a single write and flush.
+void SessionLog::run() {
+  QList<Event> events;
+  QByteArray batch;
+  for (;;) {
+    qint64 dropped = 0;
+    bool quit = false;
+    {
+      QMutexLocker lock(&mutex_);
+      if (!quit_ && queued_ < kBatchBytes) {
+        wake_.wait(&mutex_, kFlushIntervalMs);
+      }
+      events.swap(queue_);
+      queued_ = 0;
+      dropped = dropped_;
+      dropped_ = 0;
+      quit = quit_;
+    }
+    QString error;
+    bool ok = true;
+    if (dropped > 0) {
+      const qint64 at = events.isEmpty() ? clock_.nsecsElapsed() : events.first().nsecs;
+      ok = append(Event{at, 'm', QByteArray::number(dropped) + " bytes not logged: writing fell behind"}, &batch,
+                  &error);
+    }
+    for (int i = 0; ok && i < events.size(); ++i) {
+      ok = append(events.at(i), &batch, &error);
+    }
+    events.clear();
+    // A sequence still cut off when recording stops never completes; its
+    // bytes go out as replacement characters rather than being lost.
+    for (int i = 0; ok && quit && i < 2; ++i) {
+      if (!tail_[i].isEmpty()) {
+        ok = append(Event{clock_.nsecsElapsed(), i == 1 ? 'i' : 'o', QByteArray()}, &batch, &error, false);
+      }
+    }
+    ok = ok && write(&batch, &error);
+    if (!ok) {
+      {
+        QMutexLocker lock(&mutex_);
+        broken_ = true;
+        queue_.clear();
+        queued_ = 0;
+      }
+      file_.close();
+      QCoreApplication::postEvent(this, new FailedEvent(error));
+      return;
+    }
+    if (quit) {
+      file_.close();
+      return;
+    }
+  }
+}
+
+// Encodes one event into `batch`, first moving on to a new part if the
+// current one is full. Unless `hold` is false, an incomplete UTF-8 sequence
+// at the end of output or input waits for the next chunk.
+bool SessionLog::append(const Event &event, QByteArray *batch, QString *error, bool hold) {
+  if (maxBytes_ > 0 && partBytes_ + batch->size() >= maxBytes_ && partBytes_ + batch->size() > headerBytes_) {
+    if (!write(batch, error) || !startPart(event.nsecs, error)) {
+      return false;
+    }
+  }
+  batch->append('[');
+  batch->append(QByteArray::number(double(event.nsecs - partStart_) / 1e9, 'f', 6));
+  batch->append(", \"");
+  batch->append(event.code);
+  batch->append("\", ");
+  if (event.code == 'o' || event.code == 'i') {
+    QByteArray &tail = tail_[event.code == 'i' ? 1 : 0];
+    const QByteArray data = tail.isEmpty() ? event.data : tail + event.data;
+    const int held = hold ? incompleteTail(data) : 0;
+    tail = data.right(held);
+    appendJsonString(batch, data.constData(), data.size() - held);
+  } else {
+    if (event.code == 'r') {
+      const QList<QByteArray> size = event.data.split('x');
+      cols_ = size.value(0).toInt();
+      rows_ = size.value(1).toInt();
+    }
+    appendJsonString(batch, event.data.constData(), event.data.size());
+  }
+  batch->append("]\n");
+  return true;
+}
+
+bool SessionLog::write(QByteArray *batch, QString *error) {
+  if (batch->isEmpty()) {
+    return true;
+  }
+  if (file_.write(*batch) != batch->size() || !file_.flush()) {
+    if (error) *error = QString("%1: %2").arg(file_.fileName(), file_.errorString());
+    return false;
+  }
+  partBytes_ += batch->size();
+  batch->clear();
+  return true;
+}
+
+// Opens the next part and writes its header; event times in it count from
+// `nsecs`.
+bool SessionLog::startPart(qint64 nsecs, QString *error) {
+  file_.close();
+  ++part_;
+  file_.setFileName(partName(path_, part_));
+  if (!file_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    if (error) *error = QString("%1: %2").arg(file_.fileName(), file_.errorString());
+    return false;
+  }
+  QJsonObject header;
+  header["version"] = 2;
+  header["width"] = cols_;
+  header["height"] = rows_;
+  header["timestamp"] = (epochMs_ + nsecs / 1000000) / 1000;
+  if (!title_.isEmpty()) {
+    header["title"] = title_;
+  }
+  header["env"] = QJsonObject{{"TERM", "xterm"}};
+  QByteArray line = QJsonDocument(header).toJson(QJsonDocument::Compact) + '\n';
+  partStart_ = nsecs;
+  partBytes_ = 0;
+  headerBytes_ = line.size();
+  return write(&line, error);
+}
+
+QString SessionLog::benchmark(int megabytes) {
+  // Coloured `ls`-style lines with some non-ASCII names.
+  QByteArray chunk;
+  for (int i = 0; chunk.size() < 16 * 1024; ++i) {
+    chunk += "\x1b[01;34mdirectory-" + QByteArray::number(i) + "\x1b[0m  \x1b[01;32mscript.sh\x1b[0m  "
+             "notes-\xc3\xbc\xc3\xa9.txt  README.md  build.log\r\n";
+  }
+  chunk.truncate(16 * 1024);
+  QTemporaryDir dir;
+  SessionLog log;
+  QString error;
+  if (!dir.isValid() || !log.open(dir.path() + "/bench.cast", 24, 80, "bench", 0, &error)) {
+    return "could not open a log: " + error;
+  }
+  const int chunks = megabytes * 64;
+  QElapsedTimer wall;
+  wall.start();
+  qint64 callerNs = 0;
+  QElapsedTimer timer;
+  for (int i = 0; i < chunks; ++i) {
+    // Stay under kMaxQueued so every byte is written and the writer rate
+    // is measured; the wait is not counted as caller time.
+    for (;;) {
+      QMutexLocker lock(&log.mutex_);
+      if (log.queued_ < kMaxQueued / 2) {
+        break;
+      }
+      lock.unlock();
+      QThread::msleep(1);
+    }
+    // Each chunk gets its own bytes, as every read from the session does.
+    const QByteArray data(chunk.constData(), chunk.size());
+    timer.start();
+    log.output(data);
+    callerNs += timer.nsecsElapsed();
+  }
+  log.close();
+  const double seconds = wall.nsecsElapsed() / 1e9;
+  const qint64 written = QFileInfo(dir.path() + "/bench.cast").size();
+  return QString("%1 MB of output in 16 KB chunks: %2 us/MB on the caller thread, written at %3 MB/s "
+                 "(%4 MB of asciicast)")
+      .arg(megabytes)
+      .arg(callerNs / 1000.0 / megabytes, 0, 'f', 1)
+      .arg(megabytes / seconds, 0, 'f', 0)
+      .arg(written / 1048576.0, 0, 'f', 1);
+}
@@ -0,0 +1,950 @@
+#include "SftpChannel.h"
+
+#include <QFileInfo>
+#include <QtEndian>
+
+namespace {
+
+// SFTP version 3 (draft-ietf-secsh-filexfer-02), which every server speaks.
+enum PacketType : quint8 {
+  FxpInit = 1,
+  FxpVersion = 2,
+  FxpOpen = 3,
+  FxpClose = 4,
+  FxpRead = 5,
+  FxpWrite = 6,
+  FxpOpenDir = 11,
+  FxpReadDir = 12,
+  FxpRealPath = 16,
+  FxpStat = 17,
+  FxpStatus = 101,
+  FxpHandle = 102,
+  FxpData = 103,
+  FxpName = 104,
+  FxpAttrs = 105,
+};
+
+enum StatusCode : quint32 { FxOk = 0, FxEof = 1, FxNoSuchFile = 2, FxPermissionDenied = 3 };
+enum OpenFlag : quint32 { FxfRead = 0x01, FxfWrite = 0x02, FxfCreat = 0x08, FxfTrunc = 0x10 };
+enum AttrFlag : quint32 { AttrSize = 0x01, AttrUidGid = 0x02, AttrPermissions = 0x04, AttrTimes = 0x08 };
+constexpr quint32 kAttrExtended = 0x80000000u;
+
+constexpr int kOpenTimeoutMs = 15000;
+// Request bytes queued towards the channel before transfers stop issuing
+// more; keeps upload data from piling up behind a closed window.
+constexpr int kOutHighWater = 512 * 1024;
+constexpr int kMaxReadPerPass = 1024 * 1024;
+// Retry interval for replies that found the GUI's ring full.
+constexpr int kReplyRetryMs = 20;
+
+void putU32(QByteArray *out, quint32 value) {
+  char bytes[4];
+  qToBigEndian(value, bytes);
+  out->append(bytes, 4);
+}
+
+void putU64(QByteArray *out, quint64 value) {
+  char bytes[8];
+  qToBigEndian(value, bytes);
+  out->append(bytes, 8);
+}
+
+void putString(QByteArray *out, const QByteArray &value) {
+  putU32(out, quint32(value.size()));
+  out->append(value);
+}
+
+// Bounds-checked reader over one packet; any short field fails the rest.
+class Reader {
+public:
+  Reader(const char *data, int size) : data_(data), size_(size) {}
+
+  bool u32(quint32 *value) {
+    if (size_ - pos_ < 4) {
+      return fail();
+    }
+    *value = qFromBigEndian<quint32>(data_ + pos_);
+    pos_ += 4;
+    return true;
+  }
+  bool u64(quint64 *value) {
+    if (size_ - pos_ < 8) {
+      return fail();
+    }
+    *value = qFromBigEndian<quint64>(data_ + pos_);
+    pos_ += 8;
+    return true;
+  }
+  // Points into the packet instead of copying.
+  bool string(const char **data, int *length) {
+    quint32 n = 0;
+    if (!u32(&n) || quint32(size_ - pos_) < n) {
+      return fail();
+    }
+    *data = data_ + pos_;
+    *length = int(n);
+    pos_ += int(n);
+    return true;
+  }
+  bool string(QByteArray *value) {
+    const char *data = nullptr;
+    int length = 0;
+    if (!string(&data, &length)) {
+      return false;
+    }
+    *value = QByteArray(data, length);
+    return true;
+  }
+  bool attrs(SftpEntry *entry) {
+    quint32 flags = 0;
+    if (!u32(&flags)) {
+      return false;
+    }
+    quint32 skip = 0;
+    if (flags & AttrSize) {
+      quint64 size = 0;
+      u64(&size);
+      entry->size = qint64(size);
+    }
+    if (flags & AttrUidGid) {
+      u32(&skip);
+      u32(&skip);
+    }
+    if (flags & AttrPermissions) {
+      u32(&entry->permissions);
+    }
+    if (flags & AttrTimes) {
+      quint32 mtime = 0;
+      u32(&skip);
+      u32(&mtime);
+      entry->modified = QDateTime::fromSecsSinceEpoch(mtime);
+    }
+    if (flags & kAttrExtended) {
+      quint32 count = 0;
+      u32(&count);
+      QByteArray ignored;
+      for (quint32 i = 0; i < count && ok_; ++i) {
+        string(&ignored);
+        string(&ignored);
+      }
+    }
+    return ok_;
+  }
+  bool status(quint32 *code, QString *message) {
+    QByteArray text;
+    if (!u32(code)) {
+      return false;
+    }
+    if (pos_ < size_ && !string(&text)) { // absent from some old servers
+      return false;
+    }
+    *message = QString::fromUtf8(text);
+    if (message->isEmpty()) {
+      switch (*code) {
+      case FxEof:
+        *message = "end of file";
+        break;
+      case FxNoSuchFile:
+        *message = "no such file";
+        break;
+      case FxPermissionDenied:
+        *message = "permission denied";
+        break;
+      default:
+        *message = QString("error %1").arg(*code);
+        break;
+      }
+    }
+    return true;
+  }
+  int pos() const { return pos_; }
+  bool ok() const { return ok_; }
+
+private:
+  bool fail() {
+    ok_ = false;
+    pos_ = size_;
+    return false;
+  }
+
+  const char *data_;
+  int size_;
+  int pos_ = 0;
+  bool ok_ = true;
+};
+
+} // namespace
+
+bool SftpChannel::service(QString *error) {
+  if (closed_ || connection->phase != SshPhase::Ready) {
+    return true;
+  }
+  if (closeRequested) {
+    close(QString());
+    return true;
+  }
+  while (!unsent_.isEmpty() && replies.push(std::move(unsent_.first()))) {
+    unsent_.removeFirst();
+    repliesPushed_ = true;
+  }
+
+  if (phase_ < Phase::Initializing) {
+    while (stepChannel()) {
+    }
+  }
+  if (!closed_ && phase_ != Phase::Ready && deadline_.hasExpired()) {
+    close("Timed out opening the SFTP channel");
+  }
+  if (closed_) {
+    return true;
+  }
+
+  if (phase_ >= Phase::Initializing && !readPackets(error)) {
+    return false;
+  }
+  if (closed_) {
+    return true;
+  }
+  if (phase_ == Phase::Ready) {
+    takeCommands();
+    startTransfers();
+    // One request per transfer per round, so concurrent files share the
+    // pipe evenly.
+    bool issued = true;
+    while (issued) {
+      issued = false;
+      const QList<std::shared_ptr<SftpTransfer>> running = running_;
+      for (const auto &transfer : running) {
+        issued = pumpTransfer(transfer) || issued;
+      }
+      if (running_.size() != running.size()) {
+        startTransfers();
+        issued = true;
+      }
+    }
+  }
+  if (!flush(error)) {
+    return false;
+  }
+#ifdef HAVE_LIBSSH
+  if (phase_ >= Phase::Initializing && !channelReadable_ &&
+      (ssh_channel_is_eof(channel_) || ssh_channel_is_closed(channel_))) {
+    close("SFTP channel closed by the server");
+  }
+#endif
+  return true;
+}
+
+bool SftpChannel::stepChannel() {
+#ifdef HAVE_LIBSSH
+  ssh_session session = connection->session;
+  int rc = SSH_OK;
+  switch (phase_) {
+  case Phase::Creating:
+    channel_ = ssh_channel_new(session);
+    if (!channel_) {
+      close("Failed to create SFTP channel");
+      return false;
+    }
+    out_.reserve(kOutHighWater + 2 * int(kChunkSize));
+    deadline_ = QDeadlineTimer(kOpenTimeoutMs);
+    phase_ = Phase::OpeningChannel;
+    return true;
+  case Phase::OpeningChannel:
+    rc = ssh_channel_open_session(channel_);
+    if (rc == SSH_AGAIN) {
+      return false;
+    }
+    if (rc != SSH_OK) {
+      close(QString("Failed to open SFTP channel: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    phase_ = Phase::StartingSubsystem;
+    return true;
+  case Phase::StartingSubsystem:
+    rc = ssh_channel_request_subsystem(channel_, "sftp");
+    if (rc == SSH_AGAIN) {
+      return false;
+    }
+    if (rc != SSH_OK) {
+      close(QString("The server refused SFTP: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    // SSH_FXP_INIT is the one packet without a request id.
+    putU32(&out_, 5);
+    out_.append(char(FxpInit));
+    putU32(&out_, 3);
+    phase_ = Phase::Initializing;
+    channelReadable_ = true;
+    return false;
+  default:
+    return false;
+  }
+#else
+  close("libssh not available at build time");
+  return false;
+#endif
+}
+
+void SftpChannel::close(const QString &error) {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  QList<std::shared_ptr<SftpTransfer>> unfinished = running_;
+  unfinished.append(queued_);
+  // Transfers the panel handed over that were not picked up yet.
+  SftpCommand command;
+  while (commands.pop(&command)) {
+    if (command.transfer) {
+      unfinished.append(command.transfer);
+    }
+  }
+  running_.clear();
+  queued_.clear();
+  for (const auto &transfer : unfinished) {
+    transfer->file.close();
+    transfer->early.clear();
+    const bool cancelled = transfer->cancelRequested || closeRequested;
+    transfer->error = cancelled ? QString() : (error.isEmpty() ? QString("SFTP session closed") : error);
+    transfer->state = cancelled ? SftpTransfer::Cancelled : SftpTransfer::Failed;
+    SftpReply done;
+    done.kind = SftpReply::TransferDone;
+    done.transfer = transfer;
+    reply(std::move(done));
+  }
+  requests_.clear();
+#ifdef HAVE_LIBSSH
+  if (channel_) {
+    ssh_channel_close(channel_);
+    ssh_channel_free(channel_);
+    channel_ = nullptr;
+  }
+#endif
+  SftpReply closedReply;
+  closedReply.kind = SftpReply::Closed;
+  closedReply.error = error;
+  reply(std::move(closedReply));
+}
+
+void SftpChannel::markIfBuffered() {
+#ifdef HAVE_LIBSSH
+  if (!closed_ && phase_ >= Phase::Initializing && !channelReadable_ && ssh_channel_poll(channel_, 0) != 0) {
+    channelReadable_ = true;
+  }
+#endif
+}
+
+bool SftpChannel::readPending() const {
+  return !closed_ && phase_ >= Phase::Initializing && channelReadable_;
+}
+
+bool SftpChannel::writePending() const {
+  return !closed_ && outOffset_ < out_.size();
+}
+
+QDeadlineTimer SftpChannel::wakeDeadline() const {
+  if (closed_) {
+    return QDeadlineTimer(QDeadlineTimer::Forever);
+  }
+  if (!unsent_.isEmpty()) {
+    return QDeadlineTimer(kReplyRetryMs);
+  }
+  if (phase_ != Phase::Ready) {
+    return deadline_;
+  }
+  if (!running_.isEmpty() && !throttled_.hasExpired()) {
+    return throttled_;
+  }
+  return QDeadlineTimer(QDeadlineTimer::Forever);
+}
+
+bool SftpChannel::takeRepliesPushed() {
+  const bool pushed = repliesPushed_;
+  repliesPushed_ = false;
+  return pushed;
+}
+
+quint64 SftpChannel::takeBytesRead() {
+  const quint64 bytes = bytesRead_;
+  bytesRead_ = 0;
+  return bytes;
+}
+
+quint64 SftpChannel::takeBytesWritten() {
+  const quint64 bytes = bytesWritten_;
+  bytesWritten_ = 0;
+  return bytes;
+}
+
+void SftpChannel::takeCommands() {
+  SftpCommand command;
+  while (commands.pop(&command)) {
+    if (command.kind == SftpCommand::Transfer) {
+      queued_.append(command.transfer);
+      continue;
+    }
+    Request request;
+    request.kind = Request::OpenDir;
+    request.path = command.path;
+    int start = 0;
+    beginPacket(FxpOpenDir, request, &start);
+    putString(&out_, command.path.toUtf8());
+    endPacket(start);
+  }
+}
+
+bool SftpChannel::readPackets(QString *error) {
+#ifdef HAVE_LIBSSH
+  int total = 0;
+  while (channelReadable_ && !closed_ && total < kMaxReadPerPass) {
+    const int n = ssh_channel_read_nonblocking(channel_, in_.space(), uint32_t(in_.spaceSize()), 0);
+    if (n == SSH_ERROR) {
+      *error = QString("SSH read failed: %1").arg(ssh_get_error(connection->session));
+      return false;
+    }
+    if (n <= 0) {
+      channelReadable_ = false;
+      break;
+    }
+    in_.produced(n);
+    bytesRead_ += quint64(n);
+    total += n;
+    while (!closed_ && in_.pendingSize() >= 4) {
+      const quint32 length = qFromBigEndian<quint32>(in_.pending());
+      if (length == 0 || length > quint32(in_.data.size() - 4)) {
+        close(QString("SFTP protocol error: packet of %1 bytes").arg(length));
+        break;
+      }
+      if (quint32(in_.pendingSize()) < 4 + length) {
+        break;
+      }
+      const char *packet = in_.pending() + 4;
+      handlePacket(quint8(packet[0]), packet + 1, int(length) - 1);
+      in_.consumed(int(length) + 4);
+    }
+  }
+  if (total >= kMaxReadPerPass) {
+    channelReadable_ = true;
+  }
+#else
+  Q_UNUSED(error)
+#endif
+  return true;
+}
+
+void SftpChannel::handlePacket(quint8 type, const char *body, int size) {
+  if (type == FxpVersion) {
+    if (phase_ != Phase::Initializing) {
+      return;
+    }
+    phase_ = Phase::Ready;
+    Request request;
+    request.kind = Request::Home;
+    int start = 0;
+    beginPacket(FxpRealPath, request, &start);
+    putString(&out_, ".");
+    endPacket(start);
+    return;
+  }
+  Reader reader(body, size);
+  quint32 id = 0;
+  if (!reader.u32(&id)) {
+    close("SFTP protocol error: short packet");
+    return;
+  }
+  auto it = requests_.find(id);
+  if (it == requests_.end()) {
+    return;
+  }
+  Request request = std::move(it.value());
+  requests_.erase(it);
+  handleReply(request, type, body + 4, size - 4);
+}
+
+void SftpChannel::handleReply(Request &request, quint8 type, const char *body, int size) {
+  Reader reader(body, size);
+  quint32 code = FxOk;
+  QString message;
+  const bool isStatus = type == FxpStatus && reader.status(&code, &message);
+  const std::shared_ptr<SftpTransfer> transfer = request.transfer;
+
+  if (transfer && transfer->state != SftpTransfer::Running) {
+    // A late reply for a transfer that already ended.
+    if (request.kind == Request::Open && type == FxpHandle) {
+      QByteArray handle;
+      if (reader.string(&handle)) {
+        sendClose(handle);
+      }
+    }
+    return;
+  }
+
+  switch (request.kind) {
+  case Request::CloseHandle:
+    return;
+  case Request::Home: {
+    SftpReply ready;
+    ready.kind = SftpReply::Ready;
+    ready.path = ".";
+    quint32 count = 0;
+    QByteArray name;
+    if (type == FxpName && reader.u32(&count) && count > 0 && reader.string(&name)) {
+      ready.path = QString::fromUtf8(name);
+    }
+    reply(std::move(ready));
+    return;
+  }
+  case Request::OpenDir:
+  case Request::ReadDir: {
+    if (type == FxpHandle || type == FxpName) {
+      if (type == FxpHandle && !reader.string(&request.handle)) {
+        break;
+      }
+      quint32 count = 0;
+      if (type == FxpName && reader.u32(&count)) {
+        for (quint32 i = 0; i < count; ++i) {
+          QByteArray name;
+          QByteArray longName;
+          SftpEntry entry;
+          if (!reader.string(&name) || !reader.string(&longName) || !reader.attrs(&entry)) {
+            break;
+          }
+          if (name == "." || name == "..") {
+            continue;
+          }
+          entry.name = QString::fromUtf8(name);
+          request.entries.append(entry);
+        }
+      }
+      if (!reader.ok()) {
+        break;
+      }
+      request.kind = Request::ReadDir;
+      int start = 0;
+      const QByteArray handle = request.handle;
+      beginPacket(FxpReadDir, std::move(request), &start);
+      putString(&out_, handle);
+      endPacket(start);
+      return;
+    }
+    if (!isStatus) {
+      break;
+    }
+    if (!request.handle.isEmpty()) {
+      sendClose(request.handle);
+    }
+    SftpReply listing;
+    listing.path = request.path;
+    if (code == FxEof) {
+      listing.kind = SftpReply::Listing;
+      listing.entries = std::move(request.entries);
+    } else {
+      listing.kind = SftpReply::Failed;
+      listing.error = QString("%1: %2").arg(request.path, message);
+    }
+    reply(std::move(listing));
+    return;
+  }
+  case Request::Stat: {
+    SftpEntry entry;
+    const bool found = type == FxpAttrs && reader.attrs(&entry);
+    if (!found && !isStatus) {
+      break;
+    }
+    if (transfer->direction == SftpTransfer::Download) {
+      if (!found) {
+        finish(transfer, SftpTransfer::Failed, message);
+        return;
+      }
+      if (entry.isDir()) {
+        finish(transfer, SftpTransfer::Failed, "is a directory");
+        return;
+      }
+      transfer->size = entry.size;
+      qint64 have = 0;
+      const QFileInfo local(transfer->localPath);
+      if (transfer->resume && local.exists()) {
+        have = local.size();
+        if (entry.size >= 0 && have > entry.size) {
+          have = 0; // not a prefix of this file
+        }
+      }
+      transfer->file.setFileName(transfer->localPath);
+      const QIODevice::OpenMode mode = have > 0 ? QIODevice::WriteOnly | QIODevice::Append
+                                                : QIODevice::WriteOnly | QIODevice::Truncate;
+      if (!transfer->file.open(mode)) {
+        finish(transfer, SftpTransfer::Failed, transfer->file.errorString());
+        return;
+      }
+      transfer->resumedFrom = have;
+      transfer->done = have;
+    } else {
+      // Resuming an upload: keep what the server already has, if it is not
+      // longer than the local file.
+      const qint64 have = found && entry.size >= 0 && entry.size <= transfer->size ? entry.size : 0;
+      if (!transfer->file.seek(have)) {
+        finish(transfer, SftpTransfer::Failed, transfer->file.errorString());
+        return;
+      }
+      transfer->resumedFrom = have;
+      transfer->done = have;
+    }
+    openRemote(transfer);
+    return;
+  }
+  case Request::Open:
+    if (type == FxpHandle && reader.string(&transfer->handle)) {
+      return; // pumpTransfer() takes over
+    }
+    if (!isStatus) {
+      break;
+    }
+    finish(transfer, SftpTransfer::Failed, message);
+    return;
+  case Request::Read: {
+    --transfer->inFlight;
+    const char *data = nullptr;
+    int length = 0;
+    if (type == FxpData && reader.string(&data, &length)) {
+      length = qMin(length, int(request.length));
+      if (length == 0) {
+        transfer->eofAt = transfer->eofAt < 0 ? request.offset : qMin(transfer->eofAt, request.offset);
+      } else if (!downloaded(transfer, request.offset, data, length)) {
+        return;
+      }
+      if (length > 0 && quint32(length) < request.length) {
+        // Short read: ask for the rest of this chunk. Its bandwidth was
+        // already accounted for.
+        Request rest;
+        rest.kind = Request::Read;
+        rest.transfer = transfer;
+        rest.offset = request.offset + length;
+        rest.length = request.length - quint32(length);
+        sendRead(rest);
+      }
+      checkFinished(transfer);
+      return;
+    }
+    if (!isStatus) {
+      break;
+    }
+    if (code != FxEof) {
+      finish(transfer, SftpTransfer::Failed, message);
+      return;
+    }
+    transfer->eofAt = transfer->eofAt < 0 ? request.offset : qMin(transfer->eofAt, request.offset);
+    checkFinished(transfer);
+    return;
+  }
+  case Request::Write:
+    --transfer->inFlight;
+    if (!isStatus) {
+      break;
+    }
+    if (code != FxOk) {
+      finish(transfer, SftpTransfer::Failed, message);
+      return;
+    }
+    transfer->done += request.length;
+    checkFinished(transfer);
+    return;
+  }
+  close("SFTP protocol error: unexpected reply");
+}
+
+void SftpChannel::startTransfers() {
+  for (int i = 0; i < queued_.size();) {
+    const std::shared_ptr<SftpTransfer> transfer = queued_.at(i);
+    if (transfer->cancelRequested) {
+      queued_.removeAt(i);
+      finish(transfer, SftpTransfer::Cancelled, QString());
+      continue;
+    }
+    ++i;
+  }
+  while (running_.size() < qMax(1, maxTransfers.load()) && !queued_.isEmpty()) {
+    startTransfer(queued_.takeFirst());
+  }
+}
+
+void SftpChannel::startTransfer(const std::shared_ptr<SftpTransfer> &transfer) {
+  running_.append(transfer);
+  transfer->state = SftpTransfer::Running;
+  transfer->handle.clear();
+  transfer->eofAt = -1;
+  transfer->inFlight = 0;
+  transfer->early.clear();
+
+  if (transfer->direction == SftpTransfer::Upload) {
+    transfer->file.setFileName(transfer->localPath);
+    if (!transfer->file.open(QIODevice::ReadOnly)) {
+      finish(transfer, SftpTransfer::Failed, transfer->file.errorString());
+      return;
+    }
+    transfer->size = transfer->file.size();
+    if (!transfer->resume) {
+      transfer->resumedFrom = 0;
+      transfer->done = 0;
+      openRemote(transfer);
+      return;
+    }
+  }
+  // Downloads need the size; resumed uploads what the server already has.
+  Request request;
+  request.kind = Request::Stat;
+  request.transfer = transfer;
+  int start = 0;
+  beginPacket(FxpStat, std::move(request), &start);
+  putString(&out_, transfer->remotePath.toUtf8());
+  endPacket(start);
+}
+
+void SftpChannel::openRemote(const std::shared_ptr<SftpTransfer> &transfer) {
+  quint32 flags = FxfRead;
+  if (transfer->direction == SftpTransfer::Upload) {
+    flags = FxfWrite | FxfCreat | (transfer->resumedFrom == 0 ? FxfTrunc : 0);
+  }
+  transfer->nextOffset = transfer->resumedFrom;
+  Request request;
+  request.kind = Request::Open;
+  request.transfer = transfer;
+  int start = 0;
+  beginPacket(FxpOpen, std::move(request), &start);
+  putString(&out_, transfer->remotePath.toUtf8());
+  putU32(&out_, flags);
+  putU32(&out_, 0); // no attributes
+  endPacket(start);
+}
+
+// Issues at most one read or write for `transfer`; returns whether it did.
+bool SftpChannel::pumpTransfer(const std::shared_ptr<SftpTransfer> &transfer) {
+  if (transfer->state != SftpTransfer::Running) {
+    return false;
+  }
+  if (transfer->cancelRequested) {
+    finish(transfer, SftpTransfer::Cancelled, QString());
+    return false;
+  }
+  if (transfer->handle.isEmpty() || transfer->inFlight >= kMaxInFlight ||
+      out_.size() - outOffset_ >= kOutHighWater) {
+    return false;
+  }
+  const qint64 size = transfer->size;
+
+  if (transfer->direction == SftpTransfer::Download) {
+    // One read past a known size confirms the end of the file.
+    if (transfer->eofAt >= 0 || (size >= 0 && transfer->nextOffset > size) || !takeTokens(kChunkSize)) {
+      return false;
+    }
+    Request request;
+    request.kind = Request::Read;
+    request.transfer = transfer;
+    request.offset = transfer->nextOffset;
+    request.length = kChunkSize;
+    transfer->nextOffset += kChunkSize;
+    sendRead(request);
+    return true;
+  }
+
+  if (transfer->nextOffset >= size) {
+    return false;
+  }
+  const quint32 length = quint32(qMin<qint64>(kChunkSize, size - transfer->nextOffset));
+  if (!takeTokens(length)) {
+    return false;
+  }
+  Request request;
+  request.kind = Request::Write;
+  request.transfer = transfer;
+  request.offset = transfer->nextOffset;
+  request.length = length;
+  int start = 0;
+  const quint32 id = beginPacket(FxpWrite, std::move(request), &start);
+  putString(&out_, transfer->handle);
+  putU64(&out_, quint64(transfer->nextOffset));
+  putU32(&out_, length);
+  // The file is read straight into the outgoing packet.
+  const int at = out_.size();
+  out_.resize(at + int(length));
+  if (transfer->file.read(out_.data() + at, length) != qint64(length)) {
+    out_.resize(start);
+    requests_.remove(id);
+    finish(transfer, SftpTransfer::Failed, QString("%1: read failed").arg(transfer->localPath));
+    return false;
+  }
+  endPacket(start);
+  transfer->nextOffset += length;
+  ++transfer->inFlight;
+  return true;
+}
+
+// Writes downloaded data in file order; a chunk that overtook an earlier one
+// waits in `early`, so the local file is always a prefix of the remote one
+// and can be resumed.
+bool SftpChannel::downloaded(const std::shared_ptr<SftpTransfer> &transfer, qint64 offset, const char *data,
+                             int length) {
+  const qint64 done = transfer->done;
+  if (offset > done) {
+    transfer->early.insert(offset, QByteArray(data, length));
+    return true;
+  }
+  if (offset + length <= done) {
+    return true;
+  }
+  const qint64 skip = done - offset;
+  if (transfer->file.write(data + skip, length - skip) != length - skip) {
+    finish(transfer, SftpTransfer::Failed, transfer->file.errorString());
+    return false;
+  }
+  transfer->done = offset + length;
+  while (!transfer->early.isEmpty() && transfer->early.firstKey() <= transfer->done) {
+    const qint64 at = transfer->early.firstKey();
+    const QByteArray chunk = transfer->early.take(at);
+    if (!downloaded(transfer, at, chunk.constData(), chunk.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void SftpChannel::checkFinished(const std::shared_ptr<SftpTransfer> &transfer) {
+  if (transfer->state != SftpTransfer::Running || transfer->inFlight > 0) {
+    return;
+  }
+  if (transfer->direction == SftpTransfer::Download) {
+    if (transfer->eofAt < 0) {
+      return;
+    }
+    if (!transfer->early.isEmpty() || transfer->done != transfer->eofAt) {
+      finish(transfer, SftpTransfer::Failed, "the server skipped part of the file");
+      return;
+    }
+    transfer->size = transfer->done.load();
+    finish(transfer, SftpTransfer::Done, QString());
+    return;
+  }
+  if (transfer->nextOffset >= transfer->size) {
+    finish(transfer, SftpTransfer::Done, QString());
+  }
+}
+
+void SftpChannel::finish(const std::shared_ptr<SftpTransfer> &transfer, SftpTransfer::State state,
+                         const QString &error) {
+  if (!transfer->handle.isEmpty()) {
+    sendClose(transfer->handle);
+    transfer->handle.clear();
+  }
+  transfer->file.close();
+  transfer->early.clear();
+  running_.removeOne(transfer);
+  queued_.removeOne(transfer);
+  transfer->error = error;
+  transfer->state = state;
+  SftpReply done;
+  done.kind = SftpReply::TransferDone;
+  done.transfer = transfer;
+  reply(std::move(done));
+}
+
+// Token bucket over all transfers on the channel, holding at most a quarter
+// second of traffic so a paused link does not burst afterwards.
+bool SftpChannel::takeTokens(quint32 bytes) {
+  const qint64 rate = rateLimit.load();
+  if (rate <= 0) {
+    tokenClock_.invalidate();
+    return true;
+  }
+  if (!tokenClock_.isValid()) {
+    tokenClock_.start();
+    tokens_ = bytes;
+  } else {
+    const qint64 ns = tokenClock_.nsecsElapsed();
+    tokenClock_.start();
+    tokens_ = qMin(tokens_ + double(rate) * double(ns) / 1e9, qMax(double(rate) / 4, double(kChunkSize)));
+  }
+  if (tokens_ < bytes) {
+    throttled_ = QDeadlineTimer(qint64((bytes - tokens_) * 1000 / double(rate)) + 1);
+    return false;
+  }
+  tokens_ -= bytes;
+  return true;
+}
+
+quint32 SftpChannel::beginPacket(quint8 type, Request request, int *start) {
+  const quint32 id = nextId_++;
+  *start = out_.size();
+  putU32(&out_, 0); // patched by endPacket()
+  out_.append(char(type));
+  putU32(&out_, id);
+  requests_.insert(id, std::move(request));
+  return id;
+}
+
+void SftpChannel::endPacket(int start) {
+  qToBigEndian(quint32(out_.size() - start - 4), out_.data() + start);
+}
+
+void SftpChannel::sendRead(const Request &request) {
+  const std::shared_ptr<SftpTransfer> &transfer = request.transfer;
+  int start = 0;
+  beginPacket(FxpRead, request, &start);
+  putString(&out_, transfer->handle);
+  putU64(&out_, quint64(request.offset));
+  putU32(&out_, request.length);
+  endPacket(start);
+  ++transfer->inFlight;
+}
+
+void SftpChannel::sendClose(const QByteArray &handle) {
+  Request request;
+  request.kind = Request::CloseHandle;
+  int start = 0;
+  beginPacket(FxpClose, std::move(request), &start);
+  putString(&out_, handle);
+  endPacket(start);
+}
+
+// Writes queued requests as far as the channel window allows.
+bool SftpChannel::flush(QString *error) {
+#ifdef HAVE_LIBSSH
+  while (channel_ && outOffset_ < out_.size()) {
+    const uint32_t window = ssh_channel_window_size(channel_);
+    if (window == 0) {
+      break; // retried on the next pass
+    }
+    const int n = ssh_channel_write(channel_, out_.constData() + outOffset_,
+                                    qMin(uint32_t(out_.size() - outOffset_), window));
+    if (n == SSH_ERROR) {
+      *error = QString("SSH write failed: %1").arg(ssh_get_error(connection->session));
+      return false;
+    }
+    // Writing processes incoming packets too.
+    channelReadable_ = true;
+    if (n <= 0) {
+      break;
+    }
+    outOffset_ += n;
+    bytesWritten_ += quint64(n);
+  }
+#else
+  Q_UNUSED(error)
+  outOffset_ = out_.size();
+#endif
+  if (outOffset_ == out_.size()) {
+    out_.resize(0); // keeps the reserved capacity
+    outOffset_ = 0;
+  } else if (outOffset_ >= kOutHighWater) {
+    out_.remove(0, outOffset_);
+    outOffset_ = 0;
+  }
+  return true;
+}
+
+void SftpChannel::reply(SftpReply reply) {
+  if (unsent_.isEmpty() && replies.push(std::move(reply))) {
+    repliesPushed_ = true;
+    return;
+  }
+  unsent_.append(std::move(reply));
+}
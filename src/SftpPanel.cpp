@@ -0,0 +1,496 @@
+#include "SftpPanel.h"
+#include "SshSession.h"
+
+#include <QDir>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QLabel>
+#include <QLineEdit>
+#include <QMessageBox>
+#include <QPushButton>
+#include <QSettings>
+#include <QSpinBox>
+#include <QSplitter>
+#include <QTimer>
+#include <QToolButton>
+#include <QTreeWidget>
+#include <QVBoxLayout>
+
+#include <algorithm>
+
+namespace {
+
+constexpr int kUpdateMs = 500;
+
+QString formatSize(qint64 bytes) {
+  if (bytes < 0) {
+    return QString();
+  }
+  if (bytes >= 1024 * 1024 * 1024) {
+    return QString("%1 GB").arg(bytes / (1024.0 * 1024.0 * 1024.0), 0, 'f', 1);
+  }
+  if (bytes >= 1024 * 1024) {
+    return QString("%1 MB").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+  }
+  if (bytes >= 1024) {
+    return QString("%1 KB").arg(bytes / 1024.0, 0, 'f', 0);
+  }
+  return QString("%1 B").arg(bytes);
+}
+
+QString remoteDir(const QString &path) {
+  const int slash = path.lastIndexOf('/');
+  return slash <= 0 ? QString("/") : path.left(slash);
+}
+
+} // namespace
+
+SftpPanel::SftpPanel(SshSession *session, QWidget *parent)
+    : QWidget(parent), session_(session), pathEdit_(new QLineEdit(this)), files_(new QTreeWidget(this)),
+      transfers_(new QTreeWidget(this)), parallel_(new QSpinBox(this)), rateLimit_(new QSpinBox(this)),
+      status_(new QLabel(this)), timer_(new QTimer(this)) {
+  auto *upButton = new QToolButton(this);
+  upButton->setText("Up");
+  auto *refreshButton = new QToolButton(this);
+  refreshButton->setText("Refresh");
+  connect(pathEdit_, &QLineEdit::returnPressed, this, &SftpPanel::onPathEntered);
+  connect(upButton, &QToolButton::clicked, this, &SftpPanel::onUp);
+  connect(refreshButton, &QToolButton::clicked, this, [this]() { list(cwd_); });
+
+  files_->setColumnCount(3);
+  files_->setHeaderLabels({"Name", "Size", "Modified"});
+  files_->setRootIsDecorated(false);
+  files_->setSelectionMode(QAbstractItemView::ExtendedSelection);
+  files_->header()->setSectionResizeMode(0, QHeaderView::Stretch);
+  connect(files_, &QTreeWidget::itemActivated, this, &SftpPanel::onItemActivated);
+
+  auto *uploadButton = new QPushButton("Upload...", this);
+  auto *downloadButton = new QPushButton("Download...", this);
+  connect(uploadButton, &QPushButton::clicked, this, &SftpPanel::onUpload);
+  connect(downloadButton, &QPushButton::clicked, this, &SftpPanel::onDownload);
+
+  transfers_->setColumnCount(4);
+  transfers_->setHeaderLabels({"File", "Progress", "Speed", "State"});
+  transfers_->setRootIsDecorated(false);
+  transfers_->setSelectionMode(QAbstractItemView::ExtendedSelection);
+  transfers_->header()->setSectionResizeMode(0, QHeaderView::Stretch);
+  auto *cancelButton = new QPushButton("Cancel", this);
+  cancelButton->setToolTip("Cancel the selected transfers, or all of them if none is selected");
+  auto *clearButton = new QPushButton("Clear Finished", this);
+  connect(cancelButton, &QPushButton::clicked, this, &SftpPanel::onCancelTransfers);
+  connect(clearButton, &QPushButton::clicked, this, &SftpPanel::onClearTransfers);
+
+  QSettings settings("sshterminal", "sshterminal");
+  parallel_->setRange(1, 16);
+  parallel_->setValue(settings.value("sftp/maxTransfers", 3).toInt());
+  parallel_->setToolTip("Files copied at the same time");
+  rateLimit_->setRange(0, 10 * 1024 * 1024);
+  rateLimit_->setSingleStep(256);
+  rateLimit_->setSuffix(" KB/s");
+  rateLimit_->setSpecialValueText("No limit");
+  rateLimit_->setValue(settings.value("sftp/rateLimitKBps", 0).toInt());
+  rateLimit_->setToolTip("Combined speed limit for all transfers in this tab");
+  connect(parallel_, QOverload<int>::of(&QSpinBox::valueChanged), this, &SftpPanel::onLimitsChanged);
+  connect(rateLimit_, QOverload<int>::of(&QSpinBox::valueChanged), this, &SftpPanel::onLimitsChanged);
+
+  timer_->setInterval(kUpdateMs);
+  connect(timer_, &QTimer::timeout, this, &SftpPanel::updateTransfers);
+
+  auto *pathRow = new QHBoxLayout();
+  pathRow->setContentsMargins(0, 0, 0, 0);
+  pathRow->addWidget(upButton);
+  pathRow->addWidget(pathEdit_, 1);
+  pathRow->addWidget(refreshButton);
+
+  auto *fileButtons = new QHBoxLayout();
+  fileButtons->setContentsMargins(0, 0, 0, 0);
+  fileButtons->addWidget(uploadButton);
+  fileButtons->addWidget(downloadButton);
+  fileButtons->addStretch(1);
+
+  auto *limitRow = new QHBoxLayout();
+  limitRow->setContentsMargins(0, 0, 0, 0);
+  limitRow->addWidget(new QLabel("Parallel", this));
+  limitRow->addWidget(parallel_);
+  limitRow->addWidget(new QLabel("Limit", this));
+  limitRow->addWidget(rateLimit_);
+  limitRow->addStretch(1);
+  limitRow->addWidget(cancelButton);
+  limitRow->addWidget(clearButton);
+
+  auto *browser = new QWidget(this);
+  auto *browserLayout = new QVBoxLayout(browser);
+  browserLayout->setContentsMargins(0, 0, 0, 0);
+  browserLayout->addLayout(pathRow);
+  browserLayout->addWidget(files_, 1);
+  browserLayout->addLayout(fileButtons);
+
+  auto *queue = new QWidget(this);
+  auto *queueLayout = new QVBoxLayout(queue);
+  queueLayout->setContentsMargins(0, 0, 0, 0);
+  queueLayout->addWidget(transfers_, 1);
+  queueLayout->addLayout(limitRow);
+
+  auto *splitter = new QSplitter(Qt::Vertical, this);
+  splitter->addWidget(browser);
+  splitter->addWidget(queue);
+  splitter->setStretchFactor(0, 3);
+  splitter->setStretchFactor(1, 1);
+
+  auto *layout = new QVBoxLayout(this);
+  layout->setContentsMargins(0, 0, 0, 0);
+  layout->addWidget(splitter, 1);
+  layout->addWidget(status_);
+}
+
+SftpPanel::~SftpPanel() {
+  close();
+}
+
+void SftpPanel::open() {
+  if (sftp_) {
+    return;
+  }
+  sftp_ = session_->openSftp(this);
+  if (!sftp_) {
+    status_->setText("Not connected");
+    return;
+  }
+  onLimitsChanged();
+  status_->setText("Opening SFTP...");
+  timer_->start();
+}
+
+void SftpPanel::close() {
+  if (!sftp_) {
+    return;
+  }
+  // The reactor closes the channel on its own thread.
+  sftp_->owner = nullptr;
+  sftp_->closeRequested = true;
+  sftp_->connection->reactor->wake();
+  sftp_.reset();
+  // Transfers still waiting here never reach the channel, so nothing else
+  // would ever finish them.
+  for (const SftpCommand &command : pending_) {
+    if (command.transfer) {
+      command.transfer->state = SftpTransfer::Cancelled;
+    }
+  }
+  pending_.clear();
+  updateTransfers();
+}
+
+void SftpPanel::drainReplies() {
+  // Keep the channel alive even if a reply closes the panel's hold on it.
+  const std::shared_ptr<SftpChannel> sftp = sftp_;
+  if (!sftp) {
+    return;
+  }
+  sftp->repliesPosted = false;
+  SftpReply reply;
+  while (sftp->owner == this && sftp->replies.pop(&reply)) {
+    switch (reply.kind) {
+    case SftpReply::Ready:
+      status_->clear();
+      list(reply.path);
+      break;
+    case SftpReply::Listing:
+      status_->clear();
+      showListing(reply.path, std::move(reply.entries));
+      break;
+    case SftpReply::Failed:
+      status_->setText(reply.error);
+      break;
+    case SftpReply::TransferDone:
+      if (reply.transfer->direction == SftpTransfer::Upload && reply.transfer->state == SftpTransfer::Done &&
+          remoteDir(reply.transfer->remotePath) == cwd_) {
+        list(cwd_);
+      }
+      break;
+    case SftpReply::Closed:
+      status_->setText(reply.error.isEmpty() ? QString("SFTP closed") : reply.error);
+      close();
+      updateTransfers();
+      timer_->stop();
+      break;
+    }
+  }
+}
+
+void SftpPanel::list(const QString &path) {
+  SftpCommand command;
+  command.kind = SftpCommand::List;
+  command.path = path;
+  queue(std::move(command));
+}
+
+void SftpPanel::queue(SftpCommand command) {
+  if (!sftp_) {
+    status_->setText("SFTP is not open");
+    if (command.transfer) {
+      command.transfer->error = "SFTP is not open";
+      command.transfer->state = SftpTransfer::Failed;
+    }
+    return;
+  }
+  pending_.append(std::move(command));
+  flushCommands();
+}
+
+// Commands that do not fit the ring are retried on the next timer tick.
+void SftpPanel::flushCommands() {
+  bool pushed = false;
+  while (sftp_ && !pending_.isEmpty() && sftp_->commands.push(std::move(pending_.first()))) {
+    pending_.removeFirst();
+    pushed = true;
+  }
+  if (pushed) {
+    sftp_->connection->reactor->wake();
+  }
+}
+
+void SftpPanel::showListing(const QString &path, QVector<SftpEntry> entries) {
+  std::sort(entries.begin(), entries.end(), [](const SftpEntry &a, const SftpEntry &b) {
+    if (a.isDir() != b.isDir()) {
+      return a.isDir();
+    }
+    return a.name.compare(b.name, Qt::CaseInsensitive) < 0;
+  });
+  cwd_ = path;
+  entries_ = entries;
+  pathEdit_->setText(path);
+  files_->clear();
+  for (const SftpEntry &entry : entries_) {
+    auto *item = new QTreeWidgetItem(files_);
+    item->setText(0, entry.isDir() ? entry.name + "/" : (entry.isLink() ? entry.name + "@" : entry.name));
+    item->setText(1, entry.isDir() ? QString() : formatSize(entry.size));
+    item->setText(2, entry.modified.toString("yyyy-MM-dd HH:mm"));
+    item->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+    item->setData(0, Qt::UserRole, entry.name);
+  }
+}
+
+QString SftpPanel::remotePath(const QString &name) const {
+  return cwd_.endsWith('/') ? cwd_ + name : cwd_ + "/" + name;
+}
+
+void SftpPanel::onPathEntered() {
+  const QString path = pathEdit_->text().trimmed();
+  if (!path.isEmpty()) {
+    list(path);
+  }
+}
+
+void SftpPanel::onUp() {
+  if (!cwd_.isEmpty() && cwd_ != "/") {
+    list(remoteDir(cwd_));
+  }
+}
+
+void SftpPanel::onItemActivated(QTreeWidgetItem *item, int column) {
+  Q_UNUSED(column)
+  const QString name = item->data(0, Qt::UserRole).toString();
+  for (const SftpEntry &entry : entries_) {
+    if (entry.name != name) {
+      continue;
+    }
+    // A link may point at a directory; listing tells.
+    if (entry.isDir() || entry.isLink()) {
+      list(remotePath(name));
+    } else {
+      onDownload();
+    }
+    return;
+  }
+}
+
+bool SftpPanel::askResume(const QStringList &existing, bool *resume) {
+  *resume = false;
+  if (existing.isEmpty()) {
+    return true;
+  }
+  QMessageBox box(QMessageBox::Question, "SFTP",
+                  QString("%1 already exist%2 at the destination:\n%3")
+                      .arg(existing.size() == 1 ? QString("One file") : QString("%1 files").arg(existing.size()),
+                           existing.size() == 1 ? QString("s") : QString(),
+                           existing.mid(0, 5).join('\n')),
+                  QMessageBox::Cancel, this);
+  QPushButton *resumeButton = box.addButton("Resume", QMessageBox::AcceptRole);
+  QPushButton *replaceButton = box.addButton("Replace", QMessageBox::DestructiveRole);
+  box.setDefaultButton(resumeButton);
+  box.exec();
+  if (box.clickedButton() == resumeButton) {
+    *resume = true;
+    return true;
+  }
+  return box.clickedButton() == replaceButton;
+}
+
+void SftpPanel::onUpload() {
+  if (!sftp_ || cwd_.isEmpty()) {
+    return;
+  }
+  QSettings settings("sshterminal", "sshterminal");
+  const QStringList paths =
+      QFileDialog::getOpenFileNames(this, "Upload", settings.value("sftp/localDir", QDir::homePath()).toString());
+  if (paths.isEmpty()) {
+    return;
+  }
+  settings.setValue("sftp/localDir", QFileInfo(paths.first()).absolutePath());
+  QStringList existing;
+  for (const QString &path : paths) {
+    const QString name = QFileInfo(path).fileName();
+    for (const SftpEntry &entry : entries_) {
+      if (entry.name == name) {
+        existing << name;
+      }
+    }
+  }
+  bool resume = false;
+  if (!askResume(existing, &resume)) {
+    return;
+  }
+  for (const QString &path : paths) {
+    addTransfer(SftpTransfer::Upload, remotePath(QFileInfo(path).fileName()), path, resume);
+  }
+}
+
+void SftpPanel::onDownload() {
+  QStringList names;
+  for (QTreeWidgetItem *item : files_->selectedItems()) {
+    const QString name = item->data(0, Qt::UserRole).toString();
+    for (const SftpEntry &entry : entries_) {
+      if (entry.name == name && !entry.isDir()) {
+        names << name;
+      }
+    }
+  }
+  if (!sftp_ || names.isEmpty()) {
+    status_->setText("Select files to download; folders are not copied");
+    return;
+  }
+  QSettings settings("sshterminal", "sshterminal");
+  const QString dir = QFileDialog::getExistingDirectory(
+      this, "Download to", settings.value("sftp/localDir", QDir::homePath()).toString());
+  if (dir.isEmpty()) {
+    return;
+  }
+  settings.setValue("sftp/localDir", dir);
+  QStringList existing;
+  for (const QString &name : names) {
+    if (QFileInfo::exists(QDir(dir).filePath(name))) {
+      existing << name;
+    }
+  }
+  bool resume = false;
+  if (!askResume(existing, &resume)) {
+    return;
+  }
+  for (const QString &name : names) {
+    addTransfer(SftpTransfer::Download, remotePath(name), QDir(dir).filePath(name), resume);
+  }
+}
+
+void SftpPanel::addTransfer(SftpTransfer::Direction direction, const QString &remotePath, const QString &localPath,
+                            bool resume) {
+  auto transfer = std::make_shared<SftpTransfer>();
+  transfer->direction = direction;
+  transfer->remotePath = remotePath;
+  transfer->localPath = localPath;
+  transfer->resume = resume;
+
+  Row row;
+  row.transfer = transfer;
+  row.item = new QTreeWidgetItem(transfers_);
+  row.item->setText(0, direction == SftpTransfer::Download ? QString("↓ %1").arg(remotePath)
+                                                           : QString("↑ %1").arg(localPath));
+  row.item->setToolTip(0, direction == SftpTransfer::Download ? QString("%1 → %2").arg(remotePath, localPath)
+                                                              : QString("%1 → %2").arg(localPath, remotePath));
+  rows_.append(row);
+
+  SftpCommand command;
+  command.kind = SftpCommand::Transfer;
+  command.transfer = transfer;
+  queue(std::move(command));
+  updateTransfers();
+}
+
+void SftpPanel::onCancelTransfers() {
+  const QList<QTreeWidgetItem *> selected = transfers_->selectedItems();
+  for (const Row &row : rows_) {
+    if (selected.isEmpty() || selected.contains(row.item)) {
+      row.transfer->cancelRequested = true;
+    }
+  }
+  if (sftp_) {
+    sftp_->connection->reactor->wake();
+  }
+}
+
+void SftpPanel::onClearTransfers() {
+  for (int i = 0; i < rows_.size();) {
+    const int state = rows_.at(i).transfer->state;
+    if (state == SftpTransfer::Done || state == SftpTransfer::Failed || state == SftpTransfer::Cancelled) {
+      delete rows_.at(i).item;
+      rows_.removeAt(i);
+      continue;
+    }
+    ++i;
+  }
+}
+
+void SftpPanel::onLimitsChanged() {
+  QSettings settings("sshterminal", "sshterminal");
+  settings.setValue("sftp/maxTransfers", parallel_->value());
+  settings.setValue("sftp/rateLimitKBps", rateLimit_->value());
+  if (!sftp_) {
+    return;
+  }
+  sftp_->maxTransfers = parallel_->value();
+  sftp_->rateLimit = qint64(rateLimit_->value()) * 1024;
+  sftp_->connection->reactor->wake();
+}
+
+void SftpPanel::updateTransfers() {
+  flushCommands();
+  const double seconds = timer_->interval() / 1000.0;
+  for (Row &row : rows_) {
+    const SftpTransfer &t = *row.transfer;
+    const qint64 done = t.done;
+    const qint64 size = t.size;
+    const int state = t.state;
+    row.item->setText(1, size > 0 ? QString("%1 of %2 (%3%)")
+                                          .arg(formatSize(done), formatSize(size))
+                                          .arg(done * 100 / size)
+                                    : formatSize(done));
+    switch (state) {
+    case SftpTransfer::Queued:
+      row.item->setText(3, "Queued");
+      break;
+    case SftpTransfer::Running: {
+      const double rate = qMax<qint64>(0, done - row.lastDone) / seconds;
+      row.item->setText(2, QString("%1/s").arg(formatSize(qint64(rate))));
+      row.item->setText(3, t.resumedFrom > 0 ? QString("Resumed at %1").arg(formatSize(t.resumedFrom))
+                                             : QString("Copying"));
+      break;
+    }
+    case SftpTransfer::Done:
+      row.item->setText(2, QString());
+      row.item->setText(3, "Done");
+      break;
+    case SftpTransfer::Failed:
+      row.item->setText(2, QString());
+      row.item->setText(3, QString("Failed: %1").arg(t.error));
+      row.item->setToolTip(3, t.error);
+      break;
+    case SftpTransfer::Cancelled:
+      row.item->setText(2, QString());
+      row.item->setText(3, "Cancelled");
+      break;
+    }
+    row.lastDone = done;
+  }
+}
@@ -0,0 +1,1840 @@
+#include "SshReactor.h"
+#include "PerfStats.h"
+#include "SftpChannel.h"
+#include "SftpPanel.h"
+#include "SshSession.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QHash>
+#include <QThread>
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(Q_OS_WIN)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#if defined(Q_OS_LINUX)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace {
+
+constexpr int kReadBufferSize = 64 * 1024;
+// Per endpoint and loop iteration, so one flood cannot starve the others.
+constexpr int kMaxReadPerPass = 1024 * 1024;
+// Retry interval while a channel's remote window is full.
+constexpr int kWriteRetryMs = 10;
+// Consecutive writes (typically keystrokes) are merged into one channel write
+// up to this size.
+constexpr int kWriteCoalesceBytes = 64 * 1024;
+// Upper bound on a wait while any endpoint is still connecting; libssh may
+// want another call without the socket changing state.
+constexpr int kConnectTickMs = 50;
+constexpr int kMaxThreads = 16;
+
+// Bit flags.
+enum Interest { NoInterest = 0, ReadInterest = 1, WriteInterest = 2 };
+
+#if defined(MSG_NOSIGNAL)
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0; // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+// The socket calls that differ between BSD sockets and Winsock. Sockets are
+// kept as int: a Winsock SOCKET fits in one, and INVALID_SOCKET becomes -1.
+#if defined(Q_OS_WIN)
+using NativeSocket = SOCKET;
+constexpr int kShutdownWrite = SD_SEND;
+
+void initSockets() {
+  static const bool started = []() {
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+  }();
+  Q_UNUSED(started);
+}
+int socketError() { return WSAGetLastError(); }
+bool wouldBlock(int error) { return error == WSAEWOULDBLOCK; }
+bool connectPending(int error) { return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS; }
+bool interrupted(int error) { return error == WSAEINTR; }
+void closeSocket(int fd) { ::closesocket(NativeSocket(fd)); }
+int socketRecv(int fd, char *data, int size) { return ::recv(NativeSocket(fd), data, size, 0); }
+int socketSend(int fd, const char *data, int size) { return ::send(NativeSocket(fd), data, size, kSendFlags); }
+// WSAPoll skips entries whose socket is INVALID_SOCKET, as poll() skips -1.
+int pollSockets(pollfd *fds, int count, int timeoutMs) { return ::WSAPoll(fds, ULONG(count), timeoutMs); }
+#else
+using NativeSocket = int;
+constexpr int kShutdownWrite = SHUT_WR;
+
+void initSockets() {}
+int socketError() { return errno; }
+bool wouldBlock(int error) { return error == EAGAIN || error == EWOULDBLOCK; }
+bool connectPending(int error) { return error == EINPROGRESS; }
+bool interrupted(int error) { return error == EINTR; }
+void closeSocket(int fd) { ::close(fd); }
+int socketRecv(int fd, char *data, int size) { return int(::recv(fd, data, size_t(size), 0)); }
+int socketSend(int fd, const char *data, int size) { return int(::send(fd, data, size_t(size), kSendFlags)); }
+int pollSockets(pollfd *fds, int count, int timeoutMs) { return ::poll(fds, nfds_t(count), timeoutMs); }
+#endif
+
+QString socketErrorString(int error) {
+  return qt_error_string(error);
+}
+
+void setSocketOption(int fd, int level, int name, int value) {
+  ::setsockopt(NativeSocket(fd), level, name, reinterpret_cast<const char *>(&value), socklen_t(sizeof(value)));
+}
+
+const QEvent::Type kEndpointEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+const QEvent::Type kSftpEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+
+enum EventKind { OutputEvent, WrittenEvent, ProgressEvent, ClosedEvent };
+
+class EndpointEvent : public QEvent {
+public:
+  EndpointEvent(const std::shared_ptr<SshEndpoint> &endpoint, int kind, SshPhase phase)
+      : QEvent(kEndpointEvent), endpoint(endpoint), kind(kind), phase(phase) {}
+
+  std::shared_ptr<SshEndpoint> endpoint;
+  int kind;
+  SshPhase phase;
+};
+
+class SftpEvent : public QEvent {
+public:
+  explicit SftpEvent(const std::shared_ptr<SftpChannel> &sftp) : QEvent(kSftpEvent), sftp(sftp) {}
+
+  std::shared_ptr<SftpChannel> sftp;
+};
+
+int phaseTimeoutMs(SshPhase phase) {
+  switch (phase) {
+  case SshPhase::TcpConnect:
+  case SshPhase::Handshake:
+    return 15000;
+  case SshPhase::Authenticating:
+    return 30000; // agents and hardware keys may prompt the user
+  case SshPhase::OpeningChannel:
+  case SshPhase::RequestingPty:
+  case SshPhase::StartingShell:
+    return 10000;
+  case SshPhase::Ready:
+    break;
+  }
+  return -1;
+}
+
+bool toSockaddr(const QHostAddress &address, quint16 port, sockaddr_storage *storage, socklen_t *length) {
+  std::memset(storage, 0, sizeof(*storage));
+  if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+    auto *in = reinterpret_cast<sockaddr_in *>(storage);
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr.s_addr = htonl(address.toIPv4Address());
+    *length = sizeof(sockaddr_in);
+    return true;
+  }
+  if (address.protocol() == QAbstractSocket::IPv6Protocol) {
+    auto *in6 = reinterpret_cast<sockaddr_in6 *>(storage);
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    const Q_IPV6ADDR raw = address.toIPv6Address();
+    std::memcpy(&in6->sin6_addr, &raw, sizeof(raw));
+    in6->sin6_scope_id = address.scopeId().toUInt();
+    *length = sizeof(sockaddr_in6);
+    return true;
+  }
+  return false;
+}
+
+// Buffer sizes must be set before connect() to affect window scaling.
+void applySocketOptions(int fd, const SshTransport &transport) {
+  setSocketOption(fd, IPPROTO_TCP, TCP_NODELAY, transport.tcpNoDelay ? 1 : 0);
+  if (transport.sendBufferKB > 0) {
+    setSocketOption(fd, SOL_SOCKET, SO_SNDBUF, transport.sendBufferKB * 1024);
+  }
+  if (transport.receiveBufferKB > 0) {
+    setSocketOption(fd, SOL_SOCKET, SO_RCVBUF, transport.receiveBufferKB * 1024);
+  }
+}
+
+QVector<SshReactor *> &pool() {
+  static QVector<SshReactor *> reactors;
+  return reactors;
+}
+
+QHash<QString, std::shared_ptr<SshConnection>> &registry() {
+  static QHash<QString, std::shared_ptr<SshConnection>> connections;
+  return connections;
+}
+
+// What the poller should wait for on a connection's socket.
+int wantedInterest(const SshConnection *connection) {
+  if (connection->fd < 0 || connection->closed) {
+    return NoInterest;
+  }
+  if (connection->phase == SshPhase::TcpConnect) {
+    return WriteInterest;
+  }
+  if (connection->phase != SshPhase::Ready) {
+    return ReadInterest;
+  }
+  // Reading any channel pulls packets for all of them, so the socket is
+  // only ignored once every channel's output ring is full.
+  for (const auto &tunnel : connection->tunnels) {
+    if (!tunnel->closed && tunnel->down.spaceSize() > 0) {
+      return ReadInterest;
+    }
+  }
+  for (const auto &endpoint : connection->endpoints) {
+    if (!endpoint->outputStalled) {
+      return ReadInterest;
+    }
+  }
+  for (const auto &sftp : connection->sftp) {
+    if (!sftp->isClosed()) {
+      return ReadInterest;
+    }
+  }
+  return NoInterest;
+}
+
+int tunnelInterest(const SshTunnel *tunnel) {
+  if (tunnel->closed || tunnel->fd < 0) {
+    return NoInterest;
+  }
+  int interest = NoInterest;
+  if (tunnel->state != SshTunnel::Opening && !tunnel->socketEof && tunnel->up.spaceSize() > 0) {
+    interest |= ReadInterest;
+  }
+  if (tunnel->down.pendingSize() > 0) {
+    interest |= WriteInterest;
+  }
+  return interest;
+}
+
+quint16 sockaddrPort(const sockaddr_storage &storage) {
+  if (storage.ss_family == AF_INET) {
+    return ntohs(reinterpret_cast<const sockaddr_in &>(storage).sin_port);
+  }
+  if (storage.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<const sockaddr_in6 &>(storage).sin6_port);
+  }
+  return 0;
+}
+
+void setNonBlocking(int fd) {
+#if defined(Q_OS_WIN)
+  u_long on = 1;
+  ::ioctlsocket(NativeSocket(fd), FIONBIO, &on);
+#else
+  ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+  ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+#if defined(SO_NOSIGPIPE)
+  setSocketOption(fd, SOL_SOCKET, SO_NOSIGPIPE, 1);
+#endif
+}
+
+// A connected pair of stream sockets. Winsock has no socketpair(), so there
+// it is a loopback TCP connection, checked to be the one just made and not
+// another local process that connected first.
+bool socketPair(int fds[2]) {
+#if defined(Q_OS_WIN)
+  initSockets();
+  const SOCKET listener = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == INVALID_SOCKET) {
+    return false;
+  }
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int length = sizeof(address);
+  SOCKET client = INVALID_SOCKET;
+  SOCKET server = INVALID_SOCKET;
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&address), length) == 0 &&
+      ::getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) == 0 && ::listen(listener, 1) == 0) {
+    client = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (client != INVALID_SOCKET && ::connect(client, reinterpret_cast<sockaddr *>(&address), length) == 0) {
+      server = ::accept(listener, nullptr, nullptr);
+    }
+  }
+  sockaddr_in near = {};
+  sockaddr_in far = {};
+  int nearLength = sizeof(near);
+  int farLength = sizeof(far);
+  const bool ok = server != INVALID_SOCKET &&
+                  ::getsockname(client, reinterpret_cast<sockaddr *>(&near), &nearLength) == 0 &&
+                  ::getpeername(server, reinterpret_cast<sockaddr *>(&far), &farLength) == 0 &&
+                  near.sin_port == far.sin_port && near.sin_addr.s_addr == far.sin_addr.s_addr;
+  ::closesocket(listener);
+  if (!ok) {
+    if (client != INVALID_SOCKET) {
+      ::closesocket(client);
+    }
+    if (server != INVALID_SOCKET) {
+      ::closesocket(server);
+    }
+    return false;
+  }
+  fds[0] = int(client);
+  fds[1] = int(server);
+  setSocketOption(fds[0], IPPROTO_TCP, TCP_NODELAY, 1);
+  setSocketOption(fds[1], IPPROTO_TCP, TCP_NODELAY, 1);
+  return true;
+#else
+  return ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+#endif
+}
+
+int poolSize() {
+  static const int size = qBound(1, qEnvironmentVariableIntValue("SSH_TERMINAL_IO_THREADS"), kMaxThreads);
+  return size;
+}
+
+} // namespace
+
+QString sshPhaseName(SshPhase phase) {
+  switch (phase) {
+  case SshPhase::TcpConnect:
+    return "Connecting";
+  case SshPhase::Handshake:
+    return "Negotiating";
+  case SshPhase::Authenticating:
+    return "Authenticating";
+  case SshPhase::OpeningChannel:
+    return "Opening channel";
+  case SshPhase::RequestingPty:
+    return "Requesting PTY";
+  case SshPhase::StartingShell:
+    return "Starting shell";
+  case SshPhase::Ready:
+    return "Connected";
+  }
+  return QString();
+}
+
+SshReactor *SshReactor::acquire() {
+  auto &reactors = pool();
+  SshReactor *best = nullptr;
+  for (SshReactor *r : reactors) {
+    if (!best || r->load_.load() < best->load_.load()) {
+      best = r;
+    }
+  }
+  if (best && (best->load_.load() == 0 || reactors.size() >= poolSize())) {
+    return best;
+  }
+  auto *reactor = new SshReactor(reactors.size(), QCoreApplication::instance());
+  reactors.append(reactor);
+  if (reactors.size() == 1) {
+    PerfStats::setReporter("reactor", []() {
+      const Stats s = SshReactor::totalStats();
+      return QString("threads=%1 connections=%2 channels=%3 loops=%4 read=%5MB written=%6KB")
+          .arg(pool().size())
+          .arg(s.connections)
+          .arg(s.endpoints)
+          .arg(s.loops)
+          .arg(s.bytesRead / 1048576.0, 0, 'f', 1)
+          .arg(s.bytesWritten / 1024.0, 0, 'f', 1);
+    });
+  }
+  return reactor;
+}
+
+SshReactor::Stats SshReactor::totalStats() {
+  Stats total;
+  for (SshReactor *r : pool()) {
+    total.endpoints += r->load_.load();
+    total.connections += r->connectionCount_.load();
+    total.loops += r->loops_.load();
+    total.bytesRead += r->bytesRead_.load();
+    total.bytesWritten += r->bytesWritten_.load();
+  }
+  return total;
+}
+
+std::shared_ptr<SshConnection> SshReactor::shareConnection(const QString &id) {
+  if (!hasConnection(id)) {
+    return nullptr;
+  }
+  const std::shared_ptr<SshConnection> connection = registry().value(id);
+  ++connection->users;
+  return connection;
+}
+
+bool SshReactor::hasConnection(const QString &id) {
+  const std::shared_ptr<SshConnection> connection = registry().value(id);
+  return connection && !connection->retired && !connection->failed;
+}
+
+void SshReactor::addConnection(const std::shared_ptr<SshConnection> &connection) {
+  if (!connection->reactor) {
+    connection->reactor = connection->jump ? connection->jump->reactor : acquire();
+  }
+  connection->users = 1;
+  registry().insert(connection->id, connection);
+}
+
+void SshReactor::releaseConnection(const std::shared_ptr<SshConnection> &connection) {
+  if (--connection->users > 0) {
+    return;
+  }
+  connection->retired = true;
+  auto &connections = registry();
+  if (connections.value(connection->id) == connection) {
+    connections.remove(connection->id);
+  }
+  if (connection->reactor) {
+    connection->reactor->wake();
+  }
+  if (connection->jump) {
+    releaseConnection(connection->jump);
+  }
+}
+
+QString SshReactor::connectionId(const QString &host, const QString &user, int port, const QString &keyPath,
+                                 const SshTransport &transport, const QString &jumpChain) {
+  const QString id = QString("%1@%2:%3|%4|%5").arg(user, host).arg(port).arg(keyPath, transport.id());
+  return jumpChain.isEmpty() ? id : QString("%1|via %2").arg(id, jumpChain);
+}
+
+#ifdef HAVE_LIBSSH
+ssh_session SshReactor::newSession(const QString &host, const QString &user, int port, const QString &keyPath,
+                                   const QString &keyPassphrase, const SshTransport &transport, ssh_key *key,
+                                   SshTarget *target, QString *error) {
+  ssh_session session = ssh_new();
+  if (!session) {
+    *error = "Failed to create SSH session";
+    return nullptr;
+  }
+  // The config goes first so the profile's own settings below override it.
+  if (!SshTarget::resolve(session, host, user, port, target, error)) {
+    ssh_free(session);
+    return nullptr;
+  }
+
+  // libssh rejects algorithm lists it does not support.
+  auto setList = [session, error](ssh_options_e option, const QString &value, const char *what) {
+    if (value.trimmed().isEmpty()) {
+      return true;
+    }
+    if (ssh_options_set(session, option, value.trimmed().toUtf8().constData()) != SSH_OK) {
+      *error = QString("Unsupported %1: %2").arg(what, value);
+      return false;
+    }
+    return true;
+  };
+  if (!setList(SSH_OPTIONS_CIPHERS_C_S, transport.ciphers, "ciphers") ||
+      !setList(SSH_OPTIONS_CIPHERS_S_C, transport.ciphers, "ciphers") ||
+      !setList(SSH_OPTIONS_HMAC_C_S, transport.macs, "MACs") ||
+      !setList(SSH_OPTIONS_HMAC_S_C, transport.macs, "MACs") ||
+      !setList(SSH_OPTIONS_KEY_EXCHANGE, transport.kex, "key exchange")) {
+    ssh_free(session);
+    return nullptr;
+  }
+  if (transport.compressionLevel > 0) {
+    const int level = qBound(1, transport.compressionLevel, 9);
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION_LEVEL, &level);
+  } else {
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "no");
+  }
+  if (transport.rekeyDataMB > 0) {
+    const uint64_t bytes = uint64_t(transport.rekeyDataMB) * 1024 * 1024;
+    ssh_options_set(session, SSH_OPTIONS_REKEY_DATA, &bytes);
+  }
+  if (transport.rekeyTimeSec > 0) {
+    const uint32_t seconds = uint32_t(transport.rekeyTimeSec);
+    ssh_options_set(session, SSH_OPTIONS_REKEY_TIME, &seconds);
+  }
+  // Only used when libssh opens the socket itself; the reactor applies the
+  // socket options to the sockets it connects.
+  const int nodelay = transport.tcpNoDelay ? 1 : 0;
+  ssh_options_set(session, SSH_OPTIONS_NODELAY, &nodelay);
+
+  // Key files are small and may need the passphrase error reported here;
+  // everything that talks to the network runs on the reactor.
+  *key = nullptr;
+  if (!keyPath.isEmpty()) {
+    const QByteArray keyPathBytes = keyPath.toUtf8();
+    const QByteArray passBytes = keyPassphrase.toUtf8();
+    const char *pass = passBytes.isEmpty() ? nullptr : passBytes.constData();
+    const int rc = ssh_pki_import_privkey_file(keyPathBytes.constData(), pass, nullptr, nullptr, key);
+    if (rc != SSH_OK || !*key) {
+      *error = QString("Failed to load key: %1").arg(ssh_get_error(session));
+      ssh_free(session);
+      *key = nullptr;
+      return nullptr;
+    }
+  }
+  return session;
+}
+#endif
+
+SshReactor::SshReactor(int index, QObject *parent) : QObject(parent) {
+  readBuffer_.resize(kReadBufferSize);
+  if (!openPoller()) {
+    qWarning("SshReactor: failed to create poller");
+  }
+  thread_ = QThread::create([this]() { run(); });
+  thread_->setObjectName(QString("ssh-reactor-%1").arg(index));
+  thread_->start();
+}
+
+SshReactor::~SshReactor() {
+  stopping_ = true;
+  wake();
+  thread_->wait();
+  delete thread_;
+  closePoller();
+  pool().removeAll(this);
+}
+
+void SshReactor::attach(const std::shared_ptr<SshEndpoint> &endpoint) {
+  {
+    QMutexLocker lock(&attachMutex_);
+    attaching_.append(endpoint);
+  }
+  ++load_;
+  wake();
+}
+
+void SshReactor::attachConnection(const std::shared_ptr<SshConnection> &connection) {
+  {
+    QMutexLocker lock(&attachMutex_);
+    attachingConnections_.append(connection);
+  }
+  wake();
+}
+
+std::shared_ptr<SshListener> SshReactor::openListener(const PortForward &forward, QString *error) {
+  const QHostAddress address(forward.bindAddress);
+  sockaddr_storage storage;
+  socklen_t length = 0;
+  if (!toSockaddr(address, forward.bindPort, &storage, &length)) {
+    *error = QString("invalid bind address %1").arg(forward.bindAddress);
+    return nullptr;
+  }
+  initSockets();
+  const int fd = int(::socket(storage.ss_family, SOCK_STREAM, 0));
+  if (fd < 0) {
+    *error = socketErrorString(socketError());
+    return nullptr;
+  }
+  setNonBlocking(fd);
+#if !defined(Q_OS_WIN)
+  // On Windows this would let another program bind the same port.
+  setSocketOption(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+#endif
+  if (::bind(NativeSocket(fd), reinterpret_cast<sockaddr *>(&storage), length) != 0 ||
+      ::listen(NativeSocket(fd), SOMAXCONN) != 0) {
+    *error = socketErrorString(socketError());
+    closeSocket(fd);
+    return nullptr;
+  }
+  auto listener = std::make_shared<SshListener>();
+  listener->forward = forward;
+  listener->fd = fd;
+  return listener;
+}
+
+void SshReactor::attachListener(const std::shared_ptr<SshListener> &listener) {
+  {
+    QMutexLocker lock(&attachMutex_);
+    attachingListeners_.append(listener);
+  }
+  wake();
+}
+
+void SshReactor::attachSftp(const std::shared_ptr<SftpChannel> &sftp) {
+  {
+    QMutexLocker lock(&attachMutex_);
+    attachingSftp_.append(sftp);
+  }
+  wake();
+}
+
+void SshReactor::wake() {
+  if (wakePending_.exchange(true)) {
+    return;
+  }
+#if defined(Q_OS_LINUX)
+  const quint64 one = 1;
+  ssize_t rc = ::write(wakeWrite_, &one, sizeof(one));
+  Q_UNUSED(rc);
+#else
+  const char byte = 1;
+  socketSend(wakeWrite_, &byte, 1);
+#endif
+}
+
+void SshReactor::customEvent(QEvent *event) {
+  if (event->type() == kSftpEvent) {
+    const std::shared_ptr<SftpChannel> &sftp = static_cast<SftpEvent *>(event)->sftp;
+    if (sftp->owner) {
+      sftp->owner->drainReplies();
+    }
+    return;
+  }
+  if (event->type() != kEndpointEvent) {
+    QObject::customEvent(event);
+    return;
+  }
+  auto *e = static_cast<EndpointEvent *>(event);
+  SshSession *owner = e->endpoint->owner;
+  if (!owner) {
+    return;
+  }
+  switch (e->kind) {
+  case OutputEvent:
+    owner->drainReactorOutput();
+    break;
+  case WrittenEvent:
+    owner->handleReactorWritten();
+    break;
+  case ProgressEvent:
+    owner->handleReactorProgress(e->phase);
+    break;
+  case ClosedEvent:
+    owner->handleReactorClosed();
+    break;
+  }
+}
+
+void SshReactor::run() {
+  while (!stopping_) {
+    {
+      QMutexLocker lock(&attachMutex_);
+      for (const auto &connection : attachingConnections_) {
+        adoptConnection(connection);
+      }
+      attachingConnections_.clear();
+      for (const auto &endpoint : attaching_) {
+        adopt(endpoint);
+      }
+      attaching_.clear();
+      for (const auto &listener : attachingListeners_) {
+        adoptListener(listener);
+      }
+      attachingListeners_.clear();
+      for (const auto &sftp : attachingSftp_) {
+        adoptSftp(sftp);
+      }
+      attachingSftp_.clear();
+    }
+
+    for (const auto &connection : connections_) {
+      serviceConnection(connection);
+    }
+    // Start one further along each pass so no channel is always first.
+    const int count = endpoints_.size();
+    if (count > 0) {
+      rotation_ = (rotation_ + 1) % count;
+    }
+    for (int i = 0; i < count; ++i) {
+      service(endpoints_.at((rotation_ + i) % count));
+    }
+    for (const auto &connection : connections_) {
+      markBuffered(connection.get());
+    }
+
+    bool readPending = false;
+    bool writePending = false;
+    int connectWaitMs = -1;
+    auto waitFor = [&connectWaitMs](const QDeadlineTimer &deadline, qint64 capMs) {
+      const int remaining = int(qMin<qint64>(deadline.remainingTime(), capMs));
+      connectWaitMs = connectWaitMs < 0 ? remaining : qMin(connectWaitMs, remaining);
+    };
+    for (int i = 0; i < endpoints_.size();) {
+      const std::shared_ptr<SshEndpoint> endpoint = endpoints_.at(i);
+      if (endpoint->closed) {
+        endpoint->connection->endpoints.removeOne(endpoint);
+        endpoints_.removeAt(i);
+        --load_;
+        continue;
+      }
+      if (endpoint->phase != SshPhase::Ready) {
+        if (endpoint->connection->phase == SshPhase::Ready) {
+          waitFor(endpoint->deadline, kConnectTickMs);
+        }
+        ++i;
+        continue;
+      }
+      readPending = readPending || (endpoint->needsRead && !endpoint->outputStalled);
+      writePending = writePending || !endpoint->writeBacklog.isEmpty();
+      ++i;
+    }
+    for (int i = 0; i < connections_.size();) {
+      const std::shared_ptr<SshConnection> connection = connections_.at(i);
+      if (!connection->closed && connection->retired && connection->endpoints.isEmpty()) {
+        closeConnection(connection, QString());
+      }
+      if (connection->closed) {
+        connections_.removeAt(i);
+        --connectionCount_;
+        continue;
+      }
+      if (connection->phase != SshPhase::Ready) {
+        waitFor(connection->deadline, kConnectTickMs);
+      } else if (connection->keepaliveMs.load() > 0) {
+        waitFor(connection->nextKeepalive, connection->keepaliveMs.load());
+      }
+      for (int t = 0; t < connection->tunnels.size();) {
+        SshTunnel *tunnel = connection->tunnels.at(t).get();
+        if (tunnel->closed) {
+          connection->tunnels.removeAt(t);
+          continue;
+        }
+        if (tunnel->state != SshTunnel::Open) {
+          waitFor(tunnel->deadline, kConnectTickMs);
+        } else {
+          readPending = readPending || (tunnel->readable && !tunnel->socketEof && tunnel->up.spaceSize() > 0) ||
+                        (tunnel->channelReadable && tunnel->down.spaceSize() > 0);
+          writePending = writePending || tunnel->up.pendingSize() > 0;
+        }
+        updateInterest(tunnel, tunnelInterest(tunnel));
+        ++t;
+      }
+      for (const auto &listener : connection->listeners) {
+        updateInterest(listener.get(), ReadInterest);
+      }
+      for (int s = 0; s < connection->sftp.size();) {
+        const SftpChannel *sftp = connection->sftp.at(s).get();
+        if (sftp->isClosed()) {
+          connection->sftp.removeAt(s);
+          continue;
+        }
+        readPending = readPending || sftp->readPending();
+        writePending = writePending || sftp->writePending();
+        const QDeadlineTimer wakeAt = sftp->wakeDeadline();
+        if (!wakeAt.isForever()) {
+          waitFor(wakeAt, kConnectTickMs);
+        }
+        ++s;
+      }
+      updateInterest(connection.get(), wantedInterest(connection.get()));
+      ++i;
+    }
+    ++loops_;
+
+    int timeoutMs = readPending ? 0 : (writePending ? kWriteRetryMs : -1);
+    if (connectWaitMs >= 0 && (timeoutMs < 0 || connectWaitMs < timeoutMs)) {
+      timeoutMs = connectWaitMs;
+    }
+    waitForEvents(timeoutMs);
+  }
+
+  for (const auto &connection : connections_) {
+    closeConnection(connection, QString());
+  }
+  connections_.clear();
+  endpoints_.clear();
+}
+
+void SshReactor::adopt(const std::shared_ptr<SshEndpoint> &endpoint) {
+  const std::shared_ptr<SshConnection> &connection = endpoint->connection;
+  endpoints_.append(endpoint);
+  adoptConnection(connection);
+  if (connection->closed) {
+    closeEndpoint(endpoint, connection->error.isEmpty() ? QString("SSH connection closed") : connection->error);
+    return;
+  }
+  connection->endpoints.append(endpoint);
+  if (connection->phase == SshPhase::Ready) {
+    // Already authenticated: only the channel round trips remain.
+    endpoint->phase = SshPhase::Authenticating;
+  } else if (connection->fd >= 0) {
+    endpoint->phase = connection->phase;
+    post(endpoint, ProgressEvent);
+  }
+}
+
+void SshReactor::adoptListener(const std::shared_ptr<SshListener> &listener) {
+  const std::shared_ptr<SshConnection> connection = listener->connection;
+  adoptConnection(connection);
+  if (connection->closed) {
+    closeListener(listener);
+    return;
+  }
+  connection->listeners.append(listener);
+}
+
+void SshReactor::adoptSftp(const std::shared_ptr<SftpChannel> &sftp) {
+  const std::shared_ptr<SshConnection> &connection = sftp->connection;
+  adoptConnection(connection);
+  if (connection->closed) {
+    sftp->close(connection->error.isEmpty() ? QString("SSH connection closed") : connection->error);
+  } else {
+    connection->sftp.append(sftp);
+  }
+  postSftp(sftp);
+}
+
+void SshReactor::adoptConnection(const std::shared_ptr<SshConnection> &connection) {
+  if (connection->adopted) {
+    return;
+  }
+  connection->adopted = true;
+  // The jump host goes first so it is serviced ahead of the connections
+  // riding on it.
+  if (connection->jump) {
+    adoptConnection(connection->jump);
+  }
+  connections_.append(connection);
+  ++connectionCount_;
+}
+
+void SshReactor::serviceConnection(const std::shared_ptr<SshConnection> &connection) {
+  if (connection->closed) {
+    return;
+  }
+  if (connection->phase != SshPhase::Ready) {
+    advanceConnect(connection);
+    return;
+  }
+#ifdef HAVE_LIBSSH
+  const int keepaliveMs = connection->keepaliveMs.load();
+  if (keepaliveMs > 0 && connection->nextKeepalive.hasExpired()) {
+    // Also how an idle connection notices a dead peer: the write fails.
+    if (ssh_send_keepalive(connection->session) == SSH_ERROR) {
+      closeConnection(connection, QString("SSH keepalive failed: %1").arg(ssh_get_error(connection->session)));
+      return;
+    }
+    connection->nextKeepalive = QDeadlineTimer(keepaliveMs);
+  }
+#endif
+  if (connection->readable) {
+    connection->readable = false;
+    for (const auto &endpoint : connection->endpoints) {
+      endpoint->needsRead = true;
+    }
+    for (const auto &tunnel : connection->tunnels) {
+      tunnel->channelReadable = true;
+    }
+    for (const auto &sftp : connection->sftp) {
+      sftp->markReadable();
+    }
+  }
+  for (const auto &listener : connection->listeners) {
+    acceptTunnels(listener);
+  }
+  // Copied: closing the connection from inside a tunnel clears the list.
+  const QVector<std::shared_ptr<SshTunnel>> tunnels = connection->tunnels;
+  for (const auto &tunnel : tunnels) {
+    serviceTunnel(tunnel);
+  }
+  const QVector<std::shared_ptr<SftpChannel>> sftps = connection->sftp;
+  for (const auto &sftp : sftps) {
+    serviceSftp(sftp);
+  }
+}
+
+void SshReactor::serviceSftp(const std::shared_ptr<SftpChannel> &sftp) {
+  if (sftp->readPending() || sftp->writePending()) {
+    sftp->connection->pumped = true;
+  }
+  QString error;
+  if (!sftp->service(&error)) {
+    closeConnection(sftp->connection, error);
+  }
+  bytesRead_ += sftp->takeBytesRead();
+  bytesWritten_ += sftp->takeBytesWritten();
+  postSftp(sftp);
+}
+
+void SshReactor::service(const std::shared_ptr<SshEndpoint> &endpoint) {
+  if (endpoint->closed) {
+    return;
+  }
+  if (endpoint->closeRequested) {
+    closeEndpoint(endpoint, QString());
+    return;
+  }
+  if (endpoint->phase != SshPhase::Ready) {
+    if (endpoint->connection->phase != SshPhase::Ready) {
+      return; // still waiting for the shared connection
+    }
+    while (stepChannel(endpoint)) {
+    }
+    if (!endpoint->closed && endpoint->phase != SshPhase::Ready && endpoint->deadline.hasExpired()) {
+      closeEndpoint(endpoint, QString("Timed out: %1").arg(sshPhaseName(endpoint->phase).toLower()));
+    }
+    if (endpoint->closed || endpoint->phase != SshPhase::Ready) {
+      return;
+    }
+  }
+
+  flushWrites(endpoint);
+  SshCommand command;
+  bool appended = false;
+  while (!endpoint->closed && endpoint->writeBacklog.size() - endpoint->writeOffset < kWriteCoalesceBytes &&
+         endpoint->input.pop(&command)) {
+    if (command.kind == SshCommand::Write) {
+      if (endpoint->writeBacklog.isEmpty()) {
+        endpoint->writeBacklog = std::move(command.data);
+      } else {
+        endpoint->writeBacklog.append(command.data);
+      }
+      appended = true;
+    } else {
+      // Window changes are channel requests, not stream data; they need not
+      // wait behind queued input.
+#ifdef HAVE_LIBSSH
+      ssh_channel_change_pty_size(endpoint->channel, command.cols, command.rows);
+#endif
+    }
+  }
+  if (appended) {
+    flushWrites(endpoint);
+  }
+  if (endpoint->closed) {
+    return;
+  }
+
+  // Resume a session whose output ring the GUI has drained.
+  if (endpoint->outputStalled && !endpoint->output.full()) {
+    endpoint->outputStalled = false;
+    endpoint->needsRead = true;
+  }
+  if (endpoint->needsRead && !endpoint->outputStalled) {
+    readOutput(endpoint);
+  }
+}
+
+void SshReactor::advanceConnect(const std::shared_ptr<SshConnection> &connection) {
+  if (connection->phase == SshPhase::TcpConnect && connection->fd < 0) {
+    if (!connection->connectTimer.isValid()) {
+      // First pass after the connection was attached.
+      connection->connectTimer.start();
+      enterConnectionPhase(connection, SshPhase::TcpConnect);
+    }
+    if (connection->jump) {
+      if (!startJump(connection)) {
+        return;
+      }
+    } else if (!startTcpConnect(connection.get())) {
+      closeConnection(connection, QString("SSH connect failed: %1").arg(connection->error));
+      return;
+    }
+  }
+  // Run phases back to back for as long as libssh does not have to wait.
+  while (stepConnect(connection)) {
+  }
+  if (!connection->closed && connection->phase != SshPhase::Ready && connection->deadline.hasExpired()) {
+    closeConnection(connection, QString("Timed out: %1").arg(sshPhaseName(connection->phase).toLower()));
+  }
+}
+
+// Tries the remaining resolved addresses in order until one accepts a
+// non-blocking connect().
+bool SshReactor::startTcpConnect(SshConnection *connection) {
+#ifdef HAVE_LIBSSH
+  initSockets();
+  connection->error = "no usable address";
+  while (connection->addressIndex < connection->addresses.size()) {
+    const QHostAddress address = connection->addresses.at(connection->addressIndex++);
+    sockaddr_storage storage;
+    socklen_t length = 0;
+    if (!toSockaddr(address, connection->port, &storage, &length)) {
+      continue;
+    }
+    const int fd = int(::socket(storage.ss_family, SOCK_STREAM, 0));
+    if (fd < 0) {
+      connection->error = socketErrorString(socketError());
+      continue;
+    }
+    setNonBlocking(fd);
+    applySocketOptions(fd, connection->transport);
+    if (::connect(NativeSocket(fd), reinterpret_cast<sockaddr *>(&storage), length) == 0 ||
+        connectPending(socketError())) {
+      connection->error.clear();
+      connection->fd = fd;
+      connection->fdOwned = true;
+      return true;
+    }
+    connection->error = socketErrorString(socketError());
+    closeSocket(fd);
+  }
+#else
+  Q_UNUSED(connection);
+#endif
+  return false;
+}
+
+// Opens the connection's socket through its jump host once that is
+// authenticated: a socketpair whose far end the jump host pumps to and from
+// a direct-tcpip channel to the target, like a local forward. libssh then
+// treats the near end as the TCP connection. Returns false while the jump
+// host is still connecting or when the connection was closed.
+bool SshReactor::startJump(const std::shared_ptr<SshConnection> &connection) {
+  const std::shared_ptr<SshConnection> &jump = connection->jump;
+  if (jump->closed) {
+    closeConnection(connection, QString("Jump host: %1").arg(jump->error.isEmpty() ? QString("connection closed")
+                                                                                   : jump->error));
+    return false;
+  }
+  if (jump->phase != SshPhase::Ready) {
+    // The jump host runs its own phase timeouts.
+    connection->deadline = QDeadlineTimer(phaseTimeoutMs(SshPhase::TcpConnect));
+    return false;
+  }
+#ifdef HAVE_LIBSSH
+  int fds[2];
+  if (!socketPair(fds)) {
+    closeConnection(connection, QString("SSH connect failed: %1").arg(socketErrorString(socketError())));
+    return false;
+  }
+  setNonBlocking(fds[0]);
+  setNonBlocking(fds[1]);
+  auto tunnel = std::make_shared<SshTunnel>();
+  tunnel->fd = fds[1];
+  tunnel->connection = jump;
+  tunnel->carried = connection;
+  tunnel->targetHost = connection->host;
+  tunnel->targetPort = connection->port;
+  tunnel->originHost = "127.0.0.1";
+  tunnel->deadline = QDeadlineTimer(phaseTimeoutMs(SshPhase::OpeningChannel));
+  jump->tunnels.append(tunnel);
+  connection->fd = fds[0];
+  connection->fdOwned = true;
+  return true;
+#else
+  closeConnection(connection, "libssh not available at build time");
+  return false;
+#endif
+}
+
+// Moves the connection to `phase` and reports it through every channel still
+// waiting on it.
+void SshReactor::enterConnectionPhase(const std::shared_ptr<SshConnection> &connection, SshPhase phase) {
+  connection->phase = phase;
+  const int timeout = phaseTimeoutMs(phase);
+  connection->deadline = timeout < 0 ? QDeadlineTimer(QDeadlineTimer::Forever) : QDeadlineTimer(timeout);
+  for (const auto &endpoint : connection->endpoints) {
+    if (phase == SshPhase::Ready) {
+      endpoint->phase = SshPhase::Authenticating;
+    } else {
+      endpoint->phase = phase;
+      post(endpoint, ProgressEvent);
+    }
+  }
+}
+
+void SshReactor::enterPhase(const std::shared_ptr<SshEndpoint> &endpoint, SshPhase phase) {
+  endpoint->phase = phase;
+  const int timeout = phaseTimeoutMs(phase);
+  endpoint->deadline = timeout < 0 ? QDeadlineTimer(QDeadlineTimer::Forever) : QDeadlineTimer(timeout);
+  post(endpoint, ProgressEvent);
+}
+
+// Advances the connection's current phase. Returns true when the next one can
+// be tried right away, false when libssh is waiting on the network or the
+// connection closed.
+bool SshReactor::stepConnect(const std::shared_ptr<SshConnection> &connection) {
+  if (connection->closed || connection->phase == SshPhase::Ready) {
+    return false;
+  }
+#ifdef HAVE_LIBSSH
+  ssh_session session = connection->session;
+  int rc = SSH_OK;
+  switch (connection->phase) {
+  case SshPhase::TcpConnect: {
+    pollfd pfd = {NativeSocket(connection->fd), POLLOUT, 0};
+    if (pollSockets(&pfd, 1, 0) <= 0) {
+      return false;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    ::getsockopt(NativeSocket(connection->fd), SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&err), &len);
+    if (err != 0) {
+      unwatch(connection.get());
+      closeSocket(connection->fd);
+      connection->fd = -1;
+      connection->fdOwned = false;
+      if (!startTcpConnect(connection.get())) {
+        closeConnection(connection, QString("SSH connect failed: %1").arg(socketErrorString(err)));
+      }
+      return false;
+    }
+    // libssh owns and closes the socket from here on. The address was
+    // resolved from the config's HostName, which known_hosts is checked for.
+    const socket_t fd = socket_t(connection->fd);
+    ssh_options_set(session, SSH_OPTIONS_FD, &fd);
+    connection->fdOwned = false;
+    ssh_set_blocking(session, 0);
+    enterConnectionPhase(connection, SshPhase::Handshake);
+    return true;
+  }
+  case SshPhase::Handshake:
+    rc = ssh_connect(session);
+    if (rc == SSH_AGAIN) {
+      return false;
+    }
+    if (rc != SSH_OK) {
+      closeConnection(connection, QString("SSH connect failed: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    enterConnectionPhase(connection, SshPhase::Authenticating);
+    return true;
+  case SshPhase::Authenticating:
+    if (connection->key) {
+      rc = ssh_userauth_publickey(session, nullptr, connection->key);
+    } else if (connection->password.isEmpty()) {
+      rc = ssh_userauth_publickey_auto(session, nullptr, nullptr);
+    } else {
+      rc = ssh_userauth_password(session, nullptr, connection->password.constData());
+    }
+    if (rc == SSH_AUTH_AGAIN) {
+      return false;
+    }
+    if (connection->key) {
+      ssh_key_free(connection->key);
+      connection->key = nullptr;
+    }
+    connection->password.fill('\0');
+    if (rc != SSH_AUTH_SUCCESS) {
+      closeConnection(connection, QString("SSH auth failed: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    connection->connectMs = connection->connectTimer.elapsed();
+    connection->nextKeepalive = QDeadlineTimer(connection->keepaliveMs.load());
+    enterConnectionPhase(connection, SshPhase::Ready);
+    return false;
+  default:
+    break;
+  }
+#else
+  closeConnection(connection, "libssh not available at build time");
+#endif
+  return false;
+}
+
+// Opens the endpoint's channel on its authenticated connection; same return
+// convention as stepConnect().
+bool SshReactor::stepChannel(const std::shared_ptr<SshEndpoint> &endpoint) {
+  if (endpoint->closed || endpoint->phase == SshPhase::Ready) {
+    return false;
+  }
+#ifdef HAVE_LIBSSH
+  ssh_session session = endpoint->connection->session;
+  int rc = SSH_OK;
+  switch (endpoint->phase) {
+  case SshPhase::OpeningChannel:
+    rc = ssh_channel_open_session(endpoint->channel);
+    if (rc == SSH_AGAIN) {
+      return false;
+    }
+    if (rc != SSH_OK) {
+      closeEndpoint(endpoint, QString("Failed to open channel: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    enterPhase(endpoint, SshPhase::RequestingPty);
+    return true;
+  case SshPhase::RequestingPty:
+    rc = ssh_channel_request_pty_size(endpoint->channel, "xterm", endpoint->ptyCols, endpoint->ptyRows);
+    if (rc == SSH_AGAIN) {
+      return false;
+    }
+    if (rc != SSH_OK) {
+      closeEndpoint(endpoint, QString("Failed to request PTY: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    enterPhase(endpoint, SshPhase::StartingShell);
+    return true;
+  case SshPhase::StartingShell:
+    rc = ssh_channel_request_shell(endpoint->channel);
+    if (rc == SSH_AGAIN) {
+      return false;
+    }
+    if (rc != SSH_OK) {
+      closeEndpoint(endpoint, QString("Failed to request shell: %1").arg(ssh_get_error(session)));
+      return false;
+    }
+    enterPhase(endpoint, SshPhase::Ready);
+    endpoint->needsRead = true;
+    return false;
+  default:
+    // The connection just became ready.
+    endpoint->channel = ssh_channel_new(session);
+    if (!endpoint->channel) {
+      closeEndpoint(endpoint, "Failed to create SSH channel");
+      return false;
+    }
+    enterPhase(endpoint, SshPhase::OpeningChannel);
+    return true;
+  }
+#else
+  closeEndpoint(endpoint, "libssh not available at build time");
+  return false;
+#endif
+}
+
+// Writes as much of the backlog as the channel window takes. Short writes
+// keep their offset so a large paste is never copied down per chunk.
+void SshReactor::flushWrites(const std::shared_ptr<SshEndpoint> &endpoint) {
+  qint64 written = 0;
+#ifdef HAVE_LIBSSH
+  if (endpoint->writeOffset < endpoint->writeBacklog.size()) {
+    endpoint->connection->pumped = true;
+  }
+  while (endpoint->writeOffset < endpoint->writeBacklog.size()) {
+    const int n = ssh_channel_write(endpoint->channel, endpoint->writeBacklog.constData() + endpoint->writeOffset,
+                                    uint32_t(endpoint->writeBacklog.size() - endpoint->writeOffset));
+    if (n == SSH_ERROR) {
+      closeConnection(endpoint->connection,
+                      QString("SSH write failed: %1").arg(ssh_get_error(endpoint->connection->session)));
+      return;
+    }
+    // Writing processes incoming packets too, which may buffer output
+    // inside libssh without leaving the socket readable.
+    endpoint->needsRead = true;
+    if (n <= 0) {
+      break; // remote window full; retried on the next pass
+    }
+    written += n;
+    endpoint->writeOffset += n;
+  }
+#else
+  written = endpoint->writeBacklog.size() - endpoint->writeOffset;
+  endpoint->writeOffset = endpoint->writeBacklog.size();
+#endif
+  if (endpoint->writeOffset == endpoint->writeBacklog.size()) {
+    endpoint->writeBacklog.clear();
+    endpoint->writeOffset = 0;
+  }
+  if (written == 0) {
+    return;
+  }
+  bytesWritten_ += quint64(written);
+  const qint64 queued = endpoint->queuedBytes -= written;
+  if (queued <= SshEndpoint::kWriteLowWater && endpoint->drainWanted.exchange(false)) {
+    post(endpoint, WrittenEvent);
+  }
+}
+
+void SshReactor::readOutput(const std::shared_ptr<SshEndpoint> &endpoint) {
+#ifdef HAVE_LIBSSH
+  endpoint->needsRead = false;
+  endpoint->connection->pumped = true;
+  char *buffer = readBuffer_.data();
+  int total = 0;
+  bool pushed = false;
+  bool more = true;
+  while (more) {
+    more = false;
+    // stdout first, then stderr; the terminal shows both like ssh(1) does.
+    for (int isStderr = 0; isStderr < 2; ++isStderr) {
+      if (endpoint->output.full()) {
+        endpoint->outputStalled = true;
+        // The GUI may have drained the ring in between; it only wakes us
+        // for rings it saw stalled.
+        if (!endpoint->output.full()) {
+          endpoint->outputStalled = false;
+          endpoint->needsRead = true;
+        }
+        more = false;
+        break;
+      }
+      const int n = ssh_channel_read_nonblocking(endpoint->channel, buffer, kReadBufferSize, isStderr);
+      if (n == SSH_ERROR) {
+        closeConnection(endpoint->connection,
+                        QString("SSH read failed: %1").arg(ssh_get_error(endpoint->connection->session)));
+        return;
+      }
+      if (n > 0) {
+        QByteArray chunk(buffer, n);
+        endpoint->output.push(std::move(chunk));
+        bytesRead_ += quint64(n);
+        total += n;
+        pushed = true;
+        more = true;
+      }
+    }
+    if (more && total >= kMaxReadPerPass) {
+      endpoint->needsRead = true;
+      break;
+    }
+  }
+
+  if (pushed && !endpoint->outputPosted.exchange(true)) {
+    post(endpoint, OutputEvent);
+  }
+  if (!pushed && !endpoint->needsRead &&
+      (ssh_channel_is_eof(endpoint->channel) || ssh_channel_is_closed(endpoint->channel))) {
+    closeEndpoint(endpoint, QString());
+  }
+#else
+  endpoint->needsRead = false;
+#endif
+}
+
+// Any libssh read or write handles every packet that has arrived on the
+// connection, so data for its other channels can wait in libssh's buffers
+// with nothing left on the socket to wake the loop. After a pass that did
+// channel I/O, channels holding data are marked to be read. EOF only counts
+// where reading it still has an effect, so a finished channel cannot keep
+// the loop spinning.
+void SshReactor::markBuffered(SshConnection *connection) {
+  if (!connection->pumped) {
+    return;
+  }
+  connection->pumped = false;
+#ifdef HAVE_LIBSSH
+  for (const auto &endpoint : connection->endpoints) {
+    if (endpoint->closed || endpoint->phase != SshPhase::Ready || endpoint->needsRead || endpoint->outputStalled) {
+      continue;
+    }
+    if (ssh_channel_poll(endpoint->channel, 0) != 0 || ssh_channel_poll(endpoint->channel, 1) != 0) {
+      endpoint->needsRead = true;
+    }
+  }
+  for (const auto &tunnel : connection->tunnels) {
+    if (tunnel->closed || tunnel->state != SshTunnel::Open || tunnel->channelReadable ||
+        tunnel->down.spaceSize() == 0) {
+      continue;
+    }
+    const int n = ssh_channel_poll(tunnel->channel, 0);
+    if (n > 0 || n == SSH_ERROR ||
+        (n == SSH_EOF && tunnel->down.pendingSize() == 0 && !tunnel->socketShutdown)) {
+      tunnel->channelReadable = true;
+    }
+  }
+  for (const auto &sftp : connection->sftp) {
+    sftp->markIfBuffered();
+  }
+#endif
+}
+
+// Closes one channel; the connection stays up for the others.
+void SshReactor::closeEndpoint(const std::shared_ptr<SshEndpoint> &endpoint, const QString &error) {
+  if (endpoint->closed) {
+    return;
+  }
+#ifdef HAVE_LIBSSH
+  if (endpoint->channel) {
+    ssh_channel_close(endpoint->channel);
+    ssh_channel_free(endpoint->channel);
+    endpoint->channel = nullptr;
+  }
+#endif
+  endpoint->error = error;
+  endpoint->closed = true;
+  post(endpoint, ClosedEvent);
+}
+
+// Closes the connection and, with it, every channel still open on it.
+void SshReactor::closeConnection(const std::shared_ptr<SshConnection> &connection, const QString &error) {
+  if (connection->closed) {
+    return;
+  }
+  connection->failed = true;
+  connection->error = error;
+  for (const auto &endpoint : connection->endpoints) {
+    closeEndpoint(endpoint, error);
+  }
+  // Tunnels and listeners point back at the connection; drop them here to
+  // break the cycle.
+  for (const auto &tunnel : connection->tunnels) {
+    closeTunnel(tunnel);
+  }
+  connection->tunnels.clear();
+  for (const auto &listener : connection->listeners) {
+    closeListener(listener);
+  }
+  connection->listeners.clear();
+  for (const auto &sftp : connection->sftp) {
+    sftp->close(error.isEmpty() ? QString("SSH connection closed") : error);
+    postSftp(sftp);
+  }
+  connection->sftp.clear();
+  unwatch(connection.get());
+  if (connection->fdOwned) {
+    closeSocket(connection->fd);
+  }
+  connection->fd = -1;
+  connection->fdOwned = false;
+#ifdef HAVE_LIBSSH
+  if (connection->key) {
+    ssh_key_free(connection->key);
+    connection->key = nullptr;
+  }
+  connection->password.fill('\0');
+  if (connection->session) {
+    ssh_disconnect(connection->session);
+    ssh_free(connection->session);
+    connection->session = nullptr;
+  }
+#endif
+  connection->closed = true;
+}
+
+void SshReactor::post(const std::shared_ptr<SshEndpoint> &endpoint, int kind) {
+  if (!endpoint || endpoint->closeRequested) {
+    return;
+  }
+  QCoreApplication::postEvent(this, new EndpointEvent(endpoint, kind, endpoint->phase));
+}
+
+void SshReactor::postSftp(const std::shared_ptr<SftpChannel> &sftp) {
+  if (sftp->takeRepliesPushed() && !sftp->repliesPosted.exchange(true)) {
+    QCoreApplication::postEvent(this, new SftpEvent(sftp));
+  }
+}
+
+void SshReactor::acceptTunnels(const std::shared_ptr<SshListener> &listener) {
+  if (listener->closed || !listener->readable) {
+    return;
+  }
+  listener->readable = false;
+  for (;;) {
+    sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    const int fd = int(::accept(NativeSocket(listener->fd), reinterpret_cast<sockaddr *>(&peer), &length));
+    if (fd < 0) {
+      break; // drained, or out of descriptors until a tunnel closes
+    }
+    setNonBlocking(fd);
+    setSocketOption(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+
+    auto tunnel = std::make_shared<SshTunnel>();
+    tunnel->fd = fd;
+    tunnel->connection = listener->connection;
+    tunnel->listener = listener;
+    tunnel->originHost = QHostAddress(reinterpret_cast<const sockaddr *>(&peer)).toString();
+    tunnel->originPort = sockaddrPort(peer);
+    if (listener->forward.type == PortForward::Dynamic) {
+      tunnel->state = SshTunnel::SocksGreeting;
+    } else {
+      tunnel->targetHost = listener->forward.targetHost;
+      tunnel->targetPort = listener->forward.targetPort;
+    }
+    tunnel->deadline = QDeadlineTimer(phaseTimeoutMs(SshPhase::OpeningChannel));
+    listener->connection->tunnels.append(tunnel);
+    ++listener->activeTunnels;
+    ++listener->totalTunnels;
+  }
+}
+
+void SshReactor::serviceTunnel(const std::shared_ptr<SshTunnel> &tunnel) {
+  if (tunnel->closed) {
+    return;
+  }
+  if (tunnel->state != SshTunnel::Open && tunnel->deadline.hasExpired()) {
+    closeTunnel(tunnel);
+    return;
+  }
+  if ((tunnel->state == SshTunnel::SocksGreeting || tunnel->state == SshTunnel::SocksRequest) &&
+      !readSocks(tunnel)) {
+    pumpTunnel(tunnel); // flush the greeting reply
+    return;
+  }
+#ifdef HAVE_LIBSSH
+  if (tunnel->state == SshTunnel::Opening) {
+    const std::shared_ptr<SshConnection> connection = tunnel->connection;
+    if (!tunnel->channel) {
+      tunnel->channel = ssh_channel_new(connection->session);
+    }
+    const int rc = tunnel->channel ? ssh_channel_open_forward(tunnel->channel, tunnel->targetHost.toUtf8().constData(),
+                                                              tunnel->targetPort,
+                                                              tunnel->originHost.toUtf8().constData(),
+                                                              tunnel->originPort)
+                                   : SSH_ERROR;
+    if (rc == SSH_AGAIN) {
+      return;
+    }
+    const bool socks = tunnel->listener && tunnel->listener->forward.type == PortForward::Dynamic;
+    if (rc != SSH_OK) {
+      if (socks) {
+        // General failure; the client learns nothing more from ssh(1) either.
+        const char reply[10] = {5, 1, 0, 1, 0, 0, 0, 0, 0, 0};
+        socketSend(tunnel->fd, reply, int(sizeof(reply)));
+      }
+      closeTunnel(tunnel);
+      return;
+    }
+    if (socks) {
+      const char reply[10] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+      std::memcpy(tunnel->down.space(), reply, sizeof(reply));
+      tunnel->down.produced(sizeof(reply));
+    }
+    tunnel->state = SshTunnel::Open;
+    tunnel->channelReadable = true;
+    tunnel->readable = true; // data may have arrived while opening
+  }
+#endif
+  pumpTunnel(tunnel);
+}
+
+// Reads a SOCKS5 greeting and CONNECT request (RFC 1928, no authentication).
+// Returns true once the target is known and the channel can be opened.
+bool SshReactor::readSocks(const std::shared_ptr<SshTunnel> &tunnel) {
+  TunnelBuffer &in = tunnel->up;
+  while (tunnel->readable && in.spaceSize() > 0) {
+    const int n = socketRecv(tunnel->fd, in.space(), in.spaceSize());
+    const int error = n < 0 ? socketError() : 0;
+    if (n > 0) {
+      in.produced(n);
+    } else if (n < 0 && wouldBlock(error)) {
+      tunnel->readable = false;
+    } else if (n < 0 && interrupted(error)) {
+      continue;
+    } else {
+      closeTunnel(tunnel);
+      return false;
+    }
+  }
+
+  int used = 0;
+  if (tunnel->state == SshTunnel::SocksGreeting) {
+    const Socks5::Status status =
+        Socks5::parseGreeting(reinterpret_cast<const uchar *>(in.pending()), in.pendingSize(), &used);
+    if (status == Socks5::Incomplete) {
+      return false;
+    }
+    if (status != Socks5::Accepted) {
+      const char reply[2] = {5, char(0xff)};
+      socketSend(tunnel->fd, reply, int(sizeof(reply)));
+      closeTunnel(tunnel);
+      return false;
+    }
+    const char reply[2] = {5, 0};
+    std::memcpy(tunnel->down.space(), reply, sizeof(reply));
+    tunnel->down.produced(sizeof(reply));
+    in.consumed(used);
+    tunnel->state = SshTunnel::SocksRequest;
+  }
+
+  const Socks5::Status status = Socks5::parseRequest(reinterpret_cast<const uchar *>(in.pending()),
+                                                     in.pendingSize(), &used, &tunnel->targetHost,
+                                                     &tunnel->targetPort);
+  if (status == Socks5::Incomplete) {
+    return false;
+  }
+  if (status == Socks5::Unsupported) {
+    // Only CONNECT; BIND and UDP ASSOCIATE are not forwarded.
+    const char reply[10] = {5, 7, 0, 1, 0, 0, 0, 0, 0, 0};
+    socketSend(tunnel->fd, reply, int(sizeof(reply)));
+  }
+  if (status != Socks5::Accepted) {
+    closeTunnel(tunnel);
+    return false;
+  }
+  in.consumed(used);
+  tunnel->state = SshTunnel::Opening;
+  return true;
+}
+
+// Moves data both ways until a socket would block, the channel window or a
+// buffer fills up, or kMaxReadPerPass bytes went each way. A full buffer
+// stops reading its source, so a slow reader throttles the sender through
+// the SSH window or TCP.
+void SshReactor::pumpTunnel(const std::shared_ptr<SshTunnel> &tunnel) {
+  SshListener *listener = tunnel->listener.get();
+  const bool open = tunnel->state == SshTunnel::Open;
+#ifdef HAVE_LIBSSH
+  const std::shared_ptr<SshConnection> connection = tunnel->connection;
+  ssh_session session = connection->session;
+  connection->pumped = connection->pumped || open;
+  int moved = 0;
+  while (open && !tunnel->closed && moved < kMaxReadPerPass) {
+    if (!tunnel->socketEof && tunnel->readable && tunnel->up.spaceSize() > 0) {
+      const int n = socketRecv(tunnel->fd, tunnel->up.space(), tunnel->up.spaceSize());
+      const int error = n < 0 ? socketError() : 0;
+      if (n > 0) {
+        tunnel->up.produced(n);
+      } else if (n == 0) {
+        tunnel->socketEof = true;
+      } else if (wouldBlock(error)) {
+        tunnel->readable = false;
+      } else if (!interrupted(error)) {
+        closeTunnel(tunnel);
+        return;
+      }
+    }
+    const int pending = tunnel->up.pendingSize();
+    if (pending == 0) {
+      if (tunnel->socketEof || !tunnel->readable) {
+        break;
+      }
+      continue;
+    }
+    const uint32_t window = ssh_channel_window_size(tunnel->channel);
+    if (window == 0) {
+      break; // retried on the next pass
+    }
+    const int n = ssh_channel_write(tunnel->channel, tunnel->up.pending(), qMin(uint32_t(pending), window));
+    if (n == SSH_ERROR) {
+      closeConnection(connection, QString("SSH write failed: %1").arg(ssh_get_error(session)));
+      return;
+    }
+    tunnel->channelReadable = true;
+    if (n <= 0) {
+      break;
+    }
+    tunnel->up.consumed(n);
+    moved += n;
+    if (listener) {
+      listener->bytesUp += quint64(n);
+    }
+    bytesWritten_ += quint64(n);
+  }
+  if (open && tunnel->socketEof && tunnel->up.pendingSize() == 0 && !tunnel->channelEofSent) {
+    ssh_channel_send_eof(tunnel->channel);
+    tunnel->channelEofSent = true;
+  }
+
+  moved = 0;
+  while (!tunnel->closed && moved < kMaxReadPerPass) {
+    if (open && tunnel->channelReadable && tunnel->down.spaceSize() > 0) {
+      const int n = ssh_channel_read_nonblocking(tunnel->channel, tunnel->down.space(),
+                                                 uint32_t(tunnel->down.spaceSize()), 0);
+      if (n == SSH_ERROR) {
+        closeConnection(connection, QString("SSH read failed: %1").arg(ssh_get_error(session)));
+        return;
+      }
+      if (n > 0) {
+        tunnel->down.produced(n);
+        bytesRead_ += quint64(n);
+      } else {
+        tunnel->channelReadable = false;
+      }
+    }
+    const int pending = tunnel->down.pendingSize();
+    if (pending == 0) {
+      break;
+    }
+    const int n = socketSend(tunnel->fd, tunnel->down.pending(), pending);
+    if (n > 0) {
+      tunnel->down.consumed(n);
+      moved += n;
+      if (listener) {
+        listener->bytesDown += quint64(n);
+      }
+      continue;
+    }
+    const int error = n < 0 ? socketError() : 0;
+    if (n < 0 && wouldBlock(error)) {
+      break;
+    }
+    if (n < 0 && interrupted(error)) {
+      continue;
+    }
+    closeTunnel(tunnel);
+    return;
+  }
+  if (!open || tunnel->closed || tunnel->channelReadable || tunnel->down.pendingSize() > 0) {
+    return;
+  }
+  // Everything the channel delivered has been passed on.
+  if (ssh_channel_is_closed(tunnel->channel) || (ssh_channel_is_eof(tunnel->channel) && tunnel->channelEofSent)) {
+    closeTunnel(tunnel);
+  } else if (ssh_channel_is_eof(tunnel->channel) && !tunnel->socketShutdown) {
+    ::shutdown(NativeSocket(tunnel->fd), kShutdownWrite);
+    tunnel->socketShutdown = true;
+  }
+#else
+  Q_UNUSED(listener);
+  Q_UNUSED(open);
+  closeTunnel(tunnel);
+#endif
+}
+
+void SshReactor::closeTunnel(const std::shared_ptr<SshTunnel> &tunnel) {
+  if (tunnel->closed) {
+    return;
+  }
+#ifdef HAVE_LIBSSH
+  if (tunnel->channel) {
+    ssh_channel_close(tunnel->channel);
+    ssh_channel_free(tunnel->channel);
+    tunnel->channel = nullptr;
+  }
+#endif
+  unwatch(tunnel.get());
+  if (tunnel->fd >= 0) {
+    closeSocket(tunnel->fd);
+    tunnel->fd = -1;
+  }
+  if (tunnel->listener) {
+    --tunnel->listener->activeTunnels;
+  }
+  tunnel->closed = true;
+  // A connection through a jump host cannot outlive its channel.
+  const std::shared_ptr<SshConnection> carried = tunnel->carried.lock();
+  if (carried && !carried->closed) {
+    const SshConnection *jump = tunnel->connection.get();
+    QString error;
+    if (!jump->failed && tunnel->state != SshTunnel::Open) {
+      error = QString("Jump host could not connect to %1:%2").arg(tunnel->targetHost).arg(tunnel->targetPort);
+    } else if (!jump->error.isEmpty()) {
+      error = QString("Jump host: %1").arg(jump->error);
+    } else {
+      error = QString("Jump host closed the connection to %1:%2").arg(tunnel->targetHost).arg(tunnel->targetPort);
+    }
+    closeConnection(carried, error);
+  }
+}
+
+void SshReactor::closeListener(const std::shared_ptr<SshListener> &listener) {
+  unwatch(listener.get());
+  if (listener->fd >= 0) {
+    closeSocket(listener->fd);
+    listener->fd = -1;
+  }
+  listener->connection.reset();
+  listener->closed = true;
+}
+
+#if defined(Q_OS_LINUX)
+
+bool SshReactor::openPoller() {
+  pollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakeRead_ = wakeWrite_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pollFd_ < 0 || wakeRead_ < 0) {
+    return false;
+  }
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  return epoll_ctl(pollFd_, EPOLL_CTL_ADD, wakeRead_, &ev) == 0;
+}
+
+void SshReactor::closePoller() {
+  if (wakeRead_ >= 0) {
+    ::close(wakeRead_);
+  }
+  if (pollFd_ >= 0) {
+    ::close(pollFd_);
+  }
+  pollFd_ = wakeRead_ = wakeWrite_ = -1;
+}
+
+void SshReactor::updateInterest(SshPollable *pollable, int interest) {
+  if (pollable->fd < 0 || (pollable->watched && interest == pollable->interest)) {
+    return;
+  }
+  epoll_event ev = {};
+  ev.events = ((interest & ReadInterest) ? EPOLLIN : 0) | ((interest & WriteInterest) ? EPOLLOUT : 0);
+  ev.data.ptr = pollable;
+  epoll_ctl(pollFd_, pollable->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pollable->fd, &ev);
+  pollable->watched = true;
+  pollable->interest = interest;
+}
+
+void SshReactor::unwatch(SshPollable *pollable) {
+  if (pollable->watched && pollable->fd >= 0) {
+    epoll_ctl(pollFd_, EPOLL_CTL_DEL, pollable->fd, nullptr);
+  }
+  pollable->watched = false;
+}
+
+void SshReactor::waitForEvents(int timeoutMs) {
+  epoll_event events[64];
+  const int n = epoll_wait(pollFd_, events, 64, timeoutMs);
+  for (int i = 0; i < n; ++i) {
+    auto *pollable = static_cast<SshPollable *>(events[i].data.ptr);
+    if (!pollable) {
+      quint64 count = 0;
+      wakePending_ = false;
+      ssize_t rc = ::read(wakeRead_, &count, sizeof(count));
+      Q_UNUSED(rc);
+      continue;
+    }
+    // Errors and hangups wake both directions so the next read or write
+    // reports them.
+    const quint32 e = events[i].events;
+    pollable->readable = pollable->readable || (e & (EPOLLIN | EPOLLHUP | EPOLLERR));
+    pollable->writable = pollable->writable || (e & (EPOLLOUT | EPOLLHUP | EPOLLERR));
+  }
+}
+
+#else
+
+// The wakeup is a socket pair rather than a pipe, since WSAPoll() only
+// takes sockets.
+bool SshReactor::openPoller() {
+  int fds[2];
+  if (!socketPair(fds)) {
+    return false;
+  }
+  setNonBlocking(fds[0]);
+  setNonBlocking(fds[1]);
+  wakeRead_ = fds[0];
+  wakeWrite_ = fds[1];
+  return true;
+}
+
+void SshReactor::closePoller() {
+  if (wakeRead_ >= 0) {
+    closeSocket(wakeRead_);
+  }
+  if (wakeWrite_ >= 0) {
+    closeSocket(wakeWrite_);
+  }
+  wakeRead_ = wakeWrite_ = -1;
+}
+
+// poll() takes the whole set on every call, so interest is only recorded
+// here and applied in waitForEvents().
+void SshReactor::updateInterest(SshPollable *pollable, int interest) {
+  pollable->watched = pollable->fd >= 0;
+  pollable->interest = interest;
+}
+
+void SshReactor::unwatch(SshPollable *pollable) { pollable->watched = false; }
+
+void SshReactor::waitForEvents(int timeoutMs) {
+  QVector<pollfd> fds;
+  QVector<SshPollable *> pollables;
+  fds.append(pollfd{NativeSocket(wakeRead_), POLLIN, 0});
+  auto add = [&fds, &pollables](SshPollable *pollable) {
+    const short events = short(((pollable->interest & ReadInterest) ? POLLIN : 0) |
+                               ((pollable->interest & WriteInterest) ? POLLOUT : 0));
+    fds.append(pollfd{NativeSocket(pollable->watched && events ? pollable->fd : -1), events, 0});
+    pollables.append(pollable);
+  };
+  for (const auto &connection : connections_) {
+    add(connection.get());
+    for (const auto &listener : connection->listeners) {
+      add(listener.get());
+    }
+    for (const auto &tunnel : connection->tunnels) {
+      add(tunnel.get());
+    }
+  }
+  const int n = pollSockets(fds.data(), fds.size(), timeoutMs);
+  if (n <= 0) {
+    return;
+  }
+  if (fds[0].revents) {
+    char drain[64];
+    wakePending_ = false;
+    while (socketRecv(wakeRead_, drain, int(sizeof(drain))) > 0) {
+    }
+  }
+  for (int i = 1; i < fds.size(); ++i) {
+    const short e = fds[i].revents;
+    SshPollable *pollable = pollables[i - 1];
+    pollable->readable = pollable->readable || (e & (POLLIN | POLLHUP | POLLERR));
+    pollable->writable = pollable->writable || (e & (POLLOUT | POLLHUP | POLLERR));
+  }
+}
+
+#endif
@@ -1,34 +1,95 @@
 #include "SshSession.h"
+#include "JumpHost.h"
+#include "SftpChannel.h"
+#include "SshReactor.h"
 
+#include <QHostInfo>
+#include <QList>
 #include <QTimer>
 
 #ifdef HAVE_LIBSSH
 #include <libssh/libssh.h>
 #endif
 
+namespace {
+
+// Retry interval for commands that found the input ring full.
+constexpr int kCommandRetryMs = 5;
+// The lookup itself cannot be cancelled, but the tab stops waiting for it.
+constexpr int kResolveTimeoutMs = 15000;
+// Pastes are streamed in chunks, keeping at most kPasteHighWater bytes queued
+// towards the channel so the UI stays responsive and cancel takes effect fast.
+constexpr int kPasteChunkBytes = 32 * 1024;
+constexpr qint64 kPasteHighWater = 256 * 1024;
+
+// Input sent before the shell is up is held back, up to this much.
+constexpr int kMaxTypeAhead = 1024 * 1024;
+
+const QByteArray kPasteStart("\x1b[200~");
+const QByteArray kPasteEnd("\x1b[201~");
+
+} // namespace
+
 struct SshSession::Impl {
 #ifdef HAVE_LIBSSH
+  // One ProxyJump hop. Its session and key are only loaded for hops no other
+  // tab is connected to.
+  struct Hop {
+    QString id;
+    QString host;
+    quint16 port = 22;
+    ssh_session session = nullptr;
+    ssh_key key = nullptr;
+  };
+
+  void freeJumps() {
+    for (Hop &hop : jumps) {
+      if (hop.key) {
+        ssh_key_free(hop.key);
+      }
+      if (hop.session) {
+        ssh_free(hop.session);
+      }
+    }
+    jumps.clear();
+  }
+
+  // Owned here only while the host name resolves; afterwards they belong to
+  // the shared connection.
+  QString connectionId;
   ssh_session session = nullptr;
-  ssh_channel channel = nullptr;
-  QTimer pollTimer;
+  ssh_key key = nullptr;
+  QByteArray password;
+  QString host;
+  quint16 port = 22;
+  SshTransport transport;
+  QVector<Hop> jumps; // outermost first
+  int lookupId = -1;
+  QTimer resolveTimer;
+  int ptyRows = 24;
+  int ptyCols = 80;
+  std::shared_ptr<SshEndpoint> endpoint;
+  SshReactor *reactor = nullptr;
+  QList<SshCommand> overflow;
+  QByteArray typeAhead;
+  QByteArray paste;
+  int pasteOffset = 0;
+  bool pasteBracketed = false;
+  QTimer retryTimer;
+  bool outputPaused = false;
 #endif
 };
 
 SshSession::SshSession(QObject *parent) : QObject(parent), impl_(new Impl()) {
 #ifdef HAVE_LIBSSH
-  impl_->pollTimer.setInterval(30);
-  connect(&impl_->pollTimer, &QTimer::timeout, this, [this]() {
-    if (!impl_->channel) {
-      return;
-    }
-    char buffer[4096];
-    int n = ssh_channel_read_nonblocking(impl_->channel, buffer, sizeof(buffer), 0);
-    if (n > 0) {
-      emit output(QByteArray(buffer, n));
-    }
-    if (ssh_channel_is_eof(impl_->channel) || ssh_channel_is_closed(impl_->channel)) {
-      disconnectFromHost();
-    }
+  impl_->retryTimer.setSingleShot(true);
+  impl_->retryTimer.setInterval(kCommandRetryMs);
+  connect(&impl_->retryTimer, &QTimer::timeout, this, [this]() { queueCommand(SshCommand(), false); });
+  impl_->resolveTimer.setSingleShot(true);
+  impl_->resolveTimer.setInterval(kResolveTimeoutMs);
+  connect(&impl_->resolveTimer, &QTimer::timeout, this, [this]() {
+    emit error("Timed out: resolving host");
+    disconnectFromHost();
   });
 #endif
 }
@@ -43,122 +104,515 @@ void SshSession::connectToHost(const QString &host,
                                const QString &password,
                                const QString &keyPath,
                                const QString &keyPassphrase,
-                               int port) {
+                               int port,
+                               const SshTransport &transport,
+                               const QString &proxyJump) {
 #ifdef HAVE_LIBSSH
-  if (impl_->session) {
+  if (impl_->session || impl_->endpoint) {
     disconnectFromHost();
   }
 
-  impl_->session = ssh_new();
-  if (!impl_->session) {
-    emit error("Failed to create SSH session");
+  QString message;
+  QVector<JumpHost> hops;
+  if (!JumpHost::parseChain(proxyJump, &hops, &message)) {
+    emit error(QString("Proxy jump: %1").arg(message));
     return;
   }
 
-  ssh_options_set(impl_->session, SSH_OPTIONS_HOST, host.toUtf8().constData());
-  ssh_options_set(impl_->session, SSH_OPTIONS_USER, user.toUtf8().constData());
-  ssh_options_set(impl_->session, SSH_OPTIONS_PORT, &port);
+  // Another tab is already connected (or connecting) with the same
+  // credentials: open a channel on its connection.
+  impl_->connectionId = SshReactor::connectionId(host, user, port, keyPath, transport, JumpHost::chainString(hops));
+  if (const std::shared_ptr<SshConnection> shared = SshReactor::shareConnection(impl_->connectionId)) {
+    attachEndpoint(shared);
+    return;
+  }
 
-  int rc = ssh_connect(impl_->session);
-  if (rc != SSH_OK) {
-    emit error(QString("SSH connect failed: %1").arg(ssh_get_error(impl_->session)));
-    disconnectFromHost();
+  SshTarget target;
+  impl_->session = SshReactor::newSession(host, user, port, keyPath, keyPassphrase, transport, &impl_->key,
+                                          &target, &message);
+  if (!impl_->session) {
+    emit error(message);
     return;
   }
+  impl_->password = password.toUtf8();
+  impl_->host = target.host;
+  impl_->port = quint16(target.port);
+  impl_->transport = transport;
 
-  if (!keyPath.isEmpty()) {
-    ssh_key key = nullptr;
-    const QByteArray keyPathBytes = keyPath.toUtf8();
-    const QByteArray passBytes = keyPassphrase.toUtf8();
-    const char *pass = passBytes.isEmpty() ? nullptr : passBytes.constData();
-    rc = ssh_pki_import_privkey_file(keyPathBytes.constData(), pass, nullptr, nullptr, &key);
-    if (rc != SSH_OK || !key) {
-      emit error(QString("Failed to load key: %1").arg(ssh_get_error(impl_->session)));
+  // Hops up to the innermost one another tab is connected through are
+  // shared as they are; only those past it need a session of their own.
+  // Jump hosts log in with the profile's key or the agent, never the
+  // password.
+  int shared = -1;
+  for (int i = 0; i < hops.size(); ++i) {
+    Impl::Hop hop;
+    hop.id = SshReactor::connectionId(hops.at(i).host, hops.at(i).user, hops.at(i).port, keyPath, transport,
+                                      JumpHost::chainString(hops, i));
+    if (SshReactor::hasConnection(hop.id)) {
+      shared = i;
+    }
+    impl_->jumps.append(hop);
+  }
+  for (int i = shared + 1; i < hops.size(); ++i) {
+    Impl::Hop &hop = impl_->jumps[i];
+    SshTarget hopTarget;
+    hop.session = SshReactor::newSession(hops.at(i).host, hops.at(i).user, hops.at(i).port, keyPath, keyPassphrase,
+                                         transport, &hop.key, &hopTarget, &message);
+    if (!hop.session) {
+      emit error(QString("Jump host %1: %2").arg(hops.at(i).toString(), message));
       disconnectFromHost();
       return;
     }
-    rc = ssh_userauth_publickey(impl_->session, nullptr, key);
-    ssh_key_free(key);
-  } else if (password.isEmpty()) {
-    rc = ssh_userauth_publickey_auto(impl_->session, nullptr, nullptr);
-  } else {
-    rc = ssh_userauth_password(impl_->session, nullptr, password.toUtf8().constData());
+    hop.host = hopTarget.host;
+    hop.port = quint16(hopTarget.port);
   }
-
-  if (rc != SSH_AUTH_SUCCESS) {
-    emit error(QString("SSH auth failed: %1").arg(ssh_get_error(impl_->session)));
-    disconnectFromHost();
+  if (shared >= 0) {
+    // The first new hop is reached through a connected one; nothing to
+    // resolve locally.
+    startConnection(QList<QHostAddress>());
     return;
   }
 
-  impl_->channel = ssh_channel_new(impl_->session);
-  if (!impl_->channel) {
-    emit error("Failed to create SSH channel");
-    disconnectFromHost();
+  const QString first = impl_->jumps.isEmpty() ? impl_->host : impl_->jumps.first().host;
+  emit progress(QString("Resolving %1").arg(first));
+  impl_->resolveTimer.start();
+  impl_->lookupId = QHostInfo::lookupHost(first, this, SLOT(onHostResolved(QHostInfo)));
+#else
+  Q_UNUSED(host)
+  Q_UNUSED(user)
+  Q_UNUSED(password)
+  Q_UNUSED(keyPath)
+  Q_UNUSED(keyPassphrase)
+  Q_UNUSED(port)
+  Q_UNUSED(transport)
+  Q_UNUSED(proxyJump)
+  emit error("libssh not available at build time");
+#endif
+}
+
+void SshSession::cancel() {
+#ifdef HAVE_LIBSSH
+  if (connected_ || (!impl_->session && !impl_->endpoint)) {
     return;
   }
+  emit error("Connection cancelled");
+  disconnectFromHost();
+#endif
+}
 
-  rc = ssh_channel_open_session(impl_->channel);
-  if (rc != SSH_OK) {
-    emit error(QString("Failed to open channel: %1").arg(ssh_get_error(impl_->session)));
-    disconnectFromHost();
+void SshSession::onHostResolved(const QHostInfo &info) {
+#ifdef HAVE_LIBSSH
+  if (info.lookupId() != impl_->lookupId || !impl_->session) {
     return;
   }
-
-  rc = ssh_channel_request_pty(impl_->channel);
-  if (rc != SSH_OK) {
-    emit error(QString("Failed to request PTY: %1").arg(ssh_get_error(impl_->session)));
+  impl_->lookupId = -1;
+  impl_->resolveTimer.stop();
+  if (info.error() != QHostInfo::NoError || info.addresses().isEmpty()) {
+    emit error(QString("SSH connect failed: %1").arg(info.errorString()));
     disconnectFromHost();
     return;
   }
+  startConnection(info.addresses());
+#else
+  Q_UNUSED(info)
+#endif
+}
 
-  rc = ssh_channel_request_shell(impl_->channel);
-  if (rc != SSH_OK) {
-    emit error(QString("Failed to request shell: %1").arg(ssh_get_error(impl_->session)));
-    disconnectFromHost();
-    return;
+// Shares or creates the connection and opens this session's channel on it.
+// `addresses` are those of the first host reached over TCP: the target, or
+// the outermost jump host.
+void SshSession::startConnection(const QList<QHostAddress> &addresses) {
+#ifdef HAVE_LIBSSH
+  // A tab to the same host may have resolved first; share its connection
+  // and drop ours.
+  std::shared_ptr<SshConnection> connection = SshReactor::shareConnection(impl_->connectionId);
+  if (connection) {
+    if (impl_->key) {
+      ssh_key_free(impl_->key);
+      impl_->key = nullptr;
+    }
+    ssh_free(impl_->session);
+  } else {
+    std::shared_ptr<SshConnection> jump;
+    if (!impl_->jumps.isEmpty()) {
+      jump = jumpConnection(impl_->jumps.size() - 1, addresses);
+      if (!jump) {
+        emit error("Jump host connection closed");
+        disconnectFromHost();
+        return;
+      }
+    }
+    // From here on the session lives on the I/O thread.
+    connection = std::make_shared<SshConnection>();
+    connection->id = impl_->connectionId;
+    connection->session = impl_->session;
+    if (jump) {
+      connection->host = impl_->host;
+      connection->jump = jump;
+    } else {
+      connection->addresses = addresses;
+    }
+    connection->port = impl_->port;
+    connection->transport = impl_->transport;
+    connection->password = impl_->password;
+    connection->key = impl_->key;
+    impl_->key = nullptr;
+    SshReactor::addConnection(connection);
   }
+  impl_->session = nullptr;
+  impl_->password.fill('\0');
+  impl_->password.clear();
+  impl_->freeJumps();
+  attachEndpoint(connection);
+#else
+  Q_UNUSED(addresses)
+#endif
+}
 
-  impl_->pollTimer.start();
-  connected_ = true;
-  emit connected();
+// Shares hop `index` of the jump chain, or creates it on top of the hops in
+// front of it. Each hop holds one user of the hop it runs through, so a
+// bastion stays up while any tab is connected through it. Returns null if
+// the hop went away and no session was loaded for it.
+std::shared_ptr<SshConnection> SshSession::jumpConnection(int index, const QList<QHostAddress> &addresses) {
+#ifdef HAVE_LIBSSH
+  Impl::Hop &hop = impl_->jumps[index];
+  if (const std::shared_ptr<SshConnection> shared = SshReactor::shareConnection(hop.id)) {
+    return shared;
+  }
+  if (!hop.session) {
+    return nullptr;
+  }
+  std::shared_ptr<SshConnection> jump;
+  if (index > 0) {
+    jump = jumpConnection(index - 1, addresses);
+    if (!jump) {
+      return nullptr;
+    }
+  }
+  auto connection = std::make_shared<SshConnection>();
+  connection->id = hop.id;
+  connection->session = hop.session;
+  hop.session = nullptr;
+  if (jump) {
+    connection->host = hop.host;
+    connection->jump = jump;
+  } else {
+    connection->addresses = addresses;
+  }
+  connection->port = hop.port;
+  connection->transport = impl_->transport;
+  connection->key = hop.key;
+  hop.key = nullptr;
+  SshReactor::addConnection(connection);
+  return connection;
+#else
+  Q_UNUSED(index)
+  Q_UNUSED(addresses)
+  return nullptr;
+#endif
+}
+
+void SshSession::attachEndpoint(const std::shared_ptr<SshConnection> &connection) {
+#ifdef HAVE_LIBSSH
+  impl_->endpoint = std::make_shared<SshEndpoint>();
+  impl_->endpoint->connection = connection;
+  impl_->endpoint->ptyRows = impl_->ptyRows;
+  impl_->endpoint->ptyCols = impl_->ptyCols;
+  impl_->endpoint->owner = this;
+  impl_->reactor = connection->reactor;
+  impl_->reactor->attach(impl_->endpoint);
+#else
+  Q_UNUSED(connection)
+#endif
+}
+
+bool SshSession::hasSharedConnection(const QString &host, const QString &user, int port, const QString &keyPath,
+                                     const SshTransport &transport, const QString &proxyJump) {
+#ifdef HAVE_LIBSSH
+  QVector<JumpHost> hops;
+  if (!JumpHost::parseChain(proxyJump, &hops)) {
+    return false;
+  }
+  return SshReactor::hasConnection(
+      SshReactor::connectionId(host, user, port, keyPath, transport, JumpHost::chainString(hops)));
 #else
   Q_UNUSED(host)
   Q_UNUSED(user)
-  Q_UNUSED(password)
-  Q_UNUSED(keyPath)
-  Q_UNUSED(keyPassphrase)
   Q_UNUSED(port)
-  emit error("libssh not available at build time");
+  Q_UNUSED(keyPath)
+  Q_UNUSED(transport)
+  Q_UNUSED(proxyJump)
+  return false;
+#endif
+}
+
+void SshSession::handleReactorProgress(SshPhase phase) {
+#ifdef HAVE_LIBSSH
+  if (!impl_->endpoint) {
+    return;
+  }
+  if (phase != SshPhase::Ready) {
+    emit progress(sshPhaseName(phase));
+    return;
+  }
+  connected_ = true;
+  if (!impl_->typeAhead.isEmpty()) {
+    send(impl_->typeAhead);
+    impl_->typeAhead.fill('\0');
+    impl_->typeAhead.clear();
+  }
+  emit connected();
+  // Resizes that arrived after the PTY request went out.
+  if (impl_->endpoint && (impl_->ptyRows != impl_->endpoint->ptyRows || impl_->ptyCols != impl_->endpoint->ptyCols)) {
+    setPtySize(impl_->ptyRows, impl_->ptyCols);
+  }
+#else
+  Q_UNUSED(phase)
 #endif
 }
 
 void SshSession::send(const QByteArray &data) {
 #ifdef HAVE_LIBSSH
-  if (!impl_->channel) {
+  if (!impl_->endpoint && !impl_->session) {
     emit error("No active SSH channel");
     return;
   }
-  ssh_channel_write(impl_->channel, data.constData(), data.size());
+  if (!connected_) {
+    // Typed ahead while the shell is still starting; sent once it is up.
+    if (impl_->typeAhead.size() + data.size() > kMaxTypeAhead) {
+      emit error("Input dropped: the shell is still starting");
+      return;
+    }
+    impl_->typeAhead.append(data);
+    return;
+  }
+  SshCommand command;
+  command.kind = SshCommand::Write;
+  command.data = data;
+  queueCommand(std::move(command), true);
 #else
   Q_UNUSED(data)
   emit error("libssh not available at build time");
 #endif
 }
 
+// Large pastes are queued here and fed to the channel as it drains. With
+// `bracketed` the text is wrapped in the xterm paste markers, which the
+// remote enabled with DECSET 2004.
+void SshSession::sendPaste(const QByteArray &data, bool bracketed) {
+#ifdef HAVE_LIBSSH
+  if (!impl_->endpoint || !connected_ || data.isEmpty()) {
+    send(data);
+    return;
+  }
+  QByteArray body = data;
+  if (bracketed) {
+    // An embedded end marker would let pasted text run as typed commands.
+    body.replace(kPasteEnd, QByteArray());
+    body = kPasteStart + body + kPasteEnd;
+  }
+  if (impl_->paste.isEmpty() && body.size() <= kPasteChunkBytes) {
+    send(body);
+    return;
+  }
+  impl_->paste.append(body);
+  impl_->pasteBracketed = impl_->pasteBracketed || bracketed;
+  pumpPaste();
+#else
+  Q_UNUSED(bracketed)
+  send(data);
+#endif
+}
+
+void SshSession::cancelPaste() {
+#ifdef HAVE_LIBSSH
+  if (impl_->paste.isEmpty()) {
+    return;
+  }
+  const bool bracketed = impl_->pasteBracketed && impl_->pasteOffset > 0;
+  const qint64 total = impl_->paste.size();
+  impl_->paste.clear();
+  impl_->pasteOffset = 0;
+  impl_->pasteBracketed = false;
+  if (bracketed) {
+    // Leave the remote's paste mode even though the text stops midway.
+    send(kPasteEnd);
+  }
+  emit pasteProgress(total, total);
+#endif
+}
+
+void SshSession::pumpPaste() {
+#ifdef HAVE_LIBSSH
+  const std::shared_ptr<SshEndpoint> endpoint = impl_->endpoint;
+  if (!endpoint || impl_->paste.isEmpty()) {
+    return;
+  }
+  for (;;) {
+    while (impl_->pasteOffset < impl_->paste.size() && endpoint->queuedBytes.load() < kPasteHighWater) {
+      send(impl_->paste.mid(impl_->pasteOffset, kPasteChunkBytes));
+      impl_->pasteOffset += kPasteChunkBytes;
+    }
+    if (impl_->pasteOffset >= impl_->paste.size()) {
+      break;
+    }
+    // Ask for a WrittenEvent, then look again in case the reactor drained
+    // the queue before it could see the request.
+    endpoint->drainWanted = true;
+    if (endpoint->queuedBytes.load() > SshEndpoint::kWriteLowWater) {
+      break;
+    }
+    endpoint->drainWanted = false;
+  }
+
+  const qint64 total = impl_->paste.size();
+  const qint64 sent = qMin<qint64>(impl_->pasteOffset, total);
+  if (sent == total) {
+    impl_->paste.clear();
+    impl_->pasteOffset = 0;
+    impl_->pasteBracketed = false;
+  }
+  emit pasteProgress(sent, total);
+#endif
+}
+
+void SshSession::handleReactorWritten() {
+#ifdef HAVE_LIBSSH
+  pumpPaste();
+#endif
+}
+
+// Commands that do not fit the input ring wait here, in order, and are
+// retried shortly; the ring only fills while the channel's window is closed.
+void SshSession::queueCommand(SshCommand command, bool hasCommand) {
+#ifdef HAVE_LIBSSH
+  if (!impl_->endpoint) {
+    impl_->overflow.clear();
+    return;
+  }
+  if (hasCommand) {
+    if (command.kind == SshCommand::Write) {
+      impl_->endpoint->queuedBytes += command.data.size();
+      // Keystrokes typed while the ring is full go out as one write.
+      if (!impl_->overflow.isEmpty() && impl_->overflow.last().kind == SshCommand::Write) {
+        impl_->overflow.last().data.append(command.data);
+        return;
+      }
+    }
+    impl_->overflow.append(std::move(command));
+  }
+  bool pushed = false;
+  while (!impl_->overflow.isEmpty() && impl_->endpoint->input.push(std::move(impl_->overflow.first()))) {
+    impl_->overflow.removeFirst();
+    pushed = true;
+  }
+  if (pushed) {
+    impl_->reactor->wake();
+  }
+  if (!impl_->overflow.isEmpty() && !impl_->retryTimer.isActive()) {
+    impl_->retryTimer.start();
+  }
+#else
+  Q_UNUSED(command)
+  Q_UNUSED(hasCommand)
+#endif
+}
+
+void SshSession::setOutputPaused(bool paused) {
+#ifdef HAVE_LIBSSH
+  if (impl_->outputPaused == paused) {
+    return;
+  }
+  impl_->outputPaused = paused;
+  if (!paused) {
+    // Not from inside the consumer that just caught up.
+    QTimer::singleShot(0, this, [this]() { drainReactorOutput(); });
+  }
+#else
+  Q_UNUSED(paused)
+#endif
+}
+
+// Hands the output ring to output() until it is empty or the consumer
+// pauses; `all` ignores the pause, for a channel that is closing.
+void SshSession::drainReactorOutput(bool all) {
+#ifdef HAVE_LIBSSH
+  // Keep the endpoint alive even if a slot disconnects us mid-drain.
+  const std::shared_ptr<SshEndpoint> endpoint = impl_->endpoint;
+  if (!endpoint) {
+    return;
+  }
+  endpoint->outputPosted = false;
+  QByteArray chunk;
+  while (endpoint->owner == this && (all || !impl_->outputPaused) && endpoint->output.pop(&chunk)) {
+    emit output(chunk);
+  }
+  // A stalled ring stays stalled while paused; the reactor is woken once
+  // the consumer has caught up and the ring is drained.
+  if (endpoint->outputStalled && !impl_->outputPaused && impl_->reactor) {
+    impl_->reactor->wake();
+  }
+#else
+  Q_UNUSED(all)
+#endif
+}
+
+void SshSession::handleReactorClosed() {
+#ifdef HAVE_LIBSSH
+  const std::shared_ptr<SshEndpoint> endpoint = impl_->endpoint;
+  if (!endpoint) {
+    return;
+  }
+  drainReactorOutput(true);
+  if (impl_->endpoint != endpoint) {
+    return;
+  }
+  if (!endpoint->error.isEmpty()) {
+    emit error(endpoint->error);
+  }
+  disconnectFromHost();
+#endif
+}
+
 void SshSession::disconnectFromHost() {
 #ifdef HAVE_LIBSSH
-  impl_->pollTimer.stop();
-  if (impl_->channel) {
-    ssh_channel_close(impl_->channel);
-    ssh_channel_free(impl_->channel);
-    impl_->channel = nullptr;
+  impl_->retryTimer.stop();
+  impl_->resolveTimer.stop();
+  impl_->overflow.clear();
+  if (!impl_->paste.isEmpty()) {
+    const qint64 total = impl_->paste.size();
+    impl_->paste.clear();
+    impl_->pasteOffset = 0;
+    impl_->pasteBracketed = false;
+    emit pasteProgress(total, total);
+  }
+  if (impl_->lookupId >= 0) {
+    QHostInfo::abortHostLookup(impl_->lookupId);
+    impl_->lookupId = -1;
   }
+  if (impl_->endpoint) {
+    // The reactor closes the channel on its own thread, and the connection
+    // once no other session uses it.
+    impl_->endpoint->owner = nullptr;
+    impl_->endpoint->closeRequested = true;
+    impl_->reactor->wake();
+    SshReactor::releaseConnection(impl_->endpoint->connection);
+    impl_->endpoint.reset();
+    impl_->reactor = nullptr;
+  }
+  if (impl_->key) {
+    ssh_key_free(impl_->key);
+    impl_->key = nullptr;
+  }
+  impl_->password.fill('\0');
+  impl_->password.clear();
+  impl_->typeAhead.fill('\0');
+  impl_->typeAhead.clear();
   if (impl_->session) {
-    ssh_disconnect(impl_->session);
     ssh_free(impl_->session);
     impl_->session = nullptr;
   }
+  impl_->freeJumps();
   if (connected_) {
     connected_ = false;
     emit disconnected();
@@ -166,12 +620,81 @@ void SshSession::disconnectFromHost() {
 #endif
 }
 
-void SshSession::setPtySize(int rows, int cols) {
+void SshSession::addForward(const PortForward &forward) {
 #ifdef HAVE_LIBSSH
-  if (!impl_->channel) {
+  if (!impl_->endpoint) {
+    emit error(QString("Port forward %1: not connected").arg(forward.toString()));
     return;
   }
-  ssh_channel_change_pty_size(impl_->channel, cols, rows);
+  const std::shared_ptr<SshConnection> &connection = impl_->endpoint->connection;
+  for (const auto &running : connection->forwards) {
+    if (!running->closed && running->forward.toString() == forward.toString()) {
+      return;
+    }
+  }
+  QString message;
+  const std::shared_ptr<SshListener> listener = SshReactor::openListener(forward, &message);
+  if (!listener) {
+    emit error(QString("Port forward %1: %2").arg(forward.toString(), message));
+    return;
+  }
+  listener->connection = connection;
+  connection->forwards.append(listener);
+  connection->reactor->attachListener(listener);
+#else
+  Q_UNUSED(forward)
+#endif
+}
+
+QVector<SshSession::ForwardStatus> SshSession::forwardStatus() const {
+  QVector<ForwardStatus> statuses;
+#ifdef HAVE_LIBSSH
+  if (!impl_->endpoint) {
+    return statuses;
+  }
+  for (const auto &listener : impl_->endpoint->connection->forwards) {
+    if (listener->closed) {
+      continue;
+    }
+    ForwardStatus status;
+    status.forward = listener->forward;
+    status.activeTunnels = listener->activeTunnels.load();
+    status.totalTunnels = listener->totalTunnels.load();
+    status.bytesUp = listener->bytesUp.load();
+    status.bytesDown = listener->bytesDown.load();
+    statuses.append(status);
+  }
+#endif
+  return statuses;
+}
+
+std::shared_ptr<SftpChannel> SshSession::openSftp(SftpPanel *owner) {
+#ifdef HAVE_LIBSSH
+  if (!impl_->endpoint || !connected_) {
+    return nullptr;
+  }
+  auto sftp = std::make_shared<SftpChannel>(impl_->endpoint->connection);
+  sftp->owner = owner;
+  impl_->reactor->attachSftp(sftp);
+  return sftp;
+#else
+  Q_UNUSED(owner)
+  return nullptr;
+#endif
+}
+
+void SshSession::setPtySize(int rows, int cols) {
+#ifdef HAVE_LIBSSH
+  impl_->ptyRows = rows;
+  impl_->ptyCols = cols;
+  if (!impl_->endpoint || !connected_) {
+    return; // applied with the PTY request, or once the shell is up
+  }
+  SshCommand command;
+  command.kind = SshCommand::Resize;
+  command.rows = rows;
+  command.cols = cols;
+  queueCommand(std::move(command), true);
 #else
   Q_UNUSED(rows)
   Q_UNUSED(cols)
@@ -0,0 +1,39 @@
+#include "SshTarget.h"
+
+#ifdef HAVE_LIBSSH
+bool SshTarget::resolve(ssh_session session, const QString &host, const QString &user, int port, SshTarget *target,
+                        QString *error, const QString &configFile) {
+  ssh_options_set(session, SSH_OPTIONS_HOST, host.toUtf8().constData());
+  // Parsed here rather than by ssh_connect(): the reactor resolves and
+  // connects the socket itself, before libssh would read the file.
+  const QByteArray file = configFile.toUtf8();
+  if (ssh_options_parse_config(session, file.isEmpty() ? nullptr : file.constData()) != 0) {
+    if (error) *error = QString("Failed to read SSH config: %1").arg(ssh_get_error(session));
+    return false;
+  }
+  if (!user.isEmpty()) {
+    ssh_options_set(session, SSH_OPTIONS_USER, user.toUtf8().constData());
+  }
+  if (port != 22) {
+    ssh_options_set(session, SSH_OPTIONS_PORT, &port);
+  }
+
+  target->host = host;
+  target->user.clear();
+  target->port = port;
+  char *value = nullptr;
+  if (ssh_options_get(session, SSH_OPTIONS_HOST, &value) == SSH_OK) {
+    target->host = QString::fromUtf8(value);
+    ssh_string_free_char(value);
+  }
+  if (ssh_options_get(session, SSH_OPTIONS_USER, &value) == SSH_OK) {
+    target->user = QString::fromUtf8(value);
+    ssh_string_free_char(value);
+  }
+  unsigned int configured = 0;
+  if (ssh_options_get_port(session, &configured) == SSH_OK) {
+    target->port = int(configured);
+  }
+  return true;
+}
+#endif
@@ -0,0 +1,113 @@
+#include "TerminalModes.h"
+
+namespace {
+
+constexpr int kBracketedPaste = 2004;
+// Parameters past this are not modes anyone sets; stop counting to avoid overflow.
+constexpr int kMaxParam = 99999;
+
+bool isFinal(unsigned char c) {
+  return c >= 0x40 && c <= 0x7e;
+}
+
+} // namespace
+
+void TerminalModes::reset() {
+  state_ = State::Ground;
+  param_ = 0;
+  bracketedPaste_ = false;
+}
+
+void TerminalModes::endParam() {
+  namesBracketedPaste_ = namesBracketedPaste_ || param_ == kBracketedPaste;
+  param_ = 0;
+}
+
+void TerminalModes::feed(const char *data, int size) {
+  for (int i = 0; i < size; ++i) {
+    const unsigned char c = static_cast<unsigned char>(data[i]);
+    // CAN and SUB abort any sequence; ESC starts a new one except inside strings.
+    if (c == 0x18 || c == 0x1a) {
+      state_ = State::Ground;
+      continue;
+    }
+    if (c == 0x1b && state_ != State::String && state_ != State::StringEscape) {
+      state_ = State::Escape;
+      continue;
+    }
+    switch (state_) {
+      case State::Ground:
+        break;
+      case State::Escape:
+        if (c == '[') {
+          state_ = State::Csi;
+        } else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+          state_ = State::String;
+        } else if (c == 'c') {
+          reset();
+        } else if (c >= 0x20 && c <= 0x2f) {
+          state_ = State::EscapeIntermediate;
+        } else if (c >= 0x30) {
+          state_ = State::Ground;
+        }
+        break;
+      case State::EscapeIntermediate:
+        // ESC ( B and the like; whatever the final byte, it is not RIS.
+        if (c >= 0x30) {
+          state_ = State::Ground;
+        }
+        break;
+      case State::Csi:
+        if (c == '?') {
+          param_ = 0;
+          namesBracketedPaste_ = false;
+          state_ = State::Private;
+        } else if (c == '!') {
+          state_ = State::Bang;
+        } else if (isFinal(c)) {
+          state_ = State::Ground;
+        } else if (c >= 0x20) {
+          state_ = State::Ignore;
+        }
+        break;
+      case State::Private:
+        if (c >= '0' && c <= '9') {
+          param_ = param_ < kMaxParam ? param_ * 10 + (c - '0') : param_;
+        } else if (c == ';') {
+          endParam();
+        } else if (c == 'h' || c == 'l') {
+          endParam();
+          if (namesBracketedPaste_) {
+            bracketedPaste_ = c == 'h';
+          }
+          state_ = State::Ground;
+        } else if (isFinal(c)) {
+          state_ = State::Ground;
+        } else if (c >= 0x20) {
+          state_ = State::Ignore;
+        }
+        break;
+      case State::Bang:
+        if (c == 'p') {
+          reset();
+        }
+        state_ = isFinal(c) ? State::Ground : State::Ignore;
+        break;
+      case State::Ignore:
+        if (isFinal(c)) {
+          state_ = State::Ground;
+        }
+        break;
+      case State::String:
+        if (c == 0x07) {
+          state_ = State::Ground;
+        } else if (c == 0x1b) {
+          state_ = State::StringEscape;
+        }
+        break;
+      case State::StringEscape:
+        state_ = c == '\\' ? State::Ground : State::String;
+        break;
+    }
+  }
+}
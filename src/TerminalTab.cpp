@@ -1,26 +1,62 @@
 #include "TerminalTab.h"
+#include "ConnectionPool.h"
 #include "ProfileManagerDialog.h"
+#include "SessionLog.h"
+#include "SftpPanel.h"
 #include "SshSession.h"
 #include "TerminalWidget.h"
 
+#include <QCheckBox>
+#include <QDateTime>
 #include <QHBoxLayout>
 #include <QFileInfo>
 #include <QInputDialog>
+#include <QKeyEvent>
+#include <QLabel>
+#include <QLineEdit>
+#include <QProgressBar>
 #include <QPushButton>
+#include <QRegularExpression>
+#include <QSettings>
+#include <QSplitter>
+#include <QStringList>
+#include <QTimer>
+#include <QToolButton>
 #include <QVBoxLayout>
 
 TerminalTab::TerminalTab(QWidget *parent)
-    : QWidget(parent), terminal_(new TerminalWidget(this)), session_(new SshSession(this)) {
+    : QWidget(parent), terminal_(new TerminalWidget(this)), session_(new SshSession(this)),
+      statusLabel_(new QLabel(this)), cancelButton_(new QPushButton("Cancel", this)),
+      pasteBar_(new QProgressBar(this)), cancelPasteButton_(new QPushButton("Stop Paste", this)),
+      forwardsLabel_(new QLabel(this)), forwardTimer_(new QTimer(this)),
+      logButton_(new QPushButton("Log", this)), filesButton_(new QPushButton("Files", this)),
+      splitter_(new QSplitter(Qt::Horizontal, this)),
+      findBar_(new QWidget(this)), findEdit_(new QLineEdit(findBar_)),
+      findCase_(new QCheckBox("Match case", findBar_)), findRegex_(new QCheckBox("Regex", findBar_)),
+      findStatus_(new QLabel(findBar_)), log_(new SessionLog(this)) {
   auto *connectButton = new QPushButton("Connect", this);
   connect(connectButton, &QPushButton::clicked, this, &TerminalTab::onConnectClicked);
+  connect(cancelButton_, &QPushButton::clicked, session_, &SshSession::cancel);
+  connect(cancelPasteButton_, &QPushButton::clicked, session_, &SshSession::cancelPaste);
 
   connect(session_, &SshSession::output, this, &TerminalTab::onSessionOutput);
   connect(session_, &SshSession::error, this, &TerminalTab::onSessionError);
   connect(session_, &SshSession::connected, this, &TerminalTab::onSessionConnected);
   connect(session_, &SshSession::disconnected, this, &TerminalTab::onSessionDisconnected);
+  connect(session_, &SshSession::progress, this, &TerminalTab::onSessionProgress);
+  connect(session_, &SshSession::pasteProgress, this, &TerminalTab::onPasteProgress);
+  forwardTimer_->setInterval(1000);
+  connect(forwardTimer_, &QTimer::timeout, this, &TerminalTab::updateForwardStatus);
 
   connect(terminal_, &TerminalWidget::sendData, session_, &SshSession::send);
+  connect(terminal_, &TerminalWidget::pasteData, session_, &SshSession::sendPaste);
+  connect(terminal_, &TerminalWidget::sendData, this, &TerminalTab::logInput);
+  connect(terminal_, &TerminalWidget::pasteData, this, &TerminalTab::logInput);
+  connect(log_, &SessionLog::failed, this, &TerminalTab::onLogFailed);
   connect(terminal_, &TerminalWidget::terminalResized, this, &TerminalTab::onTerminalResize);
+  connect(terminal_, &TerminalWidget::outputBacklogged, session_, &SshSession::setOutputPaused);
+  connect(terminal_, &TerminalWidget::findRequested, this, &TerminalTab::onFindRequested);
+  connect(terminal_, &TerminalWidget::searchStatus, this, &TerminalTab::onSearchStatus);
 
   auto *topRowWidget = new QWidget(this);
   auto *topRow = new QHBoxLayout(topRowWidget);
@@ -29,22 +65,90 @@ TerminalTab::TerminalTab(QWidget *parent)
   connectButton->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
   connectButton->setMinimumHeight(22);
   topRow->addWidget(connectButton);
+  cancelButton_->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+  cancelButton_->setMinimumHeight(22);
+  cancelButton_->hide();
+  topRow->addWidget(statusLabel_);
+  topRow->addWidget(cancelButton_);
+  pasteBar_->setRange(0, 1000);
+  pasteBar_->setFixedWidth(160);
+  pasteBar_->setMaximumHeight(18);
+  pasteBar_->setFormat("Pasting %p%");
+  pasteBar_->hide();
+  cancelPasteButton_->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+  cancelPasteButton_->setMinimumHeight(22);
+  cancelPasteButton_->hide();
+  topRow->addWidget(pasteBar_);
+  topRow->addWidget(cancelPasteButton_);
   topRow->addStretch(1);
+  forwardsLabel_->hide();
+  topRow->addWidget(forwardsLabel_);
+  logButton_->setCheckable(true);
+  logButton_->setToolTip("Record this session to an asciicast file");
+  logButton_->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+  logButton_->setMinimumHeight(22);
+  connect(logButton_, &QPushButton::toggled, this, &TerminalTab::onLogToggled);
+  topRow->addWidget(logButton_);
+  filesButton_->setCheckable(true);
+  filesButton_->setEnabled(false);
+  filesButton_->setToolTip("Browse and copy files over SFTP on this connection");
+  filesButton_->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+  filesButton_->setMinimumHeight(22);
+  connect(filesButton_, &QPushButton::toggled, this, &TerminalTab::onFilesToggled);
+  topRow->addWidget(filesButton_);
   topRowWidget->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
   topRowWidget->setFixedHeight(26);
 
+  // Find bar under the terminal: Enter goes to the next older match,
+  // Shift+Enter to the next newer one, Escape closes it.
+  auto *findRow = new QHBoxLayout(findBar_);
+  findRow->setContentsMargins(4, 2, 4, 2);
+  findRow->setSpacing(6);
+  findEdit_->setPlaceholderText("Find in output");
+  findEdit_->installEventFilter(this);
+  connect(findEdit_, &QLineEdit::textChanged, this, &TerminalTab::onFindChanged);
+  connect(findCase_, &QCheckBox::toggled, this, &TerminalTab::onFindChanged);
+  connect(findRegex_, &QCheckBox::toggled, this, &TerminalTab::onFindChanged);
+  auto *olderButton = new QToolButton(findBar_);
+  olderButton->setArrowType(Qt::UpArrow);
+  olderButton->setToolTip("Older match (Enter)");
+  connect(olderButton, &QToolButton::clicked, this, [this]() { terminal_->findNext(true); });
+  auto *newerButton = new QToolButton(findBar_);
+  newerButton->setArrowType(Qt::DownArrow);
+  newerButton->setToolTip("Newer match (Shift+Enter)");
+  connect(newerButton, &QToolButton::clicked, this, [this]() { terminal_->findNext(false); });
+  auto *closeFindButton = new QPushButton("Close", findBar_);
+  closeFindButton->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+  closeFindButton->setMinimumHeight(22);
+  connect(closeFindButton, &QPushButton::clicked, this, &TerminalTab::closeFindBar);
+  findRow->addWidget(findEdit_, 1);
+  findRow->addWidget(findCase_);
+  findRow->addWidget(findRegex_);
+  findRow->addWidget(olderButton);
+  findRow->addWidget(newerButton);
+  findRow->addWidget(findStatus_);
+  findRow->addWidget(closeFindButton);
+  findBar_->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
+  findBar_->hide();
+
   auto *layout = new QVBoxLayout();
   layout->setContentsMargins(4, 4, 4, 4);
   layout->setSpacing(4);
   layout->addWidget(topRowWidget);
-  layout->addWidget(terminal_);
+  splitter_->addWidget(terminal_);
+  splitter_->setStretchFactor(0, 1);
+  layout->addWidget(splitter_);
+  layout->addWidget(findBar_);
   setLayout(layout);
 }
 
 void TerminalTab::connectProfile(const Profile &p, bool promptKeyPass) {
   QString keyPass;
   const QString keyPath = p.keyPath.trimmed();
-  if (promptKeyPass && !keyPath.isEmpty() && QFileInfo::exists(keyPath)) {
+  // A tab already connected with this key shares its connection, which is
+  // authenticated; the key is not loaded again.
+  if (promptKeyPass && !keyPath.isEmpty() && QFileInfo::exists(keyPath) &&
+      !SshSession::hasSharedConnection(p.host, p.user, p.port, keyPath, p.transport, p.proxyJump)) {
     bool ok = false;
     keyPass = QInputDialog::getText(this, "Key Passphrase", "Passphrase (leave empty if none)",
                                     QLineEdit::Password, "", &ok);
@@ -52,11 +156,17 @@ void TerminalTab::connectProfile(const Profile &p, bool promptKeyPass) {
       return;
     }
   }
+  connectProfile(p, keyPass);
+}
 
+void TerminalTab::connectProfile(const Profile &p, const QString &keyPassphrase) {
   currentProfile_ = p;
   hasProfile_ = true;
   emit profileSelected(currentProfile_);
-  session_->connectToHost(p.host, p.user, QString(), keyPath, keyPass, p.port);
+  ConnectionPool::instance()->recordConnect(p);
+  // Returns immediately; progress() and connected() follow from the reactor.
+  session_->connectToHost(p.host, p.user, QString(), p.keyPath.trimmed(), keyPassphrase, p.port,
+                         p.transport, p.proxyJump);
 }
 
 bool TerminalTab::hasProfile() const {
@@ -71,8 +181,9 @@ Profile TerminalTab::currentProfile() const {
   return currentProfile_;
 }
 
-void TerminalTab::applyTheme(const QColor &fg, const QColor &bg, const QFont &font) {
-  terminal_->setTheme(fg, bg, font);
+void TerminalTab::applyTheme(const QColor &fg, const QColor &bg, const QSharedPointer<const ColorTable> &colors,
+                             const QFont &font) {
+  terminal_->setTheme(fg, bg, colors, font);
 }
 
 void TerminalTab::onConnectClicked() {
@@ -89,20 +200,231 @@ void TerminalTab::onConnectClicked() {
 }
 
 void TerminalTab::onSessionOutput(const QByteArray &data) {
+  log_->output(data);
   terminal_->writeData(data);
 }
 
 void TerminalTab::onSessionError(const QString &message) {
+  if (!connected_) {
+    setConnectStatus(QString());
+  }
   terminal_->writeData("[Error] " + message.toUtf8() + "\n");
 }
 
+void TerminalTab::onSessionProgress(const QString &phase) {
+  setConnectStatus(phase + "...");
+}
+
+// Shows the connection phase and the Cancel button while connecting; an
+// empty status hides both.
+void TerminalTab::setConnectStatus(const QString &status) {
+  statusLabel_->setText(status);
+  statusLabel_->setVisible(!status.isEmpty());
+  cancelButton_->setVisible(!status.isEmpty());
+}
+
+void TerminalTab::onPasteProgress(qint64 sent, qint64 total) {
+  const bool active = total > 0 && sent < total;
+  if (active) {
+    pasteBar_->setValue(int(sent * 1000 / total));
+  }
+  pasteBar_->setVisible(active);
+  cancelPasteButton_->setVisible(active);
+}
+
+static QString formatRate(double bytesPerSecond) {
+  if (bytesPerSecond >= 1024.0 * 1024.0) {
+    return QString("%1 MB/s").arg(bytesPerSecond / (1024.0 * 1024.0), 0, 'f', 1);
+  }
+  return QString("%1 KB/s").arg(bytesPerSecond / 1024.0, 0, 'f', 0);
+}
+
+void TerminalTab::onFilesToggled(bool show) {
+  if (!sftpPanel_) {
+    if (!show) {
+      return;
+    }
+    sftpPanel_ = new SftpPanel(session_, this);
+    splitter_->addWidget(sftpPanel_);
+    splitter_->setStretchFactor(1, 0);
+    splitter_->setSizes({width() * 2 / 3, width() / 3});
+  }
+  sftpPanel_->setVisible(show);
+  if (show && connected_) {
+    sftpPanel_->open();
+  }
+}
+
+// Starts a recording named after the profile and the time, or stops the
+// current one.
+void TerminalTab::onLogToggled(bool on) {
+  if (!on) {
+    log_->close();
+    logButton_->setToolTip("Record this session to an asciicast file");
+    return;
+  }
+  if (log_->isOpen()) {
+    return;
+  }
+  QSettings settings("sshterminal", "sshterminal");
+  const QString dir = settings.value("logging/dir", SessionLog::defaultDirectory()).toString();
+  const qint64 maxBytes = settings.value("logging/maxMB", 100).toLongLong() * 1024 * 1024;
+  logInput_ = settings.value("logging/input", false).toBool();
+  QString name = currentProfile_.name.isEmpty() ? currentProfile_.host : currentProfile_.name;
+  name.replace(QRegularExpression("[^A-Za-z0-9._-]+"), "_");
+  if (name.isEmpty()) {
+    name = "session";
+  }
+  const QString path =
+      dir + "/" + name + "-" + QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss") + ".cast";
+  const QString title = currentProfile_.name.isEmpty()
+                            ? QString("%1@%2").arg(currentProfile_.user, currentProfile_.host)
+                            : currentProfile_.name;
+  QString error;
+  if (!log_->open(path, rows_, cols_, title, maxBytes, &error)) {
+    onLogFailed(error);
+    return;
+  }
+  logButton_->setToolTip("Recording to " + path);
+}
+
+void TerminalTab::onLogFailed(const QString &message) {
+  terminal_->writeData("[Error] Session log: " + message.toUtf8() + "\n");
+  logButton_->setChecked(false);
+}
+
+// Input is only recorded when asked for, and never at a password prompt.
+void TerminalTab::logInput(const QByteArray &data) {
+  if (logInput_ && !terminal_->atPasswordPrompt()) {
+    log_->input(data);
+  }
+}
+
+void TerminalTab::onFindRequested() {
+  const bool reopen = findBar_->isHidden();
+  findBar_->show();
+  findEdit_->setFocus();
+  findEdit_->selectAll();
+  if (reopen && !findEdit_->text().isEmpty()) {
+    onFindChanged();
+  }
+}
+
+// Searches again on every change; the terminal drops the previous search.
+void TerminalTab::onFindChanged() {
+  ScrollbackSearch::Query query;
+  query.pattern = findEdit_->text();
+  query.regex = findRegex_->isChecked();
+  query.caseSensitive = findCase_->isChecked();
+  QString error;
+  if (!terminal_->setSearch(query, &error)) {
+    findStatus_->setText(error);
+  }
+}
+
+void TerminalTab::onSearchStatus(int current, int total, bool searching, bool truncated) {
+  if (findEdit_->text().isEmpty()) {
+    findStatus_->clear();
+    return;
+  }
+  QString text;
+  const QString count = truncated ? QString("%1+").arg(total) : QString::number(total);
+  if (total == 0) {
+    text = searching ? QString("Searching...") : QString("No matches");
+  } else if (current > 0) {
+    text = QString("%1 of %2").arg(current).arg(count);
+  } else {
+    text = QString("%1 matches").arg(count);
+  }
+  if (searching && total > 0) {
+    text += "...";
+  }
+  findStatus_->setText(text);
+}
+
+void TerminalTab::closeFindBar() {
+  terminal_->setSearch(ScrollbackSearch::Query());
+  findBar_->hide();
+  terminal_->setFocus();
+}
+
+bool TerminalTab::eventFilter(QObject *watched, QEvent *event) {
+  if (watched == findEdit_ && event->type() == QEvent::KeyPress) {
+    auto *key = static_cast<QKeyEvent *>(event);
+    if (key->key() == Qt::Key_Return || key->key() == Qt::Key_Enter) {
+      terminal_->findNext(!key->modifiers().testFlag(Qt::ShiftModifier));
+      return true;
+    }
+    if (key->key() == Qt::Key_Escape) {
+      closeFindBar();
+      return true;
+    }
+  }
+  return QWidget::eventFilter(watched, event);
+}
+
+// One entry per forward: open connections and throughput over the last tick.
+void TerminalTab::updateForwardStatus() {
+  const QVector<SshSession::ForwardStatus> statuses = session_->forwardStatus();
+  const double seconds = forwardTimer_->interval() / 1000.0;
+  QStringList parts;
+  QStringList details;
+  for (const SshSession::ForwardStatus &s : statuses) {
+    const QString name = s.forward.toString();
+    quint64 up = 0;
+    quint64 down = 0;
+    for (const SshSession::ForwardStatus &last : lastForwards_) {
+      if (last.forward.toString() == name) {
+        up = s.bytesUp - last.bytesUp;
+        down = s.bytesDown - last.bytesDown;
+      }
+    }
+    const QString port = s.forward.type == PortForward::Dynamic
+                             ? QString("SOCKS %1").arg(s.forward.bindPort)
+                             : QString("%1→%2:%3").arg(s.forward.bindPort).arg(s.forward.targetHost).arg(s.forward.targetPort);
+    parts << QString("%1 (%2) ↑%3 ↓%4")
+                 .arg(port)
+                 .arg(s.activeTunnels)
+                 .arg(formatRate(up / seconds), formatRate(down / seconds));
+    details << QString("%1: %2 open, %3 total, %4 MB sent, %5 MB received")
+                   .arg(name)
+                   .arg(s.activeTunnels)
+                   .arg(s.totalTunnels)
+                   .arg(s.bytesUp / 1048576.0, 0, 'f', 1)
+                   .arg(s.bytesDown / 1048576.0, 0, 'f', 1);
+  }
+  lastForwards_ = statuses;
+  forwardsLabel_->setText(parts.join("  "));
+  forwardsLabel_->setToolTip(details.join('\n'));
+  forwardsLabel_->setVisible(!parts.isEmpty());
+}
+
 void TerminalTab::onTerminalResize(int rows, int cols) {
+  rows_ = rows;
+  cols_ = cols;
+  log_->resize(rows, cols);
   session_->setPtySize(rows, cols);
 }
 
 void TerminalTab::onSessionConnected() {
   connected_ = true;
+  setConnectStatus(QString());
   terminal_->clearScreen();
+  filesButton_->setEnabled(true);
+  if (sftpPanel_ && filesButton_->isChecked()) {
+    sftpPanel_->open();
+  }
+  if (hasProfile_ && !currentProfile_.forwards.isEmpty()) {
+    for (const PortForward &forward : currentProfile_.forwards) {
+      session_->addForward(forward);
+    }
+    lastForwards_.clear();
+    updateForwardStatus();
+    forwardTimer_->start();
+  }
+  if (hasProfile_ && currentProfile_.logSession) {
+    logButton_->setChecked(true);
+  }
   if (hasProfile_) {
     emit profileConnected(currentProfile_);
   }
@@ -110,5 +432,12 @@ void TerminalTab::onSessionConnected() {
 
 void TerminalTab::onSessionDisconnected() {
   connected_ = false;
+  forwardTimer_->stop();
+  forwardsLabel_->hide();
+  filesButton_->setEnabled(false);
+  if (sftpPanel_) {
+    sftpPanel_->close();
+  }
+  logButton_->setChecked(false);
   emit requestClose();
 }
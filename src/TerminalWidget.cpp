@@ -1,4 +1,10 @@
 #include "TerminalWidget.h"
+#include "FrameScheduler.h"
+#include "GlyphAtlas.h"
+#include "PerfStats.h"
+#include "ScreenModel.h"
+#include "Scrollback.h"
+#include "ScrollbackSearch.h"
 
 #include <QFontDatabase>
 #include <QHBoxLayout>
@@ -7,22 +13,61 @@
 #include <QPainter>
 #include <QPlainTextEdit>
 #include <QMouseEvent>
+#include <QShowEvent>
+#include <QHideEvent>
 #include <QApplication>
 #include <QClipboard>
+#include <algorithm>
 #include <cstring>
+#include <limits>
 #include <QMimeData>
+#include <QElapsedTimer>
+#include <QSettings>
 #include <QTimer>
+#include <QVarLengthArray>
+#include <QWheelEvent>
 
 #ifdef HAVE_LIBVTERM
 #include <vterm.h>
 #endif
 
+namespace {
+
+// Screen size bounds in cells.
+constexpr int kMinCols = 2;
+constexpr int kMaxCols = 1000;
+constexpr int kMinRows = 1;
+constexpr int kMaxRows = 1000;
+// How long the widget size must hold before the remote is told.
+constexpr int kPtyResizeDelayMs = 150;
+// Output waiting to be parsed at which the session is asked to stop handing
+// over more, and the level at which it may go on.
+constexpr qint64 kMaxPendingInput = 4 * 1024 * 1024;
+constexpr qint64 kPendingInputLowWater = 1024 * 1024;
+
+struct PaintCounters {
+  quint64 frames = 0;
+  qint64 nsecs = 0;
+};
+
+PaintCounters &paintCounters() {
+  static PaintCounters counters;
+  return counters;
+}
+
+bool matchBefore(const ScrollbackSearch::Match &a, const ScrollbackSearch::Match &b) {
+  return a.line < b.line || (a.line == b.line && a.col < b.col);
+}
+
+} // namespace
+
 TerminalWidget::TerminalWidget(QWidget *parent) : QWidget(parent) {
 #ifdef HAVE_LIBVTERM
   font_ = QFontDatabase::systemFont(QFontDatabase::FixedFont);
   font_.setPointSize(12);
   fg_ = QColor(220, 220, 220);
   bg_ = QColor(0, 0, 0);
+  colors_ = ColorTable::defaultTable();
 
   // Use libvterm by default; allow disabling via env.
   bool useVterm = true;
@@ -30,6 +75,8 @@ TerminalWidget::TerminalWidget(QWidget *parent) : QWidget(parent) {
     useVterm = false;
   }
 
+  perCellRendering_ = !qgetenv("SSH_TERMINAL_RENDER_PER_CELL").isEmpty();
+
   if (useVterm) {
     initVTerm();
   } else {
@@ -42,26 +89,39 @@ TerminalWidget::TerminalWidget(QWidget *parent) : QWidget(parent) {
   font_.setPointSize(12);
   initFallbackUi();
 #endif
-  setTheme(fg_, bg_, font_);
+  setTheme(fg_, bg_, ColorTable::defaultTable(), font_);
 }
 
 TerminalWidget::~TerminalWidget() {
 #ifdef HAVE_LIBVTERM
+  if (scheduler_) {
+    scheduler_->remove(this);
+  }
   if (vterm_) {
     vterm_free(vterm_);
     vterm_ = nullptr;
   }
+  delete model_;
+  model_ = nullptr;
 #endif
 }
 
 void TerminalWidget::writeData(const QByteArray &data) {
 #ifdef HAVE_LIBVTERM
-  if (!vterm_) {
+  if (!vterm_ || data.isEmpty()) {
     return;
   }
-  vterm_input_write(vterm_, data.constData(), data.size());
-  vterm_screen_flush_damage(screen_);
-  update();
+  // Parsing and painting are paced by the window's frame scheduler.
+  pendingInput_.append(data);
+  pendingBytes_ += data.size();
+  if (!backlogged_ && pendingBytes_ >= kMaxPendingInput) {
+    backlogged_ = true;
+    emit outputBacklogged(true);
+  }
+  if (!scheduler_) {
+    scheduler_ = FrameScheduler::forWindow(this);
+  }
+  scheduler_->inputPending(this);
 #else
   if (!output_) {
     return;
@@ -121,6 +181,30 @@ void TerminalWidget::writeData(const QByteArray &data) {
 #endif
 }
 
+#ifdef HAVE_LIBVTERM
+qint64 TerminalWidget::parsePending(qint64 maxBytes) {
+  qint64 parsed = 0;
+  while (!pendingInput_.isEmpty() && parsed < maxBytes) {
+    const QByteArray &chunk = pendingInput_.first();
+    const int n = int(qMin<qint64>(chunk.size() - pendingOffset_, maxBytes - parsed));
+    vterm_input_write(vterm_, chunk.constData() + pendingOffset_, size_t(n));
+    modes_.feed(chunk.constData() + pendingOffset_, n);
+    parsed += n;
+    pendingOffset_ += n;
+    if (pendingOffset_ >= chunk.size()) {
+      pendingInput_.removeFirst();
+      pendingOffset_ = 0;
+    }
+  }
+  pendingBytes_ -= parsed;
+  if (backlogged_ && pendingBytes_ <= kPendingInputLowWater) {
+    backlogged_ = false;
+    emit outputBacklogged(false);
+  }
+  return parsed;
+}
+#endif
+
 void TerminalWidget::clearScreen() {
 #ifdef HAVE_LIBVTERM
   // Avoid calling libvterm APIs here; some builds crash in screen flush/reset.
@@ -133,10 +217,16 @@ void TerminalWidget::clearScreen() {
 #endif
 }
 
-void TerminalWidget::setTheme(const QColor &fg, const QColor &bg, const QFont &font) {
+void TerminalWidget::setTheme(const QColor &fg, const QColor &bg, const QSharedPointer<const ColorTable> &colors,
+                              const QFont &font) {
   fg_ = fg;
   bg_ = bg;
   font_ = font;
+#ifdef HAVE_LIBVTERM
+  colors_ = colors ? colors : ColorTable::defaultTable();
+#else
+  Q_UNUSED(colors);
+#endif
 
 #if defined(__APPLE__)
   // Ensure emoji glyphs can render via fallback font on macOS.
@@ -157,6 +247,11 @@ void TerminalWidget::setTheme(const QColor &fg, const QColor &bg, const QFont &f
   cellWidth_ = fm.horizontalAdvance(QLatin1Char('M'));
   cellHeight_ = fm.height();
   cellAscent_ = fm.ascent();
+  atlas_.reset();
+  invalidateAll();
+  if (state_) {
+    applyStateColors();
+  }
   if (vterm_ && isVisible()) {
     updateSizeFromPixel();
     update();
@@ -179,9 +274,133 @@ void TerminalWidget::setTheme(const QColor &fg, const QColor &bg, const QFont &f
 #endif
 }
 
+bool TerminalWidget::setSearch(const ScrollbackSearch::Query &query, QString *error) {
+#ifdef HAVE_LIBVTERM
+  if (!model_) {
+    return true;
+  }
+  searchQuery_ = query;
+  searchMatcher_ = ScrollbackSearch::Matcher(query);
+  historyMatches_.clear();
+  historyMatchCount_ = 0;
+  screenMatches_.clear();
+  currentMatch_ = ScrollbackSearch::Match{-1, 0, 0};
+  searchTruncated_ = false;
+  if (searchMatcher_.isEmpty() || !searchMatcher_.isValid()) {
+    if (search_) {
+      search_->stop();
+    }
+    if (error) *error = searchMatcher_.errorString();
+    invalidateAll();
+    update();
+    emitSearchStatus();
+    return searchMatcher_.isValid();
+  }
+  if (!search_) {
+    search_ = new ScrollbackSearch(this);
+    connect(search_, &ScrollbackSearch::found, this, &TerminalWidget::onSearchFound);
+    connect(search_, &ScrollbackSearch::finished, this, [this](bool truncated) {
+      searchTruncated_ = searchTruncated_ || truncated;
+      emitSearchStatus();
+    });
+  }
+  search_->start(query, model_->scrollback(), model_->clusters());
+  updateScreenMatches();
+  // Start at the match nearest the bottom of the view; history hits arrive
+  // later and only take over if the screen has none.
+  ScrollbackSearch::Match match;
+  if (adjacentMatch(viewLine(model_->rows() - 1) + 1, 0, true, &match)) {
+    selectMatch(match);
+  }
+  invalidateAll();
+  update();
+  emitSearchStatus();
+  return true;
+#else
+  Q_UNUSED(query);
+  Q_UNUSED(error);
+  return false;
+#endif
+}
+
+bool TerminalWidget::atPasswordPrompt() const {
+#ifdef HAVE_LIBVTERM
+  return model_ && EchoPredictor::atPasswordPrompt(*model_);
+#else
+  return false;
+#endif
+}
+
+void TerminalWidget::findNext(bool older) {
+#ifdef HAVE_LIBVTERM
+  if (!model_ || searchMatcher_.isEmpty()) {
+    return;
+  }
+  ScrollbackSearch::Match match;
+  qint64 line = currentMatch_.line;
+  int col = currentMatch_.col;
+  if (line < 0) {
+    // Nothing selected yet: start from the edge of the view.
+    line = older ? viewLine(model_->rows() - 1) + 1 : viewLine(0) - 1;
+    col = 0;
+  }
+  if (adjacentMatch(line, col, older, &match) ||
+      adjacentMatch(older ? std::numeric_limits<qint64>::max() : -1, 0, older, &match)) {
+    selectMatch(match);
+  }
+  emitSearchStatus();
+#else
+  Q_UNUSED(older);
+#endif
+}
+
 bool TerminalWidget::handleKeyEvent(QKeyEvent *event) {
   QByteArray out;
 
+#ifdef HAVE_LIBVTERM
+  // Shift+PageUp/PageDown and Shift+Up/Down scroll back; Ctrl+Shift+Home/End
+  // jump to the oldest line and back to the live screen.
+  if (model_ && !model_->altScreen() && (event->modifiers() & Qt::ShiftModifier)) {
+    const bool control = event->modifiers().testFlag(Qt::ControlModifier);
+    const int page = qMax(1, model_->rows() - 1);
+    switch (event->key()) {
+      case Qt::Key_PageUp:
+        scrollView(page);
+        return true;
+      case Qt::Key_PageDown:
+        scrollView(-page);
+        return true;
+      case Qt::Key_Up:
+        scrollView(1);
+        return true;
+      case Qt::Key_Down:
+        scrollView(-1);
+        return true;
+      case Qt::Key_Home:
+        if (control) {
+          scrollView(std::numeric_limits<int>::max());
+          return true;
+        }
+        break;
+      case Qt::Key_End:
+        if (control) {
+          scrollView(-scrollOffset_);
+          return true;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+#endif
+
+  if ((event->modifiers() & Qt::ShiftModifier) &&
+      (event->modifiers() & Qt::ControlModifier) &&
+      event->key() == Qt::Key_F) {
+    emit findRequested();
+    return true;
+  }
+
   if ((event->modifiers() & Qt::ShiftModifier) &&
       (event->modifiers() & Qt::ControlModifier) &&
       event->key() == Qt::Key_V) {
@@ -247,6 +466,15 @@ bool TerminalWidget::handleKeyEvent(QKeyEvent *event) {
   }
 
   if (!out.isEmpty()) {
+#ifdef HAVE_LIBVTERM
+    if (model_) {
+      scrollView(-scrollOffset_);
+      const int predictedRow = predictor_.row();
+      const bool predictedShown = predictor_.visible();
+      predictor_.inputSent(out, *model_);
+      refreshPredictions(predictedRow, predictedShown);
+    }
+#endif
     emit sendData(out);
     return true;
   }
@@ -260,11 +488,18 @@ void TerminalWidget::keyPressEvent(QKeyEvent *event) {
 }
 
 void TerminalWidget::paintEvent(QPaintEvent *event) {
-  Q_UNUSED(event)
 #ifdef HAVE_LIBVTERM
+  QElapsedTimer timer;
+  if (PerfStats::enabled()) {
+    timer.start();
+  }
   QPainter p(this);
-  p.fillRect(rect(), bg_.isValid() ? bg_ : Qt::black);
-  renderVTerm(p);
+  renderVTerm(p, event->region());
+  if (timer.isValid()) {
+    PaintCounters &counters = paintCounters();
+    ++counters.frames;
+    counters.nsecs += timer.nsecsElapsed();
+  }
 #else
   QWidget::paintEvent(event);
 #endif
@@ -288,7 +523,7 @@ void TerminalWidget::focusInEvent(QFocusEvent *event) {
   QWidget::focusInEvent(event);
 #ifdef HAVE_LIBVTERM
   cursorVisible_ = true;
-  update();
+  update(cursorRect());
 #endif
 }
 
@@ -296,17 +531,54 @@ void TerminalWidget::focusOutEvent(QFocusEvent *event) {
   QWidget::focusOutEvent(event);
 #ifdef HAVE_LIBVTERM
   cursorVisible_ = false;
+  update(cursorRect());
+#endif
+}
+
+// Hidden tabs and minimized windows (which deliver spontaneous hide events)
+// stop blinking and painting; their output keeps being parsed in the
+// background and is shown with a single full repaint on return.
+void TerminalWidget::showEvent(QShowEvent *event) {
+  QWidget::showEvent(event);
+#ifdef HAVE_LIBVTERM
+  if (exposed_) {
+    return;
+  }
+  exposed_ = true;
+  if (!model_) {
+    return;
+  }
+  model_->takeMoves([](const ScreenModel::Move &) {});
+  model_->takeDamage([](int, int, int) {});
+  cursorRow_ = model_->cursorRow();
+  cursorCol_ = model_->cursorCol();
+  cursorShown_ = model_->cursorVisible();
+  invalidateAll();
   update();
+  if (cursorTimer_) {
+    cursorTimer_->start();
+  }
+  if (scheduler_ && hasPendingInput()) {
+    scheduler_->inputPending(this);
+  }
+#endif
+}
+
+void TerminalWidget::hideEvent(QHideEvent *event) {
+  QWidget::hideEvent(event);
+#ifdef HAVE_LIBVTERM
+  exposed_ = false;
+  if (cursorTimer_) {
+    cursorTimer_->stop();
+  }
 #endif
 }
 
 void TerminalWidget::mousePressEvent(QMouseEvent *event) {
 #ifdef HAVE_LIBVTERM
   if (event->button() == Qt::LeftButton) {
-    selecting_ = true;
-    selStart_ = pointToCell(event->pos());
-    selEnd_ = selStart_;
-    update();
+    const VTermPos pos = pointToCell(event->pos());
+    setSelection(pos, pos, true);
     return;
   }
   if (event->button() == Qt::MiddleButton) {
@@ -320,8 +592,7 @@ void TerminalWidget::mousePressEvent(QMouseEvent *event) {
 void TerminalWidget::mouseMoveEvent(QMouseEvent *event) {
 #ifdef HAVE_LIBVTERM
   if (selecting_) {
-    selEnd_ = pointToCell(event->pos());
-    update();
+    setSelection(selStart_, pointToCell(event->pos()), true);
     return;
   }
 #endif
@@ -331,7 +602,7 @@ void TerminalWidget::mouseMoveEvent(QMouseEvent *event) {
 void TerminalWidget::mouseReleaseEvent(QMouseEvent *event) {
 #ifdef HAVE_LIBVTERM
   if (event->button() == Qt::LeftButton && selecting_) {
-    selecting_ = false;
+    setSelection(selStart_, selEnd_, false);
     const QString text = selectedText();
     if (!text.isEmpty()) {
       QClipboard *cb = QApplication::clipboard();
@@ -342,13 +613,29 @@ void TerminalWidget::mouseReleaseEvent(QMouseEvent *event) {
         }
       }
     }
-    update();
     return;
   }
 #endif
   QWidget::mouseReleaseEvent(event);
 }
 
+void TerminalWidget::wheelEvent(QWheelEvent *event) {
+#ifdef HAVE_LIBVTERM
+  if (model_ && !model_->altScreen()) {
+    // Three lines per notch; touchpads deliver fractions of one.
+    wheelRemainder_ += event->angleDelta().y();
+    const int lines = wheelRemainder_ * 3 / 120;
+    if (lines != 0) {
+      wheelRemainder_ -= lines * 120 / 3;
+      scrollView(lines);
+    }
+    event->accept();
+    return;
+  }
+#endif
+  QWidget::wheelEvent(event);
+}
+
 void TerminalWidget::initFallbackUi() {
   class FallbackEdit : public QPlainTextEdit {
   public:
@@ -426,99 +713,106 @@ void TerminalWidget::pasteFromClipboard() {
   if (text.isEmpty()) {
     return;
   }
-  emit sendData(text.toUtf8());
+  bool bracketed = false;
+#ifdef HAVE_LIBVTERM
+  // The session adds the paste markers itself; libvterm has no way to ask
+  // whether the remote set DECSET 2004.
+  bracketed = modes_.bracketedPaste();
+  if (model_) {
+    scrollView(-scrollOffset_);
+    const int predictedRow = predictor_.row();
+    const bool predictedShown = predictor_.visible();
+    predictor_.inputSent(text.toUtf8(), *model_);
+    refreshPredictions(predictedRow, predictedShown);
+  }
+#endif
+  emit pasteData(text.toUtf8(), bracketed);
 }
 
 #ifdef HAVE_LIBVTERM
 void TerminalWidget::initVTerm() {
   setFocusPolicy(Qt::StrongFocus);
 
+  PerfStats::setReporter("paint", []() {
+    const PaintCounters &counters = paintCounters();
+    const double avgMs = counters.frames ? counters.nsecs / 1e6 / counters.frames : 0.0;
+    return QString("frames=%1 avg=%2ms").arg(counters.frames).arg(avgMs, 0, 'f', 3);
+  });
+  PerfStats::setReporter("predict", &EchoPredictor::report);
+
+  // Rolls back predictions the server does not echo, e.g. with echo off.
+  predictTimer_ = new QTimer(this);
+  predictTimer_->setInterval(100);
+  connect(predictTimer_, &QTimer::timeout, this, [this]() {
+    const int predictedRow = predictor_.row();
+    const bool predictedShown = predictor_.visible();
+    predictor_.expire();
+    refreshPredictions(predictedRow, predictedShown);
+  });
+
   QFontMetrics fm(font_);
   cellWidth_ = fm.horizontalAdvance(QLatin1Char('M'));
   cellHeight_ = fm.height();
   cellAscent_ = fm.ascent();
 
-  const int cols = qMax(100, width() / qMax(1, cellWidth_));
-  const int rows = qMax(24, height() / qMax(1, cellHeight_));
+  const int cols = qBound(kMinCols, width() / qMax(1, cellWidth_), kMaxCols);
+  const int rows = qBound(kMinRows, height() / qMax(1, cellHeight_), kMaxRows);
 
   vterm_ = vterm_new(rows, cols);
   vterm_set_utf8(vterm_, 1);
-  screen_ = vterm_obtain_screen(vterm_);
   state_ = vterm_obtain_state(vterm_);
   vtermReady_ = (vterm_ != nullptr);
   lastRows_ = rows;
   lastCols_ = cols;
 
-  // Initialize screen/state buffers to avoid crashes on first input.
-  if (screen_) {
-    vterm_screen_reset(screen_, 1);
-  }
-  if (state_) {
-    vterm_state_reset(state_, 1);
-  }
-
-  callbacks_ = {};
-  callbacks_.damage = [](VTermRect rect, void *user) -> int {
-    auto *self = static_cast<TerminalWidget *>(user);
-    Q_UNUSED(rect)
-    self->update();
-    return 1;
-  };
-  callbacks_.movecursor = [](VTermPos pos, VTermPos oldpos, int visible, void *user) -> int {
-    Q_UNUSED(oldpos)
-    auto *self = static_cast<TerminalWidget *>(user);
-    self->cursorRow_ = pos.row;
-    self->cursorCol_ = pos.col;
-    self->cursorShown_ = (visible != 0);
-    self->update();
-    return 1;
-  };
-  callbacks_.sb_pushline = [](int cols, const VTermScreenCell *cells, void *user) -> int {
-    Q_UNUSED(cols)
-    Q_UNUSED(cells)
-    Q_UNUSED(user)
-    // No scrollback buffer; ignore.
-    return 1;
-  };
-  callbacks_.sb_popline = [](int cols, VTermScreenCell *cells, void *user) -> int {
-    Q_UNUSED(cols)
-    Q_UNUSED(cells)
-    Q_UNUSED(user)
-    return 1;
-  };
-  callbacks_.sb_clear = [](void *user) -> int {
-    Q_UNUSED(user)
-    return 1;
-  };
+  // Our own screen model takes the state callbacks directly; VTermScreen is
+  // never created, so there is no second copy of the grid.
+  model_ = new ScreenModel(rows, cols);
+  model_->attach(state_);
+  layout_.reset(cols);
+  QSettings settings("sshterminal", "sshterminal");
+  model_->scrollback().setLimits(settings.value("scrollback/maxLines", 1000000).toInt(),
+                                 settings.value("scrollback/maxMB", 256).toLongLong() * 1024 * 1024);
+  model_->scrollback().setSpillEnabled(settings.value("scrollback/spill", true).toBool());
 
-  vterm_screen_set_callbacks(screen_, &callbacks_, this);
-  vterm_screen_set_damage_merge(screen_, VTERM_DAMAGE_SCROLL);
+  applyStateColors();
 
-  // Apply default colors from theme to vterm state/screen
-  if (screen_ && state_) {
-    VTermColor fg;
-    VTermColor bg;
-    const QColor fgq = fg_.isValid() ? fg_ : QColor(220, 220, 220);
-    const QColor bgq = bg_.isValid() ? bg_ : QColor(0, 0, 0);
-    vterm_color_rgb(&fg, static_cast<uint8_t>(fgq.red()), static_cast<uint8_t>(fgq.green()), static_cast<uint8_t>(fgq.blue()));
-    vterm_color_rgb(&bg, static_cast<uint8_t>(bgq.red()), static_cast<uint8_t>(bgq.green()), static_cast<uint8_t>(bgq.blue()));
-    vterm_state_set_default_colors(state_, &fg, &bg);
-    vterm_screen_set_default_colors(screen_, &fg, &bg);
-  }
+  // Reset after attaching so the initial pen reaches the model.
+  vterm_state_reset(state_, 1);
 
   if (!cursorTimer_) {
     cursorTimer_ = new QTimer(this);
     cursorTimer_->setInterval(600);
     connect(cursorTimer_, &QTimer::timeout, this, [this]() {
       cursorVisible_ = !cursorVisible_;
-      update();
+      update(cursorRect());
     });
-    cursorTimer_->start();
+    if (exposed_) {
+      cursorTimer_->start();
+    }
   }
 
   emit terminalResized(rows, cols);
 }
 
+void TerminalWidget::applyStateColors() {
+  // Apply default colors and the ANSI palette from the theme to vterm state
+  // so anything libvterm resolves itself agrees with our lookup table.
+  VTermColor fg;
+  VTermColor bg;
+  const QColor fgq = fg_.isValid() ? fg_ : QColor(220, 220, 220);
+  const QColor bgq = bg_.isValid() ? bg_ : QColor(0, 0, 0);
+  vterm_color_rgb(&fg, static_cast<uint8_t>(fgq.red()), static_cast<uint8_t>(fgq.green()), static_cast<uint8_t>(fgq.blue()));
+  vterm_color_rgb(&bg, static_cast<uint8_t>(bgq.red()), static_cast<uint8_t>(bgq.green()), static_cast<uint8_t>(bgq.blue()));
+  vterm_state_set_default_colors(state_, &fg, &bg);
+  for (int i = 0; i < ColorTable::kAnsiColors; ++i) {
+    const QRgb c = colors_->color(i);
+    VTermColor col;
+    vterm_color_rgb(&col, static_cast<uint8_t>(qRed(c)), static_cast<uint8_t>(qGreen(c)), static_cast<uint8_t>(qBlue(c)));
+    vterm_state_set_palette_color(state_, i, &col);
+  }
+}
+
 void TerminalWidget::updateSizeFromPixel() {
   if (!vterm_ || !vtermReady_) {
     return;
@@ -531,22 +825,39 @@ void TerminalWidget::updateSizeFromPixel() {
   if (w <= 0 || h <= 0) {
     return;
   }
-  int cols = qMax(100, w / cellWidth_);
-  int rows = qMax(24, h / cellHeight_);
-  cols = qMin(cols, 1000);
-  rows = qMin(rows, 1000);
+  const int cols = qBound(kMinCols, w / cellWidth_, kMaxCols);
+  const int rows = qBound(kMinRows, h / cellHeight_, kMaxRows);
   if (rows == lastRows_ && cols == lastCols_) {
     return;
   }
   lastRows_ = rows;
   lastCols_ = cols;
+  // The screen follows the widget at once, but the remote only hears about
+  // the size once it settles: every SIGWINCH makes a shell or a full-screen
+  // program redraw, and dragging a window edge would send dozens.
+  if (!ptyResizeTimer_) {
+    ptyResizeTimer_ = new QTimer(this);
+    ptyResizeTimer_->setSingleShot(true);
+    connect(ptyResizeTimer_, &QTimer::timeout, this, [this]() { emit terminalResized(lastRows_, lastCols_); });
+  }
+  ptyResizeTimer_->start(kPtyResizeDelayMs);
   // macOS libvterm builds have been unstable in resize_buffer; avoid resizing.
-#if defined(__APPLE__)
-  emit terminalResized(rows, cols);
-  return;
-#else
+#if !defined(__APPLE__)
+  // The model reflows the screen; the history is laid out again as it comes
+  // into view, and the view returns to the screen.
   vterm_set_size(vterm_, rows, cols);
-  emit terminalResized(rows, cols);
+  predictor_.reset();
+  layout_.reset(cols);
+  scrollOffset_ = 0;
+  scrollbackEnd_ = model_->scrollback().end();
+  selStart_ = selEnd_ = VTermPos{0, 0};
+  selecting_ = false;
+  // Resizing moves lines between the screen and the scrollback, so their
+  // indices are reused; search again from scratch.
+  if (search_ && search_->isActive()) {
+    setSearch(searchQuery_);
+  }
+  invalidateAll();
   update();
 #endif
 }
@@ -573,15 +884,11 @@ VTermPos TerminalWidget::pointToCell(const QPoint &p) const {
 }
 
 QString TerminalWidget::selectedText() const {
-  if (!screen_ || !vterm_) {
-    return QString();
-  }
-  int rows = 0;
-  int cols = 0;
-  vterm_get_size(vterm_, &rows, &cols);
-  if (rows <= 0 || cols <= 0) {
+  if (!model_) {
     return QString();
   }
+  const int rows = model_->rows();
+  const int cols = model_->cols();
 
   VTermPos a = selStart_;
   VTermPos b = selEnd_;
@@ -592,26 +899,21 @@ QString TerminalWidget::selectedText() const {
   }
 
   QStringList lines;
+  QVector<Cell> scratch;
   for (int r = a.row; r <= b.row && r < rows; ++r) {
     int c0 = (r == a.row) ? a.col : 0;
     int c1 = (r == b.row) ? b.col : (cols - 1);
     if (c0 > c1) {
       std::swap(c0, c1);
     }
+    const Cell *cells = viewRow(r, &scratch);
     QString line;
     line.reserve(c1 - c0 + 1);
     for (int c = c0; c <= c1 && c < cols; ++c) {
-      VTermPos pos{r, c};
-      VTermScreenCell cell;
-      if (!vterm_screen_get_cell(screen_, pos, &cell)) {
-        line.append(' ');
+      if (cells[c].glyph & Cell::WideTail) {
         continue;
       }
-      uint32_t ch = cell.chars[0];
-      if (ch == 0) {
-        ch = ' ';
-      }
-      line.append(QString::fromUcs4(&ch, 1));
+      line.append(model_->text(cells[c]));
     }
     int end = line.length();
     while (end > 0 && line.at(end - 1) == QLatin1Char(' ')) {
@@ -623,123 +925,878 @@ QString TerminalWidget::selectedText() const {
   return lines.join("\n");
 }
 
-static QColor vtermColorToQColor(const VTermScreen *screen, VTermColor col, const QColor &fallback) {
-  if (VTERM_COLOR_IS_DEFAULT_FG(&col) || VTERM_COLOR_IS_DEFAULT_BG(&col)) {
+QRgb TerminalWidget::resolveColor(quint32 color, QRgb fallback) const {
+  if (CellColor::isDefault(color)) {
     return fallback;
   }
-  if (VTERM_COLOR_IS_INDEXED(&col)) {
-    VTermColor tmp = col;
-    vterm_screen_convert_color_to_rgb(screen, &tmp);
-    col = tmp;
+  if (CellColor::isIndexed(color)) {
+    return colors_->color(int(color & 0xff));
+  }
+  return 0xff000000 | (color & 0x00ffffff);
+}
+
+static GlyphAtlas::Variant variantOf(const Cell &cell) {
+  int v = GlyphAtlas::Regular;
+  if (cell.glyph & Cell::Bold) {
+    v |= GlyphAtlas::Bold;
+  }
+  if (cell.glyph & Cell::Italic) {
+    v |= GlyphAtlas::Italic;
+  }
+  return static_cast<GlyphAtlas::Variant>(v);
+}
+
+bool TerminalWidget::ensureAtlas() {
+  const qreal dpr = devicePixelRatioF();
+  if (atlas_ && qFuzzyCompare(atlas_->devicePixelRatio(), dpr)) {
+    return false;
+  }
+  atlas_ = GlyphAtlas::shared(font_, cellWidth_, cellHeight_, cellAscent_, dpr);
+  return true;
+}
+
+// Only the glyph bits of a cell that decide what gets drawn.
+static constexpr quint32 kGlyphMask = Cell::CodepointMask | Cell::Wide | Cell::WideTail | Cell::Cluster;
+
+static bool isBlankGlyph(quint32 glyph) {
+  const quint32 ch = glyph & (Cell::CodepointMask | Cell::Cluster);
+  return (glyph & Cell::WideTail) || ch == 0 || ch == ' ';
+}
+
+int TerminalWidget::atlasGlyph(quint32 glyph, GlyphAtlas::Variant variant, QRgb color, QRect *source) {
+  const bool wide = glyph & Cell::Wide;
+  if (glyph & Cell::Cluster) {
+    return atlas_->cluster(model_->cluster(glyph & Cell::CodepointMask), wide, variant, color, source);
   }
-  if (VTERM_COLOR_IS_RGB(&col)) {
-    return QColor(col.rgb.red, col.rgb.green, col.rgb.blue);
+  return atlas_->glyph(glyph & Cell::CodepointMask, wide, variant, color, source);
+}
+
+QString TerminalWidget::glyphText(quint32 glyph) const {
+  if (glyph & Cell::Cluster) {
+    return model_->cluster(glyph & Cell::CodepointMask);
   }
-  return fallback;
+  const uint ch = glyph & Cell::CodepointMask;
+  return QString::fromUcs4(&ch, 1);
 }
 
-void TerminalWidget::renderVTerm(QPainter &p) {
-  if (!screen_) {
+// Blank cells only need their background; everything else is blitted from
+// the shared atlas instead of shaping text per cell. Wide glyphs cover the
+// next cell too, which draws nothing itself.
+void TerminalWidget::drawGlyph(QPainter &p, quint32 glyph, GlyphAtlas::Variant variant, const QColor &color, int x, int y) {
+  if (isBlankGlyph(glyph)) {
     return;
   }
-  if (cellWidth_ <= 0 || cellHeight_ <= 0) {
+  const int width = (glyph & Cell::Wide) ? 2 * cellWidth_ : cellWidth_;
+  QRect src;
+  const int page = atlasGlyph(glyph, variant, color.rgb(), &src);
+  if (page >= 0) {
+    p.drawPixmap(QRectF(x, y, width, cellHeight_), atlas_->page(page), QRectF(src));
     return;
   }
+  p.setPen(color);
+  p.drawText(x, y + cellAscent_, glyphText(glyph));
+}
 
-  p.setFont(font_);
+QRect TerminalWidget::cellRect(int row, int col) const {
+  return QRect(col * cellWidth_, row * cellHeight_, cellWidth_, cellHeight_);
+}
 
-  int rows = 0;
-  int cols = 0;
-  vterm_get_size(vterm_, &rows, &cols);
+// Two cells wide, in case the cursor sits on a double-width glyph.
+QRect TerminalWidget::cursorRect() const {
+  return QRect(cursorCol_ * cellWidth_, (cursorRow_ + scrollOffset_) * cellHeight_, 2 * cellWidth_, cellHeight_);
+}
 
-  const QColor defaultFg = fg_.isValid() ? fg_ : QColor(220, 220, 220);
-  const QColor defaultBg = bg_.isValid() ? bg_ : QColor(0, 0, 0);
-  const QColor selBg(80, 120, 200);
-  const QColor selFg(255, 255, 255);
+// Cells shown on view row `row`: scrollback rows above the screen while the
+// view is scrolled back, then the screen. Scrollback rows are decoded into
+// `scratch` at the screen width.
+const Cell *TerminalWidget::viewRow(int row, QVector<Cell> *scratch) const {
+  if (row >= scrollOffset_) {
+    return model_->row(row - scrollOffset_);
+  }
+  const Scrollback &history = model_->scrollback();
+  ScrollbackLayout::Row line;
+  if (layout_.row(history, scrollOffset_ - 1 - row, &line)) {
+    layout_.cells(history, line, scratch);
+  } else {
+    scratch->fill(Cell(), model_->cols());
+  }
+  return scratch->constData();
+}
 
-  VTermPos a = selStart_;
-  VTermPos b = selEnd_;
-  bool hasSelection = (a.row != b.row) || (a.col != b.col) || selecting_;
-  if (hasSelection && (b.row < a.row || (b.row == a.row && b.col < a.col))) {
-    VTermPos tmp = a;
-    a = b;
-    b = tmp;
+// The scrollback lines, or screen rows counted on from Scrollback::end(),
+// shown on view row `row`.
+void TerminalWidget::viewPieces(int row, QVector<ScrollbackLayout::Piece> *out) const {
+  out->clear();
+  const Scrollback &history = model_->scrollback();
+  if (row >= scrollOffset_) {
+    out->append(ScrollbackLayout::Piece{history.end() + row - scrollOffset_, 0, 0, model_->cols()});
+    return;
+  }
+  ScrollbackLayout::Row line;
+  if (layout_.row(history, scrollOffset_ - 1 - row, &line)) {
+    layout_.pieces(history, line, out);
+    if (out->isEmpty()) {
+      out->append(ScrollbackLayout::Piece{line.line, 0, 0, 0});
+    }
+  }
+}
+
+// The line at the start of view row `row`.
+qint64 TerminalWidget::viewLine(int row) const {
+  QVector<ScrollbackLayout::Piece> pieces;
+  viewPieces(row, &pieces);
+  return pieces.isEmpty() ? model_->scrollback().begin() : pieces.first().line;
+}
+
+// The view row showing column `col` of `line`, which may be out of view;
+// negative if the line is gone.
+int TerminalWidget::viewRowOf(qint64 line, int col) const {
+  const Scrollback &history = model_->scrollback();
+  if (line >= history.end()) {
+    return int(line - history.end()) + scrollOffset_;
   }
+  const int n = layout_.rowOf(history, line, col);
+  return n < 0 ? -1 : scrollOffset_ - 1 - n;
+}
 
-  VTermScreenCell cell;
+// Moves the view `lines` rows further back into the scrollback, or towards
+// the live screen when negative.
+void TerminalWidget::scrollView(int lines) {
+  if (!model_) {
+    return;
+  }
+  const qint64 want = qBound<qint64>(0, qint64(scrollOffset_) + lines, std::numeric_limits<int>::max());
+  const int offset = model_->altScreen() ? 0 : layout_.available(model_->scrollback(), int(want));
+  if (offset == scrollOffset_) {
+    return;
+  }
+  scrollOffset_ = offset;
+  // The selection is kept in view coordinates and would cover other text.
+  selStart_ = selEnd_ = VTermPos{0, 0};
+  selecting_ = false;
+  invalidateAll();
+  update();
+}
 
+// Finds the hits on every screen row again and marks the rows whose hits
+// moved or changed. True if any did.
+bool TerminalWidget::updateScreenMatches() {
+  const qint64 end = model_->scrollback().end();
+  const int rows = model_->rows();
+  bool changed = screenMatches_.size() != rows;
+  screenMatches_.resize(rows);
+  QVector<ScrollbackSearch::Match> found;
   for (int r = 0; r < rows; ++r) {
-    for (int c = 0; c < cols; ++c) {
-      VTermPos pos{r, c};
-      if (!vterm_screen_get_cell(screen_, pos, &cell)) {
-        continue;
-      }
+    found.clear();
+    searchMatcher_.matchCells(model_->row(r), model_->cols(), end + r, model_->clusters(), &found);
+    QVector<ScrollbackSearch::Match> &old = screenMatches_[r];
+    bool same = old.size() == found.size();
+    for (int i = 0; same && i < found.size(); ++i) {
+      same = old.at(i).col == found.at(i).col && old.at(i).length == found.at(i).length;
+    }
+    old = found;
+    if (same) {
+      continue;
+    }
+    changed = true;
+    const int viewRow = r + scrollOffset_;
+    if (viewRow < rowDirty_.size()) {
+      rowDirty_[viewRow] = true;
+      damage_ += QRect(0, viewRow * cellHeight_, width(), cellHeight_);
+    }
+  }
+  return changed;
+}
 
-      QColor fg = vtermColorToQColor(screen_, cell.fg, defaultFg);
-      QColor bg = vtermColorToQColor(screen_, cell.bg, defaultBg);
-      if (cell.attrs.reverse) {
-        QColor tmp = fg;
-        fg = bg;
-        bg = tmp;
-      }
-      if (hasSelection) {
-        bool inSel = false;
-        if (r > a.row && r < b.row) {
-          inSel = true;
-        } else if (r == a.row && r == b.row) {
-          inSel = (c >= a.col && c <= b.col);
-        } else if (r == a.row) {
-          inSel = (c >= a.col);
-        } else if (r == b.row) {
-          inSel = (c <= b.col);
+void TerminalWidget::onSearchFound(const QVector<ScrollbackSearch::Match> &matches) {
+  historyMatches_.insert(matches.first().line, matches);
+  historyMatchCount_ += matches.size();
+  trimSearchMatches();
+  const Scrollback &history = model_->scrollback();
+  const qint64 viewTop = viewLine(0);
+  ScrollbackSearch::Match match;
+  if (currentMatch_.line < 0 && adjacentMatch(viewLine(model_->rows() - 1) + 1, 0, true, &match)) {
+    selectMatch(match);
+  } else if (scrollOffset_ > 0 && matches.last().line >= viewTop && matches.first().line < history.end()) {
+    invalidateAll();
+    update();
+  }
+  emitSearchStatus();
+}
+
+// Drops hits on lines that left the scrollback, and the oldest batches while
+// more than ScrollbackSearch::kMaxMatches are held.
+void TerminalWidget::trimSearchMatches() {
+  const qint64 begin = model_->scrollback().begin();
+  while (!historyMatches_.isEmpty()) {
+    auto it = historyMatches_.begin();
+    const bool overLimit = historyMatchCount_ > ScrollbackSearch::kMaxMatches && historyMatches_.size() > 1;
+    if (overLimit || it.value().last().line < begin) {
+      searchTruncated_ = searchTruncated_ || overLimit;
+      historyMatchCount_ -= it.value().size();
+      historyMatches_.erase(it);
+      continue;
+    }
+    if (it.key() < begin) {
+      QVector<ScrollbackSearch::Match> rest;
+      for (const ScrollbackSearch::Match &m : it.value()) {
+        if (m.line >= begin) {
+          rest.append(m);
         }
-        if (inSel) {
-          bg = selBg;
-          fg = selFg;
+      }
+      historyMatchCount_ -= it.value().size() - rest.size();
+      historyMatches_.erase(it);
+      historyMatches_.insert(rest.first().line, rest);
+    }
+    break;
+  }
+  if (currentMatch_.line >= 0 && currentMatch_.line < begin) {
+    currentMatch_ = ScrollbackSearch::Match{-1, 0, 0};
+  }
+}
+
+// The hits on line `line`, a scrollback index or a screen row past end().
+const ScrollbackSearch::Match *TerminalWidget::matchesOn(qint64 line, int *count) const {
+  *count = 0;
+  const qint64 end = model_->scrollback().end();
+  if (line >= end) {
+    const qint64 row = line - end;
+    if (row >= screenMatches_.size() || screenMatches_.at(int(row)).isEmpty()) {
+      return nullptr;
+    }
+    *count = screenMatches_.at(int(row)).size();
+    return screenMatches_.at(int(row)).constData();
+  }
+  auto it = historyMatches_.upperBound(line);
+  if (it == historyMatches_.cbegin()) {
+    return nullptr;
+  }
+  --it;
+  const QVector<ScrollbackSearch::Match> &batch = it.value();
+  auto first = std::lower_bound(batch.cbegin(), batch.cend(), line,
+                                [](const ScrollbackSearch::Match &m, qint64 l) { return m.line < l; });
+  auto last = first;
+  while (last != batch.cend() && last->line == line) {
+    ++last;
+  }
+  *count = int(last - first);
+  return *count > 0 ? &*first : nullptr;
+}
+
+// The hit just before (older) or after the position `line`, `col`.
+bool TerminalWidget::adjacentMatch(qint64 line, int col, bool older, ScrollbackSearch::Match *out) const {
+  const ScrollbackSearch::Match target{line, col, 0};
+  const qint64 end = model_->scrollback().end();
+  if (older) {
+    for (qint64 r = qMin<qint64>(line - end, screenMatches_.size() - 1); r >= 0; --r) {
+      const QVector<ScrollbackSearch::Match> &row = screenMatches_.at(int(r));
+      for (int i = row.size() - 1; i >= 0; --i) {
+        if (matchBefore(row.at(i), target)) {
+          *out = row.at(i);
+          return true;
         }
       }
+    }
+    auto it = historyMatches_.upperBound(line);
+    while (it != historyMatches_.cbegin()) {
+      --it;
+      const QVector<ScrollbackSearch::Match> &batch = it.value();
+      const auto pos = std::lower_bound(batch.cbegin(), batch.cend(), target, matchBefore);
+      if (pos != batch.cbegin()) {
+        *out = *(pos - 1);
+        return true;
+      }
+    }
+    return false;
+  }
+  auto it = historyMatches_.upperBound(line);
+  if (it != historyMatches_.cbegin()) {
+    --it;
+  }
+  for (; it != historyMatches_.cend(); ++it) {
+    const QVector<ScrollbackSearch::Match> &batch = it.value();
+    const auto pos = std::upper_bound(batch.cbegin(), batch.cend(), target, matchBefore);
+    if (pos != batch.cend()) {
+      *out = *pos;
+      return true;
+    }
+  }
+  for (qint64 r = qMax<qint64>(0, line - end); r < screenMatches_.size(); ++r) {
+    for (const ScrollbackSearch::Match &m : screenMatches_.at(int(r))) {
+      if (matchBefore(target, m)) {
+        *out = m;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Makes `match` the selected hit, scrolling it to the middle of the view if
+// it is not in view.
+void TerminalWidget::selectMatch(const ScrollbackSearch::Match &match) {
+  currentMatch_ = match;
+  const int rows = model_->rows();
+  const int row = viewRowOf(match.line, match.col);
+  if (row < 0 || row >= rows) {
+    scrollView(rows / 2 - row);
+  }
+  invalidateAll();
+  update();
+}
+
+void TerminalWidget::emitSearchStatus() {
+  int total = historyMatchCount_;
+  for (const QVector<ScrollbackSearch::Match> &row : screenMatches_) {
+    total += row.size();
+  }
+  int current = 0;
+  if (currentMatch_.line >= 0) {
+    // Hits up to and including the selected one.
+    auto upTo = [this](const QVector<ScrollbackSearch::Match> &v) {
+      return int(std::upper_bound(v.cbegin(), v.cend(), currentMatch_, matchBefore) - v.cbegin());
+    };
+    bool counted = false;
+    for (const QVector<ScrollbackSearch::Match> &batch : historyMatches_) {
+      const int n = upTo(batch);
+      current += n;
+      if (n < batch.size()) {
+        counted = true;
+        break;
+      }
+    }
+    for (int r = 0; !counted && r < screenMatches_.size(); ++r) {
+      const int n = upTo(screenMatches_.at(r));
+      current += n;
+      counted = n < screenMatches_.at(r).size();
+    }
+  }
+  emit searchStatus(current, total, search_ && search_->isBusy(), searchTruncated_);
+}
+
+void TerminalWidget::flushDamage() {
+  if (!model_ || !exposed_) {
+    return;
+  }
+  const int predictedRow = predictor_.row();
+  const bool predictedShown = predictor_.visible();
+  predictor_.reconcile(*model_);
+  refreshPredictions(predictedRow, predictedShown);
+
+  // While scrolled back the view keeps showing the same history lines as
+  // output arrives; only the screen rows still in view are redrawn.
+  const Scrollback &history = model_->scrollback();
+  const qint64 firstPushed = qMax(scrollbackEnd_, history.begin());
+  const bool pushed = history.end() > firstPushed;
+  scrollbackEnd_ = history.end();
+  const bool searching = search_ && search_->isActive();
+  if (searching) {
+    search_->extend(history, model_->clusters());
+    trimSearchMatches();
+  }
+  if (scrollOffset_ > 0) {
+    // Add the rows the new lines take, from the first one to the newest.
+    const int grown = pushed ? layout_.rowOf(history, firstPushed, 0) + 1 : 0;
+    const int offset = model_->altScreen() ? 0 : layout_.available(history, scrollOffset_ + grown);
+    const int liveRows = model_->rows() - offset;
+    bool changed = offset != scrollOffset_;
+    scrollOffset_ = offset;
+    if (searching && updateScreenMatches()) {
+      changed = true;
+      emitSearchStatus();
+    }
+    model_->takeMoves([](const ScreenModel::Move &) {});
+    model_->takeDamage([&changed, liveRows](int row, int, int) { changed = changed || row < liveRows; });
+    if (model_->cursorRow() != cursorRow_ || model_->cursorCol() != cursorCol_ ||
+        model_->cursorVisible() != cursorShown_) {
+      changed = changed || liveRows > 0;
+      cursorRow_ = model_->cursorRow();
+      cursorCol_ = model_->cursorCol();
+      cursorShown_ = model_->cursorVisible();
+    }
+    if (changed) {
+      invalidateAll();
+      update();
+    }
+    return;
+  }
+
+  // Replay scrolls and rect moves on the backing image first; damage is
+  // recorded in post-move coordinates.
+  model_->takeMoves([this](const ScreenModel::Move &move) { applyMove(move); });
+
+  // Merge runs of rows with the same damaged columns into one rect each.
+  QRect pending;
+  model_->takeDamage([&](int row, int startCol, int endCol) {
+    if (row < rowDirty_.size()) {
+      rowDirty_[row] = true;
+    }
+    const QRect rect(startCol * cellWidth_, row * cellHeight_, (endCol - startCol) * cellWidth_, cellHeight_);
+    if (!pending.isNull() && pending.left() == rect.left() && pending.right() == rect.right() &&
+        pending.bottom() + 1 == rect.top()) {
+      pending.setBottom(rect.bottom());
+      return;
+    }
+    if (!pending.isNull()) {
+      damage_ += pending;
+    }
+    pending = rect;
+  });
+  if (!pending.isNull()) {
+    damage_ += pending;
+  }
+  // Rows whose hits changed are marked now that the moves are applied.
+  if (searching && updateScreenMatches()) {
+    emitSearchStatus();
+  }
+
+  // The cursor is painted over the row cache, so only its cells need a repaint.
+  if (model_->cursorRow() != cursorRow_ || model_->cursorCol() != cursorCol_ ||
+      model_->cursorVisible() != cursorShown_) {
+    damage_ += cursorRect();
+    cursorRow_ = model_->cursorRow();
+    cursorCol_ = model_->cursorCol();
+    cursorShown_ = model_->cursorVisible();
+    damage_ += cursorRect();
+  }
+
+  if (damage_.isEmpty()) {
+    return;
+  }
+  update(damage_);
+  damage_ = QRegion();
+}
+
+// Predictions are painted over the row cache like the cursor, so repainting
+// their row is enough to show or remove them.
+void TerminalWidget::refreshPredictions(int oldRow, bool wasVisible) {
+  if (wasVisible && oldRow >= 0) {
+    update(QRect(0, oldRow * cellHeight_, width(), cellHeight_));
+  }
+  if (predictor_.visible()) {
+    update(QRect(0, predictor_.row() * cellHeight_, width(), cellHeight_));
+  }
+  if (predictor_.isEmpty()) {
+    predictTimer_->stop();
+  } else if (!predictTimer_->isActive()) {
+    predictTimer_->start();
+  }
+}
+
+void TerminalWidget::invalidateRows(int first, int last) {
+  first = qMax(0, first);
+  last = qMin(rowDirty_.size() - 1, last);
+  if (first > last) {
+    return;
+  }
+  for (int r = first; r <= last; ++r) {
+    rowDirty_[r] = true;
+  }
+  update(QRect(0, first * cellHeight_, width(), (last - first + 1) * cellHeight_));
+}
+
+void TerminalWidget::invalidateAll() {
+  rowDirty_.fill(true);
+}
+
+bool TerminalWidget::selectionRange(VTermPos *a, VTermPos *b) const {
+  *a = selStart_;
+  *b = selEnd_;
+  const bool hasSelection = (a->row != b->row) || (a->col != b->col) || selecting_;
+  if (hasSelection && (b->row < a->row || (b->row == a->row && b->col < a->col))) {
+    std::swap(*a, *b);
+  }
+  return hasSelection;
+}
+
+void TerminalWidget::setSelection(const VTermPos &start, const VTermPos &end, bool selecting) {
+  VTermPos oldA;
+  VTermPos oldB;
+  const bool hadSelection = selectionRange(&oldA, &oldB);
+  selStart_ = start;
+  selEnd_ = end;
+  selecting_ = selecting;
+  VTermPos newA;
+  VTermPos newB;
+  const bool hasSelection = selectionRange(&newA, &newB);
+  // Rebuild only the cached rows the old or new selection touches.
+  if (hadSelection) {
+    invalidateRows(oldA.row, oldB.row);
+  }
+  if (hasSelection) {
+    invalidateRows(newA.row, newB.row);
+  }
+}
+
+void TerminalWidget::renderVTerm(QPainter &p, const QRegion &region) {
+  const QColor defaultBg = bg_.isValid() ? bg_ : QColor(0, 0, 0);
+  if (!model_ || cellWidth_ <= 0 || cellHeight_ <= 0) {
+    p.fillRect(rect(), defaultBg);
+    return;
+  }
+
+  const int rows = model_->rows();
+  const int cols = model_->cols();
+
+  if (ensureAtlas()) {
+    invalidateAll();
+  }
+  const qreal dpr = devicePixelRatioF();
+  const QRect grid(0, 0, cols * cellWidth_, rows * cellHeight_);
+  if (backing_.size() != grid.size() * dpr || rowDirty_.size() != rows) {
+    backing_ = QImage(grid.size() * dpr, QImage::Format_RGB32);
+    backing_.setDevicePixelRatio(dpr);
+    rowDirty_ = QVector<bool>(rows, true);
+  }
+
+  for (const QRect &r : region.subtracted(grid)) {
+    p.fillRect(r, defaultBg);
+  }
+
+  // Bring stale rows of the backing image up to date, then blit from it.
+  const QRect bounds = region.boundingRect() & grid;
+  const int firstRow = qMax(0, bounds.top() / cellHeight_);
+  const int lastRow = qMin(rows - 1, bounds.bottom() / cellHeight_);
+  QPainter ip;
+  for (int r = firstRow; r <= lastRow; ++r) {
+    if (!rowDirty_[r]) {
+      continue;
+    }
+    const QRect rowRect(0, r * cellHeight_, grid.width(), cellHeight_);
+    if (!region.intersects(rowRect)) {
+      continue;
+    }
+    if (!ip.isActive()) {
+      ip.begin(&backing_);
+    }
+    ip.save();
+    ip.translate(0, rowRect.top());
+    ip.setClipRect(QRect(0, 0, rowRect.width(), cellHeight_));
+    renderRow(ip, r, cols);
+    ip.restore();
+    rowDirty_[r] = false;
+  }
+  if (ip.isActive()) {
+    ip.end();
+  }
+
+  for (const QRect &r : region & grid) {
+    p.drawImage(QRectF(r), backing_, QRectF(QPointF(r.topLeft()) * dpr, QSizeF(r.size()) * dpr));
+  }
+
+  paintPredictions(p, cols);
+  paintCursor(p, rows, cols);
+}
+
+void TerminalWidget::applyMove(const ScreenModel::Move &move) {
+  const int rows = rowDirty_.size();
+  if (move.rows <= 0 || move.destRow < 0 || move.srcRow < 0 || move.destRow + move.rows > rows ||
+      move.srcRow + move.rows > rows) {
+    invalidateRows(0, rows - 1);
+    return;
+  }
+  const bool fullWidth = move.destCol == 0 && move.srcCol == 0 && move.cols == model_->cols();
+  const qreal dpr = backing_.devicePixelRatio();
+  const bool integralDpr = qFuzzyCompare(dpr, qreal(qRound(dpr)));
+  const bool canBlit = !backing_.isNull() && integralDpr && rows * cellHeight_ * qRound(dpr) == backing_.height();
+
+  // Shift pixels (and the stale flags describing them) exactly like the model
+  // shifted its cells, copying in the direction that never overwrites rows
+  // still to be read.
+  const int scale = qRound(dpr);
+  const int rowLines = cellHeight_ * scale;
+  const int bpl = backing_.bytesPerLine();
+  const int colOffset = move.srcCol * cellWidth_ * scale * 4;
+  const int destOffset = move.destCol * cellWidth_ * scale * 4;
+  const int spanBytes = move.cols * cellWidth_ * scale * 4;
+  uchar *bits = canBlit ? backing_.bits() : nullptr;
+  const bool upward = move.destRow < move.srcRow;
+  if (canBlit && fullWidth) {
+    std::memmove(bits + move.destRow * rowLines * bpl, bits + move.srcRow * rowLines * bpl,
+                 size_t(move.rows) * rowLines * bpl);
+  }
+  for (int i = 0; i < move.rows; ++i) {
+    const int offset = upward ? i : move.rows - 1 - i;
+    const int dest = move.destRow + offset;
+    const int src = move.srcRow + offset;
+    if (!canBlit) {
+      rowDirty_[dest] = true;
+      continue;
+    }
+    if (!fullWidth) {
+      for (int line = 0; line < rowLines; ++line) {
+        std::memmove(bits + (dest * rowLines + line) * bpl + destOffset,
+                     bits + (src * rowLines + line) * bpl + colOffset, size_t(spanBytes));
+      }
+      rowDirty_[dest] = rowDirty_[dest] || rowDirty_[src];
+    } else {
+      rowDirty_[dest] = rowDirty_[src];
+    }
+  }
+
+  damage_ += QRect(move.destCol * cellWidth_, move.destRow * cellHeight_, move.cols * cellWidth_,
+                   move.rows * cellHeight_);
+
+  // A highlighted selection is baked into the pixels that just moved.
+  VTermPos a;
+  VTermPos b;
+  if (selectionRange(&a, &b)) {
+    invalidateRows(a.row, b.row);
+    invalidateRows(a.row + move.destRow - move.srcRow, b.row + move.destRow - move.srcRow);
+  }
+}
+
+void TerminalWidget::renderRow(QPainter &p, int row, int cols) {
+  QRgb defaultFg = fg_.isValid() ? fg_.rgb() : qRgb(220, 220, 220);
+  QRgb defaultBg = bg_.isValid() ? bg_.rgb() : qRgb(0, 0, 0);
+  if (model_->reverseVideo()) {
+    std::swap(defaultFg, defaultBg);
+  }
+  const QRgb selBg = qRgb(80, 120, 200);
+  const QRgb selFg = qRgb(255, 255, 255);
+
+  VTermPos a;
+  VTermPos b;
+  const bool hasSelection = selectionRange(&a, &b) && row >= a.row && row <= b.row;
+
+  // Search hits on this row, 2 for the selected one.
+  const QRgb hitBg = qRgb(200, 170, 60);
+  const QRgb currentHitBg = qRgb(255, 130, 30);
+  const QRgb hitFg = qRgb(0, 0, 0);
+  QVarLengthArray<quint8, 256> hits(cols);
+  std::fill(hits.begin(), hits.end(), quint8(0));
+  int hitCount = 0;
+  viewPieces(row, &pieceScratch_);
+  for (const ScrollbackLayout::Piece &piece : pieceScratch_) {
+    const ScrollbackSearch::Match *m = matchesOn(piece.line, &hitCount);
+    for (int i = 0; i < hitCount; ++i) {
+      const quint8 kind = m[i].line == currentMatch_.line && m[i].col == currentMatch_.col ? 2 : 1;
+      const int from = qMax(m[i].col, piece.col) - piece.col + piece.at;
+      const int to = qMin(m[i].col + m[i].length, piece.col + piece.length) - piece.col + piece.at;
+      for (int c = qMax(0, from); c < qMin(cols, to); ++c) {
+        hits[c] = kind;
+      }
+    }
+  }
+
+  p.setFont(font_);
+
+  struct StyledCell {
+    quint32 glyph;
+    QRgb fg;
+    QRgb bg;
+    GlyphAtlas::Variant variant;
+  };
+  QVarLengthArray<StyledCell, 256> cells(cols);
+  const Cell *line = viewRow(row, &rowScratch_);
+
+  for (int c = 0; c < cols; ++c) {
+    StyledCell &sc = cells[c];
+    const Cell &cell = line[c];
+    sc.glyph = cell.glyph & kGlyphMask;
+    sc.fg = resolveColor(cell.fg, defaultFg);
+    sc.bg = resolveColor(cell.bg, defaultBg);
+    sc.variant = variantOf(cell);
+    if (cell.glyph & Cell::Reverse) {
+      std::swap(sc.fg, sc.bg);
+    }
+    if (hits[c]) {
+      sc.bg = hits[c] == 2 ? currentHitBg : hitBg;
+      sc.fg = hitFg;
+    }
+    if (hasSelection && !(row == a.row && c < a.col) && !(row == b.row && c > b.col)) {
+      sc.bg = selBg;
+      sc.fg = selFg;
+    }
+  }
 
+  if (perCellRendering_) {
+    for (int c = 0; c < cols; ++c) {
       const int x = c * cellWidth_;
-      const int y = r * cellHeight_;
+      p.fillRect(QRect(x, 0, cellWidth_, cellHeight_), QColor::fromRgb(cells[c].bg));
+      drawGlyph(p, cells[c].glyph, cells[c].variant, QColor::fromRgb(cells[c].fg), x, 0);
+    }
+    return;
+  }
+
+  // One background fill per run of equal colour.
+  int start = 0;
+  for (int c = 1; c <= cols; ++c) {
+    if (c == cols || cells[c].bg != cells[start].bg) {
+      p.fillRect(QRect(start * cellWidth_, 0, (c - start) * cellWidth_, cellHeight_),
+                 QColor::fromRgb(cells[start].bg));
+      start = c;
+    }
+  }
+
+  // Resolve all glyphs before drawing: a miss may recycle an atlas page that
+  // earlier lookups in this row point into, in which case resolve again.
+  QVarLengthArray<int, 256> pages(cols);
+  QVarLengthArray<QRect, 256> sources(cols);
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    const quint64 evictions = atlas_->evictions();
+    for (int c = 0; c < cols; ++c) {
+      const quint32 glyph = cells[c].glyph;
+      pages[c] = isBlankGlyph(glyph) ? -2 : atlasGlyph(glyph, cells[c].variant, cells[c].fg, &sources[c]);
+    }
+    if (atlas_->evictions() == evictions) {
+      break;
+    }
+  }
+
+  // Glyphs sit at fixed column offsets, so every run of cells sharing an
+  // atlas page goes out as a single fragment blit.
+  const qreal scale = 1.0 / atlas_->devicePixelRatio();
+  QVarLengthArray<QPainter::PixmapFragment, 256> fragments;
+  int runPage = -1;
+  auto flush = [&]() {
+    if (!fragments.isEmpty()) {
+      p.drawPixmapFragments(fragments.constData(), fragments.size(), atlas_->page(runPage));
+      fragments.clear();
+    }
+  };
+  for (int c = 0; c < cols; ++c) {
+    if (pages[c] == -2) {
+      continue;
+    }
+    if (pages[c] < 0) {
+      p.setPen(QColor::fromRgb(cells[c].fg));
+      p.drawText(c * cellWidth_, cellAscent_, glyphText(cells[c].glyph));
+      continue;
+    }
+    if (pages[c] != runPage) {
+      flush();
+      runPage = pages[c];
+    }
+    const int span = (cells[c].glyph & Cell::Wide) ? 2 : 1;
+    const QPointF center(c * cellWidth_ + span * cellWidth_ / 2.0, cellHeight_ / 2.0);
+    fragments.append(QPainter::PixmapFragment::create(center, QRectF(sources[c]), scale, scale));
+  }
+  flush();
+}
+
+void TerminalWidget::paintCursor(QPainter &p, int rows, int cols) {
+  if (!cursorVisible_) {
+    return;
+  }
+  if (!cursorShown_) {
+    return;
+  }
+  int row = model_->cursorRow();
+  int col = model_->cursorCol();
+  if (predictor_.visible()) {
+    row = predictor_.predictions().last().row;
+    col = predictor_.predictions().last().col + 1;
+  }
+  if (row < 0 || row + scrollOffset_ >= rows || col < 0 || col >= cols) {
+    return;
+  }
+  QRgb defaultFg = fg_.isValid() ? fg_.rgb() : qRgb(220, 220, 220);
+  QRgb defaultBg = bg_.isValid() ? bg_.rgb() : qRgb(0, 0, 0);
+  if (model_->reverseVideo()) {
+    std::swap(defaultFg, defaultBg);
+  }
+  const int x = col * cellWidth_;
+  const int y = (row + scrollOffset_) * cellHeight_;
+  const Cell &cell = model_->row(row)[col];
+  const int width = (cell.glyph & Cell::Wide) ? 2 * cellWidth_ : cellWidth_;
+  // Invert colors for visibility
+  p.fillRect(QRect(x, y, width, cellHeight_), QColor::fromRgb(resolveColor(cell.fg, defaultFg)));
+  drawGlyph(p, cell.glyph & kGlyphMask, variantOf(cell), QColor::fromRgb(resolveColor(cell.bg, defaultBg)), x, y);
+}
 
-      p.fillRect(QRect(x, y, cellWidth_, cellHeight_), bg);
+// Unconfirmed echo is drawn in the default colours with a thin underline.
+void TerminalWidget::paintPredictions(QPainter &p, int cols) {
+  if (!predictor_.visible() || scrollOffset_ > 0) {
+    return;
+  }
+  QRgb defaultFg = fg_.isValid() ? fg_.rgb() : qRgb(220, 220, 220);
+  QRgb defaultBg = bg_.isValid() ? bg_.rgb() : qRgb(0, 0, 0);
+  if (model_->reverseVideo()) {
+    std::swap(defaultFg, defaultBg);
+  }
+  const QColor fg = QColor::fromRgb(defaultFg);
+  for (const EchoPredictor::Prediction &prediction : predictor_.predictions()) {
+    if (prediction.row >= model_->rows() || prediction.col >= cols) {
+      continue;
+    }
+    const int x = prediction.col * cellWidth_;
+    const int y = prediction.row * cellHeight_;
+    p.fillRect(QRect(x, y, cellWidth_, cellHeight_), QColor::fromRgb(defaultBg));
+    drawGlyph(p, prediction.codepoint, GlyphAtlas::Regular, fg, x, y);
+    p.fillRect(QRect(x, y + cellHeight_ - 2, cellWidth_, 1), fg);
+  }
+}
 
-      uint32_t ch = cell.chars[0];
-      if (ch == 0) {
-        ch = ' ';
+static QByteArray lsColorSample(int rows, int cols) {
+  static const char *const kEntries[][2] = {
+      {"01;34", "src"},          {"01;32", "build.sh"}, {"", "README.md"},
+      {"01;31", "release.tgz"},  {"01;36", "current"},  {"01;35", "logo.png"},
+      {"", "CMakeLists.txt"},    {"40;33;01", "ttyS"},  {"30;42", "shared"},
+  };
+  const int kinds = int(sizeof(kEntries) / sizeof(kEntries[0]));
+  QByteArray out;
+  int n = 0;
+  for (int r = 0; r < rows; ++r) {
+    int col = 0;
+    while (true) {
+      const char *const *entry = kEntries[n % kinds];
+      const QByteArray name = QByteArray(entry[1]) + '_' + QByteArray::number(n);
+      if (col + name.size() + 2 > cols) {
+        break;
       }
-      const QString s = QString::fromUcs4(&ch, 1);
-      p.setPen(fg);
-      p.drawText(x, y + cellAscent_, s);
-    }
-  }
-
-  if (cursorVisible_) {
-    VTermPos cpos{cursorRow_, cursorCol_};
-    if (state_) {
-      vterm_state_get_cursorpos(state_, &cpos);
-    }
-    if (cpos.row >= 0 && cpos.row < rows && cpos.col >= 0 && cpos.col < cols) {
-      const int x = cpos.col * cellWidth_;
-      const int y = cpos.row * cellHeight_;
-      VTermScreenCell ccell;
-      if (vterm_screen_get_cell(screen_, cpos, &ccell)) {
-        QColor fg = vtermColorToQColor(screen_, ccell.fg, defaultFg);
-        QColor bg = vtermColorToQColor(screen_, ccell.bg, defaultBg);
-        // Invert colors for visibility
-        p.fillRect(QRect(x, y, cellWidth_, cellHeight_), fg);
-        uint32_t ch = ccell.chars[0];
-        if (ch == 0) {
-          ch = ' ';
-        }
-        const QString s = QString::fromUcs4(&ch, 1);
-        p.setPen(bg);
-        p.drawText(x, y + cellAscent_, s);
+      if (entry[0][0]) {
+        out += "\x1b[" + QByteArray(entry[0]) + "m" + name + "\x1b[0m  ";
       } else {
-        p.setPen(QPen(defaultFg));
-        p.drawRect(QRect(x, y, cellWidth_ - 1, cellHeight_ - 1));
+        out += name + "  ";
       }
+      col += name.size() + 2;
+      ++n;
+    }
+    if (r + 1 < rows) {
+      out += "\r\n";
     }
   }
+  return out;
 }
 #endif
+
+QString TerminalWidget::renderBenchmark(int frames) {
+#ifdef HAVE_LIBVTERM
+  TerminalWidget w;
+  if (!w.vterm_) {
+    return "vterm disabled (SSH_TERMINAL_DISABLE_VTERM)";
+  }
+  w.resize(200 * w.cellWidth_, 60 * w.cellHeight_);
+  w.updateSizeFromPixel();
+  int rows = 0;
+  int cols = 0;
+  vterm_get_size(w.vterm_, &rows, &cols);
+  w.writeData(lsColorSample(rows, cols));
+  w.parsePending(std::numeric_limits<qint64>::max());
+  w.flushDamage();
+
+  const qreal dpr = w.devicePixelRatioF();
+  QImage target(w.size() * dpr, QImage::Format_ARGB32_Premultiplied);
+  target.setDevicePixelRatio(dpr);
+
+  QStringList results;
+  for (bool perCell : {true, false}) {
+    w.perCellRendering_ = perCell;
+    w.invalidateAll();
+    w.render(&target); // warm the glyph atlas
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; ++i) {
+      w.invalidateAll();
+      w.render(&target);
+    }
+    const double ms = timer.nsecsElapsed() / 1e6 / qMax(1, frames);
+    results << QString("%1 %2 ms/frame").arg(perCell ? "per-cell" : "batched").arg(ms, 0, 'f', 3);
+  }
+  return QString("%1x%2 ls --color, %3 frames: %4").arg(cols).arg(rows).arg(frames).arg(results.join(", "));
+#else
+  Q_UNUSED(frames)
+  return "libvterm not available at build time";
+#endif
+}
@@ -1,4 +1,5 @@
 #include "ThemeDialog.h"
+#include "ColorTable.h"
 
 #include <QColorDialog>
 #include <QFontDialog>
@@ -20,8 +21,12 @@ static QFont defaultFont() {
   return f;
 }
 
-ThemeDialog::ThemeDialog(const QColor &fg, const QColor &bg, const QFont &font, QWidget *parent)
-    : QDialog(parent), fg_(fg), bg_(bg), font_(font) {
+ThemeDialog::ThemeDialog(const QColor &fg, const QColor &bg, const QVector<QColor> &ansi, const QFont &font,
+                         QWidget *parent)
+    : QDialog(parent), fg_(fg), bg_(bg), ansi_(ansi), font_(font) {
+  if (ansi_.size() != ColorTable::kAnsiColors) {
+    ansi_ = ColorTable::defaultAnsi();
+  }
   setWindowTitle("Theme");
   resize(420, 220);
 
@@ -40,6 +45,10 @@ ThemeDialog::ThemeDialog(const QColor &fg, const QColor &bg, const QFont &font,
   preview_ = new QLabel("Preview: The quick brown fox jumps over the lazy dog", this);
   preview_->setAutoFillBackground(true);
   preview_->setMargin(8);
+  swatches_ = new QLabel(this);
+  swatches_->setTextFormat(Qt::RichText);
+  swatches_->setMargin(8);
+  swatches_->setAutoFillBackground(true);
 
   auto *form = new QFormLayout();
   form->addRow("Foreground", fgButton_);
@@ -60,6 +69,7 @@ ThemeDialog::ThemeDialog(const QColor &fg, const QColor &bg, const QFont &font,
   auto *layout = new QVBoxLayout();
   layout->addLayout(form);
   layout->addWidget(preview_);
+  layout->addWidget(swatches_);
   layout->addLayout(buttons);
   setLayout(layout);
 
@@ -68,6 +78,7 @@ ThemeDialog::ThemeDialog(const QColor &fg, const QColor &bg, const QFont &font,
 
 QColor ThemeDialog::foreground() const { return fg_; }
 QColor ThemeDialog::background() const { return bg_; }
+QVector<QColor> ThemeDialog::ansiColors() const { return ansi_; }
 QFont ThemeDialog::font() const { return font_; }
 
 void ThemeDialog::chooseForeground() {
@@ -98,6 +109,7 @@ void ThemeDialog::chooseFont() {
 void ThemeDialog::restoreDefaults() {
   fg_ = defaultFg();
   bg_ = defaultBg();
+  ansi_ = ColorTable::defaultAnsi();
   font_ = defaultFont();
   updatePreview();
 }
@@ -111,14 +123,16 @@ void ThemeDialog::importBase16() {
   }
 
   QColor fg, bg;
+  QVector<QColor> ansi;
   QString error;
-  if (!parseBase16(path, &fg, &bg, &error)) {
+  if (!parseBase16(path, &fg, &bg, &ansi, &error)) {
     QMessageBox::warning(this, "Import Base16", error);
     return;
   }
 
   fg_ = fg;
   bg_ = bg;
+  ansi_ = ansi;
   updatePreview();
 }
 
@@ -131,9 +145,20 @@ void ThemeDialog::updatePreview() {
   fgButton_->setText(fg_.name(QColor::HexRgb));
   bgButton_->setText(bg_.name(QColor::HexRgb));
   fontButton_->setText(QString("%1 %2pt").arg(font_.family()).arg(font_.pointSize()));
+
+  // Normal colors on the first line, bright on the second.
+  QString html;
+  for (int i = 0; i < ansi_.size(); ++i) {
+    if (i == ColorTable::kAnsiColors / 2) {
+      html += "<br>";
+    }
+    html += QString("<span style=\"color:%1\">&#9608;&#9608;</span> ").arg(ansi_.at(i).name(QColor::HexRgb));
+  }
+  swatches_->setText(html);
+  swatches_->setPalette(pal);
 }
 
-bool ThemeDialog::parseBase16(const QString &path, QColor *fg, QColor *bg, QString *error) {
+bool ThemeDialog::parseBase16(const QString &path, QColor *fg, QColor *bg, QVector<QColor> *ansi, QString *error) {
   QFile f(path);
   if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) {
     if (error) *error = "Failed to open file";
@@ -170,5 +195,20 @@ bool ThemeDialog::parseBase16(const QString &path, QColor *fg, QColor *bg, QStri
     if (error) *error = "Invalid Base16 colors";
     return false;
   }
+
+  // ANSI slot -> Base16 slot, following the base16-shell mapping.
+  static const char *const kAnsiSlots[ColorTable::kAnsiColors] = {
+      "base00", "base08", "base0B", "base0A", "base0D", "base0E", "base0C", "base05",
+      "base03", "base08", "base0B", "base0A", "base0D", "base0E", "base0C", "base07",
+  };
+  ansi->clear();
+  for (const char *slot : kAnsiSlots) {
+    QString hex;
+    if (!findHex(QString::fromLatin1(slot), &hex)) {
+      if (error) *error = QString("Base16 file missing %1").arg(QString::fromLatin1(slot));
+      return false;
+    }
+    ansi->append(QColor("#" + hex));
+  }
   return true;
 }
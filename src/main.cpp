@@ -1,13 +1,32 @@
 #include "MainWindow.h"
+#include "SessionLog.h"
+#include "TerminalWidget.h"
 
 #include <QApplication>
+#include <QDebug>
 
 int main(int argc, char **argv) {
   QApplication app(argc, argv);
 
+  if (app.arguments().contains("--bench-render")) {
+    qInfo().noquote() << TerminalWidget::renderBenchmark(200);
+    return 0;
+  }
+  if (app.arguments().contains("--bench-log")) {
+    qInfo().noquote() << SessionLog::benchmark(512);
+    return 0;
+  }
+
   MainWindow window;
   window.resize(900, 600);
   window.show();
 
+  // --tabs N opens N idle tabs, e.g. to watch background wakeups with
+  // SSH_TERMINAL_STATS=1.
+  const int tabsArg = app.arguments().indexOf("--tabs");
+  if (tabsArg >= 0) {
+    window.addBlankTabs(app.arguments().value(tabsArg + 1).toInt());
+  }
+
   return app.exec();
 }
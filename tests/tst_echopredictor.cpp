@@ -0,0 +1,37 @@
+#include "EchoPredictor.h"
+
+#include <QtTest>
+
+class EchoPredictorTest : public QObject {
+  Q_OBJECT
+private slots:
+  void passwordPrompt_data();
+  void passwordPrompt();
+};
+
+void EchoPredictorTest::passwordPrompt_data() {
+  QTest::addColumn<QString>("line");
+  QTest::addColumn<bool>("prompt");
+
+  QTest::newRow("password") << "Password: " << true;
+  QTest::newRow("sudo") << "[sudo] password for alice: " << true;
+  QTest::newRow("passphrase") << "Enter passphrase for key '/home/alice/.ssh/id_ed25519': " << true;
+  QTest::newRow("pin") << "Enter PIN for 'YubiKey': " << true;
+  QTest::newRow("passcode") << "Passcode or option (1-3):" << true;
+  QTest::newRow("verification code") << "Verification code: " << true;
+
+  QTest::newRow("mapping") << "Mapping:" << false;
+  QTest::newRow("spinning up") << "Spinning up: " << false;
+  QTest::newRow("pinging") << "Pinging host:" << false;
+  QTest::newRow("shell") << "alice@host:~$ " << false;
+  QTest::newRow("typed after prompt") << "Password: hunter2" << false;
+}
+
+void EchoPredictorTest::passwordPrompt() {
+  QFETCH(QString, line);
+  QFETCH(bool, prompt);
+  QCOMPARE(EchoPredictor::isPasswordPrompt(line), prompt);
+}
+
+QTEST_APPLESS_MAIN(EchoPredictorTest)
+#include "tst_echopredictor.moc"
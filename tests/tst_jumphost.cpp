@@ -0,0 +1,129 @@
+#include "JumpHost.h"
+#include "SshTarget.h"
+
+#include <QTemporaryFile>
+#include <QtTest>
+
+class JumpHostTest : public QObject {
+  Q_OBJECT
+private slots:
+  void aliasHopLeavesUserAndPortToConfig();
+  void parsesUserAndPort();
+  void parsesIpv6Hops();
+  void rejectsInvalidHops();
+  void chainStringRoundTrips();
+  void resolvesAliasHopFromConfig();
+};
+
+void JumpHostTest::aliasHopLeavesUserAndPortToConfig() {
+  QVector<JumpHost> hops;
+  QVERIFY(JumpHost::parseChain("bastion", &hops));
+  QCOMPARE(hops.size(), 1);
+  QCOMPARE(hops.at(0).host, QString("bastion"));
+  QVERIFY(hops.at(0).user.isEmpty());
+  QCOMPARE(hops.at(0).port, 22);
+  QCOMPARE(hops.at(0).toString(), QString("bastion:22"));
+}
+
+void JumpHostTest::parsesUserAndPort() {
+  QVector<JumpHost> hops;
+  QVERIFY(JumpHost::parseChain(" ops@bastion:2200 , ssh://inner ", &hops));
+  QCOMPARE(hops.size(), 2);
+  QCOMPARE(hops.at(0).user, QString("ops"));
+  QCOMPARE(hops.at(0).host, QString("bastion"));
+  QCOMPARE(hops.at(0).port, 2200);
+  QCOMPARE(hops.at(1).host, QString("inner"));
+  QCOMPARE(hops.at(1).port, 22);
+
+  QVERIFY(JumpHost::parseChain("none", &hops));
+  QVERIFY(hops.isEmpty());
+  QVERIFY(JumpHost::parseChain("", &hops));
+  QVERIFY(hops.isEmpty());
+}
+
+void JumpHostTest::parsesIpv6Hops() {
+  QVector<JumpHost> hops;
+  QVERIFY(JumpHost::parseChain("[::1]:22,admin@[fe80::1]:2222,[2001:db8::5],2001:db8::6", &hops));
+  QCOMPARE(hops.size(), 4);
+  QCOMPARE(hops.at(0).host, QString("::1"));
+  QCOMPARE(hops.at(0).port, 22);
+  QCOMPARE(hops.at(1).user, QString("admin"));
+  QCOMPARE(hops.at(1).host, QString("fe80::1"));
+  QCOMPARE(hops.at(1).port, 2222);
+  QCOMPARE(hops.at(2).host, QString("2001:db8::5"));
+  QCOMPARE(hops.at(2).port, 22);
+  // Without brackets every colon belongs to the address.
+  QCOMPARE(hops.at(3).host, QString("2001:db8::6"));
+  QCOMPARE(hops.at(3).port, 22);
+  QCOMPARE(hops.at(1).toString(), QString("admin@[fe80::1]:2222"));
+}
+
+void JumpHostTest::rejectsInvalidHops() {
+  const char *const specs[] = {"bastion:0", "bastion:65536", "bastion:ssh", "@bastion", "[::1", "[::1]22",
+                               "bad host", "ok,[::1]x"};
+  for (const char *spec : specs) {
+    QVector<JumpHost> hops;
+    QString error;
+    QVERIFY2(!JumpHost::parseChain(spec, &hops, &error), spec);
+    QVERIFY(hops.isEmpty());
+    QVERIFY(!error.isEmpty());
+  }
+}
+
+void JumpHostTest::chainStringRoundTrips() {
+  QVector<JumpHost> hops;
+  QVERIFY(JumpHost::parseChain("ops@bastion:2200,[::1],inner", &hops));
+  const QString chain = JumpHost::chainString(hops);
+  QCOMPARE(chain, QString("ops@bastion:2200,[::1]:22,inner:22"));
+  QCOMPARE(JumpHost::chainString(hops, 1), QString("ops@bastion:2200"));
+
+  QVector<JumpHost> again;
+  QVERIFY(JumpHost::parseChain(chain, &again));
+  QCOMPARE(JumpHost::chainString(again), chain);
+}
+
+void JumpHostTest::resolvesAliasHopFromConfig() {
+#ifdef HAVE_LIBSSH
+  QTemporaryFile config;
+  QVERIFY(config.open());
+  config.write("Host bastion\n"
+               "  HostName bastion.example.com\n"
+               "  User admin\n"
+               "  Port 2222\n");
+  config.flush();
+
+  QVector<JumpHost> hops;
+  QVERIFY(JumpHost::parseChain("bastion,ops@bastion:2200,other", &hops));
+
+  struct Expected {
+    const char *host;
+    const char *user;
+    int port;
+  };
+  const Expected expected[] = {
+      {"bastion.example.com", "admin", 2222},
+      {"bastion.example.com", "ops", 2200},
+      {"other", nullptr, 22},
+  };
+  for (int i = 0; i < hops.size(); ++i) {
+    ssh_session session = ssh_new();
+    QVERIFY(session);
+    SshTarget target;
+    QString error;
+    const bool ok = SshTarget::resolve(session, hops.at(i).host, hops.at(i).user, hops.at(i).port, &target, &error,
+                                       config.fileName());
+    ssh_free(session);
+    QVERIFY2(ok, qPrintable(error));
+    QCOMPARE(target.host, QString(expected[i].host));
+    QCOMPARE(target.port, expected[i].port);
+    if (expected[i].user) {
+      QCOMPARE(target.user, QString(expected[i].user));
+    }
+  }
+#else
+  QSKIP("libssh not available at build time");
+#endif
+}
+
+QTEST_APPLESS_MAIN(JumpHostTest)
+#include "tst_jumphost.moc"
@@ -0,0 +1,197 @@
+#include "PortForward.h"
+
+#include <QtTest>
+
+namespace {
+
+const uchar *bytes(const QByteArray &data) {
+  return reinterpret_cast<const uchar *>(data.constData());
+}
+
+// VER CMD RSV ATYP, the address, then the port in network order.
+QByteArray request(char command, char type, const QByteArray &address, quint16 port) {
+  QByteArray data;
+  data += char(5);
+  data += command;
+  data += char(0);
+  data += type;
+  data += address;
+  data += char(port >> 8);
+  data += char(port & 0xff);
+  return data;
+}
+
+} // namespace
+
+Q_DECLARE_METATYPE(PortForward::Type)
+Q_DECLARE_METATYPE(Socks5::Status)
+
+class PortForwardTest : public QObject {
+  Q_OBJECT
+private slots:
+  void parsesSpecs_data();
+  void parsesSpecs();
+  void rejectsBadSpecs_data();
+  void rejectsBadSpecs();
+  void greeting_data();
+  void greeting();
+  void connectRequest_data();
+  void connectRequest();
+  void requestWaitsForEveryByte();
+};
+
+void PortForwardTest::parsesSpecs_data() {
+  QTest::addColumn<QString>("spec");
+  QTest::addColumn<PortForward::Type>("type");
+  QTest::addColumn<QString>("bindAddress");
+  QTest::addColumn<int>("bindPort");
+  QTest::addColumn<QString>("targetHost");
+  QTest::addColumn<int>("targetPort");
+  QTest::addColumn<QString>("string");
+
+  QTest::newRow("local") << "L 8080:db.internal:5432" << PortForward::Local << "127.0.0.1" << 8080 << "db.internal"
+                         << 5432 << "L 127.0.0.1:8080:db.internal:5432";
+  QTest::newRow("ssh option") << "-L 2222:localhost:22" << PortForward::Local << "127.0.0.1" << 2222 << "localhost"
+                              << 22 << "L 127.0.0.1:2222:localhost:22";
+  QTest::newRow("lower case") << "  l  1:h:2 " << PortForward::Local << "127.0.0.1" << 1 << "h" << 2
+                              << "L 127.0.0.1:1:h:2";
+  QTest::newRow("any address") << "L *:80:web:8080" << PortForward::Local << "0.0.0.0" << 80 << "web" << 8080
+                               << "L 0.0.0.0:80:web:8080";
+  QTest::newRow("ipv6") << "L [::1]:8080:[fe80::1]:65535" << PortForward::Local << "::1" << 8080 << "fe80::1"
+                        << 65535 << "L [::1]:8080:[fe80::1]:65535";
+  QTest::newRow("dynamic") << "D 1080" << PortForward::Dynamic << "127.0.0.1" << 1080 << "" << 0
+                           << "D 127.0.0.1:1080";
+  QTest::newRow("dynamic localhost") << "-D localhost:1080" << PortForward::Dynamic << "127.0.0.1" << 1080 << ""
+                                     << 0 << "D 127.0.0.1:1080";
+  QTest::newRow("dynamic ipv6") << "D [::]:1080" << PortForward::Dynamic << "::" << 1080 << "" << 0
+                                << "D [::]:1080";
+}
+
+void PortForwardTest::parsesSpecs() {
+  QFETCH(QString, spec);
+  PortForward forward;
+  QString error;
+  QVERIFY2(PortForward::parse(spec, &forward, &error), qPrintable(error));
+  QTEST(forward.type, "type");
+  QTEST(forward.bindAddress, "bindAddress");
+  QTEST(int(forward.bindPort), "bindPort");
+  QTEST(forward.targetHost, "targetHost");
+  QTEST(int(forward.targetPort), "targetPort");
+  QTEST(forward.toString(), "string");
+
+  PortForward again;
+  QVERIFY(PortForward::parse(forward.toString(), &again));
+  QCOMPARE(again.toString(), forward.toString());
+}
+
+void PortForwardTest::rejectsBadSpecs_data() {
+  QTest::addColumn<QString>("spec");
+  QTest::newRow("empty") << "";
+  QTest::newRow("unknown kind") << "R 8080:host:80";
+  QTest::newRow("no port") << "D";
+  QTest::newRow("port zero") << "L 0:host:80";
+  QTest::newRow("port too large") << "L 8080:host:65536";
+  QTest::newRow("not a port") << "D http";
+  QTest::newRow("no host") << "L 8080::80";
+  QTest::newRow("too few fields") << "L 8080:host";
+  QTest::newRow("too many fields") << "L a:1:b:2:3";
+  QTest::newRow("dynamic with target") << "D 1080:host:80";
+  QTest::newRow("unbracketed ipv6") << "L ::1:8080:host:80";
+}
+
+void PortForwardTest::rejectsBadSpecs() {
+  QFETCH(QString, spec);
+  PortForward forward;
+  forward.bindPort = 1;
+  QString error;
+  QVERIFY(!PortForward::parse(spec, &forward, &error));
+  QVERIFY(!error.isEmpty());
+  QCOMPARE(int(forward.bindPort), 1);
+}
+
+void PortForwardTest::greeting_data() {
+  QTest::addColumn<QByteArray>("data");
+  QTest::addColumn<Socks5::Status>("status");
+  QTest::addColumn<int>("used");
+
+  QTest::newRow("nothing") << QByteArray() << Socks5::Incomplete << 0;
+  QTest::newRow("version only") << QByteArray("\x05", 1) << Socks5::Incomplete << 0;
+  QTest::newRow("methods cut off") << QByteArray("\x05\x02\x00", 3) << Socks5::Incomplete << 0;
+  QTest::newRow("no auth") << QByteArray("\x05\x01\x00", 3) << Socks5::Accepted << 3;
+  QTest::newRow("no auth among others") << QByteArray("\x05\x03\x02\x01\x00", 5) << Socks5::Accepted << 5;
+  // The request may follow in the same read; it is not part of the greeting.
+  QTest::newRow("request follows") << QByteArray("\x05\x01\x00\x05\x01", 5) << Socks5::Accepted << 3;
+  QTest::newRow("password only") << QByteArray("\x05\x01\x02", 3) << Socks5::Unsupported << 3;
+  QTest::newRow("no methods") << QByteArray("\x05\x00", 2) << Socks5::Unsupported << 2;
+  QTest::newRow("socks4") << QByteArray("\x04\x01\x00", 3) << Socks5::Unsupported << 3;
+}
+
+void PortForwardTest::greeting() {
+  QFETCH(QByteArray, data);
+  int used = 0;
+  QTEST(Socks5::parseGreeting(bytes(data), data.size(), &used), "status");
+  QTEST(used, "used");
+}
+
+void PortForwardTest::connectRequest_data() {
+  QTest::addColumn<QByteArray>("data");
+  QTest::addColumn<Socks5::Status>("status");
+  QTest::addColumn<int>("used");
+  QTest::addColumn<QString>("host");
+  QTest::addColumn<int>("port");
+
+  QTest::newRow("ipv4") << request(1, 1, QByteArray("\x0a\x00\x00\x01", 4), 5432) << Socks5::Accepted << 10
+                        << "10.0.0.1" << 5432;
+  QTest::newRow("domain") << request(1, 3, "\x0b" "example.com", 443) << Socks5::Accepted << 18 << "example.com"
+                          << 443;
+  QByteArray loopback(16, '\0');
+  loopback[15] = 1;
+  QTest::newRow("ipv6") << request(1, 4, loopback, 22) << Socks5::Accepted << 22 << "::1" << 22;
+  QTest::newRow("empty domain") << request(1, 3, QByteArray(1, '\0'), 80) << Socks5::Accepted << 7 << "" << 80;
+  QTest::newRow("data follows") << request(1, 1, QByteArray(4, '\x7f'), 1) + "GET /" << Socks5::Accepted << 10
+                                << "127.127.127.127" << 1;
+  QTest::newRow("bind") << request(2, 1, QByteArray(4, '\0'), 80) << Socks5::Unsupported << 10 << "" << 0;
+  QTest::newRow("udp associate") << request(3, 1, QByteArray(4, '\0'), 80) << Socks5::Unsupported << 10 << ""
+                                 << 0;
+  QByteArray socks4 = request(1, 1, QByteArray(4, '\0'), 80);
+  socks4[0] = 4;
+  QTest::newRow("wrong version") << socks4 << Socks5::Unsupported << 10 << "" << 0;
+  QTest::newRow("unknown address type") << request(1, 2, QByteArray(4, '\0'), 80) << Socks5::Invalid << 0 << ""
+                                        << 0;
+}
+
+void PortForwardTest::connectRequest() {
+  QFETCH(QByteArray, data);
+  int used = 0;
+  QString host;
+  quint16 port = 0;
+  QTEST(Socks5::parseRequest(bytes(data), data.size(), &used, &host, &port), "status");
+  QTEST(used, "used");
+  QTEST(host, "host");
+  QTEST(int(port), "port");
+}
+
+void PortForwardTest::requestWaitsForEveryByte() {
+  QByteArray loopback(16, '\0');
+  loopback[15] = 1;
+  const QVector<QByteArray> requests{request(1, 1, QByteArray("\xc0\xa8\x01\x02", 4), 80),
+                                     request(1, 3, "\x04" "host", 8080), request(1, 4, loopback, 22)};
+  for (const QByteArray &data : requests) {
+    for (int size = 0; size < data.size(); ++size) {
+      int used = -1;
+      QString host;
+      quint16 port = 0;
+      QCOMPARE(Socks5::parseRequest(bytes(data), size, &used, &host, &port), Socks5::Incomplete);
+      QCOMPARE(used, -1);
+      QVERIFY(host.isEmpty());
+    }
+    int used = 0;
+    QString host;
+    quint16 port = 0;
+    QCOMPARE(Socks5::parseRequest(bytes(data), data.size(), &used, &host, &port), Socks5::Accepted);
+    QCOMPARE(used, data.size());
+  }
+}
+
+QTEST_APPLESS_MAIN(PortForwardTest)
+#include "tst_portforward.moc"
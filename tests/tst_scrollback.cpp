@@ -0,0 +1,316 @@
+#include "Scrollback.h"
+
+#include <QtTest>
+
+namespace {
+
+// Deterministic noise, so spilled blocks do not compress into one slot.
+quint32 noise(quint32 seed) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+Cell cell(quint32 glyph, quint32 fg = CellColor::Default, quint32 bg = CellColor::Default) {
+  Cell c;
+  c.glyph = glyph;
+  c.fg = fg;
+  c.bg = bg;
+  return c;
+}
+
+QVector<Cell> asciiLine(const QByteArray &text, int cols) {
+  QVector<Cell> cells(cols);
+  for (int i = 0; i < text.size() && i < cols; ++i) {
+    cells[i] = cell(quint32(uchar(text.at(i))));
+  }
+  return cells;
+}
+
+// Line `n` of a history of mixed scripts, wide glyphs and colour runs; the
+// last cell is never blank, so the line keeps every cell.
+QVector<Cell> noisyLine(int n, int cols) {
+  QVector<Cell> cells(cols);
+  quint32 seed = quint32(n) * 2654435761u + 1;
+  for (int i = 0; i < cols; ++i) {
+    seed = noise(seed);
+    if (seed % 7 == 0 && i + 1 < cols) {
+      cells[i] = cell(Cell::Wide | (0x4e00 + seed % 0x5000), 0, 0);
+      cells[++i] = cell(Cell::WideTail);
+      continue;
+    }
+    const quint32 glyph = seed % 3 == 0 ? 0x20 + seed % 0x5f : 0xa1 + seed % 0x10000;
+    const quint32 attrs = (seed >> 8) % 5 == 0 ? Cell::Bold | Cell::Reverse : 0;
+    cells[i] = cell(glyph | attrs, (seed >> 12) % 4 == 0 ? CellColor::IndexedTag | (seed >> 16) % 256 : 0);
+  }
+  cells[cols - 1] = cell('$');
+  return cells;
+}
+
+bool sameCells(const QVector<Cell> &a, const QVector<Cell> &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (int i = 0; i < a.size(); ++i) {
+    if (a.at(i).glyph != b.at(i).glyph || a.at(i).fg != b.at(i).fg || a.at(i).bg != b.at(i).bg) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Pushes lines until `count` blocks are sealed behind the one being filled.
+int fillBlocks(Scrollback *history, int count, int cols) {
+  int n = 0;
+  while (history->segments(history->begin()).size() <= count) {
+    const QVector<Cell> cells = noisyLine(n++, cols);
+    history->push(cells.constData(), cols);
+  }
+  return n;
+}
+
+} // namespace
+
+class ScrollbackTest : public QObject {
+  Q_OBJECT
+private slots:
+  void asciiLineRoundTrips();
+  void varintLineRoundTrips();
+  void trailingBlanksDependOnWrap();
+  void popReturnsNewestLine();
+  void blocksSplitAtSizeAndWidth();
+  void spilledBlocksReadBack();
+  void readSegmentChecksSlotHeader();
+  void popBringsSpilledBlockBack();
+  void limitsDropWholeBlocks();
+};
+
+void ScrollbackTest::asciiLineRoundTrips() {
+  Scrollback history;
+  QVector<Cell> cells = asciiLine("ls -la", 10);
+  cells[3] = cell('-' | Cell::Bold, CellColor::IndexedTag | 2);
+  cells[4] = cell('l' | Cell::Bold, CellColor::IndexedTag | 2);
+  history.push(cells.constData(), cells.size());
+
+  QVector<Cell> out;
+  bool wrapped = true;
+  QVERIFY(history.line(history.begin(), &out, &wrapped));
+  QVERIFY(!wrapped);
+  QVERIFY(sameCells(out, cells.mid(0, 6)));
+
+  // Only ASCII lines offer their text as bytes.
+  const Scrollback::Segment segment = history.segments(history.begin()).value(0);
+  const char *text = nullptr;
+  int length = 0;
+  QVERIFY(Scrollback::asciiText(segment.data.constData(), segment.data.size(), &text, &length));
+  QCOMPARE(QByteArray(text, length), QByteArray("ls -la"));
+}
+
+void ScrollbackTest::varintLineRoundTrips() {
+  Scrollback history;
+  // One-, two-, three- and four-byte varints, a wide glyph and a cluster id.
+  const QVector<Cell> cells{cell(0x7f),
+                            cell(0x80),
+                            cell(0x3fff),
+                            cell(0x4000),
+                            cell(0x10ffff | Cell::Italic, CellColor::IndexedTag | 200),
+                            cell(Cell::Wide | 0x1f600),
+                            cell(Cell::WideTail),
+                            cell(Cell::Cluster | Cell::Wide | 12345),
+                            cell(Cell::WideTail),
+                            cell('x', 0x00123456, 0x00654321)};
+  history.push(cells.constData(), cells.size(), true);
+
+  QVector<Cell> out;
+  bool wrapped = false;
+  QVERIFY(history.line(history.begin(), &out, &wrapped));
+  QVERIFY(wrapped);
+  QVERIFY(sameCells(out, cells));
+
+  const Scrollback::Segment segment = history.segments(history.begin()).value(0);
+  const char *text = nullptr;
+  int length = 0;
+  QVERIFY(!Scrollback::asciiText(segment.data.constData(), segment.data.size(), &text, &length));
+}
+
+void ScrollbackTest::trailingBlanksDependOnWrap() {
+  Scrollback history;
+  QVector<Cell> cells = asciiLine("ab", 8);
+  cells[5] = cell(' ', CellColor::Default, CellColor::IndexedTag | 4);
+  history.push(cells.constData(), cells.size());
+  history.push(cells.constData(), cells.size(), true);
+
+  QVector<Cell> out;
+  QVERIFY(history.line(history.begin(), &out));
+  // Blanks with a background colour are kept, plain ones after them are not.
+  QCOMPARE(out.size(), 6);
+  QVERIFY(history.line(history.begin() + 1, &out));
+  QCOMPARE(out.size(), 8);
+
+  const QVector<Cell> blank(8);
+  history.push(blank.constData(), blank.size());
+  QVERIFY(history.line(history.begin() + 2, &out));
+  QVERIFY(out.isEmpty());
+}
+
+void ScrollbackTest::popReturnsNewestLine() {
+  Scrollback history;
+  for (int n = 0; n < 3; ++n) {
+    const QVector<Cell> cells = noisyLine(n, 20);
+    history.push(cells.constData(), cells.size(), n == 1);
+  }
+  QVector<Cell> out;
+  bool wrapped = false;
+  QVERIFY(history.pop(&out));
+  QVERIFY(sameCells(out, noisyLine(2, 20)));
+  QVERIFY(history.pop(&out, &wrapped));
+  QVERIFY(wrapped);
+  QVERIFY(sameCells(out, noisyLine(1, 20)));
+  QVERIFY(history.pop(&out));
+  QVERIFY(!history.pop(&out));
+  QVERIFY(history.isEmpty());
+}
+
+void ScrollbackTest::blocksSplitAtSizeAndWidth() {
+  Scrollback history;
+  history.setSpillEnabled(false);
+  const int lines = fillBlocks(&history, 2, 120);
+
+  const QVector<Scrollback::Segment> segments = history.segments(history.begin());
+  QCOMPARE(segments.size(), 3);
+  qint64 next = history.begin();
+  for (const Scrollback::Segment &segment : segments) {
+    QCOMPARE(segment.first, next);
+    QVERIFY(segment.data.size() <= Scrollback::kBlockSize);
+    QCOMPARE(segment.starts.size(), segment.lines);
+    next += segment.lines;
+  }
+  QCOMPARE(next, history.end());
+  // The first line of a block is the one that would have overfilled the last.
+  const int firstLine = segments.at(1).starts.value(1, segments.at(1).data.size());
+  QVERIFY(segments.at(0).data.size() + firstLine > Scrollback::kBlockSize);
+
+  QVector<Cell> out;
+  for (int n = 0; n < lines; ++n) {
+    QVERIFY(history.line(n, &out));
+    QVERIFY2(sameCells(out, noisyLine(n, 120)), qPrintable(QString("line %1").arg(n)));
+  }
+
+  // A new width starts a new block even when the last one has room.
+  const QVector<Cell> narrow = noisyLine(lines, 40);
+  history.push(narrow.constData(), narrow.size());
+  qint64 first = 0;
+  qint64 last = 0;
+  QCOMPARE(history.width(history.end() - 1, &first, &last), 40);
+  QCOMPARE(first, history.end() - 1);
+  QCOMPARE(last, history.end());
+  QCOMPARE(history.width(history.end() - 2), 120);
+}
+
+void ScrollbackTest::spilledBlocksReadBack() {
+  Scrollback history;
+  const int lines = fillBlocks(&history, Scrollback::kHotBlocks + Scrollback::kCachedBlocks + 2, 200);
+  QVERIFY(!history.fileName().isEmpty());
+  QVERIFY(history.residentBytes() < history.bytes());
+
+  // Read every cold segment back as the search thread does, through a file
+  // opened on its own, and check it against the lines pushed.
+  QFile file(history.fileName());
+  QVERIFY(file.open(QIODevice::ReadOnly));
+  int cold = 0;
+  bool multiSlot = false;
+  for (Scrollback::Segment segment : history.segments(history.begin())) {
+    if (segment.slots.isEmpty()) {
+      continue;
+    }
+    ++cold;
+    multiSlot = multiSlot || segment.slots.size() > 1;
+    QCOMPARE(segment.slots.size(), (segment.packedSize + Scrollback::kSlotSize - 1) / Scrollback::kSlotSize);
+    QVERIFY(Scrollback::readSegment(&file, &segment));
+    QCOMPARE(segment.starts.size(), segment.lines);
+    for (int i = 0; i < segment.lines; ++i) {
+      const int start = segment.starts.at(i);
+      const int stop = i + 1 < segment.lines ? segment.starts.at(i + 1) : segment.data.size();
+      QVector<Cell> out;
+      Scrollback::decode(segment.data.constData() + start, stop - start, &out);
+      QVERIFY(sameCells(out, noisyLine(int(segment.first) + i, 200)));
+    }
+  }
+  QVERIFY(cold > Scrollback::kCachedBlocks);
+  QVERIFY(multiSlot);
+
+  // Reading through more cold blocks than the cache holds, twice.
+  QVector<Cell> out;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int n = 0; n < lines; ++n) {
+      QVERIFY(history.line(n, &out));
+      QVERIFY2(sameCells(out, noisyLine(n, 200)), qPrintable(QString("line %1").arg(n)));
+    }
+  }
+}
+
+void ScrollbackTest::readSegmentChecksSlotHeader() {
+  Scrollback history;
+  fillBlocks(&history, Scrollback::kHotBlocks + 1, 200);
+  Scrollback::Segment segment = history.segments(history.begin()).value(0);
+  QVERIFY(!segment.slots.isEmpty());
+
+  QFile file(history.fileName());
+  QVERIFY(file.open(QIODevice::ReadOnly));
+  // Slots meanwhile reused for another block read back as a failure.
+  Scrollback::Segment moved = segment;
+  ++moved.first;
+  QVERIFY(!Scrollback::readSegment(&file, &moved));
+  Scrollback::Segment shorter = segment;
+  --shorter.lines;
+  QVERIFY(!Scrollback::readSegment(&file, &shorter));
+  QVERIFY(Scrollback::readSegment(&file, &segment));
+
+  // Hot segments already hold their bytes.
+  Scrollback::Segment hot = history.segments(history.end() - 1).value(0);
+  const QByteArray data = hot.data;
+  QVERIFY(Scrollback::readSegment(&file, &hot));
+  QCOMPARE(hot.data, data);
+}
+
+void ScrollbackTest::popBringsSpilledBlockBack() {
+  Scrollback history;
+  const int lines = fillBlocks(&history, Scrollback::kHotBlocks + 1, 200);
+  QVERIFY(!history.segments(history.begin()).value(0).slots.isEmpty());
+
+  QVector<Cell> out;
+  for (int n = lines - 1; n >= 0; --n) {
+    QVERIFY(history.pop(&out));
+    QVERIFY2(sameCells(out, noisyLine(n, 200)), qPrintable(QString("line %1").arg(n)));
+  }
+  QVERIFY(history.isEmpty());
+  QCOMPARE(history.bytes(), qint64(0));
+}
+
+void ScrollbackTest::limitsDropWholeBlocks() {
+  Scrollback history(50);
+  history.setSpillEnabled(false);
+  for (int n = 0; n < 5000; ++n) {
+    const QVector<Cell> cells = noisyLine(n, 80);
+    history.push(cells.constData(), cells.size());
+  }
+  // Dropping the oldest block left would take the history under the limit.
+  const QVector<Scrollback::Segment> segments = history.segments(history.begin());
+  QCOMPARE(history.begin(), segments.value(0).first);
+  QVERIFY(history.size() - segments.value(0).lines < 50);
+
+  QVector<Cell> out;
+  QVERIFY(!history.line(history.begin() - 1, &out));
+  QVERIFY(history.line(history.begin(), &out));
+  QVERIFY(sameCells(out, noisyLine(int(history.begin()), 80)));
+
+  history.setLimits(0, 0);
+  QVERIFY(history.isEmpty());
+  const QVector<Cell> cells = noisyLine(0, 80);
+  history.push(cells.constData(), cells.size());
+  QVERIFY(history.isEmpty());
+}
+
+QTEST_APPLESS_MAIN(ScrollbackTest)
+#include "tst_scrollback.moc"
@@ -0,0 +1,237 @@
+#include "ScrollbackLayout.h"
+
+#include <QtTest>
+
+namespace {
+
+// '#' marks a double-width glyph, which takes the cell after it too.
+QVector<Cell> textCells(const QByteArray &text, int cols) {
+  QVector<Cell> cells(cols);
+  int col = 0;
+  for (int i = 0; i < text.size() && col < cols; ++i) {
+    if (text.at(i) == '#') {
+      cells[col++].glyph = Cell::Wide | 0x4e00;
+      cells[col++].glyph = Cell::WideTail;
+    } else {
+      cells[col++].glyph = quint32(uchar(text.at(i)));
+    }
+  }
+  return cells;
+}
+
+void push(Scrollback *history, const QByteArray &text, int cols, bool wrapped = false) {
+  const QVector<Cell> cells = textCells(text, cols);
+  history->push(cells.constData(), cols, wrapped);
+}
+
+// A row as text: '#' for a wide glyph, nothing for its tail, '.' for blanks.
+QByteArray rowText(ScrollbackLayout *layout, const Scrollback &history, int n) {
+  ScrollbackLayout::Row row;
+  if (!layout->row(history, n, &row)) {
+    return QByteArray();
+  }
+  QVector<Cell> cells;
+  layout->cells(history, row, &cells);
+  QByteArray text;
+  for (const Cell &cell : cells) {
+    if (cell.glyph & Cell::WideTail) {
+      continue;
+    }
+    text += cell.glyph & Cell::Wide ? '#' : cell.codepoint() ? char(cell.codepoint()) : '.';
+  }
+  return text;
+}
+
+} // namespace
+
+class ScrollbackLayoutTest : public QObject {
+  Q_OBJECT
+private slots:
+  void wrapPointsKeepWideGlyphsWhole();
+  void sameWidthLinesAreRows();
+  void reflowsWrappedLines();
+  void wideGlyphAtWrapColumnMovesDown();
+  void piecesSpanJoinedLines();
+  void rowOfFindsReflowedColumn();
+  void wrappedLineGrowsAsItIsPushed();
+  void laysOutLazilyFromTheNewest();
+  void dropsRowsOfTrimmedLines();
+};
+
+void ScrollbackLayoutTest::wrapPointsKeepWideGlyphsWhole() {
+  const QVector<Cell> cells = textCells("abc#de#", 9);
+  QCOMPARE(ScreenModel::wrapPoints(cells.constData(), 9, 4), (QVector<int>{0, 3, 7}));
+  QCOMPARE(ScreenModel::wrapPoints(cells.constData(), 9, 9), (QVector<int>{0}));
+  QCOMPARE(ScreenModel::wrapPoints(cells.constData(), 0, 4), (QVector<int>{0}));
+  // A row too narrow for the glyph cuts it rather than never ending.
+  QCOMPARE(ScreenModel::wrapPoints(cells.constData(), 9, 1), (QVector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8}));
+}
+
+void ScrollbackLayoutTest::sameWidthLinesAreRows() {
+  Scrollback history;
+  push(&history, "one", 6, true);
+  push(&history, "two", 6);
+  push(&history, "three", 6);
+  ScrollbackLayout layout;
+  layout.reset(6);
+  QCOMPARE(layout.available(history, 10), 3);
+  // Rows pushed at the width stay as they were, wrapped or not.
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("three."));
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("two..."));
+  QCOMPARE(rowText(&layout, history, 2), QByteArray("one..."));
+  ScrollbackLayout::Row row;
+  QVERIFY(!layout.row(history, 3, &row));
+}
+
+void ScrollbackLayoutTest::reflowsWrappedLines() {
+  Scrollback history;
+  push(&history, "abcdefghij", 10, true);
+  push(&history, "klmno", 10);
+  push(&history, "xyz", 10);
+  ScrollbackLayout layout;
+  layout.reset(4);
+  QCOMPARE(layout.available(history, 10), 5);
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("xyz."));
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("mno."));
+  QCOMPARE(rowText(&layout, history, 2), QByteArray("ijkl"));
+  QCOMPARE(rowText(&layout, history, 3), QByteArray("efgh"));
+  QCOMPARE(rowText(&layout, history, 4), QByteArray("abcd"));
+
+  // Wider than the lines were pushed: the run fits on one row.
+  layout.reset(20);
+  QCOMPARE(layout.available(history, 10), 2);
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("abcdefghijklmno....."));
+}
+
+void ScrollbackLayoutTest::wideGlyphAtWrapColumnMovesDown() {
+  Scrollback history;
+  // The wide glyph sits on columns 3 and 4, across the new wrap column.
+  push(&history, "abc#de", 10);
+  ScrollbackLayout layout;
+  layout.reset(4);
+  QCOMPARE(layout.available(history, 10), 2);
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("abc."));
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("#de"));
+
+  // Lines wrapped on screen with the glyph right at the edge of the row.
+  history.clear();
+  push(&history, "abcdefg#", 9, true);
+  push(&history, "#h", 9);
+  layout.reset(8);
+  QCOMPARE(layout.available(history, 10), 2);
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("abcdefg."));
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("##h..."));
+}
+
+void ScrollbackLayoutTest::piecesSpanJoinedLines() {
+  Scrollback history;
+  push(&history, "abcdefghij", 10, true);
+  push(&history, "klmno", 10);
+  const qint64 first = history.begin();
+  ScrollbackLayout layout;
+  layout.reset(4);
+  ScrollbackLayout::Row row;
+  QVERIFY(layout.row(history, 1, &row));
+  QCOMPARE(row.line, first);
+  QCOMPARE(row.last, first + 2);
+  QCOMPARE(row.offset, 8);
+  QCOMPARE(row.length, 4);
+
+  QVector<ScrollbackLayout::Piece> pieces;
+  layout.pieces(history, row, &pieces);
+  QCOMPARE(pieces.size(), 2);
+  QCOMPARE(pieces.at(0).line, first);
+  QCOMPARE(pieces.at(0).col, 8);
+  QCOMPARE(pieces.at(0).at, 0);
+  QCOMPARE(pieces.at(0).length, 2);
+  QCOMPARE(pieces.at(1).line, first + 1);
+  QCOMPARE(pieces.at(1).col, 0);
+  QCOMPARE(pieces.at(1).at, 2);
+  QCOMPARE(pieces.at(1).length, 2);
+}
+
+void ScrollbackLayoutTest::rowOfFindsReflowedColumn() {
+  Scrollback history;
+  push(&history, "abcdefghij", 10, true);
+  push(&history, "klmno", 10);
+  push(&history, "xyz", 10);
+  const qint64 first = history.begin();
+  ScrollbackLayout layout;
+  layout.reset(4);
+  QCOMPARE(layout.rowOf(history, first, 0), 4);
+  QCOMPARE(layout.rowOf(history, first, 9), 2);
+  QCOMPARE(layout.rowOf(history, first + 1, 0), 2);
+  QCOMPARE(layout.rowOf(history, first + 1, 4), 1);
+  QCOMPARE(layout.rowOf(history, first + 2, 0), 0);
+  QCOMPARE(layout.rowOf(history, first + 3, 0), -1);
+  QCOMPARE(layout.rowOf(history, first - 1, 0), -1);
+}
+
+void ScrollbackLayoutTest::wrappedLineGrowsAsItIsPushed() {
+  Scrollback history;
+  ScrollbackLayout layout;
+  layout.reset(4);
+  push(&history, "abcdefghij", 10, true);
+  QCOMPARE(layout.available(history, 10), 3);
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("ij.."));
+
+  // The rest of the line arrives after the layout was made.
+  push(&history, "klm", 10);
+  QCOMPARE(layout.available(history, 10), 4);
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("m..."));
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("ijkl"));
+
+  push(&history, "x", 10);
+  QCOMPARE(layout.available(history, 10), 5);
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("x..."));
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("m..."));
+}
+
+void ScrollbackLayoutTest::laysOutLazilyFromTheNewest() {
+  Scrollback history;
+  history.setSpillEnabled(false);
+  for (int n = 0; n < 2000; ++n) {
+    push(&history, QByteArray::number(n).rightJustified(8, '0'), 8, n % 2 == 0);
+  }
+  ScrollbackLayout layout;
+  layout.reset(5);
+  // Laid out a few rows at a time as they are asked for; rows come out the
+  // same whichever order that happens in.
+  QCOMPARE(layout.available(history, 3), 3);
+  // The newest line is "00001998" and "00001999" joined.
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("9...."));
+  QCOMPARE(rowText(&layout, history, 1), QByteArray("00199"));
+  QCOMPARE(rowText(&layout, history, 2), QByteArray("99800"));
+  QCOMPARE(rowText(&layout, history, 15), QByteArray("00001"));
+  QCOMPARE(rowText(&layout, history, 4 * 1000 - 1), QByteArray("00000"));
+  QCOMPARE(layout.available(history, 100000), 4 * 1000);
+
+  ScrollbackLayout fresh;
+  fresh.reset(5);
+  for (int n : {3999, 1234, 17, 0}) {
+    QCOMPARE(rowText(&fresh, history, n), rowText(&layout, history, n));
+  }
+}
+
+void ScrollbackLayoutTest::dropsRowsOfTrimmedLines() {
+  Scrollback history(100);
+  history.setSpillEnabled(false);
+  ScrollbackLayout layout;
+  layout.reset(4);
+  for (int n = 0; n < 20000; ++n) {
+    push(&history, QByteArray::number(n % 10).repeated(6), 8);
+    if (n % 1000 == 0) {
+      layout.available(history, 1000);
+    }
+  }
+  // Each 6-cell line takes two rows; none refer to lines that are gone.
+  const int rows = layout.available(history, 1000000);
+  QCOMPARE(rows, 2 * history.size());
+  ScrollbackLayout::Row row;
+  QVERIFY(layout.row(history, rows - 1, &row));
+  QCOMPARE(row.line, history.begin());
+  QCOMPARE(rowText(&layout, history, 0), QByteArray("99.."));
+}
+
+QTEST_APPLESS_MAIN(ScrollbackLayoutTest)
+#include "tst_scrollbacklayout.moc"
@@ -0,0 +1,106 @@
+#include "ScrollbackSearch.h"
+
+#include <QtTest>
+
+namespace {
+
+// "café ok 👩‍💻!" with the é decomposed and the emoji a two-column cluster.
+const QString kCombined = QString("e") + QChar(0x0301);
+const QString kEmoji = QString::fromUtf8("\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb");
+
+QVector<Cell> clusterRow() {
+  QVector<Cell> cells;
+  auto put = [&cells](quint32 glyph) {
+    Cell cell;
+    cell.glyph = glyph;
+    cells.append(cell);
+  };
+  for (char c : QByteArray("caf")) {
+    put(quint32(c));
+  }
+  put(Cell::Cluster | 0);
+  for (char c : QByteArray(" ok ")) {
+    put(quint32(c));
+  }
+  put(Cell::Cluster | Cell::Wide | 1);
+  put(Cell::WideTail);
+  put('!');
+  return cells;
+}
+
+QVector<ScrollbackSearch::Match> find(const QString &pattern, const QVector<Cell> &cells,
+                                      const QVector<QString> &clusters) {
+  ScrollbackSearch::Query query;
+  query.pattern = pattern;
+  QVector<ScrollbackSearch::Match> out;
+  ScrollbackSearch::Matcher(query).matchCells(cells.constData(), cells.size(), 7, clusters, &out);
+  return out;
+}
+
+} // namespace
+
+class ScrollbackSearchTest : public QObject {
+  Q_OBJECT
+private slots:
+  void findsClusterText();
+  void findsClusterTextInHistory();
+  void unknownClusterReadsAsReplacement();
+};
+
+void ScrollbackSearchTest::findsClusterText() {
+  const QVector<QString> clusters{kCombined, kEmoji};
+  const QVector<Cell> cells = clusterRow();
+
+  QVector<ScrollbackSearch::Match> matches = find("caf" + kCombined, cells, clusters);
+  QCOMPARE(matches.size(), 1);
+  QCOMPARE(matches.at(0).line, qint64(7));
+  QCOMPARE(matches.at(0).col, 0);
+  QCOMPARE(matches.at(0).length, 4);
+
+  // A wide cluster covers both of its cells.
+  matches = find(kEmoji + "!", cells, clusters);
+  QCOMPARE(matches.size(), 1);
+  QCOMPARE(matches.at(0).col, 8);
+  QCOMPARE(matches.at(0).length, 3);
+
+  ScrollbackSearch::Query regex;
+  regex.pattern = "e\\x{0301} ok";
+  regex.regex = true;
+  QVector<ScrollbackSearch::Match> out;
+  ScrollbackSearch::Matcher(regex).matchCells(cells.constData(), cells.size(), 0, clusters, &out);
+  QCOMPARE(out.size(), 1);
+  QCOMPARE(out.at(0).col, 3);
+  QCOMPARE(out.at(0).length, 4);
+}
+
+void ScrollbackSearchTest::findsClusterTextInHistory() {
+  const QVector<QString> clusters{kCombined, kEmoji};
+  const QVector<Cell> cells = clusterRow();
+  Scrollback history;
+  history.setSpillEnabled(false);
+  history.push(cells.constData(), cells.size());
+
+  // Both the ASCII fast path and the decoded path must see the cluster line.
+  for (const QString &pattern : {QString("ok"), kEmoji}) {
+    ScrollbackSearch::Query query;
+    query.pattern = pattern;
+    const ScrollbackSearch::Matcher matcher(query);
+    QVector<ScrollbackSearch::Match> out;
+    for (const Scrollback::Segment &segment : history.segments(history.begin())) {
+      matcher.matchSegment(segment, history.begin(), clusters, &out);
+    }
+    QCOMPARE(out.size(), 1);
+    QCOMPARE(out.at(0).line, history.begin());
+    QCOMPARE(out.at(0).col, pattern == "ok" ? 5 : 8);
+  }
+}
+
+void ScrollbackSearchTest::unknownClusterReadsAsReplacement() {
+  const QVector<Cell> cells = clusterRow();
+  QVERIFY(find(kEmoji, cells, QVector<QString>()).isEmpty());
+  const QVector<ScrollbackSearch::Match> matches = find(QString(QChar(0xfffd)), cells, QVector<QString>());
+  QCOMPARE(matches.size(), 2);
+}
+
+QTEST_APPLESS_MAIN(ScrollbackSearchTest)
+#include "tst_scrollbacksearch.moc"
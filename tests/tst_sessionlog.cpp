@@ -0,0 +1,190 @@
+#include "SessionLog.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtTest>
+
+namespace {
+
+// The events of a recorded cast, header skipped.
+QVector<QJsonArray> readEvents(const QString &path) {
+  QVector<QJsonArray> events;
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return events;
+  }
+  file.readLine();
+  while (!file.atEnd()) {
+    QJsonParseError error;
+    const QJsonDocument line = QJsonDocument::fromJson(file.readLine(), &error);
+    if (error.error != QJsonParseError::NoError || !line.isArray()) {
+      return QVector<QJsonArray>();
+    }
+    events.append(line.array());
+  }
+  return events;
+}
+
+// The text of every event with `code`, in order.
+QString joined(const QVector<QJsonArray> &events, const QString &code) {
+  QString text;
+  for (const QJsonArray &event : events) {
+    if (event.at(1).toString() == code) {
+      text += event.at(2).toString();
+    }
+  }
+  return text;
+}
+
+// Records `chunks` as output and returns what the cast file says was shown.
+QString recordOutput(const QVector<QByteArray> &chunks, QVector<QJsonArray> *events = nullptr) {
+  QTemporaryDir dir;
+  SessionLog log;
+  const QString path = dir.path() + "/test.cast";
+  if (!log.open(path, 24, 80, "test", 0)) {
+    return QString();
+  }
+  for (const QByteArray &chunk : chunks) {
+    log.output(chunk);
+  }
+  log.close();
+  const QVector<QJsonArray> read = readEvents(path);
+  if (events) {
+    *events = read;
+  }
+  return joined(read, "o");
+}
+
+} // namespace
+
+class SessionLogTest : public QObject {
+  Q_OBJECT
+private slots:
+  void writesHeaderAndEvents();
+  void escapesJson_data();
+  void escapesJson();
+  void invalidUtf8BecomesReplacement_data();
+  void invalidUtf8BecomesReplacement();
+  void holdsSplitUtf8UntilComplete();
+  void holdsInputAndOutputApart();
+  void flushesCutSequenceOnClose();
+};
+
+void SessionLogTest::writesHeaderAndEvents() {
+  QTemporaryDir dir;
+  const QString path = dir.path() + "/test.cast";
+  SessionLog log;
+  QString error;
+  QVERIFY2(log.open(path, 24, 80, "title", 0, &error), qPrintable(error));
+  log.output("$ ");
+  log.input("ls\r");
+  log.resize(30, 100);
+  log.close();
+
+  QFile file(path);
+  QVERIFY(file.open(QIODevice::ReadOnly));
+  const QJsonObject header = QJsonDocument::fromJson(file.readLine()).object();
+  QCOMPARE(header.value("version").toInt(), 2);
+  QCOMPARE(header.value("width").toInt(), 80);
+  QCOMPARE(header.value("height").toInt(), 24);
+  QCOMPARE(header.value("title").toString(), QString("title"));
+
+  const QVector<QJsonArray> events = readEvents(path);
+  QCOMPARE(events.size(), 3);
+  QCOMPARE(events.at(0).at(1).toString(), QString("o"));
+  QCOMPARE(events.at(0).at(2).toString(), QString("$ "));
+  QCOMPARE(events.at(1).at(1).toString(), QString("i"));
+  QCOMPARE(events.at(1).at(2).toString(), QString("ls\r"));
+  QCOMPARE(events.at(2).at(1).toString(), QString("r"));
+  QCOMPARE(events.at(2).at(2).toString(), QString("100x30"));
+  QVERIFY(events.at(0).at(0).toDouble() <= events.at(2).at(0).toDouble());
+}
+
+void SessionLogTest::escapesJson_data() {
+  QTest::addColumn<QByteArray>("data");
+
+  QTest::newRow("plain") << QByteArray("hello, world");
+  QTest::newRow("quotes and backslashes") << QByteArray("say \"C:\\dir\\\" now");
+  QTest::newRow("control characters") << QByteArray("\x1b[1;31mred\x1b[0m\r\n\t\b\x7f\x01");
+  QTest::newRow("nul") << QByteArray("a\0b", 3);
+  QTest::newRow("utf-8") << QByteArray("gr\xc3\xbc\xc3\x9f \xe2\x82\xac \xf0\x9f\x98\x80");
+  // Long enough for the 16-byte scan, with special bytes on either side of
+  // and right at a 16-byte boundary.
+  QTest::newRow("long runs") << QByteArray("0123456789abcde\"0123456789abcdef\\0123456789abcdef"
+                                           "\n0123456789abcdef0123456789abcdef\xc3\xa9xyz");
+  QByteArray every;
+  for (int c = 0; c < 0x80; ++c) {
+    every += char(c);
+  }
+  QTest::newRow("every ascii byte") << every + every;
+}
+
+void SessionLogTest::escapesJson() {
+  QFETCH(QByteArray, data);
+  QVector<QJsonArray> events;
+  QCOMPARE(recordOutput({data}, &events), QString::fromUtf8(data));
+  QCOMPARE(events.size(), 1);
+}
+
+void SessionLogTest::invalidUtf8BecomesReplacement_data() {
+  QTest::addColumn<QByteArray>("data");
+  QTest::addColumn<QString>("text");
+
+  const QString fffd(QChar(0xfffd));
+  QTest::newRow("stray continuation") << QByteArray("a\x80z") << "a" + fffd + "z";
+  QTest::newRow("invalid byte") << QByteArray("a\xff\xfez") << "a" + fffd + fffd + "z";
+  QTest::newRow("overlong") << QByteArray("\xc0\xaf!") << fffd + fffd + "!";
+  QTest::newRow("surrogate") << QByteArray("\xed\xa0\x80.") << fffd + fffd + fffd + ".";
+  QTest::newRow("past U+10FFFF") << QByteArray("\xf4\x90\x80\x80.") << fffd + fffd + fffd + fffd + ".";
+  QTest::newRow("cut by ascii") << QByteArray("\xe2\x82z") << fffd + fffd + "z";
+}
+
+void SessionLogTest::invalidUtf8BecomesReplacement() {
+  QFETCH(QByteArray, data);
+  QTEST(recordOutput({data}), "text");
+}
+
+void SessionLogTest::holdsSplitUtf8UntilComplete() {
+  const QByteArray text("a\xc3\xa9" "b\xe2\x82\xac" "c\xf0\x9f\x98\x80" "d");
+  const QString expected = QString::fromUtf8(text);
+
+  // Every way of cutting the text in two, then one byte per write.
+  for (int cut = 0; cut <= text.size(); ++cut) {
+    QCOMPARE(recordOutput({text.left(cut), text.mid(cut)}), expected);
+  }
+  QVector<QByteArray> bytes;
+  for (char c : text) {
+    bytes.append(QByteArray(1, c));
+  }
+  QVector<QJsonArray> events;
+  QCOMPARE(recordOutput(bytes, &events), expected);
+  // No event holds half a character.
+  for (const QJsonArray &event : events) {
+    QVERIFY(!event.at(2).toString().contains(QChar(0xfffd)));
+  }
+}
+
+void SessionLogTest::holdsInputAndOutputApart() {
+  QTemporaryDir dir;
+  const QString path = dir.path() + "/test.cast";
+  SessionLog log;
+  QVERIFY(log.open(path, 24, 80, QString(), 0));
+  log.output("\xe2\x82");
+  log.input("\xc3");
+  log.input("\xa9");
+  log.output("\xac");
+  log.close();
+
+  const QVector<QJsonArray> events = readEvents(path);
+  QCOMPARE(joined(events, "o"), QString::fromUtf8("\xe2\x82\xac"));
+  QCOMPARE(joined(events, "i"), QString::fromUtf8("\xc3\xa9"));
+}
+
+void SessionLogTest::flushesCutSequenceOnClose() {
+  // Bytes of a sequence that never completes are logged, not lost.
+  QCOMPARE(recordOutput({"ok\xf0\x9f\x98"}), "ok" + QString(3, QChar(0xfffd)));
+}
+
+QTEST_GUILESS_MAIN(SessionLogTest)
+#include "tst_sessionlog.moc"